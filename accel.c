@@ -0,0 +1,411 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "accel.h"
+#include "scene-file.h"
+#include "util.h"
+#include "lib/array.h"
+#include "lib/string-util.h"
+#include "lib/tempfile.h"
+#include "lib/wrappers.h"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+/*
+ * Heightfield pyramids are built in a single pass over the samples, so
+ * they are never cached.
+ */
+static void build_heightfield_accel(struct scene *scene)
+{
+	for (size_t i = 0; i < scene->nr_heightfields; i++)
+		if (!scene->heightfields[i].nodes)
+			heightfield_build_accel(&scene->heightfields[i]);
+}
+
+static void build_geometry_accel(struct scene *scene)
+{
+	build_heightfield_accel(scene);
+	for (size_t i = 0; i < scene->nr_meshes; i++)
+		if (!scene->meshes[i].bvh.nodes)
+			mesh_build_accel(&scene->meshes[i]);
+	for (size_t i = 0; i < scene->nr_particle_sets; i++)
+		if (!scene->particle_sets[i].bvh.nodes)
+			particles_build_accel(&scene->particle_sets[i]);
+}
+
+static size_t nr_geometry(const struct scene *scene)
+{
+	return scene->nr_meshes + scene->nr_particle_sets;
+}
+
+/*
+ * The BVH of entry `i` of the geometry table (meshes, then particle sets),
+ * along with the number of primitives it must have and its bounds.
+ */
+static struct bvh *geometry_bvh(struct scene *scene, size_t i,
+				uint32_t *nr_prims, struct aabb **bounds)
+{
+	if (i < scene->nr_meshes) {
+		struct mesh *m = &scene->meshes[i];
+		*nr_prims = m->nr_triangles;
+		*bounds = &m->bounds;
+		return &m->bvh;
+	}
+	struct particles *p = &scene->particle_sets[i - scene->nr_meshes];
+	*nr_prims = 0; /* see struct particles */
+	*bounds = &p->bounds;
+	return &p->bvh;
+}
+
+/*
+ * Prototypes are small and unique, so their BVHs are always built with the
+ * SAH builder, and never cached.
+ */
+static void build_prototype_accel(struct scene *scene)
+{
+	for (size_t i = 0; i < scene->nr_prototypes; i++) {
+		struct prototype *p = &scene->prototypes[i];
+		struct aabb *bounds;
+		if (p->bvh.nodes)
+			continue;
+		ALLOC_ARRAY(bounds, p->nr);
+		for (uint32_t j = 0; j < p->nr; j++)
+			if (!scene_entity_bounds(scene, &scene->proto_entities[p->first + j],
+						 &bounds[j]))
+				die("prototype %zu has an unbounded entity", i);
+		bvh_build(&p->bvh, bounds, p->nr, BVH_BUILD_SAH);
+		p->bounds = (struct aabb){ p->bvh.nodes[0].min, p->bvh.nodes[0].max };
+		free(bounds);
+	}
+}
+
+static void index_entity_leaves(struct scene *scene)
+{
+	const struct bvh *bvh = &scene->bvh;
+
+	free(scene->entity_leaves);
+	ALLOC_ARRAY(scene->entity_leaves, scene->nr_entities);
+	for (size_t i = 0; i < scene->nr_entities; i++)
+		scene->entity_leaves[i] = BVH_NO_LEAF;
+	for (uint32_t n = 0; n < bvh->nr_nodes; n++) {
+		const struct bvh_node *node = &bvh->nodes[n];
+		for (uint32_t i = node->first; i < node->first + node->count; i++)
+			scene->entity_leaves[bvh->prims[i]] = n;
+	}
+}
+
+void scene_build_accel(struct scene *scene, enum bvh_build_method method)
+{
+	struct aabb *bounds;
+	uint32_t *ids, nr_bounded = 0;
+
+	build_geometry_accel(scene);
+	build_prototype_accel(scene);
+
+	if (scene->nr_entities > UINT32_MAX)
+		die("too many entities for the BVH: %zu", scene->nr_entities);
+
+	if (!scene->bvh.mapped)
+		free(scene->unbounded);
+	bvh_destroy(&scene->bvh);
+
+	ALLOC_ARRAY(bounds, scene->nr_entities);
+	ALLOC_ARRAY(ids, scene->nr_entities);
+	scene->nr_unbounded = 0;
+	for (size_t i = 0; i < scene->nr_entities; i++) {
+		if (scene_entity_bounds(scene, &scene->entities[i], &bounds[nr_bounded]))
+			ids[nr_bounded++] = i;
+		else
+			scene->nr_unbounded++;
+	}
+
+	ALLOC_ARRAY(scene->unbounded, scene->nr_unbounded);
+	for (size_t i = 0, j = 0; i < scene->nr_entities && j < scene->nr_unbounded; i++) {
+		struct aabb dummy;
+		if (!scene_entity_bounds(scene, &scene->entities[i], &dummy))
+			scene->unbounded[j++] = i;
+	}
+
+	bvh_build(&scene->bvh, bounds, nr_bounded, method);
+	/* Make the BVH refer to entity indices directly. */
+	#pragma omp parallel for schedule(static)
+	for (uint32_t i = 0; i < scene->bvh.nr_prims; i++)
+		scene->bvh.prims[i] = ids[scene->bvh.prims[i]];
+	index_entity_leaves(scene);
+
+	free(bounds);
+	free(ids);
+}
+
+static void entity_bounds_fn(void *data, uint32_t prim, struct aabb *out)
+{
+	struct scene *scene = data;
+	scene_entity_bounds(scene, &scene->entities[prim], out);
+}
+
+void scene_refit_accel(struct scene *scene)
+{
+	bvh_refit(&scene->bvh, entity_bounds_fn, scene);
+}
+
+/*
+ * Checks that a mapped BVH is safe to traverse: children come after their
+ * parent, as bvh_build() allocates them, so that there are no cycles, no
+ * path is deeper than the traversal stack and leaves stay within `prims`,
+ * whose values must be below `nr_items`. Without `prims` (particle sets),
+ * leaves index the `nr_items` primitives directly.
+ */
+static int valid_bvh(const struct bvh_node *nodes, uint32_t nr_nodes,
+		     const uint32_t *prims, uint32_t nr_prims, uint32_t nr_items)
+{
+	uint32_t nr_leaf_prims = prims ? nr_prims : nr_items;
+	uint8_t *depth;
+	int ret = 0;
+
+	/* An empty tree (see bvh_traversal_init()). */
+	if (nr_nodes == 1 && !nodes[0].count)
+		return !nr_leaf_prims;
+
+	CALLOC_ARRAY(depth, nr_nodes);
+	for (uint32_t n = 0; n < nr_nodes; n++) {
+		const struct bvh_node *node = &nodes[n];
+		if (node->count) {
+			if (node->first > nr_leaf_prims ||
+			    node->count > nr_leaf_prims - node->first)
+				goto out;
+			continue;
+		}
+		if (node->first <= n || node->first >= nr_nodes - 1 ||
+		    depth[n] + 1 >= BVH_MAX_DEPTH)
+			goto out;
+		/* Parents come first: depth[n] is final by now. */
+		for (uint32_t c = node->first; c <= node->first + 1; c++)
+			if (depth[c] < depth[n] + 1)
+				depth[c] = depth[n] + 1;
+	}
+	for (uint32_t i = 0; prims && i < nr_prims; i++)
+		if (prims[i] >= nr_items)
+			goto out;
+	ret = 1;
+out:
+	free(depth);
+	return ret;
+}
+
+int scene_load_accel_cache(struct scene *scene, const char *path,
+			   enum bvh_build_method method)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno != ENOENT)
+			error_errno("failed to open BVH cache '%s'", path);
+		return -1;
+	}
+	if (fstat(fd, &st) || st.st_size < sizeof(struct accel_cache_header)) {
+		close(fd);
+		return error("BVH cache '%s' is unusable", path);
+	}
+
+	size_t map_size = st.st_size;
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return error_errno("failed to mmap BVH cache '%s'", path);
+
+	const struct accel_cache_header *h = (void *)map;
+	if (memcmp(h->magic, ACCEL_CACHE_MAGIC, sizeof(ACCEL_CACHE_MAGIC)) ||
+	    h->version != ACCEL_CACHE_VERSION ||
+	    h->byte_order != SCENE_FILE_BYTE_ORDER ||
+	    h->scene_hash != scene->content_hash || h->method != method)
+		goto stale;
+
+#define IN_BOUNDS(off, nr, type) \
+	((off) % ACCEL_CACHE_ALIGN == 0 && (off) <= map_size && \
+	 (uint64_t)(nr) * sizeof(type) <= map_size - (off))
+	if (!h->nr_nodes || !IN_BOUNDS(h->nodes_offset, h->nr_nodes, struct bvh_node) ||
+	    !IN_BOUNDS(h->prims_offset, h->nr_prims, uint32_t) ||
+	    !IN_BOUNDS(h->unbounded_offset, h->nr_unbounded, uint32_t) ||
+	    h->nr_prims + (uint64_t)h->nr_unbounded != scene->nr_entities ||
+	    h->nr_geometry != nr_geometry(scene) ||
+	    !IN_BOUNDS(h->geometry_offset, h->nr_geometry, struct accel_cache_bvh))
+		goto corrupt;
+	const struct accel_cache_bvh *geometry = (void *)(map + h->geometry_offset);
+	for (uint32_t i = 0; i < h->nr_geometry; i++) {
+		const struct accel_cache_bvh *g = &geometry[i];
+		struct aabb *bounds;
+		uint32_t nr_prims;
+		geometry_bvh(scene, i, &nr_prims, &bounds);
+		if (!g->nr_nodes ||
+		    !IN_BOUNDS(g->nodes_offset, g->nr_nodes, struct bvh_node) ||
+		    !IN_BOUNDS(g->prims_offset, g->nr_prims, uint32_t) ||
+		    g->nr_prims != nr_prims)
+			goto corrupt;
+		if (!valid_bvh((void *)(map + g->nodes_offset), g->nr_nodes,
+			       nr_prims ? (void *)(map + g->prims_offset) : NULL,
+			       nr_prims, i < scene->nr_meshes ? nr_prims :
+			       scene->particle_sets[i - scene->nr_meshes].nr))
+			goto corrupt;
+	}
+#undef IN_BOUNDS
+	if (!valid_bvh((void *)(map + h->nodes_offset), h->nr_nodes,
+		       (void *)(map + h->prims_offset), h->nr_prims,
+		       scene->nr_entities))
+		goto corrupt;
+	const uint32_t *unbounded = (void *)(map + h->unbounded_offset);
+	for (uint32_t i = 0; i < h->nr_unbounded; i++)
+		if (unbounded[i] >= scene->nr_entities)
+			goto corrupt;
+
+	bvh_destroy(&scene->bvh);
+	scene->bvh = (struct bvh){
+		.nodes = (void *)(map + h->nodes_offset),
+		.nr_nodes = h->nr_nodes,
+		.prims = (void *)(map + h->prims_offset),
+		.nr_prims = h->nr_prims,
+		.mapped = 1,
+	};
+	scene->unbounded = (void *)(map + h->unbounded_offset);
+	scene->nr_unbounded = h->nr_unbounded;
+	index_entity_leaves(scene);
+	for (uint32_t i = 0; i < h->nr_geometry; i++) {
+		struct aabb *bounds;
+		uint32_t nr_prims;
+		struct bvh *gb = geometry_bvh(scene, i, &nr_prims, &bounds);
+		bvh_destroy(gb);
+		*gb = (struct bvh){
+			.nodes = (void *)(map + geometry[i].nodes_offset),
+			.nr_nodes = geometry[i].nr_nodes,
+			.prims = (void *)(map + geometry[i].prims_offset),
+			.nr_prims = geometry[i].nr_prims,
+			.mapped = 1,
+		};
+		*bounds = (struct aabb){ gb->nodes[0].min, gb->nodes[0].max };
+	}
+	scene->accel_map = map;
+	scene->accel_map_size = map_size;
+	return 0;
+
+corrupt:
+	error("BVH cache '%s' is corrupt", path);
+stale:
+	munmap(map, map_size);
+	return -1;
+}
+
+static int write_padded(int fd, size_t *pos, const void *buf, size_t size)
+{
+	static const char zeros[ACCEL_CACHE_ALIGN];
+	size_t aligned = ALIGN_UP(*pos, ACCEL_CACHE_ALIGN);
+	if (write_in_full(fd, zeros, aligned - *pos) < 0 ||
+	    write_in_full(fd, buf, size) < 0)
+		return -1;
+	*pos = aligned + size;
+	return 0;
+}
+
+int scene_write_accel_cache(struct scene *scene, const char *path,
+			    enum bvh_build_method method)
+{
+	struct bvh *bvh = &scene->bvh;
+	struct accel_cache_bvh *geometry;
+	struct accel_cache_header h = {
+		.magic = ACCEL_CACHE_MAGIC,
+		.version = ACCEL_CACHE_VERSION,
+		.byte_order = SCENE_FILE_BYTE_ORDER,
+		.scene_hash = scene->content_hash,
+		.nr_nodes = bvh->nr_nodes,
+		.nr_prims = bvh->nr_prims,
+		.nr_unbounded = scene->nr_unbounded,
+		.method = method,
+		.nr_geometry = nr_geometry(scene),
+	};
+	h.nodes_offset = ALIGN_UP(sizeof(h), ACCEL_CACHE_ALIGN);
+	h.prims_offset = ALIGN_UP(h.nodes_offset + h.nr_nodes * sizeof(*bvh->nodes),
+				  ACCEL_CACHE_ALIGN);
+	h.unbounded_offset = ALIGN_UP(h.prims_offset + h.nr_prims * sizeof(*bvh->prims),
+				      ACCEL_CACHE_ALIGN);
+	h.geometry_offset = ALIGN_UP(h.unbounded_offset +
+				   h.nr_unbounded * sizeof(*scene->unbounded),
+				   ACCEL_CACHE_ALIGN);
+
+	CALLOC_ARRAY(geometry, h.nr_geometry);
+	uint64_t offset = h.geometry_offset + h.nr_geometry * sizeof(*geometry);
+	for (uint32_t i = 0; i < h.nr_geometry; i++) {
+		struct aabb *bounds;
+		uint32_t nr_prims;
+		const struct bvh *gb = geometry_bvh(scene, i, &nr_prims, &bounds);
+		geometry[i].nr_nodes = gb->nr_nodes;
+		geometry[i].nr_prims = gb->nr_prims;
+		geometry[i].nodes_offset = ALIGN_UP(offset, ACCEL_CACHE_ALIGN);
+		geometry[i].prims_offset = ALIGN_UP(geometry[i].nodes_offset +
+						    gb->nr_nodes * sizeof(*gb->nodes),
+						    ACCEL_CACHE_ALIGN);
+		offset = geometry[i].prims_offset + gb->nr_prims * sizeof(*gb->prims);
+	}
+
+	/*
+	 * Write to a temporary file and rename it into place, so that a
+	 * concurrent or interrupted render never sees a partial cache.
+	 */
+	char *template = xmkstr("%s.XXXXXX", path);
+	struct tempfile *tempfile = mktempfile_m(template, 0666);
+	free(template);
+	if (!tempfile) {
+		free(geometry);
+		return error_errno("failed to create temporary file for '%s'", path);
+	}
+
+	int fd = get_tempfile_fd(tempfile);
+	size_t pos = 0;
+	if (write_padded(fd, &pos, &h, sizeof(h)) ||
+	    write_padded(fd, &pos, bvh->nodes, h.nr_nodes * sizeof(*bvh->nodes)) ||
+	    write_padded(fd, &pos, bvh->prims, h.nr_prims * sizeof(*bvh->prims)) ||
+	    write_padded(fd, &pos, scene->unbounded,
+			 h.nr_unbounded * sizeof(*scene->unbounded)) ||
+	    write_padded(fd, &pos, geometry, h.nr_geometry * sizeof(*geometry)))
+		goto fail;
+	for (uint32_t i = 0; i < h.nr_geometry; i++) {
+		struct aabb *bounds;
+		uint32_t nr_prims;
+		const struct bvh *gb = geometry_bvh(scene, i, &nr_prims, &bounds);
+		if (write_padded(fd, &pos, gb->nodes, gb->nr_nodes * sizeof(*gb->nodes)) ||
+		    write_padded(fd, &pos, gb->prims, gb->nr_prims * sizeof(*gb->prims)))
+			goto fail;
+	}
+	free(geometry);
+	if (rename_tempfile(&tempfile, path))
+		return error_errno("failed to rename BVH cache to '%s'", path);
+	return 0;
+
+fail:
+	error_errno("failed to write BVH cache '%s'", path);
+	delete_tempfile(&tempfile);
+	free(geometry);
+	return -1;
+}
+
+void scene_prepare_accel(struct scene *scene, const char *cache_path,
+			 enum bvh_build_method method)
+{
+	double start = now_seconds();
+
+	if (cache_path && !scene_load_accel_cache(scene, cache_path, method)) {
+		build_heightfield_accel(scene);
+		build_prototype_accel(scene);
+		fprintf(stderr, "Loaded acceleration structure from '%s' (%.3fs)\n",
+			cache_path, now_seconds() - start);
+		return;
+	}
+
+	fprintf(stderr, "Building acceleration structure...\n");
+	scene_build_accel(scene, method);
+	fprintf(stderr, "Built %s BVH with %u nodes in %.3fs (SAH cost %.2f)\n",
+		bvh_build_method_name(method), scene->bvh.nr_nodes,
+		now_seconds() - start, bvh_sah_cost(&scene->bvh));
+
+	if (cache_path && !scene_write_accel_cache(scene, cache_path, method))
+		fprintf(stderr, "Wrote acceleration structure cache to '%s'\n",
+			cache_path);
+}
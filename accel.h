@@ -0,0 +1,75 @@
+#pragma once
+
+#include "scene.h"
+
+/*
+ * Scene acceleration structure.
+ *
+ * scene_prepare_accel() sets up scene->bvh and scene->unbounded, either by
+ * building them or, for scenes loaded from a file, by mapping a cache file
+ * written by a previous run. Cache files are keyed by the scene's content
+ * hash, so editing and re-converting a scene invalidates its cache, while
+ * renders that only change the camera or the rendering options reuse it.
+ *
+ * The build method is part of the key too. Prototype BVHs (see struct
+ * prototype) are small and are always built, never cached. Mesh and
+ * particle set BVHs are cached along with the scene's.
+ *
+ * Cache file layout: struct accel_cache_header, then the nodes, the
+ * primitive order and the unbounded entity indices, the geometry table
+ * (one struct accel_cache_bvh per mesh, then per particle set) and, for
+ * each of its entries, the nodes and primitive order. Each array is
+ * aligned to ACCEL_CACHE_ALIGN bytes.
+ */
+
+#define ACCEL_CACHE_MAGIC "RTBVH"
+#define ACCEL_CACHE_VERSION 4
+#define ACCEL_CACHE_ALIGN 64
+
+struct accel_cache_header {
+	char magic[8];
+	uint32_t version, byte_order;
+	uint64_t scene_hash;
+	uint32_t nr_nodes, nr_prims, nr_unbounded;
+	uint32_t method; /* enum bvh_build_method */
+	uint64_t nodes_offset, prims_offset, unbounded_offset;
+	uint64_t geometry_offset;
+	uint32_t nr_geometry;
+	uint32_t pad;
+};
+
+struct accel_cache_bvh {
+	uint64_t nodes_offset, prims_offset;
+	uint32_t nr_nodes, nr_prims;
+};
+
+/* Build the acceleration structure from scratch. */
+void scene_build_accel(struct scene *scene, enum bvh_build_method method);
+
+/*
+ * Update the acceleration structure after entities moved (see
+ * bvh_refit()). Entities must not change type, as the set of unbounded
+ * entities is kept.
+ */
+void scene_refit_accel(struct scene *scene);
+
+/*
+ * Map the acceleration structure from the cache at `path`. Returns 0 on
+ * success or -1 if the cache is missing, stale or unusable. The node,
+ * primitive and entity indices of every tree are checked first, so that
+ * a corrupt cache is rebuilt rather than traversed.
+ */
+int scene_load_accel_cache(struct scene *scene, const char *path,
+			   enum bvh_build_method method);
+
+/* Returns 0 on success or -1 on failure (with an error message printed). */
+int scene_write_accel_cache(struct scene *scene, const char *path,
+			    enum bvh_build_method method);
+
+/*
+ * Load the acceleration structure from `cache_path` or build it and write
+ * the cache. `cache_path` may be NULL to always build without caching.
+ * Build time and tree quality (SAH cost) are reported on stderr.
+ */
+void scene_prepare_accel(struct scene *scene, const char *cache_path,
+			 enum bvh_build_method method);
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "vec3.h"
+#include "bvh.h"
+
+/*
+ * An affine transform: a 3x3 linear part (the first three columns) and a
+ * translation (the last column). Points are transformed with the full
+ * matrix and direction vectors with the linear part only.
+ */
+struct affine {
+	float m[3][4];
+};
+
+#define AFFINE_IDENTITY ((struct affine){ .m = { \
+	{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0} } })
+
+static inline struct vec3 affine_vector(const struct affine *a, struct vec3 v)
+{
+	return vec3_new(a->m[0][0] * v.x + a->m[0][1] * v.y + a->m[0][2] * v.z,
+			a->m[1][0] * v.x + a->m[1][1] * v.y + a->m[1][2] * v.z,
+			a->m[2][0] * v.x + a->m[2][1] * v.y + a->m[2][2] * v.z);
+}
+
+static inline struct vec3 affine_point(const struct affine *a, struct vec3 p)
+{
+	return vec3_add(affine_vector(a, p),
+			vec3_new(a->m[0][3], a->m[1][3], a->m[2][3]));
+}
+
+/*
+ * Multiplies by the transpose of the linear part. Given the world to
+ * object transform, this maps object space normals to world space ones
+ * (up to normalization).
+ */
+static inline struct vec3 affine_transpose_vector(const struct affine *a,
+						  struct vec3 v)
+{
+	return vec3_new(a->m[0][0] * v.x + a->m[1][0] * v.y + a->m[2][0] * v.z,
+			a->m[0][1] * v.x + a->m[1][1] * v.y + a->m[2][1] * v.z,
+			a->m[0][2] * v.x + a->m[1][2] * v.y + a->m[2][2] * v.z);
+}
+
+/* Returns the transform that applies `b` and then `a`. */
+static inline struct affine affine_mul(const struct affine *a,
+				       const struct affine *b)
+{
+	struct affine r;
+	for (int i = 0; i < 3; i++) {
+		for (int j = 0; j < 4; j++) {
+			r.m[i][j] = a->m[i][0] * b->m[0][j] +
+				    a->m[i][1] * b->m[1][j] +
+				    a->m[i][2] * b->m[2][j];
+		}
+		r.m[i][3] += a->m[i][3];
+	}
+	return r;
+}
+
+/* Returns 0 on success or -1 if `a` is singular. */
+static inline int affine_invert(const struct affine *a, struct affine *inv)
+{
+	const float (*m)[4] = a->m;
+	float c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+	float c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+	float c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+	float det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+	if (!isnormal(det))
+		return -1;
+	float s = 1 / det;
+
+	inv->m[0][0] = c00 * s;
+	inv->m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * s;
+	inv->m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * s;
+	inv->m[1][0] = c01 * s;
+	inv->m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * s;
+	inv->m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * s;
+	inv->m[2][0] = c02 * s;
+	inv->m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * s;
+	inv->m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * s;
+
+	struct vec3 t = affine_vector(inv, vec3_new(m[0][3], m[1][3], m[2][3]));
+	inv->m[0][3] = -t.x;
+	inv->m[1][3] = -t.y;
+	inv->m[2][3] = -t.z;
+	return 0;
+}
+
+static inline struct affine affine_translate(struct vec3 t)
+{
+	struct affine a = AFFINE_IDENTITY;
+	a.m[0][3] = t.x;
+	a.m[1][3] = t.y;
+	a.m[2][3] = t.z;
+	return a;
+}
+
+static inline struct affine affine_scale(struct vec3 s)
+{
+	struct affine a = AFFINE_IDENTITY;
+	a.m[0][0] = s.x;
+	a.m[1][1] = s.y;
+	a.m[2][2] = s.z;
+	return a;
+}
+
+/* Rotation of `degrees` around `axis`, counterclockwise looking down it. */
+static inline struct affine affine_rotate(struct vec3 axis, float degrees)
+{
+	struct vec3 u = vec3_normalize(axis);
+	float rad = degrees * (float)M_PI / 180;
+	float c = cosf(rad), s = sinf(rad), t = 1 - c;
+	return (struct affine){ .m = {
+		{ t * u.x * u.x + c, t * u.x * u.y - s * u.z, t * u.x * u.z + s * u.y, 0 },
+		{ t * u.x * u.y + s * u.z, t * u.y * u.y + c, t * u.y * u.z - s * u.x, 0 },
+		{ t * u.x * u.z - s * u.y, t * u.y * u.z + s * u.x, t * u.z * u.z + c, 0 },
+	} };
+}
+
+/* The bounding box of a transformed box (Arvo's method). */
+static inline struct aabb affine_aabb(const struct affine *a, struct aabb b)
+{
+	float min[3], max[3];
+	for (int i = 0; i < 3; i++) {
+		min[i] = max[i] = a->m[i][3];
+		float bmin[3] = { b.min.x, b.min.y, b.min.z };
+		float bmax[3] = { b.max.x, b.max.y, b.max.z };
+		for (int j = 0; j < 3; j++) {
+			float e = a->m[i][j] * bmin[j], f = a->m[i][j] * bmax[j];
+			min[i] += fast_minf(e, f);
+			max[i] += fast_maxf(e, f);
+		}
+	}
+	return (struct aabb){ vec3_new(min[0], min[1], min[2]),
+			      vec3_new(max[0], max[1], max[2]) };
+}
@@ -0,0 +1,179 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "animation.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+#define MAX_TOKENS 8
+
+static int tokenize(char *line, char **tokens)
+{
+	int nr = 0;
+	char *saveptr;
+	for (char *tok = strtok_r(line, " \t\r\n", &saveptr); tok;
+	     tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		if (*tok == '#' || nr == MAX_TOKENS)
+			break;
+		tokens[nr++] = tok;
+	}
+	return nr;
+}
+
+static int parse_uint(const char *str, uint32_t *out)
+{
+	char *end;
+	unsigned long v = strtoul(str, &end, 10);
+	if (end == str || *end || *str == '-' || v > UINT32_MAX)
+		return -1;
+	*out = v;
+	return 0;
+}
+
+static int parse_float(const char *str, float *out)
+{
+	char *end;
+	*out = strtof(str, &end);
+	return end == str || *end ? -1 : 0;
+}
+
+static int key_cmp(const void *va, const void *vb)
+{
+	const struct animation_key *a = va, *b = vb;
+	if (a->entity != b->entity)
+		return a->entity < b->entity ? -1 : 1;
+	if (a->frame != b->frame)
+		return a->frame < b->frame ? -1 : 1;
+	return 0;
+}
+
+void animation_load(struct animation *anim, const char *path)
+{
+	FILE *in = fopen(path, "r");
+	char *line = NULL, *tokens[MAX_TOKENS];
+	size_t line_alloc = 0, line_nr = 0;
+	uint32_t last_frame = 0;
+
+	if (!in)
+		die_errno("failed to open animation '%s'", path);
+
+	while (getline(&line, &line_alloc, in) > 0) {
+		int nr = tokenize(line, tokens);
+		line_nr++;
+		if (!nr)
+			continue;
+		if (!strcmp(tokens[0], "frames")) {
+			if (nr != 2 || parse_uint(tokens[1], &anim->nr_frames) ||
+			    !anim->nr_frames)
+				die("%s:%zu: usage: frames <n>", path, line_nr);
+		} else if (!strcmp(tokens[0], "key")) {
+			struct animation_key k;
+			float x, y, z;
+			if (nr != 6 || parse_uint(tokens[1], &k.frame) ||
+			    parse_uint(tokens[2], &k.entity) ||
+			    parse_float(tokens[3], &x) || parse_float(tokens[4], &y) ||
+			    parse_float(tokens[5], &z))
+				die("%s:%zu: usage: key <frame> <entity> <x> <y> <z>",
+				    path, line_nr);
+			k.pos = vec3_new(x, y, z);
+			ALLOC_GROW(anim->keys, anim->nr_keys + 1, anim->alloc_keys);
+			anim->keys[anim->nr_keys++] = k;
+			if (k.frame > last_frame)
+				last_frame = k.frame;
+		} else {
+			die("%s:%zu: unknown directive '%s'", path, line_nr, tokens[0]);
+		}
+	}
+	if (ferror(in))
+		die_errno("failed to read animation '%s'", path);
+	fclose(in);
+	free(line);
+
+	qsort(anim->keys, anim->nr_keys, sizeof(*anim->keys), key_cmp);
+	for (size_t i = 1; i < anim->nr_keys; i++)
+		if (!key_cmp(&anim->keys[i - 1], &anim->keys[i]))
+			die("%s: duplicate key for entity %u at frame %u", path,
+			    anim->keys[i].entity, anim->keys[i].frame);
+	if (!anim->nr_frames)
+		anim->nr_frames = last_frame + 1;
+}
+
+void animation_destroy(struct animation *anim)
+{
+	free(anim->keys);
+	memset(anim, 0, sizeof(*anim));
+}
+
+static void set_position(struct scene *scene, struct entity *e, struct vec3 pos)
+{
+	switch (e->type) {
+	case ENT_SPHERE:
+		e->u.s.center = pos;
+		return;
+	case ENT_PLANE:
+		e->u.p.p0 = pos;
+		return;
+	case ENT_INSTANCE: {
+		struct instance *inst = &scene->instances[e->u.instance];
+		inst->to_world.m[0][3] = pos.x;
+		inst->to_world.m[1][3] = pos.y;
+		inst->to_world.m[2][3] = pos.z;
+		if (affine_invert(&inst->to_world, &inst->to_object))
+			BUG("instance transform became singular");
+		return;
+	}
+	case ENT_MESH:
+		die("meshes cannot be animated, but instances of them can");
+	case ENT_PARTICLES:
+		die("particle sets cannot be animated, but instances of them can");
+	case ENT_HEIGHTFIELD:
+		die("heightfields cannot be animated, but instances of them can");
+	}
+	BUG("unknown entity type %d", e->type);
+}
+
+void animation_apply(const struct animation *anim, struct scene *scene,
+		     uint32_t frame)
+{
+	const struct animation_key *keys = anim->keys;
+	size_t i = 0;
+
+	while (i < anim->nr_keys) {
+		uint32_t entity = keys[i].entity;
+		size_t end = i;
+		while (end < anim->nr_keys && keys[end].entity == entity)
+			end++;
+		if (entity >= scene->nr_entities)
+			die("animation refers to entity %u, but the scene has %zu",
+			    entity, scene->nr_entities);
+
+		/* Find the last key at or before `frame`. */
+		size_t k = i;
+		while (k + 1 < end && keys[k + 1].frame <= frame)
+			k++;
+
+		struct vec3 pos = keys[k].pos;
+		if (k + 1 < end && keys[k].frame < frame) {
+			float t = (float)(frame - keys[k].frame) /
+				  (keys[k + 1].frame - keys[k].frame);
+			pos = vec3_add(vec3_smul(keys[k].pos, 1 - t),
+				       vec3_smul(keys[k + 1].pos, t));
+		}
+		set_position(scene, &scene->entities[entity], pos);
+		i = end;
+	}
+}
+
+int animation_moves(const struct animation *anim, uint32_t frame)
+{
+	const struct animation_key *keys = anim->keys;
+
+	/* Positions only change between two keys of the same entity. */
+	for (size_t i = 0; i + 1 < anim->nr_keys; i++) {
+		if (keys[i].entity != keys[i + 1].entity)
+			continue;
+		if (keys[i].frame < frame && keys[i + 1].frame >= frame &&
+		    memcmp(&keys[i].pos, &keys[i + 1].pos, sizeof(keys[i].pos)))
+			return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include "scene.h"
+
+/*
+ * Keyframed entity motion for multi-frame renders.
+ *
+ * Animation files are text, with one directive per line and '#' starting
+ * a comment:
+ *
+ *   frames <n>                        number of frames to render
+ *   key <frame> <entity> <x> <y> <z>  entity position at <frame>
+ *
+ * Entities are numbered from 0, in the order they were added to the
+ * scene (i.e. their order in the text scene). The position of a sphere is
+ * its center, that of a plane its `p0` point, and that of an instance the
+ * translation of its transform. Between keys, positions
+ * are interpolated linearly; before the first and after the last key of
+ * an entity, they are held. Entities without keys never move.
+ *
+ * If `frames` is missing, the animation ends at its last key.
+ */
+
+struct animation_key {
+	uint32_t frame, entity;
+	struct vec3 pos;
+};
+
+struct animation {
+	uint32_t nr_frames;
+	/* Sorted by entity, then frame. */
+	struct animation_key *keys;
+	size_t nr_keys, alloc_keys;
+};
+
+#define ANIMATION_INIT { 0 }
+
+/* Dies on errors. */
+void animation_load(struct animation *anim, const char *path);
+void animation_destroy(struct animation *anim);
+
+/*
+ * Move the animated entities to their positions at `frame`. Dies if a key
+ * refers to an entity the scene does not have.
+ */
+void animation_apply(const struct animation *anim, struct scene *scene,
+		     uint32_t frame);
+
+/* Returns whether any entity moves between `frame` - 1 and `frame`. */
+int animation_moves(const struct animation *anim, uint32_t frame);
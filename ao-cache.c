@@ -0,0 +1,323 @@
+#include "ao-cache.h"
+#include "scene.h"
+#include "trace.h"
+#include "util.h"
+#include "config.h"
+#include "lib/array.h"
+
+/* The largest error (see ao-cache.h) at which a record is used. */
+#define AO_CACHE_TOLERANCE 0.4f
+
+/*
+ * The pre-pass pixel grids, coarse to fine. Records get a radius of at
+ * least two pixels divided by the tolerance, so that they reach two
+ * pixels away: render hits are jittered around the grid's pixel centers.
+ */
+static const int strides[] = { 16, 8, 4, 2, 1 };
+#define MIN_RADIUS_PIXELS (2 / AO_CACHE_TOLERANCE)
+
+void ao_cache_destroy(struct ao_cache *c)
+{
+	free(c->records);
+	free(c->cells);
+	free(c->refs);
+	memset(c, 0, sizeof(*c));
+}
+
+/*
+ * Cosine-weighted directions around `normal`: cos^2 of the angle to the
+ * normal is stratified over the samples, and the azimuth follows the
+ * golden ratio from a random start.
+ */
+float ao_compute(struct scene *scene, struct vec3 pos, struct vec3 normal,
+		 unsigned int *rand_state, float *radius)
+{
+	const struct ao_cache *c = &scene->ao_cache;
+	struct vec3 helper = fabsf(normal.x) < 0.5f ? vec3_new(1, 0, 0) :
+						      vec3_new(0, 1, 0);
+	struct vec3 t = vec3_normalize(vec3_cross(normal, helper));
+	struct vec3 b = vec3_cross(normal, t);
+	struct vec3 origin = vec3_add(pos, vec3_smul(normal, 1e-3));
+	float phi0 = rand_r_in(rand_state, 0, 1), inv_dist = 0, open = 0;
+
+	for (uint32_t i = 0; i < c->samples; i++) {
+		float u = (i + rand_r_in(rand_state, 0, 1)) / c->samples;
+		float phi = 2 * M_PI * (phi0 + i * 0.618034f);
+		float r = sqrtf(u);
+		struct vec3 dir = vec3_add(vec3_add(vec3_smul(t, r * cosf(phi)),
+						    vec3_smul(b, r * sinf(phi))),
+					   vec3_smul(normal, sqrtf(1 - u)));
+		struct ray ray = ray_new(origin, dir);
+		struct intersection it;
+		if (cast_ray(scene, &ray, c->distance, &it)) {
+			inv_dist += 1 / fmaxf(it.dist, 1e-6f);
+		} else {
+			inv_dist += 1 / c->distance;
+			open++;
+		}
+	}
+	if (radius)
+		*radius = c->samples / inv_dist;
+	return open / c->samples;
+}
+
+static inline float level_cell_size(const struct ao_cache *c, int level)
+{
+	return ldexpf(c->cell_size, -level);
+}
+
+/* The finest level whose cells are at least `reach` wide. */
+static int record_level(const struct ao_cache *c, float reach)
+{
+	int level = 0;
+	while (level + 1 < AO_CACHE_LEVELS &&
+	       level_cell_size(c, level + 1) >= reach)
+		level++;
+	return level;
+}
+
+static inline int64_t cell_coord(float x, float size)
+{
+	return floorf(x / size);
+}
+
+/* Coordinates wrap around in the key, which only costs collisions. */
+static inline uint64_t cell_key(int level, int64_t x, int64_t y, int64_t z)
+{
+	uint64_t mask = (1 << 20) - 1;
+	return (uint64_t)level << 60 | ((uint64_t)x & mask) |
+	       ((uint64_t)y & mask) << 20 | ((uint64_t)z & mask) << 40;
+}
+
+static inline size_t cell_slot(uint64_t key, size_t table_size)
+{
+	return (key * 0x9E3779B97F4A7C15ull >> 17) & (table_size - 1);
+}
+
+static const struct ao_cell *find_cell(const struct ao_cache *c, uint64_t key)
+{
+	if (!c->table_size)
+		return NULL;
+	for (size_t s = cell_slot(key, c->table_size);; s = (s + 1) & (c->table_size - 1)) {
+		if (!c->cells[s].nr)
+			return NULL;
+		if (c->cells[s].key == key)
+			return &c->cells[s];
+	}
+}
+
+int ao_cache_lookup(const struct ao_cache *c, struct vec3 pos,
+		    struct vec3 normal, float *ao)
+{
+	float sum = 0, weights = 0;
+
+	for (int level = 0; level < AO_CACHE_LEVELS; level++) {
+		if (!(c->levels & (1u << level)))
+			continue;
+		float size = level_cell_size(c, level);
+		const struct ao_cell *cell = find_cell(c,
+			cell_key(level, cell_coord(pos.x, size),
+				 cell_coord(pos.y, size), cell_coord(pos.z, size)));
+		if (!cell)
+			continue;
+		for (uint32_t i = cell->first; i < cell->first + cell->nr; i++) {
+			const struct ao_record *rec = &c->records[c->refs[i]];
+			struct vec3 d = vec3_sub(pos, rec->pos);
+			float cos = vec3_dot(normal, rec->normal);
+			float err = vec3_norm(d) / rec->radius +
+				    sqrtf(fmaxf(0, 1 - cos));
+			if (err >= AO_CACHE_TOLERANCE)
+				continue;
+			/* Skip records in front of the point: they see less of it. */
+			if (vec3_dot(d, vec3_add(normal, rec->normal)) <
+			    -0.1f * rec->radius)
+				continue;
+			float w = 1 / fmaxf(err, 1e-4f);
+			sum += w * rec->ao;
+			weights += w;
+		}
+	}
+	if (!weights)
+		return 0;
+	*ao = sum / weights;
+	return 1;
+}
+
+struct cell_ref {
+	uint64_t key;
+	uint32_t record;
+};
+
+static int cell_ref_cmp(const void *va, const void *vb)
+{
+	const struct cell_ref *a = va, *b = vb;
+	if (a->key != b->key)
+		return a->key < b->key ? -1 : 1;
+	return a->record < b->record ? -1 : a->record > b->record;
+}
+
+/* Rebuilds the hash grid from all the records. */
+static void build_grid(struct ao_cache *c)
+{
+	ARRAY(struct cell_ref) refs = ARRAY_STATIC_INIT;
+	size_t nr_cells = 0;
+
+	/*
+	 * Radii are at most `distance`, unless raised to cover the pixel
+	 * grid: level 0 must fit the largest.
+	 */
+	c->cell_size = c->distance * AO_CACHE_TOLERANCE;
+	for (size_t r = 0; r < c->nr; r++)
+		c->cell_size = fmaxf(c->cell_size,
+				     c->records[r].radius * AO_CACHE_TOLERANCE);
+
+	c->levels = 0;
+	for (size_t r = 0; r < c->nr; r++) {
+		const struct ao_record *rec = &c->records[r];
+		float reach = rec->radius * AO_CACHE_TOLERANCE;
+		int level = record_level(c, reach);
+		float size = level_cell_size(c, level);
+		struct vec3 lo = vec3_sub(rec->pos, vec3_new(reach, reach, reach));
+		struct vec3 hi = vec3_add(rec->pos, vec3_new(reach, reach, reach));
+		c->levels |= 1u << level;
+		for (int64_t x = cell_coord(lo.x, size); x <= cell_coord(hi.x, size); x++)
+			for (int64_t y = cell_coord(lo.y, size); y <= cell_coord(hi.y, size); y++)
+				for (int64_t z = cell_coord(lo.z, size); z <= cell_coord(hi.z, size); z++)
+					ARRAY_APPEND(&refs, ((struct cell_ref){
+						cell_key(level, x, y, z), r }));
+	}
+	qsort(refs.arr, refs.nr, sizeof(*refs.arr), cell_ref_cmp);
+	for (size_t i = 0; i < refs.nr; i++)
+		nr_cells += !i || refs.arr[i].key != refs.arr[i - 1].key;
+
+	free(c->cells);
+	free(c->refs);
+	c->table_size = 16;
+	while (c->table_size < 2 * nr_cells)
+		c->table_size *= 2;
+	CALLOC_ARRAY(c->cells, c->table_size);
+	ALLOC_ARRAY(c->refs, refs.nr);
+	for (size_t i = 0; i < refs.nr; i++) {
+		uint64_t key = refs.arr[i].key;
+		c->refs[i] = refs.arr[i].record;
+		if (i && key == refs.arr[i - 1].key)
+			continue;
+		size_t s = cell_slot(key, c->table_size);
+		while (c->cells[s].nr)
+			s = (s + 1) & (c->table_size - 1);
+		c->cells[s].key = key;
+		c->cells[s].first = i;
+		size_t end = i;
+		while (end < refs.nr && refs.arr[end].key == key)
+			end++;
+		c->cells[s].nr = end - i;
+	}
+	FREE_ARRAY(&refs);
+}
+
+struct candidate {
+	struct vec3 pos, normal;
+	/* The size of a pixel at the hit. */
+	float footprint;
+};
+
+typedef ARRAY(struct candidate) candidate_array;
+
+/*
+ * Follows the camera ray through (x, y) and its reflections, like
+ * render(), and collects the hits no record covers yet.
+ */
+static void collect_candidates(struct scene *scene, const struct camera_frame *camera,
+			       float x, float y, float pixel_sz, int max_depth,
+			       candidate_array *out)
+{
+	struct ray r = camera_ray(camera, x, y);
+	float path = 0;
+
+	for (int depth = 0; depth <= max_depth; depth++) {
+		struct intersection it;
+		float ao;
+		if (!cast_ray(scene, &r, INFINITY, &it))
+			return;
+		path += it.dist;
+		struct vec3 normal = vec3_dot(it.normal, r.dir) > 0 ?
+				     vec3_neg(it.normal) : it.normal;
+		if (!ao_cache_lookup(&scene->ao_cache, it.pos, normal, &ao))
+			ARRAY_APPEND(out, ((struct candidate){ it.pos, normal,
+					path * pixel_sz / camera->viewpoint_dist }));
+		if (!intersection_material(scene, &it)->reflectiveness)
+			return;
+		r = ray_new(vec3_add(it.pos, vec3_smul(normal, 1e-3)),
+			    vec3_reflect(r.dir, it.normal));
+	}
+}
+
+static float default_distance(const struct scene *scene)
+{
+	if (!scene->bvh.nr_nodes)
+		return 1;
+	const struct bvh_node *root = &scene->bvh.nodes[0];
+	return vec3_norm(vec3_sub(root->max, root->min)) / 8;
+}
+
+void scene_prepare_ao(struct scene *scene, int width, int height,
+		      int max_depth, uint32_t samples, float distance)
+{
+	struct ao_cache *c = &scene->ao_cache;
+	struct camera_frame camera = camera_frame(&scene->camera);
+	float viewport_W = 2.0, viewport_H = viewport_W / ASPECT_RATIO;
+	float pixel_sz = viewport_W / width;
+
+	ao_cache_destroy(c);
+	if (!samples)
+		return;
+
+	double start = now_seconds();
+	c->samples = samples;
+	c->distance = distance > 0 ? distance : default_distance(scene);
+
+	for (size_t l = 0; l < ARRAY_SIZE(strides); l++) {
+		int stride = strides[l], nr_rows = (height + stride - 1) / stride;
+		candidate_array *rows;
+		size_t first = c->nr;
+
+		CALLOC_ARRAY(rows, nr_rows);
+		#pragma omp parallel for schedule(dynamic)
+		for (int row = 0; row < nr_rows; row++) {
+			float y = viewport_H/2 - (row * stride + 0.5f) * pixel_sz;
+			for (int j = 0; j < width; j += stride) {
+				float x = -viewport_W/2 + (j + 0.5f) * pixel_sz;
+				collect_candidates(scene, &camera, x, y, pixel_sz,
+						   max_depth, &rows[row]);
+			}
+		}
+
+		/* Rows are appended in order, for reproducible results. */
+		for (int row = 0; row < nr_rows; row++) {
+			ALLOC_GROW(c->records, c->nr + rows[row].nr, c->alloc);
+			for (size_t i = 0; i < rows[row].nr; i++) {
+				struct candidate *cand = &rows[row].arr[i];
+				c->records[c->nr].pos = cand->pos;
+				c->records[c->nr].normal = cand->normal;
+				/* Stashed until the radius is computed. */
+				c->records[c->nr++].radius = cand->footprint;
+			}
+			FREE_ARRAY(&rows[row]);
+		}
+		free(rows);
+
+		#pragma omp parallel for schedule(dynamic, 16)
+		for (size_t r = first; r < c->nr; r++) {
+			struct ao_record *rec = &c->records[r];
+			unsigned int rand_state = r * 2654435761u;
+			float min_radius = rec->radius * MIN_RADIUS_PIXELS, radius;
+			rec->ao = ao_compute(scene, rec->pos, rec->normal,
+					     &rand_state, &radius);
+			rec->radius = radius < min_radius ? min_radius : radius;
+		}
+		build_grid(c);
+	}
+
+	fprintf(stderr, "Built AO cache with %zu records (%zu rays) in %.3fs\n",
+		c->nr, c->nr * samples, now_seconds() - start);
+}
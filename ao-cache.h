@@ -0,0 +1,96 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vec3.h"
+
+struct scene;
+
+/*
+ * Ambient occlusion cache
+ * -----------------------
+ *
+ * With ambient occlusion, the ambient term of a hit is scaled by the
+ * fraction of its (cosine-weighted) hemisphere that is open up to
+ * `distance`, estimated with `samples` rays. Computing that at every hit
+ * would multiply the ray count, but AO varies slowly over most surfaces,
+ * so it is computed at sparse points and interpolated in between, in the
+ * manner of Ward's irradiance caching.
+ *
+ * Each record has a radius of validity: the harmonic mean of its rays'
+ * hit distances, as nearby geometry makes AO change quickly. A record
+ * covers the points whose error estimate,
+ *
+ *   |p - record.pos| / record.radius + sqrt(1 - n . record.normal),
+ *
+ * is below AO_CACHE_TOLERANCE, and a lookup blends the covering records,
+ * weighted by the inverse of their error. Records live in a hash grid
+ * with AO_CACHE_LEVELS levels, whose cells halve in size from one level
+ * to the next. Each record goes to the finest level whose cells are at
+ * least as wide as its reach, so it overlaps at most 2x2x2 of them, and
+ * a lookup reads one cell per (non-empty) level.
+ *
+ * The records are placed by a pre-pass that traces the camera rays (and
+ * their reflections) on coarse to fine pixel grids, adding a record at
+ * each hit no existing one covers. Hits that are still not covered when
+ * rendering get their AO computed directly. Records are in world space,
+ * so the cache stays valid while the geometry does not move.
+ */
+struct ao_record {
+	struct vec3 pos, normal;
+	float ao, radius;
+};
+
+struct ao_cell {
+	uint64_t key;
+	/* The cell's records are refs[first, first + nr). */
+	uint32_t first, nr;
+};
+
+#define AO_CACHE_LEVELS 16
+
+struct ao_cache {
+	/* 0 when ambient occlusion is off. */
+	uint32_t samples;
+	float distance;
+
+	struct ao_record *records;
+	size_t nr, alloc;
+
+	/*
+	 * Open-addressing hash table of the non-empty cells, of all levels.
+	 * Level 0 cells are `cell_size` wide (the largest reach of a record), and bit L of `levels` tells
+	 * whether level L has any records.
+	 */
+	float cell_size;
+	uint32_t levels;
+	struct ao_cell *cells;
+	size_t table_size;
+	uint32_t *refs;
+};
+
+/*
+ * Sets up scene->ao_cache for a `width` by `height` render following up
+ * to `max_depth` reflections, or turns AO off if `samples` is 0. If
+ * `distance` is 0, it defaults to an eighth of the scene's diagonal. Must
+ * be called after scene_prepare_accel(), and again when the geometry
+ * moves.
+ */
+void scene_prepare_ao(struct scene *scene, int width, int height,
+		      int max_depth, uint32_t samples, float distance);
+
+void ao_cache_destroy(struct ao_cache *c);
+
+/*
+ * Interpolates the AO at `pos`, with `normal` facing the viewer, from the
+ * cached records. Returns 0 if no record covers it.
+ */
+int ao_cache_lookup(const struct ao_cache *c, struct vec3 pos,
+		    struct vec3 normal, float *ao);
+
+/*
+ * Computes the AO at `pos` with the cache's settings, by casting rays.
+ * If not NULL, `*radius` is set to the radius of validity of the result.
+ */
+float ao_compute(struct scene *scene, struct vec3 pos, struct vec3 normal,
+		 unsigned int *rand_state, float *radius);
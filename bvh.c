@@ -0,0 +1,627 @@
+#include "bvh.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+/*
+ * Builders
+ * --------
+ *
+ * BVH_BUILD_SAH is a top-down builder that picks each split by evaluating
+ * the surface area heuristic over NR_BINS centroid bins per axis. Subtrees
+ * are built as OpenMP tasks, and the binning and partitioning of large
+ * ranges (near the top of the tree, where there is little task
+ * parallelism) is itself split into chunks processed by parallel tasks.
+ *
+ * BVH_BUILD_LBVH sorts the primitives along a Morton curve and splits
+ * ranges at the highest differing bit of their codes. It is several times
+ * faster than the SAH builder, at the cost of a worse tree, which suits
+ * scenes that are rebuilt every frame.
+ */
+
+#define NR_BINS 16
+#define MAX_LEAF_SIZE 8
+#define LBVH_LEAF_SIZE 4
+#define TASK_THRESHOLD 1024
+#define CHUNK_SIZE 16384
+#define TRAVERSAL_COST 1.0f
+
+struct bin {
+	struct aabb bounds;
+	uint32_t count;
+};
+
+struct build_ctx {
+	struct bvh *bvh;
+	const struct aabb *bounds;
+	struct vec3 *centers;
+	uint32_t *tmp;
+	uint32_t nr_nodes;
+	/* Ranges of up to min_leaf primitives are always leaves, and no more
+	 * than max_leaf ever are. */
+	uint32_t min_leaf, max_leaf;
+};
+
+static inline float vec3_axis(struct vec3 v, int axis)
+{
+	return axis == 0 ? v.x : axis == 1 ? v.y : v.z;
+}
+
+static inline struct aabb point_aabb(struct vec3 p)
+{
+	return (struct aabb){ p, p };
+}
+
+static inline uint32_t alloc_node_pair(struct build_ctx *ctx)
+{
+	return __atomic_fetch_add(&ctx->nr_nodes, 2, __ATOMIC_RELAXED);
+}
+
+static struct aabb range_bounds(struct build_ctx *ctx, uint32_t first,
+				uint32_t count, struct aabb *centers_bounds)
+{
+	struct aabb b = AABB_EMPTY, cb = AABB_EMPTY;
+	for (uint32_t i = first; i < first + count; i++) {
+		uint32_t p = ctx->bvh->prims[i];
+		b = aabb_union(b, ctx->bounds[p]);
+		cb = aabb_union(cb, point_aabb(ctx->centers[p]));
+	}
+	*centers_bounds = cb;
+	return b;
+}
+
+static void make_leaf(struct bvh_node *node, struct aabb b, uint32_t first,
+		      uint32_t count)
+{
+	node->min = b.min;
+	node->max = b.max;
+	node->first = first;
+	node->count = count;
+}
+
+/* Binning geometry for one node: bin = (center - origin) * scale. */
+struct binning {
+	struct vec3 origin, scale;
+};
+
+static struct binning binning_new(struct aabb cb)
+{
+	struct vec3 extent = vec3_sub(cb.max, cb.min);
+	/* Slightly less than NR_BINS so that the max center maps inside. */
+	float k = NR_BINS * (1 - 1e-5f);
+	return (struct binning){
+		.origin = cb.min,
+		.scale = vec3_new(extent.x > 0 ? k / extent.x : 0,
+				  extent.y > 0 ? k / extent.y : 0,
+				  extent.z > 0 ? k / extent.z : 0),
+	};
+}
+
+static inline int bin_index(const struct binning *b, struct vec3 c, int axis)
+{
+	int i = (vec3_axis(c, axis) - vec3_axis(b->origin, axis)) *
+		vec3_axis(b->scale, axis);
+	return i < 0 ? 0 : i >= NR_BINS ? NR_BINS - 1 : i;
+}
+
+static void bin_range(struct build_ctx *ctx, const struct binning *binning,
+		      uint32_t first, uint32_t count, struct bin bins[3][NR_BINS])
+{
+	for (int a = 0; a < 3; a++)
+		for (int i = 0; i < NR_BINS; i++)
+			bins[a][i] = (struct bin){ AABB_EMPTY, 0 };
+
+	for (uint32_t i = first; i < first + count; i++) {
+		uint32_t p = ctx->bvh->prims[i];
+		struct vec3 c = ctx->centers[p];
+		for (int a = 0; a < 3; a++) {
+			struct bin *bin = &bins[a][bin_index(binning, c, a)];
+			bin->bounds = aabb_union(bin->bounds, ctx->bounds[p]);
+			bin->count++;
+		}
+	}
+}
+
+static void merge_bins(struct bin dst[3][NR_BINS], struct bin src[3][NR_BINS])
+{
+	for (int a = 0; a < 3; a++) {
+		for (int i = 0; i < NR_BINS; i++) {
+			dst[a][i].bounds = aabb_union(dst[a][i].bounds, src[a][i].bounds);
+			dst[a][i].count += src[a][i].count;
+		}
+	}
+}
+
+static void bin_range_parallel(struct build_ctx *ctx, const struct binning *binning,
+			       uint32_t first, uint32_t count,
+			       struct bin bins[3][NR_BINS])
+{
+	uint32_t nr_chunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	if (nr_chunks <= 1) {
+		bin_range(ctx, binning, first, count, bins);
+		return;
+	}
+
+	struct bin (*chunk_bins)[3][NR_BINS];
+	ALLOC_ARRAY(chunk_bins, nr_chunks);
+	#pragma omp taskloop grainsize(1)
+	for (uint32_t c = 0; c < nr_chunks; c++) {
+		uint32_t start = first + c * CHUNK_SIZE;
+		uint32_t n = c == nr_chunks - 1 ? first + count - start : CHUNK_SIZE;
+		bin_range(ctx, binning, start, n, chunk_bins[c]);
+	}
+	memcpy(bins, chunk_bins[0], sizeof(chunk_bins[0]));
+	for (uint32_t c = 1; c < nr_chunks; c++)
+		merge_bins(bins, chunk_bins[c]);
+	free(chunk_bins);
+}
+
+/*
+ * Partitions prims[first, first + count) into the primitives whose bin
+ * along `axis` is <= split_bin and the rest, and computes the bounds of
+ * the centers on each side. Returns the left count.
+ */
+static uint32_t partition_parallel(struct build_ctx *ctx,
+				   const struct binning *binning,
+				   uint32_t first, uint32_t count,
+				   int axis, int split_bin,
+				   struct aabb *lcb, struct aabb *rcb)
+{
+	uint32_t *prims = ctx->bvh->prims, *tmp = ctx->tmp;
+	uint32_t nr_chunks = (count + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	uint32_t *left_counts, nr_left = 0;
+	struct aabb (*chunk_cb)[2];
+
+	CALLOC_ARRAY(left_counts, nr_chunks + 1);
+	ALLOC_ARRAY(chunk_cb, nr_chunks);
+	#pragma omp taskloop grainsize(1)
+	for (uint32_t c = 0; c < nr_chunks; c++) {
+		uint32_t start = first + c * CHUNK_SIZE;
+		uint32_t end = c == nr_chunks - 1 ? first + count : start + CHUNK_SIZE;
+		uint32_t n = 0;
+		for (uint32_t i = start; i < end; i++)
+			n += bin_index(binning, ctx->centers[prims[i]], axis) <= split_bin;
+		left_counts[c] = n;
+	}
+	/* Exclusive prefix sums, in place. */
+	for (uint32_t c = 0; c < nr_chunks; c++) {
+		uint32_t n = left_counts[c];
+		left_counts[c] = nr_left;
+		nr_left += n;
+	}
+
+	#pragma omp taskloop grainsize(1)
+	for (uint32_t c = 0; c < nr_chunks; c++) {
+		uint32_t start = first + c * CHUNK_SIZE;
+		uint32_t end = c == nr_chunks - 1 ? first + count : start + CHUNK_SIZE;
+		uint32_t l = first + left_counts[c];
+		uint32_t r = first + nr_left + (start - first) - left_counts[c];
+		struct aabb cb[2] = { AABB_EMPTY, AABB_EMPTY };
+		for (uint32_t i = start; i < end; i++) {
+			struct vec3 center = ctx->centers[prims[i]];
+			if (bin_index(binning, center, axis) <= split_bin) {
+				tmp[l++] = prims[i];
+				cb[0] = aabb_union(cb[0], point_aabb(center));
+			} else {
+				tmp[r++] = prims[i];
+				cb[1] = aabb_union(cb[1], point_aabb(center));
+			}
+		}
+		chunk_cb[c][0] = cb[0];
+		chunk_cb[c][1] = cb[1];
+	}
+
+	#pragma omp taskloop grainsize(1)
+	for (uint32_t c = 0; c < nr_chunks; c++) {
+		uint32_t start = first + c * CHUNK_SIZE;
+		uint32_t end = c == nr_chunks - 1 ? first + count : start + CHUNK_SIZE;
+		memcpy(&prims[start], &tmp[start], (end - start) * sizeof(*prims));
+	}
+
+	*lcb = *rcb = AABB_EMPTY;
+	for (uint32_t c = 0; c < nr_chunks; c++) {
+		*lcb = aabb_union(*lcb, chunk_cb[c][0]);
+		*rcb = aabb_union(*rcb, chunk_cb[c][1]);
+	}
+	free(chunk_cb);
+	free(left_counts);
+	return nr_left;
+}
+
+static uint32_t partition(struct build_ctx *ctx, const struct binning *binning,
+			  uint32_t first, uint32_t count, int axis, int split_bin,
+			  struct aabb *lcb, struct aabb *rcb)
+{
+	if (count > CHUNK_SIZE)
+		return partition_parallel(ctx, binning, first, count, axis,
+					  split_bin, lcb, rcb);
+
+	uint32_t *prims = ctx->bvh->prims;
+	uint32_t i = first, j = first + count;
+	*lcb = *rcb = AABB_EMPTY;
+	while (i < j) {
+		struct vec3 center = ctx->centers[prims[i]];
+		if (bin_index(binning, center, axis) <= split_bin) {
+			*lcb = aabb_union(*lcb, point_aabb(center));
+			i++;
+		} else {
+			*rcb = aabb_union(*rcb, point_aabb(center));
+			uint32_t tmp = prims[i];
+			prims[i] = prims[--j];
+			prims[j] = tmp;
+		}
+	}
+	return i - first;
+}
+
+static void build_sah(struct build_ctx *ctx, uint32_t node_idx, uint32_t first,
+		      uint32_t count, struct aabb b, struct aabb cb, int depth)
+{
+	struct bvh_node *node = &ctx->bvh->nodes[node_idx];
+	struct aabb lb, lcb, rb, rcb;
+	uint32_t left_count = 0;
+
+	if (count <= ctx->min_leaf) {
+		make_leaf(node, b, first, count);
+		return;
+	}
+
+	int best_axis = -1, best_bin = 0;
+	float best_cost = INFINITY;
+	struct binning binning = binning_new(cb);
+
+	if (depth < BVH_MAX_DEPTH - 32) {
+		struct bin bins[3][NR_BINS];
+		bin_range_parallel(ctx, &binning, first, count, bins);
+
+		for (int a = 0; a < 3; a++) {
+			if (vec3_axis(binning.scale, a) == 0)
+				continue;
+			/* right_cost[i]: cost of bins (i, NR_BINS) as one child. */
+			float right_cost[NR_BINS];
+			struct aabb acc = AABB_EMPTY;
+			uint32_t n = 0;
+			for (int i = NR_BINS - 1; i > 0; i--) {
+				acc = aabb_union(acc, bins[a][i].bounds);
+				n += bins[a][i].count;
+				right_cost[i - 1] = n ? aabb_area(acc) * n : INFINITY;
+			}
+			acc = AABB_EMPTY;
+			n = 0;
+			for (int i = 0; i < NR_BINS - 1; i++) {
+				acc = aabb_union(acc, bins[a][i].bounds);
+				n += bins[a][i].count;
+				float cost = n ? aabb_area(acc) * n + right_cost[i] : INFINITY;
+				if (cost < best_cost) {
+					best_cost = cost;
+					best_axis = a;
+					best_bin = i;
+				}
+			}
+		}
+
+		if (best_axis >= 0) {
+			float area = aabb_area(b);
+			best_cost = TRAVERSAL_COST + (area ? best_cost / area : 0);
+			if (count <= ctx->max_leaf && count <= best_cost) {
+				make_leaf(node, b, first, count);
+				return;
+			}
+
+			lb = rb = AABB_EMPTY;
+			for (int i = 0; i < NR_BINS; i++) {
+				struct bin *bin = &bins[best_axis][i];
+				if (i <= best_bin) {
+					lb = aabb_union(lb, bin->bounds);
+					left_count += bin->count;
+				} else {
+					rb = aabb_union(rb, bin->bounds);
+				}
+			}
+			uint32_t n = partition(ctx, &binning, first, count,
+					       best_axis, best_bin, &lcb, &rcb);
+			if (n != left_count)
+				BUG("BVH partition disagrees with binning (%u != %u)",
+				    n, left_count);
+		}
+	}
+
+	if (best_axis < 0) {
+		/*
+		 * All centers coincide, or we are too deep: split evenly,
+		 * which bounds the depth of the remaining subtree by
+		 * log2(count) and keeps traversal stacks small.
+		 */
+		if (count <= ctx->max_leaf) {
+			make_leaf(node, b, first, count);
+			return;
+		}
+		left_count = count / 2;
+		lb = range_bounds(ctx, first, left_count, &lcb);
+		rb = range_bounds(ctx, first + left_count, count - left_count, &rcb);
+	}
+
+	uint32_t left = alloc_node_pair(ctx);
+	node->min = b.min;
+	node->max = b.max;
+	node->first = left;
+	node->count = 0;
+
+	if (left_count > TASK_THRESHOLD) {
+		#pragma omp task
+		build_sah(ctx, left, first, left_count, lb, lcb, depth + 1);
+	} else {
+		build_sah(ctx, left, first, left_count, lb, lcb, depth + 1);
+	}
+	build_sah(ctx, left + 1, first + left_count, count - left_count, rb, rcb,
+		  depth + 1);
+}
+
+static inline uint32_t morton_code(const struct binning *b, struct vec3 c)
+{
+	/* binning_new() scales to [0, NR_BINS); rescale to [0, 1024). */
+	float k = 1024.0f / NR_BINS;
+	uint32_t x = (c.x - b->origin.x) * b->scale.x * k;
+	uint32_t y = (c.y - b->origin.y) * b->scale.y * k;
+	uint32_t z = (c.z - b->origin.z) * b->scale.z * k;
+	return (morton_expand_bits(x) << 2) | (morton_expand_bits(y) << 1) |
+	       morton_expand_bits(z);
+}
+
+/* LSD radix sort, which is stable. */
+void radix_sort_upper(uint64_t *keys, uint64_t *tmp, uint32_t nr)
+{
+	for (int shift = 32; shift < 64; shift += 8) {
+		uint32_t nr_chunks = (nr + CHUNK_SIZE - 1) / CHUNK_SIZE;
+		uint32_t (*hist)[256];
+		CALLOC_ARRAY(hist, nr_chunks ? nr_chunks : 1);
+
+		#pragma omp parallel for schedule(static)
+		for (uint32_t c = 0; c < nr_chunks; c++) {
+			uint32_t end = c == nr_chunks - 1 ? nr : (c + 1) * CHUNK_SIZE;
+			for (uint32_t i = c * CHUNK_SIZE; i < end; i++)
+				hist[c][(keys[i] >> shift) & 0xff]++;
+		}
+		/* Turn histograms into chunk-wise output offsets. */
+		uint32_t sum = 0;
+		for (int d = 0; d < 256; d++) {
+			for (uint32_t c = 0; c < nr_chunks; c++) {
+				uint32_t n = hist[c][d];
+				hist[c][d] = sum;
+				sum += n;
+			}
+		}
+		#pragma omp parallel for schedule(static)
+		for (uint32_t c = 0; c < nr_chunks; c++) {
+			uint32_t end = c == nr_chunks - 1 ? nr : (c + 1) * CHUNK_SIZE;
+			for (uint32_t i = c * CHUNK_SIZE; i < end; i++)
+				tmp[hist[c][(keys[i] >> shift) & 0xff]++] = keys[i];
+		}
+		memcpy(keys, tmp, nr * sizeof(*keys));
+		free(hist);
+	}
+}
+
+static void build_lbvh_node(struct build_ctx *ctx, const uint32_t *codes,
+			    uint32_t node_idx, uint32_t first, uint32_t count,
+			    int depth)
+{
+	struct bvh *bvh = ctx->bvh;
+	struct bvh_node *node = &bvh->nodes[node_idx];
+
+	if (count <= LBVH_LEAF_SIZE) {
+		struct aabb cb, b = range_bounds(ctx, first, count, &cb);
+		make_leaf(node, b, first, count);
+		return;
+	}
+
+	uint32_t last = first + count - 1, left_count;
+	uint32_t diff = codes[first] ^ codes[last];
+	if (!diff || depth >= BVH_MAX_DEPTH - 32) {
+		left_count = count / 2;
+	} else {
+		/* Find the first code with the highest differing bit set. */
+		uint32_t bit = 1u << (31 - __builtin_clz(diff));
+		uint32_t lo = first, hi = last;
+		while (lo < hi) {
+			uint32_t mid = lo + (hi - lo) / 2;
+			if (codes[mid] & bit)
+				hi = mid;
+			else
+				lo = mid + 1;
+		}
+		left_count = lo - first;
+	}
+
+	uint32_t left = alloc_node_pair(ctx);
+	if (left_count > TASK_THRESHOLD) {
+		#pragma omp task
+		build_lbvh_node(ctx, codes, left, first, left_count, depth + 1);
+	} else {
+		build_lbvh_node(ctx, codes, left, first, left_count, depth + 1);
+	}
+	build_lbvh_node(ctx, codes, left + 1, first + left_count,
+			count - left_count, depth + 1);
+	#pragma omp taskwait
+
+	struct bvh_node *l = &bvh->nodes[left], *r = l + 1;
+	struct aabb b = aabb_union((struct aabb){ l->min, l->max },
+				   (struct aabb){ r->min, r->max });
+	node->min = b.min;
+	node->max = b.max;
+	node->first = left;
+	node->count = 0;
+}
+
+static void build_lbvh(struct build_ctx *ctx, struct aabb cb)
+{
+	struct bvh *bvh = ctx->bvh;
+	uint32_t nr = bvh->nr_prims, *codes;
+	uint64_t *keys, *tmp;
+	struct binning binning = binning_new(cb);
+
+	ALLOC_ARRAY(keys, nr);
+	ALLOC_ARRAY(tmp, nr);
+	ALLOC_ARRAY(codes, nr);
+	#pragma omp parallel for schedule(static)
+	for (uint32_t i = 0; i < nr; i++)
+		keys[i] = (uint64_t)morton_code(&binning, ctx->centers[i]) << 32 | i;
+	radix_sort_upper(keys, tmp, nr);
+	#pragma omp parallel for schedule(static)
+	for (uint32_t i = 0; i < nr; i++) {
+		codes[i] = keys[i] >> 32;
+		bvh->prims[i] = (uint32_t)keys[i];
+	}
+	free(keys);
+	free(tmp);
+
+	#pragma omp parallel
+	#pragma omp single
+	build_lbvh_node(ctx, codes, 0, 0, nr, 0);
+	free(codes);
+}
+
+static void build(struct bvh *bvh, const struct aabb *bounds, uint32_t nr,
+		  enum bvh_build_method method, uint32_t min_leaf,
+		  uint32_t max_leaf)
+{
+	struct build_ctx ctx = {
+		.bvh = bvh, .bounds = bounds, .nr_nodes = 1,
+		.min_leaf = min_leaf, .max_leaf = max_leaf,
+	};
+	struct aabb b = AABB_EMPTY, cb = AABB_EMPTY;
+
+	memset(bvh, 0, sizeof(*bvh));
+	bvh->nr_prims = nr;
+	ALLOC_ARRAY(bvh->prims, nr ? nr : 1);
+	ALLOC_ARRAY(bvh->nodes, nr ? 2 * (size_t)nr - 1 : 1);
+	ALLOC_ARRAY(ctx.centers, nr ? nr : 1);
+
+	#pragma omp parallel
+	{
+		struct aabb local_b = AABB_EMPTY, local_cb = AABB_EMPTY;
+		#pragma omp for schedule(static) nowait
+		for (uint32_t i = 0; i < nr; i++) {
+			bvh->prims[i] = i;
+			ctx.centers[i] = aabb_center(bounds[i]);
+			local_b = aabb_union(local_b, bounds[i]);
+			local_cb = aabb_union(local_cb, point_aabb(ctx.centers[i]));
+		}
+		#pragma omp critical
+		{
+			b = aabb_union(b, local_b);
+			cb = aabb_union(cb, local_cb);
+		}
+	}
+
+	if (!nr) {
+		/* An empty root (see bvh_traversal_init()). */
+		bvh->nodes[0] = (struct bvh_node){
+			.min = AABB_EMPTY.min, .max = AABB_EMPTY.max,
+		};
+	} else if (method == BVH_BUILD_LBVH) {
+		build_lbvh(&ctx, cb);
+	} else {
+		ALLOC_ARRAY(ctx.tmp, nr);
+		#pragma omp parallel
+		#pragma omp single
+		build_sah(&ctx, 0, 0, nr, b, cb, 0);
+		free(ctx.tmp);
+	}
+	bvh->nr_nodes = ctx.nr_nodes;
+	free(ctx.centers);
+}
+
+void bvh_build(struct bvh *bvh, const struct aabb *bounds, uint32_t nr,
+	       enum bvh_build_method method)
+{
+	build(bvh, bounds, nr, method, 2, MAX_LEAF_SIZE);
+}
+
+void bvh_build_clusters(struct bvh *bvh, const struct aabb *bounds, uint32_t nr,
+			uint32_t leaf_size)
+{
+	build(bvh, bounds, nr, BVH_BUILD_SAH, leaf_size, leaf_size);
+}
+
+void bvh_destroy(struct bvh *bvh)
+{
+	if (!bvh->mapped) {
+		free(bvh->nodes);
+		free(bvh->prims);
+	}
+	memset(bvh, 0, sizeof(*bvh));
+}
+
+static struct aabb node_aabb(const struct bvh_node *n)
+{
+	return (struct aabb){ n->min, n->max };
+}
+
+void bvh_refit(struct bvh *bvh, bvh_bounds_fn bounds, void *data)
+{
+	if (!bvh->nr_prims)
+		return;
+
+	#pragma omp parallel for schedule(dynamic, 1024)
+	for (uint32_t i = 0; i < bvh->nr_nodes; i++) {
+		struct bvh_node *n = &bvh->nodes[i];
+		struct aabb b = AABB_EMPTY;
+		if (!n->count)
+			continue;
+		for (uint32_t j = n->first; j < n->first + n->count; j++) {
+			struct aabb pb;
+			bounds(data, bvh->prims[j], &pb);
+			b = aabb_union(b, pb);
+		}
+		n->min = b.min;
+		n->max = b.max;
+	}
+
+	/* Children always come after their parent, so a reverse sweep suffices. */
+	for (uint32_t i = bvh->nr_nodes; i-- > 0; ) {
+		struct bvh_node *n = &bvh->nodes[i];
+		if (n->count)
+			continue;
+		struct aabb b = aabb_union(node_aabb(&bvh->nodes[n->first]),
+					   node_aabb(&bvh->nodes[n->first + 1]));
+		n->min = b.min;
+		n->max = b.max;
+	}
+}
+
+double bvh_sah_cost(const struct bvh *bvh)
+{
+	double root_area = aabb_area(node_aabb(&bvh->nodes[0]));
+	double cost = 0;
+	if (!root_area)
+		return 0;
+	#pragma omp parallel for reduction(+:cost) schedule(static)
+	for (uint32_t i = 0; i < bvh->nr_nodes; i++) {
+		const struct bvh_node *n = &bvh->nodes[i];
+		double area = aabb_area(node_aabb(n));
+		cost += area * (n->count ? n->count : TRAVERSAL_COST);
+	}
+	return cost / root_area;
+}
+
+const char *bvh_build_method_name(enum bvh_build_method method)
+{
+	switch (method) {
+	case BVH_BUILD_SAH:
+		return "sah";
+	case BVH_BUILD_LBVH:
+		return "lbvh";
+	}
+	BUG("unknown BVH build method %d", method);
+}
+
+int bvh_parse_build_method(const char *name, enum bvh_build_method *method)
+{
+	if (!strcmp(name, "sah"))
+		*method = BVH_BUILD_SAH;
+	else if (!strcmp(name, "lbvh"))
+		*method = BVH_BUILD_LBVH;
+	else
+		return -1;
+	return 0;
+}
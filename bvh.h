@@ -0,0 +1,320 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include "vec3.h"
+#include "ray.h"
+
+struct aabb {
+	struct vec3 min, max;
+};
+
+/*
+ * fminf() and fmaxf() must handle NaNs, so GCC emits library calls for
+ * them. These compile to single min/max instructions instead.
+ */
+static inline float fast_minf(float a, float b)
+{
+	return a < b ? a : b;
+}
+
+static inline float fast_maxf(float a, float b)
+{
+	return a > b ? a : b;
+}
+
+#define AABB_EMPTY ((struct aabb){ .min = {INFINITY, INFINITY, INFINITY}, \
+				   .max = {-INFINITY, -INFINITY, -INFINITY} })
+
+static inline struct aabb aabb_union(struct aabb a, struct aabb b)
+{
+	return (struct aabb){
+		.min = vec3_new(fast_minf(a.min.x, b.min.x),
+				fast_minf(a.min.y, b.min.y),
+				fast_minf(a.min.z, b.min.z)),
+		.max = vec3_new(fast_maxf(a.max.x, b.max.x),
+				fast_maxf(a.max.y, b.max.y),
+				fast_maxf(a.max.z, b.max.z)),
+	};
+}
+
+static inline struct vec3 aabb_center(struct aabb a)
+{
+	return vec3_smul(vec3_add(a.min, a.max), 0.5);
+}
+
+static inline float aabb_area(struct aabb a)
+{
+	struct vec3 d = vec3_sub(a.max, a.min);
+	if (d.x < 0 || d.y < 0 || d.z < 0)
+		return 0;
+	return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
+/*
+ * A bounding volume hierarchy over an array of primitives, each given by
+ * its bounding box. Node 0 is the root. Inner nodes have `count == 0` and
+ * their children at `first` and `first + 1`. Leaves reference `count`
+ * primitives starting at `prims[first]`, where `prims` holds indices into
+ * the caller's primitive array.
+ *
+ * Nodes are exactly 32 bytes so that two of them share a cache line.
+ */
+struct bvh_node {
+	struct vec3 min;
+	uint32_t first;
+	struct vec3 max;
+	uint32_t count;
+};
+
+struct bvh {
+	struct bvh_node *nodes;
+	uint32_t nr_nodes;
+	uint32_t *prims;
+	uint32_t nr_prims;
+	/*
+	 * Set when nodes and prims point into a mapped cache file, owned by
+	 * the caller, so that bvh_destroy() must not free them.
+	 */
+	int mapped;
+};
+
+#define BVH_MAX_DEPTH 64
+/* For primitives that are in no leaf. */
+#define BVH_NO_LEAF UINT32_MAX
+
+enum bvh_build_method {
+	/* Binned SAH: slower to build, faster to trace. The default. */
+	BVH_BUILD_SAH,
+	/* Morton-code (linear) BVH: fast to build, e.g. for animations. */
+	BVH_BUILD_LBVH,
+};
+
+const char *bvh_build_method_name(enum bvh_build_method method);
+/* Returns 0 on success or -1 if `name` is not a known method. */
+int bvh_parse_build_method(const char *name, enum bvh_build_method *method);
+
+/*
+ * Build a BVH over `nr` primitives, in parallel. Boxes may not be empty.
+ * Must not be called from within an OpenMP parallel region.
+ */
+void bvh_build(struct bvh *bvh, const struct aabb *bounds, uint32_t nr,
+	       enum bvh_build_method method);
+
+/*
+ * Like bvh_build() with BVH_BUILD_SAH, but every range of up to
+ * `leaf_size` primitives becomes a leaf. For tiny primitives that are
+ * cheap to test in bulk, this trades a few more tests for a much smaller
+ * tree.
+ */
+void bvh_build_clusters(struct bvh *bvh, const struct aabb *bounds, uint32_t nr,
+			uint32_t leaf_size);
+
+/* Spreads the lower 10 bits of v so that there are two zeros between each. */
+static inline uint32_t morton_expand_bits(uint32_t v)
+{
+	v &= 0x3ff;
+	v = (v | (v << 16)) & 0x030000ff;
+	v = (v | (v << 8)) & 0x0300f00f;
+	v = (v | (v << 4)) & 0x030c30c3;
+	v = (v | (v << 2)) & 0x09249249;
+	return v;
+}
+
+/*
+ * Sorts `nr` 64-bit keys on their upper 32 bits, in parallel, keeping keys
+ * with equal upper halves in their original order. `tmp` must have room
+ * for `nr` keys. Must not be called from within an OpenMP parallel region.
+ */
+void radix_sort_upper(uint64_t *keys, uint64_t *tmp, uint32_t nr);
+void bvh_destroy(struct bvh *bvh);
+
+typedef void (*bvh_bounds_fn)(void *data, uint32_t prim, struct aabb *out);
+
+/*
+ * Recompute the node boxes after primitives moved, in O(n) and keeping
+ * the tree topology. `bounds` is called with the values stored in `prims`.
+ * Tree quality degrades as primitives drift from where they were at build
+ * time; compare bvh_sah_cost() against the built tree to decide when to
+ * rebuild. Must not be called from within an OpenMP parallel region.
+ */
+void bvh_refit(struct bvh *bvh, bvh_bounds_fn bounds, void *data);
+
+/*
+ * The surface area heuristic cost of the tree, relative to the root's
+ * area, with unit traversal and intersection costs. Useful to compare the
+ * quality of different trees over the same primitives.
+ */
+double bvh_sah_cost(const struct bvh *bvh);
+
+/* Ray data precomputed for box tests. */
+struct bvh_ray {
+	struct vec3 pos, inv_dir;
+};
+
+/*
+ * Zero direction components are replaced by a tiny value, so that the
+ * slab distances are never 0 * inf = NaN.
+ */
+static inline float safe_inverse(float d)
+{
+	return 1 / (fabsf(d) > 1e-30f ? d : copysignf(1e-30f, d));
+}
+
+static inline struct bvh_ray bvh_ray_new(const struct ray *r)
+{
+	return (struct bvh_ray){
+		.pos = r->pos,
+		.inv_dir = vec3_new(safe_inverse(r->dir.x), safe_inverse(r->dir.y),
+				    safe_inverse(r->dir.z)),
+	};
+}
+
+/*
+ * Returns the distance at which the ray enters the node's box, or INFINITY
+ * if it misses the box or only reaches it after `limit`.
+ */
+static inline float bvh_node_hit(const struct bvh_node *n,
+				 const struct bvh_ray *r, float limit)
+{
+	float tx1 = (n->min.x - r->pos.x) * r->inv_dir.x;
+	float tx2 = (n->max.x - r->pos.x) * r->inv_dir.x;
+	float tmin = fast_minf(tx1, tx2), tmax = fast_maxf(tx1, tx2);
+	float ty1 = (n->min.y - r->pos.y) * r->inv_dir.y;
+	float ty2 = (n->max.y - r->pos.y) * r->inv_dir.y;
+	tmin = fast_maxf(tmin, fast_minf(ty1, ty2));
+	tmax = fast_minf(tmax, fast_maxf(ty1, ty2));
+	float tz1 = (n->min.z - r->pos.z) * r->inv_dir.z;
+	float tz2 = (n->max.z - r->pos.z) * r->inv_dir.z;
+	tmin = fast_maxf(tmin, fast_minf(tz1, tz2));
+	tmax = fast_minf(tmax, fast_maxf(tz1, tz2));
+	if (tmax < fast_maxf(tmin, 0) || tmin > limit)
+		return INFINITY;
+	return tmin;
+}
+
+/*
+ * Front to back traversal of the leaves whose boxes a ray enters before
+ * `limit`. Callers test the leaf primitives and may lower `limit` between
+ * calls as they find hits, which prunes the remaining subtrees:
+ *
+ *	struct bvh_traversal t;
+ *	const struct bvh_node *leaf;
+ *	bvh_traversal_init(&t, bvh, &br, limit);
+ *	while ((leaf = bvh_next_leaf(&t, &br, limit)))
+ *		...test bvh->prims[leaf->first, leaf->first + leaf->count)...
+ */
+struct bvh_traversal {
+	const struct bvh_node *nodes;
+	int sp;
+	struct {
+		uint32_t node;
+		float dist;
+	} stack[BVH_MAX_DEPTH];
+};
+
+static inline void bvh_traversal_init(struct bvh_traversal *t,
+				      const struct bvh *bvh,
+				      const struct bvh_ray *br, float limit)
+{
+	float dist = bvh_node_hit(&bvh->nodes[0], br, limit);
+	t->nodes = bvh->nodes;
+	t->sp = 0;
+	/* The root of an empty tree is an inner node without children. */
+	if (dist != INFINITY && (bvh->nodes[0].count || bvh->nr_nodes > 1)) {
+		t->stack[0].node = 0;
+		t->stack[0].dist = dist;
+		t->sp = 1;
+	}
+}
+
+/* Half the surface area of the node's box. */
+static inline float bvh_node_area(const struct bvh_node *n)
+{
+	struct vec3 d = vec3_sub(n->max, n->min);
+	return d.x * d.y + d.y * d.z + d.z * d.x;
+}
+
+/*
+ * Like bvh_next_leaf(), for any-hit queries, which stop at the first hit
+ * and never lower `limit`. Leaves are not visited front to back: the
+ * child with the larger box goes first, as large boxes are more likely to
+ * hold something that blocks the ray (walls, floors, big meshes). This
+ * finds occluders sooner in shadow-heavy scenes.
+ */
+static inline const struct bvh_node *bvh_next_leaf_any(struct bvh_traversal *t,
+						       const struct bvh_ray *br,
+						       float limit)
+{
+	const struct bvh_node *nodes = t->nodes;
+	while (t->sp) {
+		const struct bvh_node *n = &nodes[t->stack[--t->sp].node];
+
+		while (!n->count) {
+			const struct bvh_node *left = &nodes[n->first];
+			const struct bvh_node *right = left + 1;
+			float dl = bvh_node_hit(left, br, limit);
+			float dr = bvh_node_hit(right, br, limit);
+			if (dl == INFINITY && dr == INFINITY)
+				goto next;
+			if (dl == INFINITY || (dr != INFINITY &&
+			    bvh_node_area(right) > bvh_node_area(left))) {
+				const struct bvh_node *tmp_n = left;
+				float tmp_d = dl;
+				left = right;
+				dl = dr;
+				right = tmp_n;
+				dr = tmp_d;
+			}
+			if (dr != INFINITY) {
+				t->stack[t->sp].node = right - nodes;
+				t->stack[t->sp++].dist = dr;
+			}
+			n = left;
+		}
+		return n;
+next:
+		;
+	}
+	return NULL;
+}
+
+static inline const struct bvh_node *bvh_next_leaf(struct bvh_traversal *t,
+						   const struct bvh_ray *br,
+						   float limit)
+{
+	const struct bvh_node *nodes = t->nodes;
+	while (t->sp) {
+		t->sp--;
+		if (t->stack[t->sp].dist > limit)
+			continue;
+		const struct bvh_node *n = &nodes[t->stack[t->sp].node];
+
+		while (!n->count) {
+			const struct bvh_node *left = &nodes[n->first];
+			const struct bvh_node *right = left + 1;
+			float dl = bvh_node_hit(left, br, limit);
+			float dr = bvh_node_hit(right, br, limit);
+			if (dl > dr) {
+				const struct bvh_node *tmp_n = left;
+				float tmp_d = dl;
+				left = right;
+				dl = dr;
+				right = tmp_n;
+				dr = tmp_d;
+			}
+			if (dl == INFINITY)
+				goto next;
+			if (dr != INFINITY) {
+				t->stack[t->sp].node = right - nodes;
+				t->stack[t->sp++].dist = dr;
+			}
+			n = left;
+		}
+		return n;
+next:
+		;
+	}
+	return NULL;
+}
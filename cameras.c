@@ -0,0 +1,119 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "cameras.h"
+#include "lib/array.h"
+#include "lib/error.h"
+#include "lib/string-util.h"
+
+#define MAX_TOKENS 8
+
+static int tokenize(char *line, char **tokens)
+{
+	int nr = 0;
+	char *saveptr;
+	for (char *tok = strtok_r(line, " \t\r\n", &saveptr); tok;
+	     tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		if (*tok == '#' || nr == MAX_TOKENS)
+			break;
+		tokens[nr++] = tok;
+	}
+	return nr;
+}
+
+static int parse_float(const char *str, float *out)
+{
+	char *end;
+	*out = strtof(str, &end);
+	return end == str || *end ? -1 : 0;
+}
+
+/* Parses comma-separated x,y,z. */
+static int parse_vec3(const char *str, struct vec3 *out)
+{
+	float v[3];
+	for (int i = 0; i < 3; i++) {
+		char *end;
+		v[i] = strtof(str, &end);
+		if (end == str || *end != (i == 2 ? '\0' : ','))
+			return -1;
+		str = end + 1;
+	}
+	*out = vec3_new(v[0], v[1], v[2]);
+	return 0;
+}
+
+/*
+ * Returns the first invalid property, or NULL. The camera may still be
+ * invalid as a whole: see valid_camera().
+ */
+static const char *parse_camera(char **tokens, int nr, struct camera *c)
+{
+	for (int i = 1; i < nr; i++) {
+		const char *val;
+		int ret;
+		if (skip_prefix(tokens[i], "pos=", &val))
+			ret = parse_vec3(val, &c->pos);
+		else if (skip_prefix(tokens[i], "dir=", &val))
+			ret = parse_vec3(val, &c->dir);
+		else if (skip_prefix(tokens[i], "up=", &val))
+			ret = parse_vec3(val, &c->up);
+		else if (skip_prefix(tokens[i], "dist=", &val))
+			ret = parse_float(val, &c->viewpoint_dist);
+		else
+			ret = -1;
+		if (ret)
+			return tokens[i];
+	}
+	return NULL;
+}
+
+/* Whether the camera has a view to render, like server requests must. */
+static int valid_camera(const struct camera *c)
+{
+	return vec3_square(c->dir) > 0 &&
+	       vec3_square(vec3_cross(c->dir, c->up)) > 0 &&
+	       c->viewpoint_dist > 0;
+}
+
+void camera_list_load(struct camera_list *list, const char *path,
+		      const struct camera *defaults)
+{
+	FILE *in = fopen(path, "r");
+	char *line = NULL, *tokens[MAX_TOKENS];
+	size_t line_alloc = 0, line_nr = 0;
+
+	if (!in)
+		die_errno("failed to open camera file '%s'", path);
+
+	while (getline(&line, &line_alloc, in) > 0) {
+		int nr = tokenize(line, tokens);
+		line_nr++;
+		if (!nr)
+			continue;
+		if (strcmp(tokens[0], "camera"))
+			die("%s:%zu: unknown directive '%s'", path, line_nr, tokens[0]);
+		struct camera c = *defaults;
+		const char *bad = parse_camera(tokens, nr, &c);
+		if (bad)
+			die("%s:%zu: invalid camera property '%s'", path,
+			    line_nr, bad);
+		if (!valid_camera(&c))
+			die("%s:%zu: the camera needs a nonzero direction, not "
+			    "parallel to its up vector, and a positive dist",
+			    path, line_nr);
+		ALLOC_GROW(list->cameras, list->nr + 1, list->alloc);
+		list->cameras[list->nr++] = c;
+	}
+	if (ferror(in))
+		die_errno("failed to read camera file '%s'", path);
+	fclose(in);
+	free(line);
+	if (!list->nr)
+		die("camera file '%s' has no cameras", path);
+}
+
+void camera_list_destroy(struct camera_list *list)
+{
+	free(list->cameras);
+	memset(list, 0, sizeof(*list));
+}
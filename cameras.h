@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stddef.h>
+#include "scene.h"
+
+/*
+ * Camera lists, for rendering several views of a scene in one run (see
+ * render_views()).
+ *
+ * Camera files are text, with one camera per line and '#' starting a
+ * comment. Lines use the syntax of the text scene format:
+ *
+ *   camera [pos=<x>,<y>,<z>] [dir=<x>,<y>,<z>] [up=<x>,<y>,<z>] [dist=<d>]
+ *
+ * Properties left out are those of the scene's camera. Directions must be
+ * nonzero and not parallel to the up vector, and distances positive.
+ */
+struct camera_list {
+	struct camera *cameras;
+	size_t nr, alloc;
+};
+
+#define CAMERA_LIST_INIT { 0 }
+
+/* Dies on errors. `defaults` is the scene's camera. */
+void camera_list_load(struct camera_list *list, const char *path,
+		      const struct camera *defaults);
+void camera_list_destroy(struct camera_list *list);
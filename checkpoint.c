@@ -0,0 +1,121 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "checkpoint.h"
+#include "render.h"
+#include "scene-file.h"
+#include "lib/string-util.h"
+#include "lib/tempfile.h"
+#include "lib/wrappers.h"
+
+static size_t nr_pixels(const struct accumulator *acc)
+{
+	return (size_t)acc->rows * acc->cols;
+}
+
+static size_t nr_tiles(const struct accumulator *acc)
+{
+	return (size_t)acc->tiles_w * acc->tiles_h;
+}
+
+static size_t checkpoint_size(const struct accumulator *acc)
+{
+	return sizeof(struct checkpoint_header) +
+	       nr_pixels(acc) * (sizeof(*acc->sum_sq) + sizeof(*acc->sum)) +
+	       nr_tiles(acc);
+}
+
+int checkpoint_write(const char *path, uint64_t key, uint32_t frame,
+		     const struct accumulator *acc)
+{
+	struct checkpoint_header h = {
+		.magic = CHECKPOINT_MAGIC,
+		.version = CHECKPOINT_VERSION,
+		.byte_order = SCENE_FILE_BYTE_ORDER,
+		.key = key,
+		.frame = frame,
+		.passes = acc->passes,
+		.rows = acc->rows,
+		.cols = acc->cols,
+		.tile_size = ACCUMULATOR_TILE,
+	};
+
+	char *template = xmkstr("%s.XXXXXX", path);
+	struct tempfile *tempfile = mktempfile_m(template, 0666);
+	free(template);
+	if (!tempfile)
+		return error_errno("failed to create temporary file for '%s'", path);
+
+	int fd = get_tempfile_fd(tempfile);
+	if (write_in_full(fd, &h, sizeof(h)) < 0 ||
+	    write_in_full(fd, acc->sum_sq, nr_pixels(acc) * sizeof(*acc->sum_sq)) < 0 ||
+	    write_in_full(fd, acc->sum, nr_pixels(acc) * sizeof(*acc->sum)) < 0 ||
+	    write_in_full(fd, acc->tile_done, nr_tiles(acc)) < 0) {
+		error_errno("failed to write checkpoint '%s'", path);
+		delete_tempfile(&tempfile);
+		return -1;
+	}
+	if (rename_tempfile(&tempfile, path))
+		return error_errno("failed to rename checkpoint to '%s'", path);
+	return 0;
+}
+
+int checkpoint_read(const char *path, uint64_t key, uint32_t *frame,
+		    struct accumulator *acc)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 1;
+		return error_errno("failed to open checkpoint '%s'", path);
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		return error_errno("failed to stat checkpoint '%s'", path);
+	}
+	if ((uint64_t)st.st_size != checkpoint_size(acc)) {
+		close(fd);
+		return error("checkpoint '%s' is not for a %ux%u render",
+			     path, acc->cols, acc->rows);
+	}
+
+	size_t map_size = st.st_size;
+	char *map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return error_errno("failed to mmap checkpoint '%s'", path);
+
+	const struct checkpoint_header *h = (void *)map;
+	int ret = -1;
+	if (memcmp(h->magic, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) ||
+	    h->version != CHECKPOINT_VERSION ||
+	    h->byte_order != SCENE_FILE_BYTE_ORDER ||
+	    h->tile_size != ACCUMULATOR_TILE) {
+		error("checkpoint '%s' is unusable", path);
+		goto out;
+	}
+	if (h->key != key || h->rows != acc->rows || h->cols != acc->cols) {
+		error("checkpoint '%s' is for another scene or other settings",
+		      path);
+		goto out;
+	}
+
+	const char *p = map + sizeof(*h);
+	memcpy(acc->sum_sq, p, nr_pixels(acc) * sizeof(*acc->sum_sq));
+	p += nr_pixels(acc) * sizeof(*acc->sum_sq);
+	memcpy(acc->sum, p, nr_pixels(acc) * sizeof(*acc->sum));
+	p += nr_pixels(acc) * sizeof(*acc->sum);
+	acc->nr_tiles_done = 0;
+	for (size_t t = 0; t < nr_tiles(acc); t++) {
+		acc->tile_done[t] = !!p[t];
+		acc->nr_tiles_done += acc->tile_done[t];
+	}
+	acc->passes = h->passes;
+	*frame = h->frame;
+	ret = 0;
+out:
+	munmap(map, map_size);
+	return ret;
+}
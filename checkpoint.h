@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+struct accumulator;
+
+/*
+ * Checkpoints
+ * -----------
+ *
+ * A progressive render (see struct accumulator) can be saved to a file,
+ * and carried on from it after the process was killed. The file holds the
+ * frame being rendered and its accumulator: the sums of the passes done,
+ * and the tiles of the pass in progress already added to them. That is
+ * all the state there is: the random numbers of a pixel are drawn from a
+ * seed that only depends on the pixel and the pass, and what rendering
+ * threads keep across tiles, which a resumed process starts without (see
+ * struct shade_state), never changes the pixels. So a resumed render gives
+ * the same image, bit for bit, as an uninterrupted one.
+ *
+ * A checkpoint only applies to the render it was taken from. The caller
+ * passes a key that identifies the scene, the animation and the settings
+ * the image depends on, and a checkpoint with another key or size is
+ * refused.
+ *
+ * File layout: struct checkpoint_header, then the squared luminance sums,
+ * the color sums and the tile flags of the accumulator, with the machine's
+ * byte order.
+ */
+
+#define CHECKPOINT_MAGIC "RTCKPT"
+#define CHECKPOINT_VERSION 1
+
+struct checkpoint_header {
+	char magic[8];
+	uint32_t version, byte_order;
+	uint64_t key;
+	uint32_t frame, passes;
+	uint32_t rows, cols;
+	uint32_t tile_size, pad;
+};
+
+/*
+ * Writes `acc`, for frame `frame`, to `path`. The file is replaced
+ * atomically, so an interrupted write leaves the previous checkpoint.
+ * Returns 0 on success, or -1 with an error printed.
+ */
+int checkpoint_write(const char *path, uint64_t key, uint32_t frame,
+		     const struct accumulator *acc);
+
+/*
+ * Reads the checkpoint at `path` into `acc`, which must have been
+ * initialized with the size of the render, and its frame into `*frame`.
+ * Returns 0 on success, 1 if there is no checkpoint, or -1 with an error
+ * printed if it cannot be used.
+ */
+int checkpoint_read(const char *path, uint64_t key, uint32_t *frame,
+		    struct accumulator *acc);
@@ -5,6 +5,9 @@
 #define VIEWPOINT_DIST 1
 
 #define RAY_RECUSION_LIMIT 4
+#define RUSSIAN_ROULETTE_THRESHOLD 0 /* off: it adds noise */
+#define ADAPTIVE_ANGLE 20
+#define CHECKPOINT_INTERVAL 60
 #define AMBIENT_LIGHT_INTENSITY 0.08
 
 #define CAN_PROJ_ORTO 0
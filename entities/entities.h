@@ -1,8 +1,13 @@
 #pragma once
+#include <stdint.h>
 #include "../vec3.h"
 #include "../ppm.h"
 #include "../ray.h"
 #include "../texture.h"
+#include "../bvh.h"
+#include "mesh.h"
+#include "particles.h"
+#include "heightfield.h"
 #include "../lib/error.h"
 
 struct sphere {
@@ -46,43 +51,122 @@ struct material {
 	{.texture=texture_v, .diffuse_constant=1, .reflectiveness=ref, \
 	 .specular_constant=1, .shininess=800}
 
-typedef int (*ray_intersection_fn)(struct ray *r, struct entity *e,
-				   struct intersection *it);
-
-typedef struct vec3 (*lookup_texture_fn)(struct entity *e,
-					 struct vec3 pos);
-
+/*
+ * Entities hold no pointers: the material is an index into the scene's
+ * material table and the intersection/texture routines are dispatched on
+ * `type`. This allows the entity array to be used in place from a
+ * memory-mapped scene file (see scene-file.h).
+ *
+ * ENT_INSTANCE entities place a prototype of the scene (see struct
+ * instance in scene.h). They are handled by the scene-level code, as they
+ * need the scene's instance and prototype tables; their material is
+ * either ENTITY_NO_MATERIAL, to keep the prototype's materials, or an
+ * override for all of the prototype's entities.
+ *
+ * ENT_MESH, ENT_PARTICLES and ENT_HEIGHTFIELD entities refer to a
+ * triangle mesh (see mesh.h), a particle set (see particles.h) or a
+ * heightfield (see heightfield.h) of the scene's tables, and are handled
+ * by the scene-level code as well.
+ */
 struct entity {
-	enum entity_type{
+	enum entity_type {
 		ENT_SPHERE,
 		ENT_PLANE,
+		ENT_INSTANCE,
+		ENT_MESH,
+		ENT_PARTICLES,
+		ENT_HEIGHTFIELD,
 	} type;
+	uint32_t material;
 	union {
 		struct sphere s;
 		struct plane p;
+		uint32_t instance; /* index into scene->instances */
+		uint32_t mesh; /* index into scene->meshes */
+		uint32_t particles; /* index into scene->particle_sets */
+		uint32_t heightfield; /* index into scene->heightfields */
 	} u;
-	struct material material;
-	ray_intersection_fn ray_intersects;
-	lookup_texture_fn lookup_texture;
 };
 
+#define ENTITY_NO_MATERIAL UINT32_MAX
+
 int ray_intersects_sphere(struct ray *r, struct entity *e, struct intersection *it);
-struct vec3 lookup_sphere_texture(struct entity *e, struct vec3 pos);
+struct vec3 lookup_sphere_texture(struct sphere *s, struct texture *texture,
+				  struct vec3 pos);
 
 int ray_intersects_plane(struct ray *r, struct entity *e, struct intersection *it);
 
-static struct vec3 missing_lookup_texture_fn(struct entity *e,
-					     struct vec3 pos)
+static inline int entity_ray_intersects(struct ray *r, struct entity *e,
+					struct intersection *it)
 {
-	die("Missing lookup texture function for entity %d\n", e->type);
+	switch (e->type) {
+	case ENT_SPHERE:
+		return ray_intersects_sphere(r, e, it);
+	case ENT_PLANE:
+		return ray_intersects_plane(r, e, it);
+	case ENT_INSTANCE:
+	case ENT_MESH:
+	case ENT_PARTICLES:
+	case ENT_HEIGHTFIELD:
+		BUG("instances, meshes, particles and heightfields must be traced with cast_ray()");
+	}
+	BUG("unknown entity type %d", e->type);
+}
+
+static inline struct vec3 entity_lookup_texture(struct entity *e,
+						struct texture *texture,
+						struct vec3 pos)
+{
+	if (e->type == ENT_SPHERE)
+		return lookup_sphere_texture(&e->u.s, texture, pos);
+	BUG("entity type %d cannot be textured (see scene_entity_takes_texture())",
+	    e->type);
+}
+
+/*
+ * Returns 0 for unbounded entities, which are kept out of the scene BVH.
+ * Instances, meshes, particles and heightfields are bounded, but see
+ * scene_entity_bounds().
+ */
+static inline int entity_bounds(const struct entity *e, struct aabb *b)
+{
+	switch (e->type) {
+	case ENT_SPHERE: {
+		struct vec3 r = vec3_new(e->u.s.radius, e->u.s.radius, e->u.s.radius);
+		b->min = vec3_sub(e->u.s.center, r);
+		b->max = vec3_add(e->u.s.center, r);
+		return 1;
+	}
+	case ENT_PLANE:
+		return 0;
+	case ENT_INSTANCE:
+	case ENT_MESH:
+	case ENT_PARTICLES:
+	case ENT_HEIGHTFIELD:
+		BUG("instance, mesh, particle and heightfield bounds need the scene");
+	}
+	BUG("unknown entity type %d", e->type);
 }
 
 #define ENTITY_SPHERE(center_v, radius_v, material_v) \
 	((struct entity) {.type=ENT_SPHERE, .u={.s={.center=center_v, .radius=radius_v}}, \
-	 .material=material_v, .ray_intersects=ray_intersects_sphere, \
-	 .lookup_texture=lookup_sphere_texture})
+	 .material=material_v})
 
 #define ENTITY_PLANE(p0_v, normal_v, material_v) \
 	((struct entity) {.type=ENT_PLANE, .u={.p={.p0=p0_v, .normal=normal_v}}, \
-	 .material=material_v, .ray_intersects=ray_intersects_plane, \
-	 .lookup_texture=missing_lookup_texture_fn})
+	 .material=material_v})
+
+#define ENTITY_INSTANCE(instance_v, material_v) \
+	((struct entity) {.type=ENT_INSTANCE, .u={.instance=instance_v}, \
+	 .material=material_v})
+
+#define ENTITY_MESH(mesh_v, material_v) \
+	((struct entity) {.type=ENT_MESH, .u={.mesh=mesh_v}, .material=material_v})
+
+#define ENTITY_PARTICLES(particles_v, material_v) \
+	((struct entity) {.type=ENT_PARTICLES, .u={.particles=particles_v}, \
+	 .material=material_v})
+
+#define ENTITY_HEIGHTFIELD(heightfield_v, material_v) \
+	((struct entity) {.type=ENT_HEIGHTFIELD, .u={.heightfield=heightfield_v}, \
+	 .material=material_v})
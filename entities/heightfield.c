@@ -0,0 +1,346 @@
+#include "entities.h"
+#include "../lib/array.h"
+
+void heightfield_alloc(struct heightfield *hf, uint32_t nx, uint32_t nz,
+		       int bits16)
+{
+	size_t nr = st_mult(nx, nz);
+	memset(hf, 0, sizeof(*hf));
+	hf->mem = xmalloc(st_mult(nr, bits16 ? sizeof(uint16_t) : sizeof(float)));
+	if (bits16)
+		hf->heights16 = hf->mem;
+	else
+		hf->heights = hf->mem;
+	hf->nx = nx;
+	hf->nz = nz;
+	hf->cell_x = hf->cell_z = hf->height_scale = 1;
+}
+
+void heightfield_destroy(struct heightfield *hf)
+{
+	free(hf->mem);
+	free(hf->nodes);
+	memset(hf, 0, sizeof(*hf));
+}
+
+/*
+ * Pyramid
+ * -------
+ *
+ * Node bounds are quantized over the heightfield's height range, rounding
+ * outwards (and by one more step, to absorb the rounding of the
+ * dequantization), so that they always contain the exact bounds.
+ */
+
+static inline uint32_t level_width(uint32_t cells, uint32_t level)
+{
+	return ((cells - 1) >> level) + 1;
+}
+
+static inline float quantum(const struct heightfield *hf)
+{
+	return (hf->bounds.max.y - hf->bounds.min.y) / UINT16_MAX;
+}
+
+static inline struct heightfield_node quantize(const struct heightfield *hf,
+					       float lo, float hi)
+{
+	float q = quantum(hf);
+	float qlo = q > 0 ? floorf((lo - hf->bounds.min.y) / q) - 1 : 0;
+	float qhi = q > 0 ? ceilf((hi - hf->bounds.min.y) / q) + 1 : 0;
+	return (struct heightfield_node){
+		.min = qlo < 0 ? 0 : qlo > UINT16_MAX ? UINT16_MAX : qlo,
+		.max = qhi < 0 ? 0 : qhi > UINT16_MAX ? UINT16_MAX : qhi,
+	};
+}
+
+static void compute_bounds(struct heightfield *hf)
+{
+	size_t nr = (size_t)hf->nx * hf->nz;
+	float lo = INFINITY, hi = -INFINITY;
+
+	#pragma omp parallel for schedule(static) reduction(min:lo) reduction(max:hi)
+	for (size_t i = 0; i < nr; i++) {
+		float h = hf->heights16 ? hf->heights16[i] : hf->heights[i];
+		lo = fast_minf(lo, h);
+		hi = fast_maxf(hi, h);
+	}
+	lo = hf->origin.y + lo * hf->height_scale;
+	hi = hf->origin.y + hi * hf->height_scale;
+	hf->bounds.min = vec3_new(hf->origin.x, fast_minf(lo, hi), hf->origin.z);
+	hf->bounds.max = vec3_new(hf->origin.x + (hf->nx - 1) * hf->cell_x,
+				  fast_maxf(lo, hi),
+				  hf->origin.z + (hf->nz - 1) * hf->cell_z);
+}
+
+/* Level 1 from the samples: each node covers up to 3 by 3 of them. */
+static void build_level1(struct heightfield *hf)
+{
+	uint32_t w = level_width(hf->nx - 1, 1), h = level_width(hf->nz - 1, 1);
+	struct heightfield_node *nodes = hf->nodes + hf->level_first[1];
+
+	#pragma omp parallel for schedule(static)
+	for (uint32_t j = 0; j < h; j++) {
+		for (uint32_t i = 0; i < w; i++) {
+			float lo = INFINITY, hi = -INFINITY;
+			for (uint32_t z = 2 * j; z <= 2 * j + 2 && z < hf->nz; z++) {
+				for (uint32_t x = 2 * i; x <= 2 * i + 2 && x < hf->nx; x++) {
+					float y = heightfield_height(hf, x, z);
+					lo = fast_minf(lo, y);
+					hi = fast_maxf(hi, y);
+				}
+			}
+			nodes[(size_t)j * w + i] = quantize(hf, lo, hi);
+		}
+	}
+}
+
+void heightfield_build_accel(struct heightfield *hf)
+{
+	uint32_t cells_x = hf->nx - 1, cells_z = hf->nz - 1;
+	size_t nr_nodes = 0;
+
+	compute_bounds(hf);
+
+	hf->nr_levels = 1;
+	while (level_width(cells_x, hf->nr_levels - 1) > 1 ||
+	       level_width(cells_z, hf->nr_levels - 1) > 1) {
+		hf->level_first[hf->nr_levels] = nr_nodes;
+		nr_nodes += (size_t)level_width(cells_x, hf->nr_levels) *
+			    level_width(cells_z, hf->nr_levels);
+		hf->nr_levels++;
+	}
+	FREE_AND_NULL(hf->nodes);
+	ALLOC_ARRAY(hf->nodes, nr_nodes);
+
+	if (hf->nr_levels > 1)
+		build_level1(hf);
+
+	/* Upper levels from their 2 by 2 children. */
+	for (uint32_t level = 2; level < hf->nr_levels; level++) {
+		const struct heightfield_node *below = hf->nodes + hf->level_first[level - 1];
+		struct heightfield_node *nodes = hf->nodes + hf->level_first[level];
+		uint32_t bw = level_width(cells_x, level - 1);
+		uint32_t bh = level_width(cells_z, level - 1);
+		uint32_t w = level_width(cells_x, level);
+		uint32_t h = level_width(cells_z, level);
+		#pragma omp parallel for schedule(static)
+		for (uint32_t j = 0; j < h; j++) {
+			for (uint32_t i = 0; i < w; i++) {
+				struct heightfield_node n = { UINT16_MAX, 0 };
+				for (uint32_t z = 2 * j; z < 2 * j + 2 && z < bh; z++) {
+					for (uint32_t x = 2 * i; x < 2 * i + 2 && x < bw; x++) {
+						const struct heightfield_node *c = &below[(size_t)z * bw + x];
+						n.min = c->min < n.min ? c->min : n.min;
+						n.max = c->max > n.max ? c->max : n.max;
+					}
+				}
+				nodes[(size_t)j * w + i] = n;
+			}
+		}
+	}
+}
+
+/*
+ * Intersection
+ * ------------
+ *
+ * The DDA walks the ray through the grid in cell coordinates, starting
+ * at the top of the pyramid. At each step it finds the node of the
+ * current level that contains the ray, and the distance at which the ray
+ * leaves it. If the ray's height range over that span misses the node's,
+ * the ray skips to the node's exit and goes up a level; otherwise it goes
+ * down a level, until it reaches a cell, whose triangles are tested. The
+ * node is always found from the ray's position, so moving between levels
+ * needs no bookkeeping.
+ */
+
+/*
+ * The cell containing grid coordinate `g`. On a cell boundary, this is
+ * the cell the ray is entering, which depends on the sign of its
+ * direction.
+ */
+static inline uint32_t cell_at(float g, float inv_dir, uint32_t cells)
+{
+	float f = floorf(g);
+	if (f == g && inv_dir < 0)
+		f--;
+	return f < 0 ? 0 : f >= cells ? cells - 1 : f;
+}
+
+/*
+ * Clips the ray to the heightfield's bounds. Returns 0 if it misses them
+ * before `limit`.
+ */
+static int clip(const struct heightfield *hf, const struct bvh_ray *br,
+		float limit, float *t0, float *t1)
+{
+	struct bvh_node box = { .min = hf->bounds.min, .max = hf->bounds.max };
+	float tmin = bvh_node_hit(&box, br, limit);
+	if (tmin == INFINITY)
+		return 0;
+
+	float tx = fast_maxf((box.min.x - br->pos.x) * br->inv_dir.x,
+			     (box.max.x - br->pos.x) * br->inv_dir.x);
+	float ty = fast_maxf((box.min.y - br->pos.y) * br->inv_dir.y,
+			     (box.max.y - br->pos.y) * br->inv_dir.y);
+	float tz = fast_maxf((box.min.z - br->pos.z) * br->inv_dir.z,
+			     (box.max.z - br->pos.z) * br->inv_dir.z);
+	*t0 = fast_maxf(tmin, 0);
+	*t1 = fast_minf(fast_minf(tx, ty), fast_minf(tz, limit));
+	return 1;
+}
+
+/* Möller-Trumbore. Returns the distance, or INFINITY on misses. */
+static inline float intersect_triangle(const struct ray *r, struct vec3 p0,
+				       struct vec3 p1, struct vec3 p2,
+				       float *u, float *v)
+{
+	struct vec3 e1 = vec3_sub(p1, p0), e2 = vec3_sub(p2, p0);
+	struct vec3 p = vec3_cross(r->dir, e2);
+	float det = vec3_dot(e1, p);
+	if (det == 0)
+		return INFINITY;
+	float inv_det = 1 / det;
+	struct vec3 s = vec3_sub(r->pos, p0);
+	*u = vec3_dot(s, p) * inv_det;
+	if (*u < 0 || *u > 1)
+		return INFINITY;
+	struct vec3 q = vec3_cross(s, e1);
+	*v = vec3_dot(r->dir, q) * inv_det;
+	if (*v < 0 || *u + *v > 1)
+		return INFINITY;
+	float t = vec3_dot(e2, q) * inv_det;
+	return t > 0 ? t : INFINITY;
+}
+
+/* The smooth normal at sample (x, z), unnormalized, by central differences. */
+static struct vec3 sample_normal(const struct heightfield *hf, uint32_t x,
+				 uint32_t z)
+{
+	uint32_t x0 = x ? x - 1 : x, x1 = x + 1 < hf->nx ? x + 1 : x;
+	uint32_t z0 = z ? z - 1 : z, z1 = z + 1 < hf->nz ? z + 1 : z;
+	float dx = (heightfield_height(hf, x1, z) - heightfield_height(hf, x0, z)) /
+		   ((x1 - x0) * hf->cell_x);
+	float dz = (heightfield_height(hf, x, z1) - heightfield_height(hf, x, z0)) /
+		   ((z1 - z0) * hf->cell_z);
+	return vec3_new(-dx, 1, -dz);
+}
+
+/*
+ * Tests the two triangles of cell (cx, cz), split along the diagonal from
+ * its (0, 0) corner, given its corner heights.
+ */
+static int intersect_cell(const struct heightfield *hf, const struct ray *r,
+			  uint32_t cx, uint32_t cz, const float h[4],
+			  float *limit, struct intersection *it)
+{
+	float x0 = hf->origin.x + cx * hf->cell_x, x1 = x0 + hf->cell_x;
+	float z0 = hf->origin.z + cz * hf->cell_z, z1 = z0 + hf->cell_z;
+	struct vec3 p00 = vec3_new(x0, h[0], z0), p10 = vec3_new(x1, h[1], z0);
+	struct vec3 p01 = vec3_new(x0, h[2], z1), p11 = vec3_new(x1, h[3], z1);
+	float ua = 0, va = 0, ub = 0, vb = 0;
+	float ta = intersect_triangle(r, p00, p10, p11, &ua, &va);
+	float tb = intersect_triangle(r, p00, p11, p01, &ub, &vb);
+	float t = fast_minf(ta, tb);
+	if (!(t < *limit))
+		return 0;
+	if (!it)
+		return 1;
+
+	/* Interpolate the corner normals with the barycentric coordinates. */
+	struct vec3 n00 = sample_normal(hf, cx, cz);
+	struct vec3 n11 = sample_normal(hf, cx + 1, cz + 1);
+	struct vec3 n;
+	if (ta <= tb)
+		n = vec3_add(vec3_add(vec3_smul(n00, 1 - ua - va),
+				      vec3_smul(sample_normal(hf, cx + 1, cz), ua)),
+			     vec3_smul(n11, va));
+	else
+		n = vec3_add(vec3_add(vec3_smul(n00, 1 - ub - vb),
+				      vec3_smul(n11, ub)),
+			     vec3_smul(sample_normal(hf, cx, cz + 1), vb));
+
+	*limit = t;
+	it->dist = t;
+	it->pos = vec3_add(r->pos, vec3_smul(r->dir, t));
+	it->normal = vec3_normalize(n);
+	it->prim = cz * (hf->nx - 1) + cx;
+	return 1;
+}
+
+int heightfield_intersect(const struct heightfield *hf, const struct ray *r,
+			  float *limit, struct intersection *it)
+{
+	struct bvh_ray br = bvh_ray_new(r);
+	uint32_t cells_x = hf->nx - 1, cells_z = hf->nz - 1;
+	uint32_t top = hf->nr_levels - 1, level = top;
+	float t, t_end;
+
+	if (!clip(hf, &br, *limit, &t, &t_end))
+		return 0;
+
+	/* The ray in cell coordinates. */
+	float ox = (r->pos.x - hf->origin.x) / hf->cell_x;
+	float oz = (r->pos.z - hf->origin.z) / hf->cell_z;
+	float dx = r->dir.x / hf->cell_x, dz = r->dir.z / hf->cell_z;
+	float inv_dx = safe_inverse(dx), inv_dz = safe_inverse(dz);
+	float q = quantum(hf);
+
+	while (t <= t_end) {
+		uint32_t cx = cell_at(ox + t * dx, inv_dx, cells_x);
+		uint32_t cz = cell_at(oz + t * dz, inv_dz, cells_z);
+		uint64_t i = cx >> level, j = cz >> level;
+
+		/* Where the ray leaves the node's block of cells. */
+		uint64_t bx = inv_dx > 0 ? (i + 1) << level : i << level;
+		uint64_t bz = inv_dz > 0 ? (j + 1) << level : j << level;
+		float t_exit = fast_minf(fast_minf(((float)bx - ox) * inv_dx,
+						   ((float)bz - oz) * inv_dz), t_end);
+		float y0 = r->pos.y + t * r->dir.y;
+		float y1 = r->pos.y + t_exit * r->dir.y;
+
+		float h[4], lo, hi;
+		if (level) {
+			const struct heightfield_node *n = &hf->nodes[hf->level_first[level] +
+				j * level_width(cells_x, level) + i];
+			lo = hf->bounds.min.y + n->min * q;
+			hi = hf->bounds.min.y + n->max * q;
+		} else {
+			h[0] = heightfield_height(hf, cx, cz);
+			h[1] = heightfield_height(hf, cx + 1, cz);
+			h[2] = heightfield_height(hf, cx, cz + 1);
+			h[3] = heightfield_height(hf, cx + 1, cz + 1);
+			lo = fast_minf(fast_minf(h[0], h[1]), fast_minf(h[2], h[3]));
+			hi = fast_maxf(fast_maxf(h[0], h[1]), fast_maxf(h[2], h[3]));
+		}
+
+		if (fast_maxf(y0, y1) >= lo && fast_minf(y0, y1) <= hi) {
+			if (level) {
+				level--;
+				continue;
+			}
+			/* Cells are visited front to back: the first hit is the closest. */
+			if (intersect_cell(hf, r, cx, cz, h, limit, it))
+				return 1;
+		}
+
+		t = t_exit > t ? t_exit : nextafterf(t, INFINITY);
+		if (level < top)
+			level++;
+	}
+	return 0;
+}
+
+struct vec3 heightfield_lookup_texture(const struct heightfield *hf,
+				       struct texture *texture, struct vec3 pos)
+{
+	float u = (pos.x - hf->bounds.min.x) / (hf->bounds.max.x - hf->bounds.min.x);
+	float v = (pos.z - hf->bounds.min.z) / (hf->bounds.max.z - hf->bounds.min.z);
+	u = u < 0 ? 0 : u > 1 ? 1 : u;
+	v = v < 0 ? 0 : v > 1 ? 1 : v;
+
+	/* Filter method: nearest pixel. */
+	return texture_color(texture, roundf(u * (texture->W - 1)),
+			     roundf(v * (texture->H - 1)));
+}
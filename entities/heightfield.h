@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include "../bvh.h"
+#include "../ray.h"
+#include "../texture.h"
+
+/*
+ * A heightfield: terrain given by a regular grid of nx by nz height
+ * samples. Sample (x, z) sits at
+ *
+ *   origin + (x * cell_x, height * height_scale, z * cell_z)
+ *
+ * and each grid cell is split into two triangles. Heights are stored
+ * either as floats (`heights`) or as 16-bit integers (`heights16`),
+ * whichever is set, in row-major order (x varies fastest).
+ *
+ * Rays are traced with a DDA over the grid, accelerated by a pyramid of
+ * min/max heights: level L has a node for each block of 2^L by 2^L cells,
+ * and whole blocks are skipped when the ray passes above or below them.
+ * Levels start at 1, as level 0 comes straight from the samples. The
+ * pyramid stores its bounds quantized to 16 bits, so a heightfield takes
+ * about 1.3 bytes per sample on top of its heights.
+ *
+ * Like meshes, the heights may point into a scene file mapping, in which
+ * case `mem` is NULL.
+ */
+#define HEIGHTFIELD_MAX_LEVELS 32
+
+struct heightfield_node {
+	uint16_t min, max;
+};
+
+struct heightfield {
+	float *heights;
+	uint16_t *heights16;
+	uint32_t nx, nz;
+	struct vec3 origin;
+	float cell_x, cell_z, height_scale;
+	void *mem;
+
+	/* Set by scene_prepare_accel(). */
+	struct aabb bounds;
+	struct heightfield_node *nodes;
+	/* Where each level starts in `nodes`. */
+	size_t level_first[HEIGHTFIELD_MAX_LEVELS];
+	uint32_t nr_levels;
+};
+
+/*
+ * Allocates the heights of an nx by nz heightfield, as 16-bit integers if
+ * `bits16` is set, and sets its other fields to a unit grid at the origin.
+ */
+void heightfield_alloc(struct heightfield *hf, uint32_t nx, uint32_t nz,
+		       int bits16);
+void heightfield_destroy(struct heightfield *hf);
+
+static inline float heightfield_height(const struct heightfield *hf,
+				       uint32_t x, uint32_t z)
+{
+	size_t i = (size_t)z * hf->nx + x;
+	float h = hf->heights16 ? hf->heights16[i] : hf->heights[i];
+	return hf->origin.y + h * hf->height_scale;
+}
+
+/* Builds the min/max pyramid and sets `bounds`. */
+void heightfield_build_accel(struct heightfield *hf);
+
+/*
+ * Intersects the ray with the heightfield, whose pyramid must be built,
+ * like mesh_intersect(). On hits, it->prim is the index of the cell.
+ */
+int heightfield_intersect(const struct heightfield *hf, const struct ray *r,
+			  float *limit, struct intersection *it);
+
+/* The texture is stretched over the whole grid, seen from above. */
+struct vec3 heightfield_lookup_texture(const struct heightfield *hf,
+				       struct texture *texture, struct vec3 pos);
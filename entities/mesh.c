@@ -0,0 +1,303 @@
+#include "entities.h"
+#include "../lib/array.h"
+
+void mesh_alloc(struct mesh *mesh, uint32_t nr_vertices, uint32_t nr_triangles,
+		int normals)
+{
+	size_t floats = st_mult(nr_vertices, normals ? 6 : 3);
+	char *mem = xmalloc(st_mult(floats, sizeof(float)) +
+			    st_mult(nr_triangles, sizeof(*mesh->tris)));
+	float *f = (float *)mem;
+
+	memset(mesh, 0, sizeof(*mesh));
+	mesh->mem = mem;
+	mesh->nr_vertices = nr_vertices;
+	mesh->nr_triangles = nr_triangles;
+	mesh->x = f;
+	mesh->y = f + nr_vertices;
+	mesh->z = f + 2 * (size_t)nr_vertices;
+	if (normals) {
+		mesh->nx = f + 3 * (size_t)nr_vertices;
+		mesh->ny = f + 4 * (size_t)nr_vertices;
+		mesh->nz = f + 5 * (size_t)nr_vertices;
+	}
+	mesh->tris = (void *)(f + floats);
+}
+
+void mesh_destroy(struct mesh *mesh)
+{
+	free(mesh->mem);
+	bvh_destroy(&mesh->bvh);
+	memset(mesh, 0, sizeof(*mesh));
+}
+
+static inline struct vec3 mesh_vertex(const struct mesh *m, uint32_t v)
+{
+	return vec3_new(m->x[v], m->y[v], m->z[v]);
+}
+
+static inline struct vec3 triangle_normal(const struct mesh *m, uint32_t t)
+{
+	struct vec3 p0 = mesh_vertex(m, m->tris[t][0]);
+	return vec3_cross(vec3_sub(mesh_vertex(m, m->tris[t][1]), p0),
+			  vec3_sub(mesh_vertex(m, m->tris[t][2]), p0));
+}
+
+void mesh_compute_normals(struct mesh *m)
+{
+	struct vec3 *normals;
+
+	/* The cross product's length is twice the area: no need to weight. */
+	ALLOC_ARRAY(normals, m->nr_triangles);
+	#pragma omp parallel for schedule(static)
+	for (uint32_t t = 0; t < m->nr_triangles; t++)
+		normals[t] = triangle_normal(m, t);
+
+	/*
+	 * Summed serially, in triangle order: float addition is not
+	 * associative, and the normals must not depend on the thread schedule.
+	 */
+	memset(m->nx, 0, m->nr_vertices * sizeof(*m->nx));
+	memset(m->ny, 0, m->nr_vertices * sizeof(*m->ny));
+	memset(m->nz, 0, m->nr_vertices * sizeof(*m->nz));
+	for (uint32_t t = 0; t < m->nr_triangles; t++) {
+		for (int i = 0; i < 3; i++) {
+			uint32_t v = m->tris[t][i];
+			m->nx[v] += normals[t].x;
+			m->ny[v] += normals[t].y;
+			m->nz[v] += normals[t].z;
+		}
+	}
+	free(normals);
+
+	#pragma omp parallel for schedule(static)
+	for (uint32_t v = 0; v < m->nr_vertices; v++) {
+		struct vec3 n = vec3_new(m->nx[v], m->ny[v], m->nz[v]);
+		float len = vec3_norm(n);
+		if (len > 0)
+			n = vec3_sdiv(n, len);
+		m->nx[v] = n.x;
+		m->ny[v] = n.y;
+		m->nz[v] = n.z;
+	}
+}
+
+void mesh_build_accel(struct mesh *m)
+{
+	struct aabb *bounds;
+	ALLOC_ARRAY(bounds, m->nr_triangles);
+	#pragma omp parallel for schedule(static)
+	for (uint32_t t = 0; t < m->nr_triangles; t++)
+		bounds[t] = mesh_triangle_bounds(m, t);
+	bvh_build(&m->bvh, bounds, m->nr_triangles, BVH_BUILD_SAH);
+	m->bounds = (struct aabb){ m->bvh.nodes[0].min, m->bvh.nodes[0].max };
+	free(bounds);
+}
+
+/*
+ * Intersection
+ * ------------
+ *
+ * Triangles are intersected with the watertight algorithm by Woop, Benthin
+ * and Wald ("Watertight Ray/Triangle Intersection", JCGT 2013): vertices
+ * are translated to the ray origin and sheared so that the ray points down
+ * the z axis, which reduces the test to 2D edge functions that are
+ * consistent across shared edges, so that rays never slip between
+ * adjacent triangles. Edge functions that come out exactly zero are
+ * recomputed in double precision.
+ *
+ * Leaves are tested LANES triangles at a time with GCC vector extensions,
+ * which compile to SSE on x86-64 and NEON on AArch64.
+ */
+
+#define LANES 4
+typedef float f32xL __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t i32xL __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+struct wt_ray {
+	int kx, ky, kz;
+	float sx, sy, sz;
+	float org[3];
+};
+
+static struct wt_ray wt_ray_new(const struct ray *r)
+{
+	float dir[3] = { r->dir.x, r->dir.y, r->dir.z };
+	struct wt_ray wr = { .org = { r->pos.x, r->pos.y, r->pos.z } };
+	float ax = fabsf(dir[0]), ay = fabsf(dir[1]), az = fabsf(dir[2]);
+
+	wr.kz = ax > ay ? (ax > az ? 0 : 2) : (ay > az ? 1 : 2);
+	wr.kx = (wr.kz + 1) % 3;
+	wr.ky = (wr.kx + 1) % 3;
+	/* Keep the winding, so that the edge function signs stay meaningful. */
+	if (dir[wr.kz] < 0) {
+		int tmp = wr.kx;
+		wr.kx = wr.ky;
+		wr.ky = tmp;
+	}
+	wr.sx = dir[wr.kx] / dir[wr.kz];
+	wr.sy = dir[wr.ky] / dir[wr.kz];
+	wr.sz = 1 / dir[wr.kz];
+	return wr;
+}
+
+struct packet_hit {
+	float dist;
+	uint32_t tri;
+	float bary[3];
+};
+
+/* The vertex coordinates of a triangle packet, relative to the ray origin. */
+struct packet {
+	f32xL x[3], y[3], z[3];
+};
+
+static inline void gather(const struct mesh *m, const struct wt_ray *wr,
+			  const uint32_t *ids, int nr, struct packet *p)
+{
+	const float *axes[3] = { m->x, m->y, m->z };
+	const float *px = axes[wr->kx], *py = axes[wr->ky], *pz = axes[wr->kz];
+	float x[3][LANES], y[3][LANES], z[3][LANES];
+	for (int l = 0; l < LANES; l++) {
+		/* Unused lanes repeat the first triangle, and are masked out. */
+		uint32_t t = ids[l < nr ? l : 0];
+		for (int i = 0; i < 3; i++) {
+			uint32_t v = m->tris[t][i];
+			x[i][l] = px[v] - wr->org[wr->kx];
+			y[i][l] = py[v] - wr->org[wr->ky];
+			z[i][l] = pz[v] - wr->org[wr->kz];
+		}
+	}
+	memcpy(p->x, x, sizeof(x));
+	memcpy(p->y, y, sizeof(y));
+	memcpy(p->z, z, sizeof(z));
+}
+
+static void edge_functions_double(const struct wt_ray *wr, const struct packet *p,
+				  int l, float *u, float *v, float *w)
+{
+	double x[3], y[3];
+	for (int i = 0; i < 3; i++) {
+		x[i] = (double)p->x[i][l] - (double)wr->sx * p->z[i][l];
+		y[i] = (double)p->y[i][l] - (double)wr->sy * p->z[i][l];
+	}
+	*u = x[2] * y[1] - y[2] * x[1];
+	*v = x[0] * y[2] - y[0] * x[2];
+	*w = x[1] * y[0] - y[1] * x[0];
+}
+
+/*
+ * Tests up to LANES triangles, whose indices are `ids[0, nr)`. Returns 1
+ * and fills `hit` with the closest one if any is hit closer than `limit`.
+ */
+static int intersect_packet(const struct mesh *m, const struct wt_ray *wr,
+			    const uint32_t *ids, int nr, float limit,
+			    struct packet_hit *hit)
+{
+	struct packet p;
+	f32xL x[3], y[3];
+	i32xL active;
+
+	gather(m, wr, ids, nr, &p);
+	for (int l = 0; l < LANES; l++)
+		active[l] = l < nr ? -1 : 0;
+
+	for (int i = 0; i < 3; i++) {
+		x[i] = p.x[i] - wr->sx * p.z[i];
+		y[i] = p.y[i] - wr->sy * p.z[i];
+	}
+	f32xL U = x[2] * y[1] - y[2] * x[1];
+	f32xL V = x[0] * y[2] - y[0] * x[2];
+	f32xL W = x[1] * y[0] - y[1] * x[0];
+
+	i32xL zero = active & ((U == 0) | (V == 0) | (W == 0));
+	for (int l = 0; l < LANES; l++) {
+		if (zero[l]) {
+			float u, v, w;
+			edge_functions_double(wr, &p, l, &u, &v, &w);
+			U[l] = u;
+			V[l] = v;
+			W[l] = w;
+		}
+	}
+
+	i32xL outside = ((U < 0) | (V < 0) | (W < 0)) & ((U > 0) | (V > 0) | (W > 0));
+	f32xL det = U + V + W;
+	f32xL T = wr->sz * (U * p.z[0] + V * p.z[1] + W * p.z[2]);
+
+	/* Compare T with 0 and limit * det without dividing, for either sign. */
+	i32xL sign = (i32xL)det & INT32_MIN;
+	f32xL Ts = (f32xL)((i32xL)T ^ sign);
+	f32xL adet = (f32xL)((i32xL)det ^ sign);
+	i32xL valid = active & ~outside & (adet > 0) & (Ts > 0) & (Ts < limit * adet);
+
+	int best = -1;
+	float best_dist = INFINITY;
+	for (int l = 0; l < LANES; l++) {
+		if (!valid[l])
+			continue;
+		float dist = T[l] / det[l];
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = l;
+		}
+	}
+	if (best < 0)
+		return 0;
+
+	float inv_det = 1 / det[best];
+	hit->dist = best_dist;
+	hit->tri = ids[best];
+	hit->bary[0] = U[best] * inv_det;
+	hit->bary[1] = V[best] * inv_det;
+	hit->bary[2] = W[best] * inv_det;
+	return 1;
+}
+
+static struct vec3 hit_normal(const struct mesh *m, const struct packet_hit *hit)
+{
+	if (m->nx) {
+		struct vec3 n = vec3_new(0, 0, 0);
+		for (int i = 0; i < 3; i++) {
+			uint32_t v = m->tris[hit->tri][i];
+			n = vec3_add(n, vec3_smul(vec3_new(m->nx[v], m->ny[v], m->nz[v]),
+						  hit->bary[i]));
+		}
+		float len = vec3_norm(n);
+		if (len > 0)
+			return vec3_sdiv(n, len);
+	}
+	return vec3_normalize(triangle_normal(m, hit->tri));
+}
+
+int mesh_intersect(const struct mesh *m, const struct ray *r, float *limit,
+		   struct intersection *it)
+{
+	struct bvh_ray br = bvh_ray_new(r);
+	struct wt_ray wr = wt_ray_new(r);
+	struct bvh_traversal t;
+	const struct bvh_node *leaf;
+	struct packet_hit hit, nearest = { .dist = INFINITY };
+
+	bvh_traversal_init(&t, &m->bvh, &br, *limit);
+	while ((leaf = bvh_next_leaf(&t, &br, *limit))) {
+		for (uint32_t i = 0; i < leaf->count; i += LANES) {
+			int nr = leaf->count - i < LANES ? leaf->count - i : LANES;
+			if (!intersect_packet(m, &wr, &m->bvh.prims[leaf->first + i],
+					      nr, *limit, &hit))
+				continue;
+			if (!it)
+				return 1;
+			nearest = hit;
+			*limit = hit.dist;
+		}
+	}
+	if (nearest.dist == INFINITY)
+		return 0;
+
+	it->dist = nearest.dist;
+	it->pos = vec3_add(r->pos, vec3_smul(r->dir, nearest.dist));
+	it->normal = hit_normal(m, &nearest);
+	it->prim = nearest.tri;
+	return 1;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include "../bvh.h"
+#include "../ray.h"
+
+/*
+ * An indexed triangle mesh. Vertex attributes are stored as separate x, y
+ * and z arrays (SoA), and each triangle as three vertex indices. Normals
+ * are optional: without them, hits get the triangle's geometric normal.
+ *
+ * The arrays may point into a scene file mapping (see scene-file.h), in
+ * which case `mem` is NULL. Otherwise, they all live in the `mem` block.
+ */
+struct mesh {
+	float *x, *y, *z;
+	float *nx, *ny, *nz;
+	uint32_t (*tris)[3];
+	uint32_t nr_vertices, nr_triangles;
+	void *mem;
+
+	/* Set by scene_prepare_accel(). */
+	struct aabb bounds;
+	struct bvh bvh;
+};
+
+/*
+ * Allocates the arrays of a mesh with `nr_vertices` vertices (with normals
+ * if `normals` is set) and `nr_triangles` triangles.
+ */
+void mesh_alloc(struct mesh *mesh, uint32_t nr_vertices, uint32_t nr_triangles,
+		int normals);
+void mesh_destroy(struct mesh *mesh);
+
+/*
+ * Compute smooth vertex normals, as the area weighted average of the
+ * normals of the triangles sharing each vertex. The normal arrays must be
+ * allocated.
+ */
+void mesh_compute_normals(struct mesh *mesh);
+
+static inline struct aabb mesh_triangle_bounds(const struct mesh *m, uint32_t t)
+{
+	struct aabb b = AABB_EMPTY;
+	for (int i = 0; i < 3; i++) {
+		uint32_t v = m->tris[t][i];
+		struct vec3 p = vec3_new(m->x[v], m->y[v], m->z[v]);
+		b = aabb_union(b, (struct aabb){ p, p });
+	}
+	return b;
+}
+
+/* Builds the mesh BVH (over triangles) and sets `bounds`. */
+void mesh_build_accel(struct mesh *mesh);
+
+/*
+ * Intersects the ray with the mesh, whose BVH must be built. Only hits
+ * closer than `*limit` are considered. If `it` is NULL, returns 1 at the
+ * first hit found. Otherwise, the closest hit is saved on `it` (except
+ * for its entity fields), `*limit` is lowered to its distance and 1 is
+ * returned.
+ */
+int mesh_intersect(const struct mesh *mesh, const struct ray *r, float *limit,
+		   struct intersection *it);
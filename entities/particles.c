@@ -0,0 +1,221 @@
+#include "entities.h"
+#include "../lib/array.h"
+
+void particles_alloc(struct particles *p, uint32_t nr, uint32_t nr_colors)
+{
+	size_t floats = st_mult((size_t)nr + nr_colors, 3);
+	char *mem = xmalloc(st_mult(floats, sizeof(float)) +
+			    st_mult(nr, sizeof(uint16_t) + sizeof(uint8_t)));
+	float *f = (float *)mem;
+
+	memset(p, 0, sizeof(*p));
+	p->mem = mem;
+	p->nr = nr;
+	p->nr_colors = nr_colors;
+	p->radius_scale = 1;
+	p->x = f;
+	p->y = f + nr;
+	p->z = f + 2 * (size_t)nr;
+	p->palette = (struct vec3 *)(f + 3 * (size_t)nr);
+	p->radius = (uint16_t *)(f + floats);
+	p->color = (uint8_t *)(p->radius + nr);
+}
+
+void particles_destroy(struct particles *p)
+{
+	free(p->mem);
+	bvh_destroy(&p->bvh);
+	memset(p, 0, sizeof(*p));
+}
+
+#define PERMUTE(arr, order, nr, tmp) do { \
+	typeof(*(arr)) *_t = (void *)(tmp); \
+	_Pragma("omp parallel for schedule(static)") \
+	for (uint32_t _i = 0; _i < (nr); _i++) \
+		_t[_i] = (arr)[(order)[_i]]; \
+	memcpy((arr), _t, (nr) * sizeof(*(arr))); \
+} while (0)
+
+static struct aabb *particle_bounds(const struct particles *p)
+{
+	struct aabb *bounds;
+	ALLOC_ARRAY(bounds, p->nr);
+	#pragma omp parallel for schedule(static)
+	for (uint32_t i = 0; i < p->nr; i++) {
+		float r = particle_radius(p, i);
+		struct vec3 center = vec3_new(p->x[i], p->y[i], p->z[i]);
+		struct vec3 rv = vec3_new(r, r, r);
+		bounds[i] = (struct aabb){ vec3_sub(center, rv), vec3_add(center, rv) };
+	}
+	return bounds;
+}
+
+static void build(struct particles *p)
+{
+	struct aabb *bounds = particle_bounds(p);
+	bvh_build_clusters(&p->bvh, bounds, p->nr, PARTICLE_LEAF_SIZE);
+	free(bounds);
+}
+
+static void permute(struct particles *p, const uint32_t *order)
+{
+	float *tmp;
+	ALLOC_ARRAY(tmp, p->nr);
+	PERMUTE(p->x, order, p->nr, tmp);
+	PERMUTE(p->y, order, p->nr, tmp);
+	PERMUTE(p->z, order, p->nr, tmp);
+	PERMUTE(p->radius, order, p->nr, tmp);
+	PERMUTE(p->color, order, p->nr, tmp);
+	free(tmp);
+}
+
+void particles_sort(struct particles *p)
+{
+	build(p);
+	permute(p, p->bvh.prims);
+	bvh_destroy(&p->bvh);
+}
+
+/*
+ * Which primitives end up in which leaf, and where leaves sit in the
+ * primitive array, only depends on the set of particle boxes: once sorted,
+ * the particles of each leaf are exactly those of its range, in some
+ * order. Checks that, as then the primitive array is not needed.
+ */
+static int leaves_match_ranges(const struct bvh *bvh)
+{
+	for (uint32_t n = 0; n < bvh->nr_nodes; n++) {
+		const struct bvh_node *node = &bvh->nodes[n];
+		for (uint32_t i = node->first; node->count && i < node->first + node->count; i++)
+			if (bvh->prims[i] < node->first ||
+			    bvh->prims[i] >= node->first + node->count)
+				return 0;
+	}
+	return 1;
+}
+
+void particles_build_accel(struct particles *p)
+{
+	build(p);
+	if (!leaves_match_ranges(&p->bvh))
+		die("particle set is not sorted (see particles_sort())");
+	/* Leaves refer to particles directly. */
+	FREE_AND_NULL(p->bvh.prims);
+	p->bvh.nr_prims = 0;
+	/* The node array is sized for the worst case: give back the rest. */
+	REALLOC_ARRAY(p->bvh.nodes, p->bvh.nr_nodes);
+	p->bounds = (struct aabb){ p->bvh.nodes[0].min, p->bvh.nodes[0].max };
+}
+
+/*
+ * Intersection
+ * ------------
+ *
+ * Leaves are tested LANES particles at a time with GCC vector
+ * extensions, like mesh triangles. The distance from each center to the
+ * ray line is computed directly, rather than from the discriminant
+ * b^2 - c, which loses all precision for spheres that are small compared
+ * to their distance.
+ */
+
+#define LANES 4
+typedef float f32xL __attribute__((vector_size(LANES * sizeof(float))));
+typedef int32_t i32xL __attribute__((vector_size(LANES * sizeof(int32_t))));
+
+static inline f32xL load(const float *src, int nr)
+{
+	float v[LANES] = { 0 };
+	f32xL ret;
+	memcpy(v, src, nr * sizeof(float));
+	memcpy(&ret, v, sizeof(ret));
+	return ret;
+}
+
+static inline f32xL load_radius(const struct particles *p, uint32_t first, int nr)
+{
+	float v[LANES] = { 0 };
+	f32xL ret;
+	for (int l = 0; l < nr; l++)
+		v[l] = p->radius[first + l];
+	memcpy(&ret, v, sizeof(ret));
+	return ret * p->radius_scale;
+}
+
+static inline f32xL vsqrt(f32xL v)
+{
+	for (int l = 0; l < LANES; l++)
+		v[l] = sqrtf(v[l]);
+	return v;
+}
+
+/*
+ * Tests particles [first, first + nr). Returns the lane of the closest hit
+ * before `limit` (which it lowers), or -1.
+ */
+static int intersect_packet(const struct particles *p, const struct ray *r,
+			    uint32_t first, int nr, float *limit)
+{
+	f32xL ox = load(p->x + first, nr) - r->pos.x;
+	f32xL oy = load(p->y + first, nr) - r->pos.y;
+	f32xL oz = load(p->z + first, nr) - r->pos.z;
+	f32xL rad = load_radius(p, first, nr);
+	f32xL b = ox * r->dir.x + oy * r->dir.y + oz * r->dir.z;
+	f32xL px = ox - b * r->dir.x, py = oy - b * r->dir.y, pz = oz - b * r->dir.z;
+	f32xL h2 = rad * rad - (px * px + py * py + pz * pz);
+	i32xL valid = h2 >= 0;
+	int32_t any = 0;
+	for (int l = 0; l < LANES; l++)
+		any |= valid[l];
+	if (!any)
+		return -1;
+
+	f32xL h = vsqrt((f32xL)((i32xL)h2 & valid));
+	f32xL t = b - h;
+	/* The far side, for rays starting inside a particle. */
+	i32xL near = t > 0;
+	t = (f32xL)(((i32xL)t & near) | ((i32xL)(b + h) & ~near));
+	valid &= (t > 0) & (t < *limit);
+
+	int best = -1;
+	for (int l = 0; l < nr; l++) {
+		if (valid[l] && t[l] < *limit) {
+			*limit = t[l];
+			best = l;
+		}
+	}
+	return best;
+}
+
+int particles_intersect(const struct particles *p, const struct ray *r,
+			float *limit, struct intersection *it)
+{
+	struct bvh_ray br = bvh_ray_new(r);
+	struct bvh_traversal t;
+	const struct bvh_node *leaf;
+	uint32_t hit = UINT32_MAX;
+
+	bvh_traversal_init(&t, &p->bvh, &br, *limit);
+	while ((leaf = bvh_next_leaf(&t, &br, *limit))) {
+		uint32_t end = leaf->first + leaf->count;
+		for (uint32_t i = leaf->first; i < end; i += LANES) {
+			int nr = end - i < LANES ? end - i : LANES;
+			float l = *limit;
+			int lane = intersect_packet(p, r, i, nr, &l);
+			if (lane < 0)
+				continue;
+			if (!it)
+				return 1;
+			*limit = l;
+			hit = i + lane;
+		}
+	}
+	if (hit == UINT32_MAX)
+		return 0;
+
+	struct vec3 center = vec3_new(p->x[hit], p->y[hit], p->z[hit]);
+	it->dist = *limit;
+	it->pos = vec3_add(r->pos, vec3_smul(r->dir, *limit));
+	it->normal = vec3_sdiv(vec3_sub(it->pos, center), particle_radius(p, hit));
+	it->prim = hit;
+	return 1;
+}
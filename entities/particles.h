@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdint.h>
+#include "../bvh.h"
+#include "../ray.h"
+
+/*
+ * A particle set: many small spheres sharing one material, for point data
+ * such as simulation outputs. Each particle takes 15 bytes: its center as
+ * separate x, y and z arrays (SoA), a radius quantized to 16 bits (in
+ * units of `radius_scale`) and an index into the set's color palette.
+ *
+ * The BVH has leaves of up to PARTICLE_LEAF_SIZE particles, which are
+ * tested together with SIMD. Particles are stored in the order of its
+ * leaves (see particles_sort()), so that leaves refer to ranges of
+ * particles directly and the BVH needs no primitive array. This keeps it
+ * to about 4 bytes per particle.
+ *
+ * Like meshes, the arrays may point into a scene file mapping, in which
+ * case `mem` is NULL. Otherwise, they all live in the `mem` block.
+ */
+#define PARTICLE_LEAF_SIZE 24
+#define PARTICLE_MAX_COLORS 256
+
+struct particles {
+	float *x, *y, *z;
+	uint16_t *radius;
+	uint8_t *color;
+	/* If there are no colors, particles take their material's color. */
+	struct vec3 *palette;
+	uint32_t nr, nr_colors;
+	float radius_scale;
+	void *mem;
+
+	/* Set by scene_prepare_accel(). */
+	struct aabb bounds;
+	struct bvh bvh;
+};
+
+void particles_alloc(struct particles *p, uint32_t nr, uint32_t nr_colors);
+void particles_destroy(struct particles *p);
+
+/* Returns the radius unit that fits radii up to `max_radius` in 16 bits. */
+static inline float particles_radius_scale(float max_radius)
+{
+	return max_radius > 0 ? max_radius / UINT16_MAX : 1;
+}
+
+static inline uint16_t particles_quantize_radius(const struct particles *p,
+						 float radius)
+{
+	float q = radius / p->radius_scale + 0.5f;
+	return q < 1 ? 1 : q > UINT16_MAX ? UINT16_MAX : q;
+}
+
+static inline float particle_radius(const struct particles *p, uint32_t i)
+{
+	return p->radius[i] * p->radius_scale;
+}
+
+/* Reorders the particles into the order of their BVH leaves. */
+void particles_sort(struct particles *p);
+
+/*
+ * Builds the BVH and sets `bounds`. The particles must have been sorted
+ * with particles_sort().
+ */
+void particles_build_accel(struct particles *p);
+
+/*
+ * Intersects the ray with the particles, whose BVH must be built, like
+ * mesh_intersect(). On hits, it->prim is the index of the particle.
+ */
+int particles_intersect(const struct particles *p, const struct ray *r,
+			float *limit, struct intersection *it);
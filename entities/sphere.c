@@ -53,12 +53,9 @@ int ray_intersects_sphere(struct ray *r, struct entity *e, struct intersection *
 }
 
 
-struct vec3 lookup_sphere_texture(struct entity *e, struct vec3 pos)
+struct vec3 lookup_sphere_texture(struct sphere *s, struct texture *texture,
+				  struct vec3 pos)
 {
-	assert(e->type == ENT_SPHERE);
-	struct sphere *s = &e->u.s;
-
-	struct texture *texture = e->material.texture;
 	assert(texture);
 
 	struct vec3 normalized_pos = vec3_normalize(vec3_sub(pos, s->center));
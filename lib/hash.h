@@ -0,0 +1,41 @@
+#ifndef _HASH_H
+#define _HASH_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * A 64-bit FNV-1a variant that consumes the input 8 bytes at a time (with a
+ * final mixing step), which is fast enough to fingerprint hundreds of
+ * megabytes of scene data. It is NOT a cryptographic hash and its values are
+ * only meant to be compared between runs on the same machine.
+ */
+
+#define HASH_INIT 0xcbf29ce484222325ULL
+#define HASH_PRIME 0x100000001b3ULL
+
+static inline uint64_t hash_update(uint64_t h, const void *buf, size_t len)
+{
+	const unsigned char *p = buf;
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t word;
+		memcpy(&word, p, 8);
+		h = (h ^ word) * HASH_PRIME;
+	}
+	for (; len; len--, p++)
+		h = (h ^ *p) * HASH_PRIME;
+	return h;
+}
+
+static inline uint64_t hash_final(uint64_t h)
+{
+	/* Mixer from MurmurHash3's fmix64(). */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+#endif
@@ -81,6 +81,7 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 #include "error.h"
 #include "array.h"
 #include "tempfile.h"
@@ -200,7 +201,8 @@ struct tempfile *create_tempfile_mode(const char *path, int allow_existent,
 	return tempfile;
 }
 
-struct tempfile *mktempfile_s(const char *filename_template, size_t suffixlen)
+struct tempfile *mktempfile_sm(const char *filename_template, size_t suffixlen,
+			       int mode)
 {
 	struct tempfile *tempfile = new_tempfile();
 	tempfile->filename = xstrdup(filename_template);
@@ -209,6 +211,18 @@ struct tempfile *mktempfile_s(const char *filename_template, size_t suffixlen)
 		deactivate_tempfile(tempfile);
 		return NULL;
 	}
+	if (mode != 0600) {
+		mode_t mask = umask(0);
+		umask(mask);
+		if (fchmod(tempfile->fd, mode & ~mask)) {
+			int save_errno = errno;
+			close(tempfile->fd);
+			unlink(tempfile->filename);
+			deactivate_tempfile(tempfile);
+			errno = save_errno;
+			return NULL;
+		}
+	}
 	activate_tempfile(tempfile);
 	return tempfile;
 }
@@ -139,9 +139,20 @@ static inline struct tempfile *create_tempfile(const char *path,
  * for writing the temporary file. On errors, they return NULL and set
  * errno appropriately.
  */
-struct tempfile *mktempfile_s(const char *filename_template, size_t suffixlen);
+struct tempfile *mktempfile_sm(const char *filename_template, size_t suffixlen,
+			       int mode);
+#define mktempfile_s(filename_template, suffixlen) \
+	mktempfile_sm(filename_template, suffixlen, 0600)
 #define mktempfile(filename_template) mktempfile_s(filename_template, 0)
 
+/*
+ * Like mktempfile(), but the file gets the permissions `mode` (modified by
+ * the umask) instead of 0600. Useful for files that are later renamed into
+ * place.
+ */
+#define mktempfile_m(filename_template, mode) \
+	mktempfile_sm(filename_template, 0, mode)
+
 /*
  * Associate a stdio stream with the temporary file (which must still
  * be open). Return `NULL` (*without* deleting the file) on error. The
@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 #include "error.h"
 
 static void *xmalloc(size_t nr)
@@ -89,4 +90,64 @@ static char *xstrndup(const char *str, size_t size)
 	return ret;
 }
 
+static ssize_t xread(int fd, void *buf, size_t len)
+{
+	while (1) {
+		ssize_t nr = read(fd, buf, len);
+		if (nr < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		return nr;
+	}
+}
+
+static ssize_t read_in_full(int fd, void *buf, size_t count)
+{
+	char *p = buf;
+	ssize_t total = 0;
+
+	while (count > 0) {
+		ssize_t loaded = xread(fd, p, count);
+		if (loaded < 0)
+			return -1;
+		if (!loaded)
+			return total;
+		count -= loaded;
+		p += loaded;
+		total += loaded;
+	}
+
+	return total;
+}
+
+static ssize_t xwrite(int fd, const void *buf, size_t len)
+{
+	while (1) {
+		ssize_t nr = write(fd, buf, len);
+		if (nr < 0 && (errno == EAGAIN || errno == EINTR))
+			continue;
+		return nr;
+	}
+}
+
+static ssize_t write_in_full(int fd, const void *buf, size_t count)
+{
+	const char *p = buf;
+	ssize_t total = 0;
+
+	while (count > 0) {
+		ssize_t written = xwrite(fd, p, count);
+		if (written < 0)
+			return -1;
+		if (!written) {
+			errno = ENOSPC;
+			return -1;
+		}
+		count -= written;
+		p += written;
+		total += written;
+	}
+
+	return total;
+}
+
 #endif
@@ -0,0 +1,17 @@
+#include "libraytracer.h"
+
+void scene_prepare(struct scene *scene, const struct prepare_opts *opts)
+{
+	scene_prepare_accel(scene, opts->bvh_cache, opts->bvh_method);
+	scene_prepare_lights(scene, opts->light_samples, opts->light_cull);
+	scene_prepare_view(scene, opts);
+}
+
+void scene_prepare_view(struct scene *scene, const struct prepare_opts *opts)
+{
+	scene_prepare_shadow_maps(scene, opts->shadow_map_res, opts->shadow_bias);
+	scene_prepare_ao(scene, opts->width, opts->height, opts->max_depth,
+			 opts->ao_samples, opts->ao_distance);
+	scene_prepare_screen_bins(scene, opts->width, opts->height,
+				  opts->screen_tiles);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+/*
+ * libraytracer
+ * ------------
+ *
+ * Everything but the command line front end is built into libraytracer.a,
+ * which the raytracer binary and the tools link against. To render from
+ * another program:
+ *
+ *   - build a scene with scene_add_material(), scene_add_entity() and
+ *     scene_add_light() (see scene.h), with textures from load_texture()
+ *     (see texture.h), or load one with scene_file_load();
+ *   - prepare it with scene_prepare();
+ *   - render it with render_into() (see render.h), into a buffer of
+ *     floats or bytes, optionally with a callback for each tile done;
+ *   - free it with scene_destroy() and free_textures().
+ *
+ * Errors are fatal, as everywhere in the raytracer: they go through die(),
+ * which calls the handlers of push_at_die() (see lib/error.h) and exits.
+ */
+
+#include "scene.h"
+#include "scene-file.h"
+#include "texture.h"
+#include "render.h"
+#include "accel.h"
+#include "config.h"
+
+/* How to prepare a scene, with the defaults of the raytracer binary. */
+struct prepare_opts {
+	/*
+	 * The size of the images to render: the AO cache and the screen
+	 * bins are built for it.
+	 */
+	int width, height;
+	/* The BVH builder, and where to cache the BVH, if anywhere (see accel.h). */
+	enum bvh_build_method bvh_method;
+	const char *bvh_cache;
+	/* See lights.h. */
+	uint32_t light_samples;
+	float light_cull;
+	/* See shadow-maps.h: no shadow maps if shadow_map_res is 0. */
+	uint32_t shadow_map_res;
+	float shadow_bias;
+	/* See ao-cache.h: no AO if ao_samples is 0. */
+	uint32_t ao_samples;
+	float ao_distance;
+	/* The reflections the AO cache follows, as render_opts.max_depth. */
+	int max_depth;
+	/* See screen-bins.h: no screen bins if screen_tiles is 0. */
+	uint32_t screen_tiles;
+};
+
+#define PREPARE_OPTS_INIT { .width = OUTPUT_WIDTH * RENDER_RESOLUTION, \
+			    .height = OUTPUT_WIDTH * RENDER_RESOLUTION / ASPECT_RATIO, \
+			    .bvh_method = BVH_BUILD_SAH, \
+			    .shadow_bias = 1.5, \
+			    .max_depth = RAY_RECUSION_LIMIT }
+
+/* Prepares everything render() and render_into() need. */
+void scene_prepare(struct scene *scene, const struct prepare_opts *opts);
+
+/*
+ * Prepares again what depends on where the entities and the camera are
+ * (shadow maps, the AO cache and the screen bins), after they moved and
+ * the acceleration structure was updated (see accel.h).
+ */
+void scene_prepare_view(struct scene *scene, const struct prepare_opts *opts);
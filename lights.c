@@ -0,0 +1,81 @@
+#include "lights.h"
+#include "scene.h"
+#include "lib/array.h"
+
+void light_sampler_destroy(struct light_sampler *ls)
+{
+	free(ls->ids);
+	free(ls->prob);
+	free(ls->weight);
+	free(ls->alias);
+	memset(ls, 0, sizeof(*ls));
+}
+
+/*
+ * Vose's alias method: entries are split into those below and above the
+ * average intensity, and each small one is paired with a large one that
+ * fills the rest of its slot.
+ */
+static void build_alias_table(struct light_sampler *ls, const struct scene *scene)
+{
+	uint32_t *small, *large, nr_small = 0, nr_large = 0;
+	float total = 0;
+
+	for (uint32_t i = 0; i < ls->nr; i++)
+		total += scene->lights[ls->ids[i]].intensity;
+
+	ALLOC_ARRAY(ls->prob, ls->nr);
+	ALLOC_ARRAY(ls->weight, ls->nr);
+	ALLOC_ARRAY(ls->alias, ls->nr);
+	ALLOC_ARRAY(small, ls->nr);
+	ALLOC_ARRAY(large, ls->nr);
+	for (uint32_t i = 0; i < ls->nr; i++) {
+		float intensity = scene->lights[ls->ids[i]].intensity;
+		ls->weight[i] = total / (intensity * ls->samples);
+		ls->prob[i] = intensity * ls->nr / total;
+		ls->alias[i] = i;
+		if (ls->prob[i] < 1)
+			small[nr_small++] = i;
+		else
+			large[nr_large++] = i;
+	}
+	while (nr_small && nr_large) {
+		uint32_t s = small[--nr_small], l = large[nr_large - 1];
+		ls->alias[s] = l;
+		ls->prob[l] -= 1 - ls->prob[s];
+		if (ls->prob[l] < 1) {
+			nr_large--;
+			small[nr_small++] = l;
+		}
+	}
+	/* What is left is 1 up to rounding errors. */
+	while (nr_large)
+		ls->prob[large[--nr_large]] = 1;
+	while (nr_small)
+		ls->prob[small[--nr_small]] = 1;
+	free(small);
+	free(large);
+}
+
+void scene_prepare_lights(struct scene *scene, uint32_t samples, float cull)
+{
+	struct light_sampler *ls = &scene->light_sampler;
+
+	light_sampler_destroy(ls);
+	if (scene->nr_lights > UINT32_MAX)
+		die("too many lights: %zu", scene->nr_lights);
+	ALLOC_ARRAY(ls->ids, scene->nr_lights);
+	for (uint32_t i = 0; i < scene->nr_lights; i++)
+		if (scene->lights[i].intensity > 0 &&
+		    scene->lights[i].intensity >= cull)
+			ls->ids[ls->nr++] = i;
+
+	/* Sampling as many lights as there are gains nothing. */
+	if (samples && samples < ls->nr) {
+		ls->samples = samples;
+		build_alias_table(ls, scene);
+	}
+	if (ls->nr < scene->nr_lights)
+		fprintf(stderr, "Culled %zu of %zu lights\n",
+			scene->nr_lights - ls->nr, scene->nr_lights);
+}
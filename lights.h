@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include "util.h"
+
+struct scene;
+
+/*
+ * Many-light sampling
+ * -------------------
+ *
+ * By default, every hit is shaded with all of the scene's lights, each
+ * needing a shadow ray. With `samples` set, hits are shaded with that
+ * many lights instead, drawn with probability proportional to their
+ * intensity, and each contribution is divided by its probability (and
+ * the number of samples), so that the expected result is the same. As
+ * lights have no falloff, intensity is also an upper bound of their
+ * contribution, which makes it the natural importance: drawing a light
+ * takes constant time from an alias table, and the cost of a hit no
+ * longer depends on the number of lights.
+ *
+ * Lights with an intensity below `cull` are dropped in both modes. A
+ * dropped light would have given a hit at most `cull` of diffuse light,
+ * but up to `cull` to the power of the shininess of specular light, which
+ * is more than `cull` for shininess below 1 (and 1 for a shininess of 0).
+ */
+struct light_sampler {
+	/* The lights kept after culling, as indices into scene->lights. */
+	uint32_t *ids;
+	uint32_t nr;
+	/* 0 to shade with all (kept) lights. */
+	uint32_t samples;
+	/*
+	 * Alias table over `ids`: entry i is kept with probability prob[i],
+	 * and replaced by entry alias[i] otherwise. weight[i] is the factor
+	 * a draw of entry i scales its contribution by.
+	 */
+	float *prob, *weight;
+	uint32_t *alias;
+};
+
+/*
+ * Sets up scene->light_sampler. Must be called after the lights are
+ * added, and before rendering.
+ */
+void scene_prepare_lights(struct scene *scene, uint32_t samples, float cull);
+
+void light_sampler_destroy(struct light_sampler *ls);
+
+/*
+ * Draws a light, returning its index into scene->lights. `*weight` is set
+ * to the factor its contribution must be scaled by, for one of the
+ * `samples` draws.
+ */
+static inline uint32_t light_sampler_pick(const struct light_sampler *ls,
+					  unsigned int *rand_state, float *weight)
+{
+	uint32_t i = rand_r(rand_state) % ls->nr;
+	if (rand_r_in(rand_state, 0, 1) >= ls->prob[i])
+		i = ls->alias[i];
+	*weight = ls->weight[i];
+	return ls->ids[i];
+}
@@ -0,0 +1,364 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "obj.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+#define OBJ_CHUNK_SIZE (4 << 20)
+
+struct obj_chunk {
+	const char *start, *end;
+	/* Record counts, from the first pass. */
+	size_t nr_v, nr_vn, nr_tris;
+	/* Index of the chunk's first record of each kind. */
+	size_t v, vn, tris;
+	/* Whether every face corner has a normal with its position's index. */
+	int normals_match;
+	/* The first parse error, if any. */
+	const char *error_pos, *error;
+};
+
+struct obj_ctx {
+	const char *map;
+	size_t nr_v, nr_vn;
+	struct mesh *mesh;
+	float *vn; /* x, y and z arrays of nr_vn each */
+};
+
+static inline int is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline int is_digit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static inline const char *skip_spaces(const char *p, const char *end)
+{
+	while (p < end && is_space(*p))
+		p++;
+	return p;
+}
+
+static inline int at_statement(const char *p, const char *end, const char *kw,
+			       size_t len)
+{
+	return end - p > len && !memcmp(p, kw, len) && is_space(p[len]);
+}
+
+static double pow10i(int e)
+{
+	static const double table[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20,
+		1e21, 1e22,
+	};
+	return e < ARRAY_SIZE(table) ? table[e] : pow(10, e);
+}
+
+/*
+ * A float parser for the plain decimal notation found in OBJ files, much
+ * faster than strtof() (which must handle locales, hex floats and so on).
+ * It may be off by an ulp, which does not matter here. Returns the end of
+ * the number or NULL if there is none.
+ */
+static const char *parse_float(const char *p, const char *end, float *out)
+{
+	int neg = 0, digits = 0, exp = 0;
+	double mant = 0;
+
+	if (p < end && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	for (; p < end && is_digit(*p); p++, digits++)
+		mant = mant * 10 + (*p - '0');
+	if (p < end && *p == '.') {
+		for (p++; p < end && is_digit(*p); p++, digits++, exp--)
+			mant = mant * 10 + (*p - '0');
+	}
+	if (!digits)
+		return NULL;
+	if (p < end && (*p == 'e' || *p == 'E')) {
+		int eneg = 0, e = 0;
+		p++;
+		if (p < end && (*p == '-' || *p == '+'))
+			eneg = *p++ == '-';
+		if (p == end || !is_digit(*p))
+			return NULL;
+		for (; p < end && is_digit(*p); p++)
+			if (e < 10000)
+				e = e * 10 + (*p - '0');
+		exp += eneg ? -e : e;
+	}
+	mant = exp < 0 ? mant / pow10i(-exp) : mant * pow10i(exp);
+	*out = neg ? -mant : mant;
+	return p;
+}
+
+static const char *parse_int(const char *p, const char *end, long *out)
+{
+	int neg = 0;
+	long v = 0;
+	if (p < end && *p == '-') {
+		neg = 1;
+		p++;
+	}
+	if (p == end || !is_digit(*p))
+		return NULL;
+	for (; p < end && is_digit(*p); p++)
+		if (v < INT64_MAX / 16)
+			v = v * 10 + (*p - '0');
+	*out = neg ? -v : v;
+	return p;
+}
+
+/* Parses "x y z", ignoring anything after it (e.g. a "w" or vertex colors). */
+static const char *parse_vec(const char *p, const char *end, float v[3])
+{
+	for (int i = 0; i < 3; i++) {
+		p = skip_spaces(p, end);
+		if (!(p = parse_float(p, end, &v[i])) || (p < end && !is_space(*p)))
+			return NULL;
+	}
+	return p;
+}
+
+/* Returns the number of corners of the face on [p, end). */
+static size_t count_corners(const char *p, const char *end)
+{
+	size_t nr = 0;
+	for (p = skip_spaces(p, end); p < end; p = skip_spaces(p, end)) {
+		nr++;
+		while (p < end && !is_space(*p))
+			p++;
+	}
+	return nr;
+}
+
+/*
+ * Resolves a 1-based or negative (relative) OBJ index against `nr_before`
+ * records defined so far. Returns -1 if it is out of `[0, nr)`.
+ */
+static inline int64_t resolve_index(long idx, size_t nr_before, size_t nr)
+{
+	int64_t i = idx > 0 ? idx - 1 : (int64_t)nr_before + idx;
+	return idx && i >= 0 && i < nr ? i : -1;
+}
+
+#define CHUNK_ERROR(c, pos, msg) do { \
+	(c)->error_pos = (pos); \
+	(c)->error = (msg); \
+	return; \
+} while (0)
+
+static void count_chunk(struct obj_chunk *c)
+{
+	for (const char *p = c->start, *eol; p < c->end; p = eol + 1) {
+		if (!(eol = memchr(p, '\n', c->end - p)))
+			eol = c->end;
+		p = skip_spaces(p, eol);
+		if (at_statement(p, eol, "v", 1)) {
+			c->nr_v++;
+		} else if (at_statement(p, eol, "vn", 2)) {
+			c->nr_vn++;
+		} else if (at_statement(p, eol, "f", 1)) {
+			size_t corners = count_corners(p + 1, eol);
+			if (corners < 3)
+				CHUNK_ERROR(c, p, "face with less than 3 vertices");
+			c->nr_tris += corners - 2;
+		}
+	}
+}
+
+static const char *parse_corner(struct obj_ctx *ctx, struct obj_chunk *c,
+				const char *p, const char *end, size_t v_before,
+				size_t vn_before, uint32_t *out)
+{
+	long idx, normal_idx;
+	int64_t v, vn = -1;
+
+	if (!(p = parse_int(p, end, &idx)) ||
+	    (v = resolve_index(idx, v_before, ctx->nr_v)) < 0)
+		return NULL;
+	if (p < end && *p == '/') {
+		p++;
+		if (p < end && *p != '/' && !is_space(*p) && !(p = parse_int(p, end, &idx)))
+			return NULL; /* texture coordinates are ignored */
+		if (p < end && *p == '/') {
+			if (!(p = parse_int(p + 1, end, &normal_idx)) ||
+			    (vn = resolve_index(normal_idx, vn_before, ctx->nr_vn)) < 0)
+				return NULL;
+		}
+	}
+	if (p < end && !is_space(*p))
+		return NULL;
+	if (vn != v)
+		c->normals_match = 0;
+	*out = v;
+	return p;
+}
+
+static void parse_chunk(struct obj_ctx *ctx, struct obj_chunk *c)
+{
+	struct mesh *m = ctx->mesh;
+	size_t v = c->v, vn = c->vn, t = c->tris;
+
+	c->normals_match = 1;
+	for (const char *p = c->start, *eol; p < c->end; p = eol + 1) {
+		if (!(eol = memchr(p, '\n', c->end - p)))
+			eol = c->end;
+		p = skip_spaces(p, eol);
+		if (at_statement(p, eol, "v", 1)) {
+			float xyz[3];
+			if (!parse_vec(p + 1, eol, xyz))
+				CHUNK_ERROR(c, p, "invalid vertex");
+			m->x[v] = xyz[0];
+			m->y[v] = xyz[1];
+			m->z[v] = xyz[2];
+			v++;
+		} else if (at_statement(p, eol, "vn", 2)) {
+			float xyz[3];
+			if (!parse_vec(p + 2, eol, xyz))
+				CHUNK_ERROR(c, p, "invalid normal");
+			ctx->vn[vn] = xyz[0];
+			ctx->vn[ctx->nr_vn + vn] = xyz[1];
+			ctx->vn[2 * ctx->nr_vn + vn] = xyz[2];
+			vn++;
+		} else if (at_statement(p, eol, "f", 1)) {
+			const char *q = p + 1;
+			uint32_t first = 0, prev = 0, cur;
+			for (int i = 0; (q = skip_spaces(q, eol)) < eol; i++) {
+				if (!(q = parse_corner(ctx, c, q, eol, v, vn, &cur)))
+					CHUNK_ERROR(c, p, "invalid face");
+				if (i >= 2) {
+					m->tris[t][0] = first;
+					m->tris[t][1] = prev;
+					m->tris[t][2] = cur;
+					t++;
+				}
+				if (!i)
+					first = cur;
+				prev = cur;
+			}
+		}
+	}
+}
+
+static size_t line_number(const char *map, const char *pos)
+{
+	size_t nr = 1;
+	for (const char *p = map; (p = memchr(p, '\n', pos - p)); p++)
+		nr++;
+	return nr;
+}
+
+/* Returns -1 (after printing the first error) if any chunk failed. */
+static int check_chunks(const char *path, const char *map,
+			struct obj_chunk *chunks, size_t nr)
+{
+	for (size_t i = 0; i < nr; i++) {
+		if (chunks[i].error)
+			return error("%s:%zu: %s", path,
+				     line_number(map, chunks[i].error_pos),
+				     chunks[i].error);
+	}
+	return 0;
+}
+
+int obj_load(struct mesh *mesh, const char *path)
+{
+	struct obj_ctx ctx = { 0 };
+	struct obj_chunk *chunks = NULL;
+	struct stat st;
+	size_t nr_chunks, nr_tris = 0;
+	int normals_match = 1, ret = -1;
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return error_errno("failed to open '%s'", path);
+	if (fstat(fd, &st)) {
+		close(fd);
+		return error_errno("failed to stat '%s'", path);
+	}
+	if (!st.st_size) {
+		close(fd);
+		return error("'%s' has no triangles", path);
+	}
+	const char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return error_errno("failed to mmap '%s'", path);
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+	ctx.map = map;
+
+	/* Chunks start after the first newline past their nominal start. */
+	nr_chunks = (st.st_size + OBJ_CHUNK_SIZE - 1) / OBJ_CHUNK_SIZE;
+	CALLOC_ARRAY(chunks, nr_chunks);
+	for (size_t i = 0; i < nr_chunks; i++) {
+		const char *end = map + st.st_size, *start = map + i * OBJ_CHUNK_SIZE;
+		if (i) {
+			const char *nl = memchr(start, '\n', end - start);
+			start = nl ? nl + 1 : end;
+		}
+		chunks[i].start = start;
+		if (i)
+			chunks[i - 1].end = start;
+		chunks[i].end = end;
+	}
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (size_t i = 0; i < nr_chunks; i++)
+		count_chunk(&chunks[i]);
+	if (check_chunks(path, map, chunks, nr_chunks))
+		goto out;
+
+	for (size_t i = 0; i < nr_chunks; i++) {
+		chunks[i].v = ctx.nr_v;
+		chunks[i].vn = ctx.nr_vn;
+		chunks[i].tris = nr_tris;
+		ctx.nr_v += chunks[i].nr_v;
+		ctx.nr_vn += chunks[i].nr_vn;
+		nr_tris += chunks[i].nr_tris;
+	}
+	if (!nr_tris) {
+		error("'%s' has no triangles", path);
+		goto out;
+	}
+	if (ctx.nr_v > UINT32_MAX || nr_tris > UINT32_MAX) {
+		error("'%s' is too large", path);
+		goto out;
+	}
+
+	mesh_alloc(mesh, ctx.nr_v, nr_tris, 1);
+	ctx.mesh = mesh;
+	if (ctx.nr_vn)
+		ALLOC_ARRAY(ctx.vn, st_mult(3, ctx.nr_vn));
+
+	#pragma omp parallel for schedule(dynamic, 1)
+	for (size_t i = 0; i < nr_chunks; i++)
+		parse_chunk(&ctx, &chunks[i]);
+	if (check_chunks(path, map, chunks, nr_chunks)) {
+		mesh_destroy(mesh);
+		goto out;
+	}
+
+	for (size_t i = 0; i < nr_chunks; i++)
+		normals_match &= chunks[i].normals_match;
+	if (ctx.nr_vn >= ctx.nr_v && normals_match) {
+		memcpy(mesh->nx, ctx.vn, ctx.nr_v * sizeof(float));
+		memcpy(mesh->ny, ctx.vn + ctx.nr_vn, ctx.nr_v * sizeof(float));
+		memcpy(mesh->nz, ctx.vn + 2 * ctx.nr_vn, ctx.nr_v * sizeof(float));
+	} else {
+		mesh_compute_normals(mesh);
+	}
+	ret = 0;
+
+out:
+	free(ctx.vn);
+	free(chunks);
+	munmap((void *)map, st.st_size);
+	return ret;
+}
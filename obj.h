@@ -0,0 +1,19 @@
+#pragma once
+
+#include "entities/mesh.h"
+
+/*
+ * Load the triangles of a Wavefront OBJ file into `mesh`. Only vertex
+ * positions ("v"), vertex normals ("vn") and faces ("f") are read, and
+ * polygons are split into triangle fans. Other statements are ignored.
+ *
+ * The file is mapped and parsed in chunks, in parallel: a first pass counts
+ * the records of each chunk and a second one parses them into place.
+ *
+ * Since meshes share one index per vertex, the file's normals are only used
+ * when every face corner uses the same index for its position and normal.
+ * Otherwise, smooth normals are computed (see mesh_compute_normals()).
+ *
+ * Returns 0 on success or -1 on error (with a message printed).
+ */
+int obj_load(struct mesh *mesh, const char *path);
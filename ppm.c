@@ -7,11 +7,6 @@
 #define STB_IMAGE_RESIZE_IMPLEMENTATION
 #include "stb/stb_image_resize.h"
 
-static struct vec3 color_float_to_byte(struct vec3 color)
-{
-	return vec3_map(vec3_smul(clamp_color_vec(color), 255), roundf);
-}
-
 void ppm_write(struct ppm *ppm, FILE *f)
 {
 	fprintf(f, "P3\n");
@@ -27,6 +22,19 @@ void ppm_write(struct ppm *ppm, FILE *f)
 	}
 }
 
+void ppm_get_bytes(struct ppm *ppm, unsigned first_row, unsigned nr_rows,
+		   uint8_t *out)
+{
+	for (unsigned i = first_row; i < first_row + nr_rows; i++) {
+		for (unsigned j = 0; j < ppm->cols; j++) {
+			struct vec3 color = color_float_to_byte(*ppm_color(ppm, i, j));
+			*out++ = color.x;
+			*out++ = color.y;
+			*out++ = color.z;
+		}
+	}
+}
+
 struct ppm *ppm_new(unsigned rows, unsigned cols)
 {
 	struct ppm *ppm = xmalloc(sizeof(*ppm));
@@ -69,3 +77,23 @@ void ppm_destroy(struct ppm **ppm_ptr)
 	free(ppm);
 	*ppm_ptr = NULL;
 }
+
+int check_output_pattern(const char *pattern)
+{
+	int nr = 0;
+	for (const char *c = pattern; *c; c++) {
+		if (*c != '%')
+			continue;
+		if (*++c == '%')
+			continue;
+		while (*c == '0' || *c == '-')
+			c++;
+		while (*c >= '0' && *c <= '9')
+			c++;
+		if (*c != 'd')
+			die("invalid output pattern '%s': only %%d is allowed",
+			    pattern);
+		nr++;
+	}
+	return nr;
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <stdio.h>
+#include <stdint.h>
 #include <assert.h>
 #include "vec3.h"
 
@@ -20,6 +21,12 @@ struct ppm {
 #define clamp_color_vec(c) \
 	((struct vec3){clamp_color((c).x), clamp_color((c).y), clamp_color((c).z)})
 
+/* The color as written in images: clamped, and from 0 to 255. */
+static inline struct vec3 color_float_to_byte(struct vec3 color)
+{
+	return vec3_map(vec3_smul(clamp_color_vec(color), 255), roundf);
+}
+
 static struct vec3 color_average(struct vec3 *colors, int size)
 {
 	struct vec3 average = {0};
@@ -35,6 +42,20 @@ void ppm_destroy(struct ppm **ppm_ptr);
 struct vec3 *ppm_color(struct ppm *ppm, unsigned i, unsigned j);
 void ppm_write(struct ppm *ppm, FILE *f);
 
+/*
+ * Converts `nr_rows` rows from `first_row` to 8-bit RGB, as ppm_write()
+ * does, into `out`, which must hold 3 * ppm->cols bytes per row.
+ */
+void ppm_get_bytes(struct ppm *ppm, unsigned first_row, unsigned nr_rows,
+		   uint8_t *out);
+
 unsigned ppm_2d_to_1d(struct ppm *ppm, unsigned i, unsigned j);
 
 void ppm_resize(struct ppm *ppm, unsigned rows, unsigned cols);
+
+/*
+ * Returns the number of "%d" conversions in `pattern`, the name of the
+ * images of a sequence, dying if it has any other conversion. Flags and a
+ * width ("%04d") are allowed and "%%" stands for a literal percent sign.
+ */
+int check_output_pattern(const char *pattern);
@@ -0,0 +1,113 @@
+#include "ray-query.h"
+#include "scene.h"
+#include "trace.h"
+#include "bvh.h"
+#include "lib/array.h"
+#include "lib/error.h"
+
+/* Rays handed to a thread at a time. */
+#define RAY_QUERY_CHUNK 1024
+
+static inline uint32_t octant(struct vec3 dir)
+{
+	return (dir.x < 0) << 2 | (dir.y < 0) << 1 | (dir.z < 0);
+}
+
+/*
+ * Returns the order to trace the rays in: by direction octant, then by
+ * the Morton code of the origin within the bounds of all origins, with
+ * its lowest bit dropped to fit in the upper half of the sort keys.
+ */
+static uint32_t *sort_rays(const struct ray_query *rays, size_t nr)
+{
+	struct aabb b = AABB_EMPTY;
+	uint64_t *keys, *tmp;
+	uint32_t *order;
+
+	if (nr > UINT32_MAX)
+		die("cannot sort more than %u rays", UINT32_MAX);
+	for (size_t i = 0; i < nr; i++)
+		b = aabb_union(b, (struct aabb){ rays[i].origin, rays[i].origin });
+	struct vec3 extent = vec3_sub(b.max, b.min);
+	struct vec3 scale = vec3_new(extent.x > 0 ? 1023 / extent.x : 0,
+				     extent.y > 0 ? 1023 / extent.y : 0,
+				     extent.z > 0 ? 1023 / extent.z : 0);
+
+	ALLOC_ARRAY(keys, nr);
+	ALLOC_ARRAY(tmp, nr);
+	#pragma omp parallel for schedule(static)
+	for (size_t i = 0; i < nr; i++) {
+		struct vec3 o = rays[i].origin;
+		uint32_t code = morton_expand_bits((o.x - b.min.x) * scale.x) << 2 |
+				morton_expand_bits((o.y - b.min.y) * scale.y) << 1 |
+				morton_expand_bits((o.z - b.min.z) * scale.z);
+		uint32_t key = octant(rays[i].dir) << 29 | code >> 1;
+		keys[i] = (uint64_t)key << 32 | i;
+	}
+	radix_sort_upper(keys, tmp, nr);
+	free(tmp);
+
+	/* The keys are done with: reuse their memory. */
+	order = (uint32_t *)keys;
+	for (size_t i = 0; i < nr; i++)
+		order[i] = (uint32_t)keys[i];
+	return order;
+}
+
+/*
+ * `occluder` is the entity that blocked the thread's previous any-hit
+ * query: with coherent rays, it is likely to block this one too.
+ */
+static int query_ray(struct scene *scene, enum ray_query_type type,
+		     const struct ray_query *q, struct ray_hit *hit,
+		     uint32_t *occluder)
+{
+	struct ray r = ray_new(q->origin, q->dir);
+	struct intersection it;
+
+	memset(hit, 0, sizeof(*hit));
+	if (type == RAY_QUERY_ANY) {
+		if (!cast_shadow_ray(scene, &r, q->tmax, occluder)) {
+			hit->entity = RAY_QUERY_MISS;
+			return 0;
+		}
+		hit->entity = *occluder;
+		return 1;
+	}
+
+	if (!cast_ray(scene, &r, q->tmax, &it)) {
+		hit->dist = INFINITY;
+		hit->entity = RAY_QUERY_MISS;
+		return 0;
+	}
+	hit->dist = it.dist;
+	hit->entity = (it.instance ? it.instance : it.entity) - scene->entities;
+	/* Only set by the entities with primitives. */
+	if (it.entity->type == ENT_MESH || it.entity->type == ENT_PARTICLES ||
+	    it.entity->type == ENT_HEIGHTFIELD)
+		hit->prim = it.prim;
+	hit->normal = it.normal;
+	return 1;
+}
+
+size_t scene_query_rays(struct scene *scene, enum ray_query_type type,
+			int sort, const struct ray_query *rays,
+			struct ray_hit *hits, size_t nr)
+{
+	uint32_t *order = sort ? sort_rays(rays, nr) : NULL;
+	size_t nr_hits = 0;
+
+	#pragma omp parallel reduction(+:nr_hits)
+	{
+		uint32_t occluder = NO_OCCLUDER;
+
+		#pragma omp for schedule(dynamic, RAY_QUERY_CHUNK)
+		for (size_t k = 0; k < nr; k++) {
+			size_t i = order ? order[k] : k;
+			nr_hits += query_ray(scene, type, &rays[i], &hits[i],
+					     &occluder);
+		}
+	}
+	free(order);
+	return nr_hits;
+}
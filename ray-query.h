@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vec3.h"
+
+struct scene;
+
+/*
+ * Batch ray queries
+ * -----------------
+ *
+ * For uses of the intersection core other than rendering, such as
+ * visibility analysis: scene_query_rays() traces a batch of rays in
+ * parallel and writes a record per ray. Closest-hit queries give the
+ * nearest hit within the ray's `tmax`, any-hit queries (like shadow rays,
+ * see cast_shadow_ray()) only whether something blocks it, which is
+ * cheaper.
+ *
+ * Incoherent batches trace faster once sorted: rays from nearby origins
+ * going in the same direction visit the same nodes of the BVH, which then
+ * stay in cache. With `sort`, the rays are traced in the order of their
+ * direction octant, then of the Morton code of their origin (see
+ * BVH_BUILD_LBVH); the results are still in the order of the rays.
+ *
+ * The tools/rayquery tool runs queries over files, which hold a struct
+ * ray_file_header, with RAY_FILE_MAGIC or HIT_FILE_MAGIC, followed by the
+ * records, in the machine's byte order (see SCENE_FILE_BYTE_ORDER).
+ */
+enum ray_query_type {
+	RAY_QUERY_CLOSEST,
+	RAY_QUERY_ANY,
+};
+
+struct ray_query {
+	/* `dir` needs not be normalized: distances are in scene units. */
+	struct vec3 origin, dir;
+	float tmax;
+};
+
+#define RAY_QUERY_MISS UINT32_MAX
+
+struct ray_hit {
+	/* INFINITY on misses. */
+	float dist;
+	/*
+	 * The index of the entity hit in scene->entities (the instance, for
+	 * instanced geometry), or RAY_QUERY_MISS. For meshes, particle sets
+	 * and heightfields, `prim` is the triangle, particle or cell hit.
+	 */
+	uint32_t entity, prim;
+	/* Facing either side of the surface. */
+	struct vec3 normal;
+};
+
+/*
+ * Traces `rays` and writes their results to `hits`, both `nr` long. Any-hit
+ * queries only set `entity`, to an entity blocking the ray, and leave the
+ * other fields zero. The scene's acceleration structure must be prepared
+ * (see accel.h). Returns the number of rays that hit.
+ */
+size_t scene_query_rays(struct scene *scene, enum ray_query_type type,
+			int sort, const struct ray_query *rays,
+			struct ray_hit *hits, size_t nr);
+
+#define RAY_FILE_MAGIC "RTRAYS"
+#define HIT_FILE_MAGIC "RTHITS"
+#define RAY_FILE_VERSION 1
+
+struct ray_file_header {
+	char magic[8];
+	uint32_t version, byte_order;
+	/* The records that follow. */
+	uint64_t nr;
+};
@@ -15,4 +15,11 @@ struct intersection {
 	struct vec3 pos, normal;
 	float dist;
 	struct entity *entity;
+	/*
+	 * For hits on instanced geometry, the ENT_INSTANCE entity, while
+	 * `entity` is the prototype's entity that was hit. NULL otherwise.
+	 */
+	struct entity *instance;
+	/* For meshes and particle sets, the triangle or particle hit. */
+	uint32_t prim;
 };
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <getopt.h>
 #include "ppm.h"
 #include "vec3.h"
 #include "lib/error.h"
@@ -9,13 +10,35 @@
 #include "ray.h"
 #include "lib/array.h"
 #include "texture.h"
+#include "libraytracer.h"
+#include "animation.h"
+#include "cameras.h"
+#include "checkpoint.h"
+#include "workers.h"
+#include "server.h"
+#include "shm-framebuffer.h"
+#include "lib/hash.h"
+#include "lib/string-util.h"
+#include "lib/tempfile.h"
 #include "config.h"
 
-ARRAY(struct entity) scene;
-#define ADD_ENTITY(e) ARRAY_APPEND(&scene, (e));
+#define ADD_MATERIAL(m) scene_add_material(scene, (struct material)m)
+#define ADD_ENTITY(e) scene_add_entity(scene, (e))
+#define ADD_LIGHT(...) scene_add_light(scene, (struct light){__VA_ARGS__})
 
-struct light lights[] = {
-	{.pos={.x=3, .y=2, .z=-1}, .intensity=1},
+void make_scene(struct scene *scene)
+{
+	struct texture_opts opts = {.rotate_X = -300};
+	struct texture *env = load_texture("neon-studio.jpg", &opts);
+	struct texture *tiles = load_texture("tiles.png", NULL);
+	ADD_ENTITY(ENTITY_SPHERE(vec3_new(-2.5, -.5, 6), 1.2,
+				 ADD_MATERIAL(MAT_MATTE_T(tiles))));
+	ADD_ENTITY(ENTITY_SPHERE(vec3_new(0, 0, 6), 1,
+				 ADD_MATERIAL(MAT_REFLECTIVE(vec3_new(0, 0, 1), 0.5))));
+	ADD_ENTITY(ENTITY_SPHERE(vec3_new(0.2, 0.2, .5), .2,
+				 ADD_MATERIAL(MAT_REFLECTIVE(vec3_new(0, 1, 0), 0.5))));
+
+	ADD_LIGHT(.pos={.x=3, .y=2, .z=-1}, .intensity=1);
 	/*
 	 * NEEDSWORK: I only added this second light because the current shadow
 	 * implementation shuts off the pixels that are not directly visible by
@@ -23,195 +46,793 @@ struct light lights[] = {
 	 * gives a weird effect on reflective materials. Instead, I think we
 	 * should just darken the pixels, but considering reflectiveness.
 	 */
-	{.pos={.x=0, .y=0, .z=0}, .intensity=1},
-};
+	ADD_LIGHT(.pos={.x=0, .y=0, .z=0}, .intensity=1);
+
+	scene->background = env;
+}
+
+static const char usage[] =
+	"usage: raytracer [<options>] [<scene-file>]\n"
+	"\n"
+	"    -o, --output=<file>   write the image to <file> instead of stdout;\n"
+	"                          for animations, a pattern like 'frame%04d.ppm'\n"
+	"    --bvh=<method>        BVH builder: 'sah' (default) or 'lbvh'\n"
+	"    --no-bvh-cache        do not read or write <scene-file>.bvh\n"
+	"    --animate=<file>      render the frames of an animation file\n"
+	"    --rebuild-threshold=<ratio>\n"
+	"                          rebuild the BVH when refitting makes its SAH\n"
+	"                          cost exceed <ratio> times the built cost (1.5)\n"
+	"    --rebuild-every=<n>   also rebuild the BVH every <n> frames\n"
+	"    --cameras=<file>      render the views of a camera file (see\n"
+	"                          cameras.h) instead of the scene's camera\n"
+	"    --light-samples=<n>   shade each hit with <n> lights drawn by intensity,\n"
+	"                          instead of with all of them\n"
+	"    --light-cull=<intensity>\n"
+	"                          ignore lights dimmer than <intensity>\n"
+	"    --shadow-maps=<res>   approximate shadows with cube shadow maps of\n"
+	"                          6x<res>x<res> texels per light, for previews\n"
+	"    --shadow-bias=<texels>\n"
+	"                          shadow map depth bias, in texels (1.5)\n"
+	"    --ao-samples=<n>      scale ambient light by ambient occlusion, from\n"
+	"                          a cache of estimates with <n> rays each\n"
+	"    --ao-distance=<d>     distance up to which geometry occludes (default:\n"
+	"                          an eighth of the scene's diagonal)\n"
+	"    --max-depth=<n>       follow at most <n> reflections (4, at most 64)\n"
+	"    --rr-threshold=<t>    end reflection paths contributing less than <t>\n"
+	"                          at random, by Russian roulette (0: never, the\n"
+	"                          default; 0.1 is a good start)\n"
+	"    --decoupled-shading   shade the samples of a pixel that hit the same\n"
+	"                          surface once\n"
+	"    --adaptive=<contrast> trace a subset of the pixels, interpolating the\n"
+	"                          others where colors vary by at most <contrast>\n"
+	"    --adaptive-angle=<degrees>\n"
+	"                          and normals by at most <degrees> (20)\n"
+	"    --screen-tiles=<n>    trace camera rays against the entities whose\n"
+	"                          screen bounds overlap their tile of <n>x<n>\n"
+	"                          pixels, instead of through the BVH\n"
+	"    --region=<x>,<y>,<w>,<h>\n"
+	"                          only render the <w>x<h> pixels from (<x>, <y>),\n"
+	"                          leaving the rest of the image black\n"
+	"    --workers=<n>         split the image among <n> worker processes\n"
+	"    --worker              render bands for a coordinator over stdin and\n"
+	"                          stdout, instead of writing images\n"
+	"    --serve=<socket>      keep the scene loaded and render images for\n"
+	"                          clients of a Unix socket (see server.h)\n"
+	"    --shm=<name>          render into the shared memory object <name>\n"
+	"                          (e.g. '/render'), for viewers to follow (see\n"
+	"                          shm-framebuffer.h and tools/shmview)\n"
+	"\n"
+	"Progressive rendering (any of the first three enables it):\n"
+	"    --passes=<n>          render at most <n> passes of samples\n"
+	"    --time-budget=<s>     stop before <s> seconds of rendering\n"
+	"    --target-noise=<n>    stop when the estimated noise (the standard\n"
+	"                          error of pixel luminance) is below <n>\n"
+	"    --snapshot-every=<n>  write the image every <n> passes\n"
+	"    --snapshot-interval=<s>\n"
+	"                          write the image every <s> seconds\n"
+	"    --checkpoint=<file>   save the render to <file> now and then, to be\n"
+	"                          carried on with --resume if it is interrupted\n"
+	"    --checkpoint-interval=<s>\n"
+	"                          save it every <s> seconds (60)\n"
+	"    --resume              carry on from the --checkpoint file, if any";
 
 /*
- * Returns 1 if the ray intersect any scene object or 0 otherwise.  If
- * `nearest_it` is not NULL, the data for the nearest intersection is saved
- * on it. Otherwise, the function returns early at the first intersection.
+ * Files are written to a temporary file and renamed into place, so that
+ * readers (e.g. of progressive snapshots) never see a partial image.
  */
-int cast_ray(struct ray *r, float limit, struct intersection *nearest_it)
+static void write_frame(struct ppm *ppm, const char *pattern, uint32_t frame)
 {
-	int ret = 0;
-	if (nearest_it)
-		nearest_it->dist = INFINITY;
-
-	for (int i = 0; i < scene.nr; i++) {
-		struct entity *e = &scene.arr[i];
-		struct intersection this_it;
-		if (!e->ray_intersects(r, e, &this_it) || this_it.dist > limit)
-			continue;
-		if (!nearest_it)
-			return 1;
-		if (this_it.dist < nearest_it->dist) {
-			*nearest_it = this_it;
-			ret = 1;
-		}
+	if (!pattern) {
+		ppm_write(ppm, stdout);
+		return;
 	}
-	return ret;
+
+	char *path = xmkstr(pattern, frame);
+	char *template = xmkstr("%s.XXXXXX", path);
+	struct tempfile *tempfile = mktempfile_m(template, 0666);
+	if (!tempfile)
+		die_errno("failed to create temporary file for '%s'", path);
+	FILE *f = fdopen_tempfile(tempfile, "w");
+	if (!f)
+		die_errno("failed to open '%s'", get_tempfile_path(tempfile));
+	ppm_write(ppm, f);
+	if (rename_tempfile(&tempfile, path))
+		die_errno("failed to write '%s'", path);
+	free(template);
+	free(path);
 }
 
-void cast_ray_and_color_pixel(struct ray *r, struct vec3 *color,
-			      int recursion_limit);
+struct progressive_opts {
+	/* Stop after that many passes, 0 for no limit. */
+	uint32_t max_passes;
+	/* Stop before exceeding that many seconds, 0 for no limit. */
+	double time_budget;
+	/* Stop once the noise estimate is that low, 0 for no target. */
+	double target_noise;
+	/* Write a snapshot every that many passes or seconds, 0 for never. */
+	uint32_t snapshot_every;
+	double snapshot_interval;
+	/*
+	 * Save the accumulator to `checkpoint` every `checkpoint_interval`
+	 * seconds, under `checkpoint_key` (see checkpoint.h).
+	 */
+	const char *checkpoint;
+	double checkpoint_interval;
+	uint64_t checkpoint_key;
+	/* If not NULL, publish the mean of the passes there after each pass. */
+	struct shm_framebuffer *fb;
+};
 
-struct vec3 intersection_color(struct intersection *it, struct vec3 ray_dir,
-			       int recursion_limit)
+static void write_output(struct ppm *ppm, const char *output, uint32_t frame)
 {
-	float diffuse_light_intensity = AMBIENT_LIGHT_INTENSITY;
-	float specular_light_intensity = 0;
-	struct material *material = &it->entity->material;
-	struct vec3 reflect_color;
-	int reflected = 0;
-
-	for (int i = 0; i < ARRAY_SIZE(lights); i++) {
-		struct light *l = &lights[i];
-		float light_dist = vec3_norm(vec3_sub(l->pos, it->pos));
-		struct vec3 it_to_light_dir = vec3_normalize(vec3_sub(l->pos, it->pos));
-
-		/* Shadow */
-		/*
-		 * Note: we displace the origin of the ray to avoid intersecting
-		 * with the origin point itself.
-		 */
-		float displacement = sign(vec3_dot(it_to_light_dir, it->normal)) * 1e-3;
-		struct vec3 displaced_it_pos = vec3_add(it->pos, vec3_smul(it->normal, displacement));
-		struct ray shadow_ray = ray_new(displaced_it_pos, it_to_light_dir);
-		if (cast_ray(&shadow_ray, light_dist, NULL))
-			continue;
-
-		/* Reflection */
-		if (recursion_limit && material->reflectiveness) {
-			struct vec3 reflect_dir = vec3_reflect(ray_dir, it->normal);
-			struct ray reflect_ray = ray_new(displaced_it_pos, reflect_dir);
-			cast_ray_and_color_pixel(&reflect_ray, &reflect_color,
-						 recursion_limit - 1);
-			reflected = 1;
-		}
+	ppm_resize(ppm, OUTPUT_WIDTH / ASPECT_RATIO, OUTPUT_WIDTH);
+	write_frame(ppm, output, frame);
+}
 
-		diffuse_light_intensity += l->intensity * fabsf(
-			vec3_dot(vec3_normalize(vec3_sub(l->pos, it->pos)),
-				 it->normal));
+static int progressive_done(const struct progressive_opts *prog,
+			    const struct accumulator *acc,
+			    double elapsed, uint32_t passes_run)
+{
+	if (prog->max_passes && acc->passes >= prog->max_passes)
+		return 1;
+	if (prog->target_noise && accumulator_noise(acc) <= prog->target_noise)
+		return 1;
+	if (prog->time_budget && passes_run &&
+	    elapsed + elapsed / passes_run > prog->time_budget)
+		return 1;
+	return 0;
+}
 
-		/* Specular component */
-		/*
-		 * TODO: should really use vec3_smul(ray_dir, -1)?
-		 */
-		float specular_light_incidence = fabsf(vec3_dot(
-			vec3_normalize(vec3_reflect(vec3_smul(it_to_light_dir, -1), it->normal)),
-			vec3_normalize(vec3_smul(ray_dir, -1))));
+/*
+ * Renders passes into `acc` (see render.h), which may hold some from a
+ * checkpoint, until a stop condition is met, and leaves their mean in
+ * `ppm`. As passes take about the same time, the time budget is kept by
+ * not starting a pass that would end past it, going by the mean pass time
+ * of this run. The first pass always runs. Checkpoints may be taken in
+ * the middle of a pass, which is then completed by the next call to
+ * render_pass().
+ */
+static void render_progressive(struct scene *scene, struct ppm *ppm,
+			       const struct render_opts *opts,
+			       const struct progressive_opts *prog,
+			       struct accumulator *acc,
+			       const char *output, uint32_t frame)
+{
+	struct render_stats stats = { 0 };
+	double start = now_seconds(), last_snapshot = start;
+	double last_checkpoint = start;
+	uint32_t last_snapshot_pass = acc->passes, first_pass = acc->passes;
 
-		specular_light_intensity +=
-			powf(specular_light_incidence * l->intensity,
-			     material->shininess);
-	}
+	for (;;) {
+		if (!acc->nr_tiles_done && acc->passes &&
+		    progressive_done(prog, acc, now_seconds() - start,
+				     acc->passes - first_pass))
+			break;
 
-	struct vec3 base_color = material->texture ?
-				it->entity->lookup_texture(it->entity, it->pos) :
-				material->color;
+		double deadline = prog->checkpoint ?
+				  last_checkpoint + prog->checkpoint_interval : 0;
+		int complete = render_pass(scene, acc, opts, &stats, deadline);
+		double now = now_seconds(), elapsed = now - start;
+		if (prog->checkpoint && now >= deadline) {
+			if (!checkpoint_write(prog->checkpoint,
+					      prog->checkpoint_key, frame, acc))
+				fprintf(stderr, "Checkpoint written at %.3fs\n",
+					elapsed);
+			last_checkpoint = now_seconds();
+		}
+		if (!complete)
+			continue;
 
-	diffuse_light_intensity = clamp_color(diffuse_light_intensity);
-	struct vec3 diffuse_color = vec3_smul(base_color,
-					      diffuse_light_intensity *
-					      material->diffuse_constant);
+		if (acc->passes > 1)
+			fprintf(stderr, "Pass %u done at %.3fs, noise %.5f\n",
+				acc->passes, elapsed, accumulator_noise(acc));
+		else
+			fprintf(stderr, "Pass 1 done at %.3fs\n", elapsed);
+		if (prog->fb) {
+			accumulator_resolve(acc, ppm);
+			shm_framebuffer_publish(prog->fb, ppm);
+		}
 
-	specular_light_intensity = clamp_color(specular_light_intensity);
-	struct vec3 specular_color =
-		vec3_smul((struct vec3){1, 1, 1},
-			  specular_light_intensity * material->specular_constant);
+		if ((prog->snapshot_every &&
+		     acc->passes - last_snapshot_pass >= prog->snapshot_every) ||
+		    (prog->snapshot_interval &&
+		     now - last_snapshot >= prog->snapshot_interval)) {
+			struct ppm *snapshot = ppm_new(ppm->rows, ppm->cols);
+			accumulator_resolve(acc, snapshot);
+			write_output(snapshot, output, frame);
+			ppm_destroy(&snapshot);
+			last_snapshot = now_seconds();
+			last_snapshot_pass = acc->passes;
+		}
+	}
+	accumulator_resolve(acc, ppm);
+	render_stats_print(&stats, opts, (size_t)ppm->rows * ppm->cols *
+			   (acc->passes - first_pass));
+}
 
-	struct vec3 this_color = vec3_add(diffuse_color, specular_color);
+struct view_output {
+	const char *pattern;
+	size_t nr_views;
+	double start;
+};
 
-	if (reflected)
-		return vec3_add(vec3_smul(this_color, 1 - material->reflectiveness),
-				vec3_smul(reflect_color, material->reflectiveness));
-	return this_color;
+static void write_view(size_t view, struct ppm *ppm, void *data)
+{
+	struct view_output *out = data;
+	write_output(ppm, out->pattern, view);
+	fprintf(stderr, "View %zu/%zu done at %.3fs\n", view + 1, out->nr_views,
+		now_seconds() - out->start);
 }
 
-struct entity background_map;
-
-void cast_ray_and_color_pixel(struct ray *r, struct vec3 *color,
-			      int recursion_limit)
+/*
+ * Renders the scene from each camera of the camera file at `path` (see
+ * render_views()), writing the views as frames of `output`.
+ */
+static void render_cameras(struct scene *scene, const struct render_opts *opts,
+			   const char *path, int W, int H, const char *output,
+			   int nr_conversions)
 {
-	struct intersection it;
-	if (cast_ray(r, INFINITY, &it))
-		*color = intersection_color(&it, r->dir, recursion_limit);
-	else
-		*color = lookup_sphere_texture(&background_map, r->dir);
+	struct camera_list cameras = CAMERA_LIST_INIT;
+	camera_list_load(&cameras, path, &scene->camera);
+	if (cameras.nr > 1 && nr_conversions != 1)
+		die("rendering %zu views needs an --output pattern with one %%d",
+		    cameras.nr);
+
+	struct view_output out = { output, cameras.nr, now_seconds() };
+	fprintf(stderr, "Casting rays...\n");
+	render_views(scene, opts, cameras.cameras, cameras.nr, W, H,
+		     write_view, &out);
+	camera_list_destroy(&cameras);
 }
 
-static void ensure_unit_length_in_scene_normals(void)
+/*
+ * Renders the frames with worker processes (see workers.h), which load
+ * and prepare the scene themselves.
+ */
+static void render_with_workers(size_t nr_workers, char **argv, int W, int H,
+				uint32_t nr_frames, const char *output)
 {
-	for (int i = 0; i < scene.nr; i++) {
-		struct entity *e = &scene.arr[i];
-		if (e->type == ENT_PLANE)
-			vec3_normalize_inplace(e->u.p.normal);
+	struct worker_pool pool;
+
+	worker_pool_start(&pool, nr_workers, argv);
+	for (uint32_t frame = 0; frame < nr_frames; frame++) {
+		struct ppm *ppm = ppm_new(H, W);
+		double start = now_seconds();
+		worker_pool_render(&pool, ppm, frame);
+		fprintf(stderr, "Writing...\n");
+		write_output(ppm, output, frame);
+		ppm_destroy(&ppm);
+		if (nr_frames > 1)
+			fprintf(stderr, "Frame %u/%u done in %.3fs\n", frame + 1,
+				nr_frames, now_seconds() - start);
 	}
+	worker_pool_stop(&pool);
 }
 
-void make_scene(void)
+static void parse_region(const char *arg, struct render_region *region)
 {
-	struct texture_opts opts = {.rotate_X = -300};
-	struct texture *env = load_texture("neon-studio.jpg", &opts);
-	struct texture *tiles = load_texture("tiles.png", NULL);
-	ADD_ENTITY(ENTITY_SPHERE(vec3_new(-2.5, -.5, 6), 1.2,
-				 MAT_MATTE_T(tiles)));
-	ADD_ENTITY(ENTITY_SPHERE(vec3_new(0, 0, 6), 1,
-				 MAT_REFLECTIVE(vec3_new(0, 0, 1), 0.5)));
-	ADD_ENTITY(ENTITY_SPHERE(vec3_new(0.2, 0.2, .5), .2,
-				 MAT_REFLECTIVE(vec3_new(0, 1, 0), 0.5)));
-	ensure_unit_length_in_scene_normals();
-	background_map = ENTITY_SPHERE(vec3_new(0, 0, 0), 50, MAT_MATTE_T(env));
+	const char *p = arg;
+	long v[4];
+	char *end;
+
+	for (int k = 0; k < 4; k++) {
+		v[k] = strtol(p, &end, 10);
+		if (end == p || *end != (k < 3 ? ',' : '\0') || v[k] < 0 ||
+		    v[k] > 1 << 20 || (k >= 2 && !v[k]))
+			die("--region must be <x>,<y>,<width>,<height>, with a "
+			    "non-empty width and height");
+		p = end + 1;
+	}
+	*region = (struct render_region){ v[0], v[1], v[0] + v[2], v[1] + v[3] };
 }
 
 /*
- * Viewport is a 2 by 2 plane (in word coordinates), centered at
- * (0, 0, VIEWPOINT_DIST). VIEWPOINT_DIST indirectly defines the field of view.
+ * What a checkpoint must match to be resumed: everything the image
+ * depends on besides its size, which the checkpoint records.
  */
+static uint64_t checkpoint_key(const struct scene *scene,
+			       const struct animation *anim,
+			       const struct render_opts *opts,
+			       const double *settings, size_t nr_settings)
+{
+	uint64_t key = HASH_INIT;
+	uint32_t spp = SAMPLES_PER_PIXEL;
+
+	key = hash_update(key, &scene->content_hash, sizeof(scene->content_hash));
+	key = hash_update(key, &anim->nr_frames, sizeof(anim->nr_frames));
+	key = hash_update(key, anim->keys, anim->nr_keys * sizeof(*anim->keys));
+	key = hash_update(key, opts, sizeof(*opts));
+	key = hash_update(key, settings, nr_settings * sizeof(*settings));
+	key = hash_update(key, &spp, sizeof(spp));
+	return hash_final(key);
+}
+
 int main(int argc, char **argv)
 {
+	struct scene scene = SCENE_INIT;
+	struct animation anim = ANIMATION_INIT;
+	const char *scene_path = NULL, *anim_path = NULL, *output = NULL;
+	char *bvh_cache_path = NULL;
+	int use_bvh_cache = 1;
+	enum bvh_build_method bvh_method = BVH_BUILD_SAH;
+	double rebuild_threshold = 1.5;
+	unsigned long rebuild_every = 0, light_samples = 0;
+	double light_cull = 0, shadow_bias = 1.5;
+	unsigned long shadow_map_res = 0, ao_samples = 0, screen_tiles = 0;
+	double ao_distance = 0;
+	struct render_opts render_opts = RENDER_OPTS_INIT;
+	unsigned long max_depth;
+	double rr_threshold, adaptive_contrast, adaptive_angle;
+	struct progressive_opts prog = { 0 };
+	unsigned long passes, nr_workers = 0;
+	int resume = 0, worker = 0;
+	struct render_region region = { 0 };
+	const char *serve_path = NULL, *shm_name = NULL, *cameras_path = NULL;
+	struct shm_framebuffer fb = { 0 };
+	char *end;
+
+	enum {
+		OPT_NO_BVH_CACHE = 256,
+		OPT_BVH,
+		OPT_ANIMATE,
+		OPT_REBUILD_THRESHOLD,
+		OPT_REBUILD_EVERY,
+		OPT_CAMERAS,
+		OPT_LIGHT_SAMPLES,
+		OPT_LIGHT_CULL,
+		OPT_SHADOW_MAPS,
+		OPT_SHADOW_BIAS,
+		OPT_AO_SAMPLES,
+		OPT_AO_DISTANCE,
+		OPT_MAX_DEPTH,
+		OPT_RR_THRESHOLD,
+		OPT_DECOUPLED_SHADING,
+		OPT_ADAPTIVE,
+		OPT_ADAPTIVE_ANGLE,
+		OPT_SCREEN_TILES,
+		OPT_PASSES,
+		OPT_TIME_BUDGET,
+		OPT_TARGET_NOISE,
+		OPT_SNAPSHOT_EVERY,
+		OPT_SNAPSHOT_INTERVAL,
+		OPT_CHECKPOINT,
+		OPT_CHECKPOINT_INTERVAL,
+		OPT_RESUME,
+		OPT_REGION,
+		OPT_WORKERS,
+		OPT_WORKER,
+		OPT_SERVE,
+		OPT_SHM,
+	};
+	static const struct option options[] = {
+		{ "output", required_argument, NULL, 'o' },
+		{ "no-bvh-cache", no_argument, NULL, OPT_NO_BVH_CACHE },
+		{ "bvh", required_argument, NULL, OPT_BVH },
+		{ "animate", required_argument, NULL, OPT_ANIMATE },
+		{ "rebuild-threshold", required_argument, NULL, OPT_REBUILD_THRESHOLD },
+		{ "rebuild-every", required_argument, NULL, OPT_REBUILD_EVERY },
+		{ "cameras", required_argument, NULL, OPT_CAMERAS },
+		{ "light-samples", required_argument, NULL, OPT_LIGHT_SAMPLES },
+		{ "light-cull", required_argument, NULL, OPT_LIGHT_CULL },
+		{ "shadow-maps", required_argument, NULL, OPT_SHADOW_MAPS },
+		{ "shadow-bias", required_argument, NULL, OPT_SHADOW_BIAS },
+		{ "ao-samples", required_argument, NULL, OPT_AO_SAMPLES },
+		{ "ao-distance", required_argument, NULL, OPT_AO_DISTANCE },
+		{ "max-depth", required_argument, NULL, OPT_MAX_DEPTH },
+		{ "rr-threshold", required_argument, NULL, OPT_RR_THRESHOLD },
+		{ "decoupled-shading", no_argument, NULL, OPT_DECOUPLED_SHADING },
+		{ "adaptive", required_argument, NULL, OPT_ADAPTIVE },
+		{ "adaptive-angle", required_argument, NULL, OPT_ADAPTIVE_ANGLE },
+		{ "screen-tiles", required_argument, NULL, OPT_SCREEN_TILES },
+		{ "passes", required_argument, NULL, OPT_PASSES },
+		{ "time-budget", required_argument, NULL, OPT_TIME_BUDGET },
+		{ "target-noise", required_argument, NULL, OPT_TARGET_NOISE },
+		{ "snapshot-every", required_argument, NULL, OPT_SNAPSHOT_EVERY },
+		{ "snapshot-interval", required_argument, NULL, OPT_SNAPSHOT_INTERVAL },
+		{ "checkpoint", required_argument, NULL, OPT_CHECKPOINT },
+		{ "checkpoint-interval", required_argument, NULL, OPT_CHECKPOINT_INTERVAL },
+		{ "resume", no_argument, NULL, OPT_RESUME },
+		{ "region", required_argument, NULL, OPT_REGION },
+		{ "workers", required_argument, NULL, OPT_WORKERS },
+		{ "worker", no_argument, NULL, OPT_WORKER },
+		{ "serve", required_argument, NULL, OPT_SERVE },
+		{ "shm", required_argument, NULL, OPT_SHM },
+		{ "help", no_argument, NULL, 'h' },
+		{ 0 },
+	};
+	int opt;
+	while ((opt = getopt_long(argc, argv, "ho:", options, NULL)) != -1) {
+		switch (opt) {
+		case 'o':
+			output = optarg;
+			break;
+		case OPT_NO_BVH_CACHE:
+			use_bvh_cache = 0;
+			break;
+		case OPT_BVH:
+			if (bvh_parse_build_method(optarg, &bvh_method))
+				die("unknown BVH build method '%s'", optarg);
+			break;
+		case OPT_ANIMATE:
+			anim_path = optarg;
+			break;
+		case OPT_REBUILD_THRESHOLD:
+			rebuild_threshold = strtod(optarg, &end);
+			if (end == optarg || *end || !(rebuild_threshold >= 1))
+				die("--rebuild-threshold must be a number >= 1");
+			break;
+		case OPT_REBUILD_EVERY:
+			rebuild_every = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || *optarg == '-')
+				die("--rebuild-every must be a non-negative integer");
+			break;
+		case OPT_CAMERAS:
+			cameras_path = optarg;
+			break;
+		case OPT_LIGHT_SAMPLES:
+			light_samples = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || *optarg == '-' ||
+			    light_samples > UINT32_MAX)
+				die("--light-samples must be a non-negative integer");
+			break;
+		case OPT_LIGHT_CULL:
+			light_cull = strtod(optarg, &end);
+			if (end == optarg || *end || !(light_cull >= 0))
+				die("--light-cull must be a number >= 0");
+			break;
+		case OPT_SHADOW_MAPS:
+			shadow_map_res = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || *optarg == '-' ||
+			    shadow_map_res > 16384)
+				die("--shadow-maps must be an integer from 0 to 16384");
+			break;
+		case OPT_SHADOW_BIAS:
+			shadow_bias = strtod(optarg, &end);
+			if (end == optarg || *end || !(shadow_bias >= 0))
+				die("--shadow-bias must be a number >= 0");
+			break;
+		case OPT_AO_SAMPLES:
+			ao_samples = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || *optarg == '-' ||
+			    ao_samples > UINT32_MAX)
+				die("--ao-samples must be a non-negative integer");
+			break;
+		case OPT_AO_DISTANCE:
+			ao_distance = strtod(optarg, &end);
+			if (end == optarg || *end || !(ao_distance > 0))
+				die("--ao-distance must be a positive number");
+			break;
+		case OPT_MAX_DEPTH:
+			max_depth = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || *optarg == '-' ||
+			    max_depth > MAX_RAY_DEPTH)
+				die("--max-depth must be an integer from 0 to %d",
+				    MAX_RAY_DEPTH);
+			render_opts.max_depth = max_depth;
+			break;
+		case OPT_RR_THRESHOLD:
+			rr_threshold = strtod(optarg, &end);
+			if (end == optarg || *end ||
+			    !(rr_threshold >= 0 && rr_threshold <= 1))
+				die("--rr-threshold must be a number from 0 to 1");
+			render_opts.rr_threshold = rr_threshold;
+			break;
+		case OPT_DECOUPLED_SHADING:
+			render_opts.decoupled_shading = 1;
+			break;
+		case OPT_ADAPTIVE:
+			adaptive_contrast = strtod(optarg, &end);
+			if (end == optarg || *end ||
+			    !(adaptive_contrast >= 0 && adaptive_contrast <= 1))
+				die("--adaptive must be a number from 0 to 1");
+			render_opts.adaptive_contrast = adaptive_contrast;
+			break;
+		case OPT_ADAPTIVE_ANGLE:
+			adaptive_angle = strtod(optarg, &end);
+			if (end == optarg || *end ||
+			    !(adaptive_angle >= 0 && adaptive_angle <= 180))
+				die("--adaptive-angle must be a number from 0 to 180");
+			render_opts.adaptive_angle = adaptive_angle;
+			break;
+		case OPT_SCREEN_TILES:
+			screen_tiles = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || *optarg == '-' ||
+			    screen_tiles > 4096)
+				die("--screen-tiles must be an integer from 0 to 4096");
+			break;
+		case OPT_PASSES:
+		case OPT_SNAPSHOT_EVERY:
+			passes = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || *optarg == '-' ||
+			    !passes || passes > UINT32_MAX)
+				die("--%s must be a positive integer",
+				    opt == OPT_PASSES ? "passes" : "snapshot-every");
+			if (opt == OPT_PASSES)
+				prog.max_passes = passes;
+			else
+				prog.snapshot_every = passes;
+			break;
+		case OPT_TIME_BUDGET:
+			prog.time_budget = strtod(optarg, &end);
+			if (end == optarg || *end || !(prog.time_budget > 0))
+				die("--time-budget must be a positive number");
+			break;
+		case OPT_TARGET_NOISE:
+			prog.target_noise = strtod(optarg, &end);
+			if (end == optarg || *end || !(prog.target_noise > 0))
+				die("--target-noise must be a positive number");
+			break;
+		case OPT_SNAPSHOT_INTERVAL:
+			prog.snapshot_interval = strtod(optarg, &end);
+			if (end == optarg || *end || !(prog.snapshot_interval > 0))
+				die("--snapshot-interval must be a positive number");
+			break;
+		case OPT_CHECKPOINT:
+			prog.checkpoint = optarg;
+			break;
+		case OPT_CHECKPOINT_INTERVAL:
+			prog.checkpoint_interval = strtod(optarg, &end);
+			if (end == optarg || *end || !(prog.checkpoint_interval > 0))
+				die("--checkpoint-interval must be a positive number");
+			break;
+		case OPT_RESUME:
+			resume = 1;
+			break;
+		case OPT_REGION:
+			parse_region(optarg, &region);
+			break;
+		case OPT_WORKERS:
+			nr_workers = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || *optarg == '-' ||
+			    !nr_workers || nr_workers > 1024)
+				die("--workers must be an integer from 1 to 1024");
+			break;
+		case OPT_WORKER:
+			worker = 1;
+			break;
+		case OPT_SERVE:
+			serve_path = optarg;
+			break;
+		case OPT_SHM:
+			shm_name = optarg;
+			break;
+		case 'h':
+			puts(usage);
+			return 0;
+		default:
+			die("%s", usage);
+		}
+	}
+	if (argc - optind > 1)
+		die("%s", usage);
+	if (optind < argc)
+		scene_path = argv[optind];
+	if (resume && !prog.checkpoint)
+		die("--resume needs a --checkpoint file");
+	if (prog.checkpoint_interval && !prog.checkpoint)
+		die("--checkpoint-interval needs a --checkpoint file");
+	if (!prog.checkpoint_interval)
+		prog.checkpoint_interval = CHECKPOINT_INTERVAL;
+	/* Checkpoints are of passes: a single one is the plain render. */
+	if (prog.checkpoint && !prog.time_budget && !prog.target_noise &&
+	    !prog.max_passes)
+		prog.max_passes = 1;
+	int progressive = prog.max_passes || prog.time_budget || prog.target_noise;
+	if ((prog.snapshot_every || prog.snapshot_interval) && !progressive)
+		die("snapshots need progressive rendering (see --passes, "
+		    "--time-budget and --target-noise)");
+	if ((prog.snapshot_every || prog.snapshot_interval) && !output)
+		die("snapshots need an --output file");
+	if (progressive && render_opts.adaptive_contrast)
+		die("--adaptive does not apply to progressive rendering");
+	/* Workers are started with the coordinator's options. */
+	if (worker)
+		nr_workers = 0;
+	if ((nr_workers || worker) &&
+	    (progressive || render_opts.adaptive_contrast || region.x1))
+		die("--workers does not apply to progressive, adaptive or "
+		    "region rendering");
+	if (region.x1 && (progressive || render_opts.adaptive_contrast))
+		die("--region does not apply to progressive or adaptive rendering");
+	if (serve_path && (anim_path || progressive || nr_workers || worker ||
+			   region.x1 || render_opts.adaptive_contrast))
+		die("--serve does not apply to animations, progressive, "
+		    "adaptive, region or distributed rendering");
+	if (shm_name && (nr_workers || worker || serve_path || region.x1))
+		die("--shm does not apply to region, distributed or served "
+		    "rendering");
+	if (cameras_path && (anim_path || progressive || nr_workers || worker ||
+			     serve_path || region.x1 || shm_name ||
+			     render_opts.adaptive_contrast || screen_tiles ||
+			     ao_samples))
+		die("--cameras does not apply to animations, progressive, "
+		    "adaptive, region, distributed, served or --shm rendering, "
+		    "nor to screen tiles or ambient occlusion");
+
 	int W = OUTPUT_WIDTH * RENDER_RESOLUTION, H = W / ASPECT_RATIO;
+	if (region.x1 > W || region.y1 > H)
+		die("--region must lie within the %dx%d image", W, H);
 
-	float viewport_W = 2.0;
-	float viewport_H = viewport_W / ASPECT_RATIO;
-	float pixel_sz = viewport_W / W;
-	unsigned int rand_state = 0;
+	uint32_t nr_frames = 1;
+	if (anim_path) {
+		animation_load(&anim, anim_path);
+		nr_frames = anim.nr_frames;
+	}
+	int nr_conversions = output ? check_output_pattern(output) : 0;
+	if (nr_frames > 1 && nr_conversions != 1)
+		die("rendering %u frames needs an --output pattern with one %%d",
+		    nr_frames);
+	if (nr_conversions > 1)
+		die("output pattern '%s' has more than one %%d", output);
+
+	if (nr_workers) {
+		render_with_workers(nr_workers, argv, W, H, nr_frames, output);
+		animation_destroy(&anim);
+		fprintf(stderr, "Done!\n");
+		return 0;
+	}
 
 	fprintf(stderr, "Loading resources...\n");
-	make_scene();
-	struct ppm *ppm = ppm_new(H, W);
+	if (scene_path) {
+		scene_file_load(&scene, scene_path);
+		if (use_bvh_cache)
+			bvh_cache_path = xmkstr("%s.bvh", scene_path);
+	} else {
+		make_scene(&scene);
+	}
+	if (anim_path) {
+		animation_apply(&anim, &scene, 0);
+		/* The cache holds a tree for the static scene: build for frame 0. */
+		FREE_AND_NULL(bvh_cache_path);
+	}
 
-	fprintf(stderr, "Casting rays...\n");
-	#pragma omp parallel for collapse(2) private(rand_state)
-	for (int i = 0; i < H; i++) {
-		for (int j = 0; j < W; j++) {
-			struct vec3 samples[SAMPLES_PER_PIXEL];
-			float top_x = -viewport_W/2 + j * pixel_sz;
-			float top_y = viewport_H/2 - i * pixel_sz;
-			for (int s = 0; s < SAMPLES_PER_PIXEL; s++) {
-				struct vec3 *color = &samples[s];
-				float x = rand_r_in(&rand_state, top_x, top_x + pixel_sz);
-				float y = rand_r_in(&rand_state, top_y, top_y + pixel_sz);
-
-#if CAN_PROJ_ORTO == 1
-				struct ray r = ray_new(vec3_new(x, y, 0),
-						       vec3_new(0, 0, VIEWPOINT_DIST));
-#else
-				struct ray r = ray_new(vec3_new(0, 0, 0),
-						       vec3_new(x, y, VIEWPOINT_DIST));
-#endif
-				cast_ray_and_color_pixel(&r, color, RAY_RECUSION_LIMIT);
+	struct prepare_opts prep = {
+		.width = W, .height = H,
+		.bvh_method = bvh_method, .bvh_cache = bvh_cache_path,
+		.light_samples = light_samples, .light_cull = light_cull,
+		.shadow_map_res = shadow_map_res, .shadow_bias = shadow_bias,
+		.ao_samples = ao_samples, .ao_distance = ao_distance,
+		.max_depth = render_opts.max_depth,
+		.screen_tiles = screen_tiles,
+	};
+	scene_prepare(&scene, &prep);
+	if (cameras_path) {
+		render_cameras(&scene, &render_opts, cameras_path, W, H, output,
+			       nr_conversions);
+		scene_destroy(&scene);
+		free_textures();
+		free(bvh_cache_path);
+		fprintf(stderr, "Done!\n");
+		return 0;
+	}
+	double built_cost = bvh_sah_cost(&scene.bvh);
+	uint32_t last_build = 0;
+
+	struct accumulator acc = { 0 };
+	uint32_t first_frame = 0;
+	if (progressive)
+		accumulator_init(&acc, H, W);
+	if (prog.checkpoint) {
+		double settings[] = {
+			light_samples, light_cull, shadow_map_res, shadow_bias,
+			ao_samples, ao_distance,
+		};
+		prog.checkpoint_key = checkpoint_key(&scene, &anim, &render_opts,
+						     settings, ARRAY_SIZE(settings));
+	}
+	if (resume) {
+		int ret = checkpoint_read(prog.checkpoint, prog.checkpoint_key,
+					  &first_frame, &acc);
+		if (ret < 0)
+			die("cannot resume from '%s'", prog.checkpoint);
+		if (ret)
+			warning("no checkpoint at '%s', starting over",
+				prog.checkpoint);
+		else if (first_frame >= nr_frames)
+			die("checkpoint '%s' is for frame %u of %u", prog.checkpoint,
+			    first_frame, nr_frames);
+		else
+			fprintf(stderr, "Resuming frame %u after %u passes\n",
+				first_frame, acc.passes);
+	}
+
+	if (shm_name) {
+		shm_framebuffer_create(&fb, shm_name, W, H);
+		prog.fb = &fb;
+	}
+
+	/*
+	 * Textures, the scene and the OpenMP thread pool are kept across
+	 * frames. Only the moved entities change, and the BVH is refit to
+	 * them unless its quality degraded too much since the last build.
+	 */
+	for (uint32_t frame = 0; frame < nr_frames; frame++) {
+		if (frame) {
+			double start = now_seconds();
+			animation_apply(&anim, &scene, frame);
+			scene_refit_accel(&scene);
+			double cost = bvh_sah_cost(&scene.bvh);
+			if (cost > rebuild_threshold * built_cost ||
+			    (rebuild_every && frame - last_build >= rebuild_every)) {
+				scene_build_accel(&scene, bvh_method);
+				built_cost = cost = bvh_sah_cost(&scene.bvh);
+				last_build = frame;
+				fprintf(stderr, "Frame %u: rebuilt BVH in %.3fs (SAH cost %.2f)\n",
+					frame, now_seconds() - start, cost);
+			} else {
+				fprintf(stderr, "Frame %u: refit BVH in %.3fs (SAH cost %.2f)\n",
+					frame, now_seconds() - start, cost);
 			}
-			*ppm_color(ppm, i, j) = color_average(samples, SAMPLES_PER_PIXEL);
 		}
+
+		/*
+		 * Shadow maps, the AO cache and the screen bins are only valid
+		 * for the geometry they were built on. Frames before that of a
+		 * checkpoint are skipped, but still applied, as BVH rebuilds
+		 * depend on them.
+		 */
+		if (frame < first_frame)
+			continue;
+		if (frame && (frame == first_frame || animation_moves(&anim, frame)))
+			scene_prepare_view(&scene, &prep);
+
+		if (worker) {
+			worker_serve_frame(&scene, &render_opts, W, H, frame);
+			continue;
+		}
+		if (serve_path)
+			serve(&scene, &render_opts, W, H, screen_tiles, serve_path);
+
+		struct ppm *ppm = ppm_new(H, W);
+		double start = now_seconds();
+		fprintf(stderr, "Casting rays...\n");
+		if (shm_name)
+			shm_framebuffer_set_frame(&fb, frame);
+		if (progressive) {
+			render_progressive(&scene, ppm, &render_opts, &prog,
+					   &acc, output, frame);
+		} else if (region.x1) {
+			struct render_stats stats = { 0 };
+			render_region(&scene, ppm, &render_opts, &region, &stats);
+			render_stats_print(&stats, &render_opts,
+					   (size_t)(region.x1 - region.x0) *
+					   (region.y1 - region.y0));
+		} else if (shm_name) {
+			struct render_target target;
+			shm_framebuffer_target(&fb, &target);
+			render_into(&scene, &render_opts, &target);
+			shm_framebuffer_get(&fb, ppm);
+		} else {
+			render(&scene, ppm, &render_opts);
+		}
+		fprintf(stderr, "Writing...\n");
+		write_output(ppm, output, frame);
+		ppm_destroy(&ppm);
+		if (progressive) {
+			accumulator_release(&acc);
+			accumulator_init(&acc, H, W);
+		}
+		/* Past this frame, a resumed render starts the next one. */
+		if (prog.checkpoint && frame + 1 < nr_frames)
+			checkpoint_write(prog.checkpoint, prog.checkpoint_key,
+					 frame + 1, &acc);
+		else if (prog.checkpoint && unlink(prog.checkpoint) && errno != ENOENT)
+			error_errno("failed to remove checkpoint '%s'",
+				    prog.checkpoint);
+		if (nr_frames > 1)
+			fprintf(stderr, "Frame %u/%u done in %.3fs\n", frame + 1,
+				nr_frames, now_seconds() - start);
 	}
-	fprintf(stderr, "Resizing...\n");
-	ppm_resize(ppm, OUTPUT_WIDTH / ASPECT_RATIO, OUTPUT_WIDTH);
 
-	fprintf(stderr, "Writing...\n");
-	ppm_write(ppm, stdout);
-	ppm_destroy(&ppm);
+	if (shm_name) {
+		shm_framebuffer_set_done(&fb);
+		shm_framebuffer_close(&fb);
+	}
+	accumulator_release(&acc);
+	animation_destroy(&anim);
+	scene_destroy(&scene);
 	free_textures();
+	free(bvh_cache_path);
 
 	fprintf(stderr, "Done!\n");
 	return 0;
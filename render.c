@@ -0,0 +1,914 @@
+#include <inttypes.h>
+#include "render.h"
+#include "trace.h"
+#include "util.h"
+#include "config.h"
+#include "lib/array.h"
+
+/*
+ * How much of scene->lights[light] reaches the hit: 0 or 1 from shadow
+ * rays, or anything in between from the shadow maps if there are any.
+ */
+static float light_visibility(struct scene *scene, struct intersection *it,
+			      uint32_t light, struct shade_state *st)
+{
+	struct light *l = &scene->lights[light];
+	float light_dist = vec3_norm(vec3_sub(l->pos, it->pos));
+	struct vec3 it_to_light_dir = vec3_normalize(vec3_sub(l->pos, it->pos));
+
+	/*
+	 * Note: we displace the origin of the ray to avoid intersecting
+	 * with the origin point itself.
+	 */
+	float displacement = sign(vec3_dot(it_to_light_dir, it->normal)) * 1e-3;
+	struct vec3 displaced_it_pos = vec3_add(it->pos, vec3_smul(it->normal, displacement));
+	if (scene->shadow_maps.res)
+		return shadow_map_visibility(&scene->shadow_maps, light, l->pos,
+					     displaced_it_pos);
+
+	struct ray shadow_ray = ray_new(displaced_it_pos, it_to_light_dir);
+	uint32_t cached = st->occluders[light];
+	st->stats.shadow_rays++;
+	if (cast_shadow_ray(scene, &shadow_ray, light_dist, &st->occluders[light])) {
+		st->stats.occluded++;
+		st->stats.occluder_hits += cached != NO_OCCLUDER &&
+				     st->occluders[light] == cached;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Adds the diffuse and specular intensities that scene->lights[light]
+ * gives the hit, scaled by `weight`, unless the light is shadowed.
+ * Returns whether the light reaches the hit.
+ */
+static int add_light(struct scene *scene, struct intersection *it,
+		     uint32_t light, float weight, struct vec3 ray_dir,
+		     struct material *material, struct shade_state *st,
+		     float *diffuse, float *specular)
+{
+	struct light *l = &scene->lights[light];
+	struct vec3 it_to_light_dir = vec3_normalize(vec3_sub(l->pos, it->pos));
+
+	weight *= light_visibility(scene, it, light, st);
+	if (!weight)
+		return 0;
+
+	*diffuse += weight * l->intensity * fabsf(vec3_dot(it_to_light_dir, it->normal));
+
+	/* Specular component */
+	/*
+	 * TODO: should really use vec3_smul(ray_dir, -1)?
+	 */
+	float specular_light_incidence = fabsf(vec3_dot(
+		vec3_normalize(vec3_reflect(vec3_smul(it_to_light_dir, -1), it->normal)),
+		vec3_normalize(vec3_smul(ray_dir, -1))));
+
+	*specular += weight * powf(specular_light_incidence * l->intensity,
+				   material->shininess);
+	return 1;
+}
+
+/*
+ * The AO of the hit, from the cache if it covers the hit, or computed on
+ * the spot otherwise.
+ */
+static float ambient_occlusion(struct scene *scene, struct intersection *it,
+			       struct vec3 ray_dir, struct shade_state *st)
+{
+	struct vec3 normal = vec3_dot(it->normal, ray_dir) > 0 ?
+			     vec3_neg(it->normal) : it->normal;
+	float ao;
+
+	st->stats.ao_lookups++;
+	if (ao_cache_lookup(&scene->ao_cache, it->pos, normal, &ao))
+		return ao;
+	st->stats.ao_misses++;
+	return ao_compute(scene, it->pos, normal, &st->rand_state, NULL);
+}
+
+static struct vec3 intersection_color(struct scene *scene,
+				      struct intersection *it,
+				      struct vec3 ray_dir, int recursion_limit,
+				      struct shade_state *st)
+{
+	float diffuse_light_intensity = AMBIENT_LIGHT_INTENSITY;
+	float specular_light_intensity = 0;
+	struct material *material = intersection_material(scene, it);
+	const struct light_sampler *ls = &scene->light_sampler;
+	struct vec3 reflect_color;
+	int lit = 0, reflected = 0;
+
+	if (scene->ao_cache.samples)
+		diffuse_light_intensity *= ambient_occlusion(scene, it, ray_dir, st);
+
+	if (ls->samples) {
+		for (uint32_t s = 0; s < ls->samples; s++) {
+			float weight;
+			uint32_t i = light_sampler_pick(ls, &st->rand_state, &weight);
+			lit |= add_light(scene, it, i, weight, ray_dir, material, st,
+					 &diffuse_light_intensity,
+					 &specular_light_intensity);
+		}
+		/*
+		 * Whether the hit is lit must not depend on which lights were
+		 * drawn, or sampling would darken reflections on average.
+		 */
+		for (uint32_t i = 0; !lit && recursion_limit &&
+		     material->reflectiveness && i < ls->nr; i++)
+			lit = light_visibility(scene, it, ls->ids[i], st) > 0;
+	} else {
+		for (uint32_t i = 0; i < ls->nr; i++)
+			lit |= add_light(scene, it, ls->ids[i], 1, ray_dir, material,
+					 st, &diffuse_light_intensity,
+					 &specular_light_intensity);
+	}
+
+	/* Reflection, for hits that some light reaches. */
+	if (lit && recursion_limit && material->reflectiveness) {
+		float path_throughput = st->throughput;
+		float throughput = path_throughput * material->reflectiveness;
+		float weight = 1;
+
+		if (throughput < st->opts->rr_threshold) {
+			float survival = throughput / st->opts->rr_threshold;
+			weight = rand_r_in(&st->rand_state, 0, 1) < survival ?
+				 1 / survival : 0;
+		}
+		if (weight) {
+			struct vec3 reflect_dir = vec3_reflect(ray_dir, it->normal);
+			float displacement = sign(vec3_dot(reflect_dir, it->normal)) * 1e-3;
+			struct ray reflect_ray = ray_new(vec3_add(it->pos,
+					vec3_smul(it->normal, displacement)), reflect_dir);
+			st->throughput = throughput * weight;
+			cast_ray_and_color_pixel(scene, &reflect_ray, &reflect_color,
+						 recursion_limit - 1, st);
+			st->throughput = path_throughput;
+			reflect_color = vec3_smul(reflect_color, weight);
+		} else {
+			reflect_color = vec3_new(0, 0, 0);
+			st->stats.rr_ended++;
+		}
+		reflected = 1;
+	}
+
+	struct vec3 base_color = intersection_base_color(scene, it, material);
+
+	diffuse_light_intensity = clamp_color(diffuse_light_intensity);
+	struct vec3 diffuse_color = vec3_smul(base_color,
+					      diffuse_light_intensity *
+					      material->diffuse_constant);
+
+	specular_light_intensity = clamp_color(specular_light_intensity);
+	struct vec3 specular_color =
+		vec3_smul((struct vec3){1, 1, 1},
+			  specular_light_intensity * material->specular_constant);
+
+	struct vec3 this_color = vec3_add(diffuse_color, specular_color);
+
+	if (reflected)
+		return vec3_add(vec3_smul(this_color, 1 - material->reflectiveness),
+				vec3_smul(reflect_color, material->reflectiveness));
+	return this_color;
+}
+
+static struct vec3 background_color(struct scene *scene, struct vec3 dir)
+{
+	struct vec3 color;
+	if (!scene->background)
+		return vec3_new(0, 0, 0);
+	env_texture_lookup(scene->background, &dir, &color, 1);
+	return color;
+}
+
+void cast_ray_and_color_pixel(struct scene *scene, struct ray *r,
+			      struct vec3 *color, int recursion_limit,
+			      struct shade_state *st)
+{
+	struct intersection it;
+
+	st->stats.depth_rays[st->opts->max_depth - recursion_limit]++;
+	if (cast_ray(scene, r, INFINITY, &it))
+		*color = intersection_color(scene, &it, r->dir, recursion_limit, st);
+	else
+		*color = background_color(scene, r->dir);
+}
+
+/*
+ * Hits of the same pixel that get shaded as one: same entity (and
+ * instance), and normals less than about 18 degrees apart, which keeps
+ * creases and self-occluding meshes apart.
+ */
+static int same_surface(const struct intersection *a,
+			const struct intersection *b)
+{
+	return a->entity == b->entity && a->instance == b->instance &&
+	       vec3_dot(a->normal, b->normal) > 0.95f;
+}
+
+void shade_state_init(struct shade_state *st, const struct scene *scene,
+		      const struct render_opts *opts)
+{
+	memset(st, 0, sizeof(*st));
+	st->opts = opts;
+	ALLOC_ARRAY(st->occluders, scene->nr_lights);
+	for (size_t i = 0; i < scene->nr_lights; i++)
+		st->occluders[i] = NO_OCCLUDER;
+}
+
+void shade_state_release(struct shade_state *st)
+{
+	FREE_AND_NULL(st->occluders);
+}
+
+/* The pixel grid of a render, on the viewport (see struct camera). */
+struct view {
+	int W, H;
+	float viewport_W, viewport_H, pixel_sz;
+	struct camera_frame camera;
+	/* Progressive rendering pass, which the sample positions depend on. */
+	uint32_t pass;
+};
+
+/*
+ * The viewport is a 2 by (2 / ASPECT_RATIO) plane, in front of the camera
+ * (see struct camera).
+ */
+static struct view view_from_camera(const struct camera *camera, int W, int H,
+				    uint32_t pass)
+{
+	return (struct view){
+		.W = W, .H = H,
+		.viewport_W = 2.0, .viewport_H = 2.0 / ASPECT_RATIO,
+		.pixel_sz = 2.0 / W,
+		.camera = camera_frame(camera),
+		.pass = pass,
+	};
+}
+
+static struct view view_new(struct scene *scene, int W, int H, uint32_t pass)
+{
+	const struct screen_bins *sb = &scene->screen_bins;
+
+	if (sb->tile_size && (sb->width != W || sb->height != H))
+		die("screen bins were prepared for %dx%d, not %dx%d",
+		    sb->width, sb->height, W, H);
+	return view_from_camera(&scene->camera, W, H, pass);
+}
+
+/* The primary hit a pixel is summarized by, for adaptive rendering. */
+struct pixel_hit {
+	/* NULL for the background. */
+	const struct entity *entity, *instance;
+	struct vec3 normal;
+};
+
+/*
+ * Traces the samples of pixel (i, j), and returns its color. If `hit` is
+ * not NULL, it is set to the first sample's hit.
+ *
+ * With decoupled shading, the primary rays are all traced, but shading
+ * (lights, shadows, reflections) runs once per surface they hit, at its
+ * first sample, and the result goes to all the samples that hit it. The
+ * pixel thus keeps antialiased edges, while its interior costs about one
+ * sample.
+ */
+static struct vec3 sample_color(struct scene *scene, const struct ray *r,
+				int hit, struct intersection *it,
+				struct shade_state *st)
+{
+	if (!hit)
+		return background_color(scene, r->dir);
+	st->throughput = 1;
+	return intersection_color(scene, it, r->dir, st->opts->max_depth, st);
+}
+
+static struct vec3 render_pixel(struct scene *scene, const struct view *v,
+				int i, int j, struct shade_state *st,
+				struct pixel_hit *hit)
+{
+	struct ray rays[SAMPLES_PER_PIXEL];
+	struct intersection its[SAMPLES_PER_PIXEL];
+	struct vec3 colors[SAMPLES_PER_PIXEL];
+	int hits[SAMPLES_PER_PIXEL], done[SAMPLES_PER_PIXEL] = { 0 };
+	float top_x = -v->viewport_W/2 + j * v->pixel_sz;
+	float top_y = v->viewport_H/2 - i * v->pixel_sz;
+
+	/* Tiles that only see the background need no tracing. */
+	const struct screen_tile *tile = screen_bins_tile(&scene->screen_bins, i, j);
+	int background = tile && !tile->nr && !scene->nr_unbounded;
+
+	/*
+	 * Seeded per pixel and pass, so that renders are reproducible.
+	 * Without decoupled shading, each sample is shaded before the next
+	 * one is jittered, so that its shading draws (Russian roulette, light
+	 * samples, AO) come right after its jitter.
+	 */
+	st->rand_state = (i * v->W + j) * 2654435761u + v->pass * 0x9E3779B9u;
+	for (int s = 0; s < SAMPLES_PER_PIXEL; s++) {
+		float x = rand_r_in(&st->rand_state, top_x, top_x + v->pixel_sz);
+		float y = rand_r_in(&st->rand_state, top_y, top_y + v->pixel_sz);
+		rays[s] = camera_ray(&v->camera, x, y);
+		if (background)
+			continue;
+		st->stats.depth_rays[0]++;
+		hits[s] = cast_camera_ray(scene, &rays[s], i, j, &its[s]);
+		if (!st->opts->decoupled_shading)
+			colors[s] = sample_color(scene, &rays[s], hits[s], &its[s], st);
+	}
+	if (background) {
+		struct vec3 dirs[SAMPLES_PER_PIXEL];
+		for (int s = 0; s < SAMPLES_PER_PIXEL; s++) {
+			dirs[s] = rays[s].dir;
+			colors[s] = vec3_new(0, 0, 0);
+		}
+		if (scene->background)
+			env_texture_lookup(scene->background, dirs, colors,
+					   SAMPLES_PER_PIXEL);
+		if (hit)
+			hit->entity = hit->instance = NULL;
+		st->stats.pixels++;
+		st->stats.background_pixels++;
+		return color_average(colors, SAMPLES_PER_PIXEL);
+	}
+
+	for (int s = 0; st->opts->decoupled_shading && s < SAMPLES_PER_PIXEL; s++) {
+		if (done[s])
+			continue;
+		colors[s] = sample_color(scene, &rays[s], hits[s], &its[s], st);
+		if (!hits[s])
+			continue;
+		st->stats.shadings++;
+		for (int t = s + 1; t < SAMPLES_PER_PIXEL; t++) {
+			if (hits[t] && !done[t] && same_surface(&its[s], &its[t])) {
+				colors[t] = colors[s];
+				done[t] = 1;
+			}
+		}
+	}
+
+	if (hit) {
+		hit->entity = hits[0] ? its[0].entity : NULL;
+		hit->instance = hits[0] ? its[0].instance : NULL;
+		hit->normal = its[0].normal;
+	}
+	st->stats.pixels++;
+	return color_average(colors, SAMPLES_PER_PIXEL);
+}
+
+static void render_stats_add(struct render_stats *to,
+			     const struct render_stats *from)
+{
+	to->shadow_rays += from->shadow_rays;
+	to->occluded += from->occluded;
+	to->occluder_hits += from->occluder_hits;
+	to->ao_lookups += from->ao_lookups;
+	to->ao_misses += from->ao_misses;
+	for (int d = 0; d <= MAX_RAY_DEPTH; d++)
+		to->depth_rays[d] += from->depth_rays[d];
+	to->rr_ended += from->rr_ended;
+	to->shadings += from->shadings;
+	to->pixels += from->pixels;
+	to->background_pixels += from->background_pixels;
+}
+
+/*
+ * Adaptive rendering
+ * ------------------
+ *
+ * Pixels are traced on a lattice of stride ADAPTIVE_STEP (plus the last
+ * row and column). Each block of the lattice whose four corners hit the
+ * same surface, with normals and colors close enough (see
+ * struct render_opts), is deemed flat and filled by interpolating its
+ * corners. The others are split in four, tracing the lattice of half the
+ * stride inside them, down to single pixels.
+ *
+ * Levels are processed one at a time, so that every pixel is traced by a
+ * single thread: blocks are checked in parallel against the pixels
+ * traced so far, and the pixels the split blocks need are then traced in
+ * parallel.
+ */
+#define ADAPTIVE_STEP 8
+
+struct adaptive {
+	const struct view *v;
+	const struct render_opts *opts;
+	struct ppm *ppm;
+	float cos_angle;
+	struct pixel_hit *hits;
+	/* 1 for traced pixels, 2 for those about to be. */
+	uint8_t *traced;
+	/* The pixels to trace next, as indices into `hits`. */
+	uint32_t *todo;
+	size_t nr_todo;
+};
+
+static int lattice_next(int x, int stride, int n)
+{
+	return x + stride < n - 1 ? x + stride : n - 1;
+}
+
+static int is_flat(const struct adaptive *a, const uint32_t corner[4])
+{
+	const struct pixel_hit *h0 = &a->hits[corner[0]];
+	struct vec3 lo = a->ppm->img[corner[0]], hi = lo;
+
+	for (int c = 1; c < 4; c++) {
+		const struct pixel_hit *h = &a->hits[corner[c]];
+		struct vec3 color = a->ppm->img[corner[c]];
+		if (h->entity != h0->entity || h->instance != h0->instance)
+			return 0;
+		if (h->entity && vec3_dot(h->normal, h0->normal) < a->cos_angle)
+			return 0;
+		lo = vec3_new(fminf(lo.x, color.x), fminf(lo.y, color.y), fminf(lo.z, color.z));
+		hi = vec3_new(fmaxf(hi.x, color.x), fmaxf(hi.y, color.y), fmaxf(hi.z, color.z));
+	}
+	return hi.x - lo.x <= a->opts->adaptive_contrast &&
+	       hi.y - lo.y <= a->opts->adaptive_contrast &&
+	       hi.z - lo.z <= a->opts->adaptive_contrast;
+}
+
+static void trace_todo(struct scene *scene, struct adaptive *a,
+		       struct shade_state *st)
+{
+	#pragma omp for schedule(dynamic, 64)
+	for (size_t t = 0; t < a->nr_todo; t++) {
+		uint32_t p = a->todo[t];
+		int i = p / a->v->W, j = p % a->v->W;
+		a->ppm->img[p] = render_pixel(scene, a->v, i, j, st, &a->hits[p]);
+		a->traced[p] = 1;
+	}
+}
+
+static void add_todo(struct adaptive *a, int i, int j)
+{
+	uint32_t p = (uint32_t)i * a->v->W + j;
+	if (a->traced[p])
+		return;
+	a->traced[p] = 2;
+	a->todo[a->nr_todo++] = p;
+}
+
+/*
+ * Queues the pixels of the stride / 2 lattice inside the blocks of the
+ * stride lattice that are not flat.
+ */
+static void split_blocks(struct adaptive *a, int stride)
+{
+	int W = a->v->W, H = a->v->H, half = stride / 2;
+
+	a->nr_todo = 0;
+	for (int i0 = 0; i0 < H - 1; i0 += stride) {
+		int i1 = lattice_next(i0, stride, H);
+		for (int j0 = 0; j0 < W - 1; j0 += stride) {
+			int j1 = lattice_next(j0, stride, W);
+			uint32_t corner[4] = {
+				(uint32_t)i0 * W + j0, (uint32_t)i0 * W + j1,
+				(uint32_t)i1 * W + j0, (uint32_t)i1 * W + j1,
+			};
+			if (a->traced[corner[0]] != 1 || a->traced[corner[1]] != 1 ||
+			    a->traced[corner[2]] != 1 || a->traced[corner[3]] != 1 ||
+			    is_flat(a, corner))
+				continue;
+			for (int i = i0; i <= i1; i = i < i1 ? lattice_next(i, half, i1 + 1) : i1 + 1)
+				for (int j = j0; j <= j1; j = j < j1 ? lattice_next(j, half, j1 + 1) : j1 + 1)
+					add_todo(a, i, j);
+		}
+	}
+}
+
+/* Fills the pixels that were not traced from the flat block around them. */
+static void interpolate(struct adaptive *a)
+{
+	int W = a->v->W, H = a->v->H;
+
+	#pragma omp for schedule(static)
+	for (int i = 0; i < H; i++) {
+		for (int j = 0; j < W; j++) {
+			if (a->traced[(size_t)i * W + j])
+				continue;
+			for (int stride = 2; stride <= ADAPTIVE_STEP; stride *= 2) {
+				int i0 = i / stride * stride, i1 = lattice_next(i0, stride, H);
+				int j0 = j / stride * stride, j1 = lattice_next(j0, stride, W);
+				struct vec3 *img = a->ppm->img;
+				size_t c00 = (size_t)i0 * W + j0, c01 = (size_t)i0 * W + j1;
+				size_t c10 = (size_t)i1 * W + j0, c11 = (size_t)i1 * W + j1;
+				if (!a->traced[c00] || !a->traced[c01] ||
+				    !a->traced[c10] || !a->traced[c11])
+					continue;
+				float ty = (float)(i - i0) / (i1 - i0);
+				float tx = (float)(j - j0) / (j1 - j0);
+				struct vec3 top = vec3_add(vec3_smul(img[c00], 1 - tx),
+							   vec3_smul(img[c01], tx));
+				struct vec3 bottom = vec3_add(vec3_smul(img[c10], 1 - tx),
+							      vec3_smul(img[c11], tx));
+				img[(size_t)i * W + j] = vec3_add(vec3_smul(top, 1 - ty),
+								  vec3_smul(bottom, ty));
+				break;
+			}
+		}
+	}
+}
+
+static void render_adaptive(struct scene *scene, const struct view *v,
+			    struct ppm *ppm, const struct render_opts *opts,
+			    struct render_stats *stats)
+{
+	struct adaptive a = {
+		.v = v, .opts = opts, .ppm = ppm,
+		.cos_angle = cosf(opts->adaptive_angle * M_PI / 180),
+	};
+	size_t nr_pixels = (size_t)v->W * v->H;
+
+	ALLOC_ARRAY(a.hits, nr_pixels);
+	CALLOC_ARRAY(a.traced, nr_pixels);
+	ALLOC_ARRAY(a.todo, nr_pixels);
+
+	for (int i = 0; i < v->H; i = i < v->H - 1 ? lattice_next(i, ADAPTIVE_STEP, v->H) : v->H)
+		for (int j = 0; j < v->W; j = j < v->W - 1 ? lattice_next(j, ADAPTIVE_STEP, v->W) : v->W)
+			add_todo(&a, i, j);
+
+	#pragma omp parallel
+	{
+		struct shade_state st;
+		shade_state_init(&st, scene, opts);
+
+		trace_todo(scene, &a, &st);
+		for (int stride = ADAPTIVE_STEP; stride > 1; stride /= 2) {
+			/* The implicit barriers of omp for keep levels apart. */
+			#pragma omp single
+			split_blocks(&a, stride);
+			trace_todo(scene, &a, &st);
+		}
+		interpolate(&a);
+
+		#pragma omp critical
+		render_stats_add(stats, &st.stats);
+		shade_state_release(&st);
+	}
+
+	free(a.hits);
+	free(a.traced);
+	free(a.todo);
+}
+
+void render_stats_print(const struct render_stats *stats,
+			const struct render_opts *opts, size_t nr_pixels)
+{
+	fprintf(stderr, "Rays per depth:");
+	for (int d = 0; d <= opts->max_depth && stats->depth_rays[d]; d++)
+		fprintf(stderr, " %"PRIu64, stats->depth_rays[d]);
+	fprintf(stderr, "\n");
+	if (opts->adaptive_contrast)
+		fprintf(stderr, "Adaptive: traced %.1f%% of the pixels\n",
+			100.0 * stats->pixels / nr_pixels);
+	if (stats->background_pixels)
+		fprintf(stderr, "Screen tiles: %.1f%% of the pixels only see the background\n",
+			100.0 * stats->background_pixels / stats->pixels);
+	if (opts->decoupled_shading)
+		fprintf(stderr, "Decoupled shading: %.2f shadings per pixel\n",
+			(double)stats->shadings / stats->pixels);
+	if (stats->rr_ended)
+		fprintf(stderr, "Russian roulette ended %"PRIu64" paths\n",
+			stats->rr_ended);
+	if (stats->shadow_rays)
+		fprintf(stderr, "Shadow rays: %"PRIu64", %.1f%% blocked, "
+			"%.1f%% of those by the cached occluder\n",
+			stats->shadow_rays,
+			100.0 * stats->occluded / stats->shadow_rays,
+			stats->occluded ?
+			100.0 * stats->occluder_hits / stats->occluded : 0);
+	if (stats->ao_lookups)
+		fprintf(stderr, "Ambient occlusion: %.1f%% of hits from the cache\n",
+			100.0 * (stats->ao_lookups - stats->ao_misses) /
+			stats->ao_lookups);
+}
+
+/* Where render_tile() puts each pixel it renders. */
+typedef void (*store_pixel_fn)(void *data, int i, int j, struct vec3 color);
+
+static void store_ppm_pixel(void *data, int i, int j, struct vec3 color)
+{
+	*ppm_color(data, i, j) = color;
+}
+
+/*
+ * The number of tiles of `size` pixels across `area`, the last ones cut
+ * short by its edges.
+ */
+static int tiles_across(const struct render_region *area, int size)
+{
+	return (area->x1 - area->x0 + size - 1) / size;
+}
+
+static size_t nr_tiles(const struct render_region *area, int size)
+{
+	return (size_t)tiles_across(area, size) *
+	       ((area->y1 - area->y0 + size - 1) / size);
+}
+
+/* Tile `t` of `area`, in row-major order. */
+static struct render_region area_tile(const struct render_region *area,
+				      int size, size_t t)
+{
+	int tiles_w = tiles_across(area, size);
+	struct render_region tile = {
+		.x0 = area->x0 + t % tiles_w * size,
+		.y0 = area->y0 + t / tiles_w * size,
+	};
+	tile.x1 = tile.x0 + size < area->x1 ? tile.x0 + size : area->x1;
+	tile.y1 = tile.y0 + size < area->y1 ? tile.y0 + size : area->y1;
+	return tile;
+}
+
+/* Renders the pixels of `tile` and passes them to `store`. */
+static void render_tile(struct scene *scene, const struct view *v,
+			const struct render_region *tile,
+			struct shade_state *st, store_pixel_fn store,
+			void *data)
+{
+	for (int i = tile->y0; i < tile->y1; i++)
+		for (int j = tile->x0; j < tile->x1; j++)
+			store(data, i, j, render_pixel(scene, v, i, j, st, NULL));
+}
+
+/*
+ * Renders `region` in parallel, in tiles of RENDER_TILE pixels, and
+ * passes each to `tile_done`, if not NULL, once all its pixels are stored.
+ */
+static void render_tiles(struct scene *scene, const struct view *v,
+			 const struct render_opts *opts,
+			 const struct render_region *region,
+			 store_pixel_fn store, void *data,
+			 void (*tile_done)(const struct render_region *, void *),
+			 void *tile_data, struct render_stats *stats)
+{
+	size_t nr = nr_tiles(region, RENDER_TILE);
+
+	#pragma omp parallel
+	{
+		struct shade_state st;
+		shade_state_init(&st, scene, opts);
+
+		#pragma omp for schedule(dynamic)
+		for (size_t t = 0; t < nr; t++) {
+			struct render_region tile = area_tile(region, RENDER_TILE, t);
+			render_tile(scene, v, &tile, &st, store, data);
+			if (tile_done)
+				tile_done(&tile, tile_data);
+		}
+
+		#pragma omp critical
+		render_stats_add(stats, &st.stats);
+		shade_state_release(&st);
+	}
+}
+
+void render_region(struct scene *scene, struct ppm *ppm,
+		   const struct render_opts *opts,
+		   const struct render_region *region,
+		   struct render_stats *stats)
+{
+	struct view v = view_new(scene, ppm->cols, ppm->rows, 0);
+	render_tiles(scene, &v, opts, region, store_ppm_pixel, ppm, NULL, NULL,
+		     stats);
+}
+
+void render(struct scene *scene, struct ppm *ppm,
+	    const struct render_opts *opts)
+{
+	struct render_stats stats = { 0 };
+
+	if (opts->adaptive_contrast) {
+		struct view v = view_new(scene, ppm->cols, ppm->rows, 0);
+		render_adaptive(scene, &v, ppm, opts, &stats);
+	} else {
+		struct render_region all = { 0, 0, ppm->cols, ppm->rows };
+		render_region(scene, ppm, opts, &all, &stats);
+	}
+	render_stats_print(&stats, opts, (size_t)ppm->cols * ppm->rows);
+}
+
+static void *target_pixel(const struct render_target *t, int i, int j)
+{
+	size_t pixel_size = t->format == PIXEL_RGB8 ? 3 : 3 * sizeof(float);
+	size_t stride = t->stride ? t->stride : t->width * pixel_size;
+	return (char *)t->pixels + i * stride + j * pixel_size;
+}
+
+static void store_target_pixel(void *data, int i, int j, struct vec3 color)
+{
+	const struct render_target *t = data;
+
+	if (t->format == PIXEL_RGB8) {
+		uint8_t *out = target_pixel(t, i, j);
+		struct vec3 c = color_float_to_byte(color);
+		out[0] = c.x;
+		out[1] = c.y;
+		out[2] = c.z;
+	} else {
+		float *out = target_pixel(t, i, j);
+		out[0] = color.x;
+		out[1] = color.y;
+		out[2] = color.z;
+	}
+}
+
+void render_into(struct scene *scene, const struct render_opts *opts,
+		 const struct render_target *target)
+{
+	struct render_region all = { 0, 0, target->width, target->height };
+	struct render_stats stats = { 0 };
+	/* store_target_pixel() only writes through target->pixels. */
+	struct render_target t = *target;
+
+	if (opts->adaptive_contrast) {
+		struct ppm *ppm = ppm_new(target->height, target->width);
+		render(scene, ppm, opts);
+		for (int i = 0; i < target->height; i++)
+			for (int j = 0; j < target->width; j++)
+				store_target_pixel(&t, i, j, *ppm_color(ppm, i, j));
+		ppm_destroy(&ppm);
+		if (target->tile_done)
+			target->tile_done(&all, target->data);
+		return;
+	}
+
+	struct view v = view_new(scene, target->width, target->height, 0);
+	render_tiles(scene, &v, opts, &all, store_target_pixel, &t,
+		     target->tile_done, target->data, &stats);
+	render_stats_print(&stats, opts, (size_t)v.W * v.H);
+}
+
+struct batch_view {
+	struct view v;
+	/* Allocated by the first tile, freed by the last. */
+	struct ppm *ppm;
+	uint32_t tiles_left;
+};
+
+void render_views(struct scene *scene, const struct render_opts *opts,
+		  const struct camera *cameras, size_t nr_views,
+		  int width, int height, view_done_fn view_done, void *data)
+{
+	struct render_region all = { 0, 0, width, height };
+	size_t tiles_per_view = nr_tiles(&all, RENDER_TILE);
+	struct render_stats stats = { 0 };
+	struct batch_view *views;
+
+	if (scene->screen_bins.tile_size)
+		BUG("screen bins are only valid for the scene's camera");
+	if (scene->ao_cache.samples)
+		BUG("the AO cache is only valid for the scene's camera");
+	if (opts->adaptive_contrast)
+		BUG("adaptive rendering does not apply to several views");
+
+	CALLOC_ARRAY(views, nr_views);
+	for (size_t n = 0; n < nr_views; n++) {
+		views[n].v = view_from_camera(&cameras[n], width, height, 0);
+		views[n].tiles_left = tiles_per_view;
+	}
+
+	#pragma omp parallel
+	{
+		struct shade_state st;
+		shade_state_init(&st, scene, opts);
+
+		/*
+		 * Tiles are handed out view after view, but with no barrier in
+		 * between: threads done with a view go on with the next one.
+		 */
+		#pragma omp for schedule(dynamic)
+		for (size_t t = 0; t < nr_views * tiles_per_view; t++) {
+			size_t n = t / tiles_per_view;
+			struct batch_view *bv = &views[n];
+			struct render_region tile = area_tile(&all, RENDER_TILE,
+							      t % tiles_per_view);
+			struct ppm *ppm;
+
+			#pragma omp critical(render_views_alloc)
+			{
+				if (!bv->ppm)
+					bv->ppm = ppm_new(height, width);
+				ppm = bv->ppm;
+			}
+			render_tile(scene, &bv->v, &tile, &st, store_ppm_pixel, ppm);
+
+			/* The last tile sees the pixels of all the others. */
+			if (__atomic_sub_fetch(&bv->tiles_left, 1, __ATOMIC_ACQ_REL))
+				continue;
+			#pragma omp critical(render_views_done)
+			view_done(n, ppm, data);
+			ppm_destroy(&bv->ppm);
+		}
+
+		#pragma omp critical
+		render_stats_add(&stats, &st.stats);
+		shade_state_release(&st);
+	}
+	render_stats_print(&stats, opts, nr_views * width * height);
+	free(views);
+}
+
+void accumulator_init(struct accumulator *acc, unsigned rows, unsigned cols)
+{
+	acc->rows = rows;
+	acc->cols = cols;
+	acc->passes = 0;
+	CALLOC_ARRAY(acc->sum, (size_t)rows * cols);
+	CALLOC_ARRAY(acc->sum_sq, (size_t)rows * cols);
+	acc->tiles_w = (cols + ACCUMULATOR_TILE - 1) / ACCUMULATOR_TILE;
+	acc->tiles_h = (rows + ACCUMULATOR_TILE - 1) / ACCUMULATOR_TILE;
+	CALLOC_ARRAY(acc->tile_done, (size_t)acc->tiles_w * acc->tiles_h);
+	acc->nr_tiles_done = 0;
+}
+
+void accumulator_release(struct accumulator *acc)
+{
+	FREE_AND_NULL(acc->sum);
+	FREE_AND_NULL(acc->sum_sq);
+	FREE_AND_NULL(acc->tile_done);
+}
+
+static inline float luminance(struct vec3 c)
+{
+	return 0.2126f * c.x + 0.7152f * c.y + 0.0722f * c.z;
+}
+
+static void accumulate_pixel(void *data, int i, int j, struct vec3 color)
+{
+	struct accumulator *acc = data;
+	size_t p = (size_t)i * acc->cols + j;
+
+	acc->sum[p] = vec3_add(acc->sum[p], color);
+	acc->sum_sq[p] += square(luminance(color));
+}
+
+int render_pass(struct scene *scene, struct accumulator *acc,
+		const struct render_opts *opts, struct render_stats *stats,
+		double deadline)
+{
+	struct view v = view_new(scene, acc->cols, acc->rows, acc->passes);
+	struct render_region all = { 0, 0, acc->cols, acc->rows };
+	size_t nr = nr_tiles(&all, ACCUMULATOR_TILE);
+
+	#pragma omp parallel
+	{
+		struct shade_state st;
+		shade_state_init(&st, scene, opts);
+
+		#pragma omp for schedule(dynamic)
+		for (size_t t = 0; t < nr; t++) {
+			struct render_region tile;
+			if (acc->tile_done[t] ||
+			    (deadline && now_seconds() > deadline))
+				continue;
+			tile = area_tile(&all, ACCUMULATOR_TILE, t);
+			render_tile(scene, &v, &tile, &st, accumulate_pixel, acc);
+			acc->tile_done[t] = 1;
+			#pragma omp atomic
+			acc->nr_tiles_done++;
+		}
+
+		#pragma omp critical
+		render_stats_add(stats, &st.stats);
+		shade_state_release(&st);
+	}
+	if (acc->nr_tiles_done < nr)
+		return 0;
+	memset(acc->tile_done, 0, nr);
+	acc->nr_tiles_done = 0;
+	acc->passes++;
+	return 1;
+}
+
+void accumulator_resolve(const struct accumulator *acc, struct ppm *ppm)
+{
+	size_t nr_pixels = (size_t)acc->rows * acc->cols;
+
+	if (ppm->rows != acc->rows || ppm->cols != acc->cols)
+		BUG("accumulator and image sizes differ");
+	for (size_t p = 0; p < nr_pixels; p++)
+		ppm->img[p] = vec3_smul(acc->sum[p], 1.0 / acc->passes);
+}
+
+/*
+ * The variance of a pixel is estimated from its passes, and the noise is
+ * the standard error of its mean, averaged over the image.
+ */
+double accumulator_noise(const struct accumulator *acc)
+{
+	size_t nr_pixels = (size_t)acc->rows * acc->cols;
+	double n = acc->passes, total = 0;
+
+	if (acc->passes < 2)
+		return INFINITY;
+	#pragma omp parallel for reduction(+:total) schedule(static)
+	for (size_t p = 0; p < nr_pixels; p++) {
+		double mean = luminance(acc->sum[p]) / n;
+		double variance = (acc->sum_sq[p] - n * mean * mean) / (n - 1);
+		total += sqrt(fmax(variance, 0) / n);
+	}
+	return total / nr_pixels;
+}
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "scene.h"
+#include "ppm.h"
+#include "trace.h"
+
+/* The deepest reflection chains --max-depth allows. */
+#define MAX_RAY_DEPTH 64
+
+struct render_opts {
+	/* Reflections followed at most. */
+	int max_depth;
+	/*
+	 * Reflection paths whose throughput (the fraction of their color
+	 * that reaches the pixel) drops below this are ended at random
+	 * (Russian roulette), and the survivors are weighted up so that the
+	 * expected color is unchanged. 0 disables it.
+	 */
+	float rr_threshold;
+	/*
+	 * Shade the samples of a pixel that hit the same surface once (see
+	 * render_pixel() in render.c).
+	 */
+	int decoupled_shading;
+	/*
+	 * Adaptive rendering (see render_adaptive() in render.c): pixels are
+	 * interpolated over blocks whose corners hit the same surface, with
+	 * normals at most adaptive_angle degrees apart, and colors at most
+	 * adaptive_contrast apart on each channel. A contrast of 0 disables
+	 * it.
+	 */
+	float adaptive_contrast, adaptive_angle;
+};
+
+#define RENDER_OPTS_INIT { .max_depth = RAY_RECUSION_LIMIT, \
+			   .rr_threshold = RUSSIAN_ROULETTE_THRESHOLD, \
+			   .adaptive_angle = ADAPTIVE_ANGLE }
+
+/* Counters render() reports. */
+struct render_stats {
+	/* Shadow rays cast, those blocked, and those blocked by the cached occluder. */
+	uint64_t shadow_rays, occluded, occluder_hits;
+	/* Hits that needed AO, and those the AO cache did not cover. */
+	uint64_t ao_lookups, ao_misses;
+	/* Rays cast at each depth, and paths ended by Russian roulette. */
+	uint64_t depth_rays[MAX_RAY_DEPTH + 1], rr_ended;
+	/* Primary hits shaded, with decoupled shading. */
+	uint64_t shadings;
+	/*
+	 * Pixels traced, rather than interpolated, and those of them in
+	 * background-only screen tiles.
+	 */
+	uint64_t pixels, background_pixels;
+};
+
+/*
+ * The state a rendering thread carries from one shading to the next. It
+ * may speed shading up but must never change the pixels, which would then
+ * depend on the pixels the thread rendered before (see render_region()).
+ */
+struct shade_state {
+	const struct render_opts *opts;
+	/* The throughput of the path being shaded. */
+	float throughput;
+	/* Drives the random choices, such as the lights sampled (see lights.h). */
+	unsigned int rand_state;
+	/*
+	 * For each light, the entity that blocked the last shadow ray
+	 * towards it, or NO_OCCLUDER (see cast_shadow_ray()). Neighboring
+	 * hits are usually shadowed by the same entity.
+	 */
+	uint32_t *occluders;
+	struct render_stats stats;
+};
+
+/* Sets up `st` for the scene's lights. */
+void shade_state_init(struct shade_state *st, const struct scene *scene,
+		      const struct render_opts *opts);
+void shade_state_release(struct shade_state *st);
+
+/*
+ * Follows at most `recursion_limit` reflections, out of the
+ * st->opts->max_depth of the whole path.
+ */
+void cast_ray_and_color_pixel(struct scene *scene, struct ray *r,
+			      struct vec3 *color, int recursion_limit,
+			      struct shade_state *st);
+
+/*
+ * Render the scene, as seen from its camera, into `ppm` (at its current
+ * size). The scene's acceleration structure and lights must be prepared
+ * (see scene_prepare_accel() and scene_prepare_lights()).
+ */
+void render(struct scene *scene, struct ppm *ppm,
+	    const struct render_opts *opts);
+
+/* A rectangle of pixels: columns [x0, x1) of rows [y0, y1). */
+struct render_region {
+	int x0, y0, x1, y1;
+};
+
+/*
+ * Renders the pixels of `region` into `ppm` like render() does, but
+ * without adaptive rendering, and leaves the others untouched. Pixels only
+ * depend on their position: what rendering threads keep from one pixel to
+ * the next, like the cached occluders of shadow rays (see
+ * cast_shadow_ray()), never changes them. So images split into regions
+ * come out the same, whatever the number of threads. Adds the counters to
+ * `stats`.
+ */
+void render_region(struct scene *scene, struct ppm *ppm,
+		   const struct render_opts *opts,
+		   const struct render_region *region,
+		   struct render_stats *stats);
+
+/*
+ * Rendering into the caller's buffer
+ * ----------------------------------
+ *
+ * For embedding: render_into() writes the pixels, in the target's format,
+ * straight into `pixels`, in tiles of RENDER_TILE pixels rendered in
+ * parallel, and passes each tile to `tile_done` as soon as it is written.
+ */
+#define RENDER_TILE 32
+
+enum pixel_format {
+	/* Three floats per pixel, unclamped. */
+	PIXEL_RGB_FLOAT,
+	/* Three bytes per pixel, as written in images. */
+	PIXEL_RGB8,
+};
+
+struct render_target {
+	void *pixels;
+	int width, height;
+	/* Bytes from one row to the next, or 0 if rows are packed. */
+	size_t stride;
+	enum pixel_format format;
+	/*
+	 * If not NULL, called with each tile once it is in `pixels`. Calls
+	 * come from the rendering threads, concurrently.
+	 */
+	void (*tile_done)(const struct render_region *tile, void *data);
+	void *data;
+};
+
+/*
+ * Renders the scene like render() does, at the target's size, into the
+ * target. With adaptive rendering, the whole image is a single tile. Dies
+ * if the screen bins were prepared for another size.
+ */
+void render_into(struct scene *scene, const struct render_opts *opts,
+		 const struct render_target *target);
+
+/*
+ * Batch rendering
+ * ---------------
+ *
+ * render_views() renders the scene from each of `cameras`, instead of its
+ * own camera, in a single parallel loop over the tiles of all the views:
+ * rather than idling while the last tiles of a view complete, threads go
+ * on with the next view. Images only exist while their tiles are being
+ * rendered: about one per thread at most. Each view comes out as render()
+ * would render it from its camera.
+ *
+ * `view_done` gets each image, `width` by `height`, once complete, from
+ * the rendering thread that completed it (others keep rendering), one
+ * call at a time. The image is freed after it returns. Screen bins (see
+ * screen-bins.h), the AO cache (see ao-cache.h) and adaptive rendering do
+ * not apply.
+ */
+typedef void (*view_done_fn)(size_t view, struct ppm *ppm, void *data);
+
+void render_views(struct scene *scene, const struct render_opts *opts,
+		  const struct camera *cameras, size_t nr_views,
+		  int width, int height, view_done_fn view_done, void *data);
+
+/* Prints the counters of a render of `nr_pixels` pixels to stderr. */
+void render_stats_print(const struct render_stats *stats,
+			const struct render_opts *opts, size_t nr_pixels);
+
+/*
+ * Progressive rendering
+ * ---------------------
+ *
+ * Instead of a single render, the image is rendered in passes, each with
+ * SAMPLES_PER_PIXEL samples per pixel at different positions, which are
+ * accumulated until the caller is satisfied with the result: the mean of
+ * the passes so far is a complete image at any time, and it gets less
+ * noisy as passes are added. Pass 0 samples like render() does.
+ *
+ * A pass is rendered in square tiles of ACCUMULATOR_TILE pixels, which
+ * are added to the sums as they complete, so that it can be interrupted
+ * and carried on later (see checkpoint.h). The samples of a pixel only
+ * depend on the pixel and the pass, so the result does not depend on how
+ * the passes were split.
+ */
+#define ACCUMULATOR_TILE 32
+
+struct accumulator {
+	unsigned rows, cols;
+	/* The passes done, not counting the one in progress. */
+	uint32_t passes;
+	/* The sum of the pass colors of each pixel. */
+	struct vec3 *sum;
+	/* And of their squared luminance, for the noise estimate. */
+	double *sum_sq;
+	/*
+	 * The tiles, row-major, and which of them the pass in progress has
+	 * added to the sums.
+	 */
+	unsigned tiles_w, tiles_h;
+	uint8_t *tile_done;
+	size_t nr_tiles_done;
+};
+
+void accumulator_init(struct accumulator *acc, unsigned rows, unsigned cols);
+void accumulator_release(struct accumulator *acc);
+
+/*
+ * Renders the tiles of the pass in progress that are not done yet into
+ * `acc`, adding their counters to `stats`. No tile is started after
+ * `deadline` (see now_seconds()), unless it is 0. Returns 1 if the pass
+ * is complete, or 0 if some of it is left for the next call. Adaptive
+ * rendering does not apply.
+ */
+int render_pass(struct scene *scene, struct accumulator *acc,
+		const struct render_opts *opts, struct render_stats *stats,
+		double deadline);
+
+/*
+ * These two only look at complete passes: they must not be called while
+ * a pass is in progress.
+ */
+
+/* Writes the mean of the passes to `ppm`, which must have the same size. */
+void accumulator_resolve(const struct accumulator *acc, struct ppm *ppm);
+
+/*
+ * Estimates the noise left in the image, as the standard error of the
+ * luminance of its pixels (from 0 to 1), averaged over the image. Returns
+ * INFINITY before the second pass.
+ */
+double accumulator_noise(const struct accumulator *acc);
@@ -0,0 +1,453 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "scene-file.h"
+#include "lib/array.h"
+#include "lib/hash.h"
+#include "lib/string-util.h"
+#include "lib/tempfile.h"
+#include "lib/wrappers.h"
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+struct payload {
+	uint32_t type, record_size;
+	const void *buf;
+	size_t nr;
+};
+
+static int write_payload(int fd, size_t *pos, size_t offset, const void *buf,
+			 size_t size)
+{
+	static const char zeros[SCENE_FILE_ALIGN];
+	if (offset < *pos)
+		BUG("scene file payloads out of order");
+	if (write_in_full(fd, zeros, offset - *pos) < 0 ||
+	    write_in_full(fd, buf, size) < 0)
+		return -1;
+	*pos = offset + size;
+	return 0;
+}
+
+int scene_file_write(const struct scene_file_data *data, const char *path)
+{
+	struct payload payloads[] = {
+		{ SCENE_SECTION_STRINGS, 1, data->strings, data->strings_size },
+		{ SCENE_SECTION_TEXTURES, sizeof(*data->textures),
+		  data->textures, data->nr_textures },
+		{ SCENE_SECTION_MATERIALS, sizeof(*data->materials),
+		  data->materials, data->nr_materials },
+		{ SCENE_SECTION_LIGHTS, sizeof(*data->lights),
+		  data->lights, data->nr_lights },
+		{ SCENE_SECTION_ENTITIES, sizeof(*data->entities),
+		  data->entities, data->nr_entities },
+		{ SCENE_SECTION_PROTOTYPES, sizeof(*data->prototypes),
+		  data->prototypes, data->nr_prototypes },
+		{ SCENE_SECTION_PROTO_ENTITIES, sizeof(*data->proto_entities),
+		  data->proto_entities, data->nr_proto_entities },
+		{ SCENE_SECTION_INSTANCES, sizeof(*data->instances),
+		  data->instances, data->nr_instances },
+		{ SCENE_SECTION_MESHES, sizeof(*data->meshes),
+		  data->meshes, data->nr_meshes },
+		{ SCENE_SECTION_MESH_FLOATS, sizeof(*data->mesh_floats),
+		  data->mesh_floats, data->nr_mesh_floats },
+		{ SCENE_SECTION_MESH_INDICES, sizeof(*data->mesh_indices),
+		  data->mesh_indices, data->nr_mesh_indices },
+		{ SCENE_SECTION_PARTICLE_SETS, sizeof(*data->particle_sets),
+		  data->particle_sets, data->nr_particle_sets },
+		{ SCENE_SECTION_PARTICLE_FLOATS, sizeof(*data->particle_floats),
+		  data->particle_floats, data->nr_particle_floats },
+		{ SCENE_SECTION_PARTICLE_RADII, sizeof(*data->particle_radii),
+		  data->particle_radii, data->nr_particles },
+		{ SCENE_SECTION_PARTICLE_COLORS, sizeof(*data->particle_colors),
+		  data->particle_colors, data->nr_particles },
+		{ SCENE_SECTION_HEIGHTFIELDS, sizeof(*data->heightfields),
+		  data->heightfields, data->nr_heightfields },
+		{ SCENE_SECTION_HEIGHTFIELD_FLOATS, sizeof(*data->heightfield_floats),
+		  data->heightfield_floats, data->nr_heightfield_floats },
+		{ SCENE_SECTION_HEIGHTFIELD_SAMPLES, sizeof(*data->heightfield_samples),
+		  data->heightfield_samples, data->nr_heightfield_samples },
+	};
+	struct scene_file_section sections[ARRAY_SIZE(payloads)];
+	struct scene_file_header header = {
+		.magic = SCENE_FILE_MAGIC,
+		.version = SCENE_FILE_VERSION,
+		.byte_order = SCENE_FILE_BYTE_ORDER,
+		.camera = data->camera,
+		.background = data->background,
+		.nr_sections = ARRAY_SIZE(payloads),
+	};
+	size_t offset = sizeof(header) + sizeof(sections);
+	uint64_t hash = HASH_INIT;
+
+	for (size_t i = 0; i < ARRAY_SIZE(payloads); i++) {
+		offset = ALIGN_UP(offset, SCENE_FILE_ALIGN);
+		sections[i].type = payloads[i].type;
+		sections[i].record_size = payloads[i].record_size;
+		sections[i].offset = offset;
+		sections[i].nr = payloads[i].nr;
+		offset += st_mult(payloads[i].record_size, payloads[i].nr);
+	}
+
+	hash = hash_update(hash, &header.camera, sizeof(header.camera));
+	hash = hash_update(hash, &header.background, sizeof(header.background));
+	hash = hash_update(hash, sections, sizeof(sections));
+	for (size_t i = 0; i < ARRAY_SIZE(payloads); i++)
+		hash = hash_update(hash, payloads[i].buf,
+				   payloads[i].record_size * payloads[i].nr);
+	header.content_hash = hash_final(hash);
+
+	char *template = xmkstr("%s.XXXXXX", path);
+	struct tempfile *tempfile = mktempfile_m(template, 0666);
+	free(template);
+	if (!tempfile)
+		return error_errno("failed to create temporary file for '%s'", path);
+
+	int fd = get_tempfile_fd(tempfile);
+	size_t pos = 0;
+	if (write_payload(fd, &pos, 0, &header, sizeof(header)) ||
+	    write_payload(fd, &pos, pos, sections, sizeof(sections)))
+		goto fail;
+	for (size_t i = 0; i < ARRAY_SIZE(payloads); i++) {
+		if (write_payload(fd, &pos, sections[i].offset, payloads[i].buf,
+				  payloads[i].record_size * payloads[i].nr))
+			goto fail;
+	}
+
+	if (rename_tempfile(&tempfile, path))
+		return error_errno("failed to rename scene file to '%s'", path);
+	return 0;
+
+fail:
+	error_errno("failed to write scene file '%s'", path);
+	delete_tempfile(&tempfile);
+	return -1;
+}
+
+static const void *find_section(const char *map, size_t map_size,
+				const struct scene_file_section *sections,
+				uint32_t nr_sections, uint32_t type,
+				uint32_t record_size, size_t *nr,
+				const char *path)
+{
+	for (uint32_t i = 0; i < nr_sections; i++) {
+		const struct scene_file_section *s = &sections[i];
+		if (s->type != type)
+			continue;
+		if (s->record_size != record_size)
+			die("scene file '%s': section %u has records of %u bytes, expected %u",
+			    path, type, s->record_size, record_size);
+		if (s->offset % SCENE_FILE_ALIGN || s->offset > map_size ||
+		    unsigned_mult_overflows(s->nr, (uint64_t)record_size) ||
+		    s->nr * record_size > map_size - s->offset)
+			die("scene file '%s': section %u is out of bounds", path, type);
+		*nr = s->nr;
+		return map + s->offset;
+	}
+	*nr = 0;
+	return NULL;
+}
+
+/*
+ * Checks the indices of an entity used in place from the file, which
+ * check_entity() in scene.c does for entities added to a scene.
+ */
+static void check_file_entity(const struct scene *scene, const struct entity *e,
+			      const char *path, const char *what, size_t i)
+{
+	const char *kind = NULL;
+	uint32_t index = 0;
+	size_t nr = 0;
+
+	switch (e->type) {
+	case ENT_SPHERE:
+	case ENT_PLANE:
+		break;
+	case ENT_INSTANCE:
+		kind = "instance";
+		index = e->u.instance;
+		nr = scene->nr_instances;
+		break;
+	case ENT_MESH:
+		kind = "mesh";
+		index = e->u.mesh;
+		nr = scene->nr_meshes;
+		break;
+	case ENT_PARTICLES:
+		kind = "particle set";
+		index = e->u.particles;
+		nr = scene->nr_particle_sets;
+		break;
+	case ENT_HEIGHTFIELD:
+		kind = "heightfield";
+		index = e->u.heightfield;
+		nr = scene->nr_heightfields;
+		break;
+	default:
+		die("scene file '%s': %s %zu has unknown type %d", path, what,
+		    i, e->type);
+	}
+	if (kind && index >= nr)
+		die("scene file '%s': %s %zu references unknown %s %u", path,
+		    what, i, kind, index);
+	if (e->type == ENT_INSTANCE && e->material == ENTITY_NO_MATERIAL)
+		return;
+	if (e->material >= scene->nr_materials)
+		die("scene file '%s': %s %zu references unknown material %u",
+		    path, what, i, e->material);
+	if (scene->materials[e->material].texture &&
+	    !scene_entity_takes_texture(scene, e))
+		die("scene file '%s': %s %zu has a texture, but only spheres and heightfields can be textured",
+		    path, what, i);
+}
+
+void scene_file_load(struct scene *scene, const char *path)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die_errno("failed to open scene file '%s'", path);
+	if (fstat(fd, &st))
+		die_errno("failed to stat scene file '%s'", path);
+	if (st.st_size < sizeof(struct scene_file_header))
+		die("scene file '%s' is too small", path);
+
+	/*
+	 * A private writable mapping lets callers modify entities in place
+	 * (copy-on-write) without ever touching the file.
+	 */
+	size_t map_size = st.st_size;
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED)
+		die_errno("failed to mmap scene file '%s'", path);
+	close(fd);
+
+	const struct scene_file_header *header = (void *)map;
+	if (memcmp(header->magic, SCENE_FILE_MAGIC, sizeof(header->magic)))
+		die("'%s' is not a scene file", path);
+	if (header->byte_order != SCENE_FILE_BYTE_ORDER)
+		die("scene file '%s' was written with a different byte order", path);
+	if (header->version != SCENE_FILE_VERSION)
+		die("scene file '%s' has version %u, expected %u (re-run scene2bin)",
+		    path, header->version, SCENE_FILE_VERSION);
+	if (header->nr_sections > (map_size - sizeof(*header)) /
+				  sizeof(struct scene_file_section))
+		die("scene file '%s' is truncated", path);
+	const struct scene_file_section *sections = (void *)(header + 1);
+
+	size_t strings_size, nr_textures, nr_materials, nr_lights, nr_entities;
+	size_t nr_prototypes, nr_proto_entities, nr_instances;
+	size_t nr_meshes, nr_mesh_floats, nr_mesh_indices;
+	size_t nr_particle_sets, nr_particle_floats, nr_radii, nr_colors;
+	size_t nr_heightfields, nr_heightfield_floats, nr_heightfield_samples;
+#define SECTION(type, rec, nr) \
+	find_section(map, map_size, sections, header->nr_sections, \
+		     (type), sizeof(rec), (nr), path)
+	const char *strings = SECTION(SCENE_SECTION_STRINGS, char, &strings_size);
+	const struct scene_file_texture *file_textures =
+		SECTION(SCENE_SECTION_TEXTURES, struct scene_file_texture, &nr_textures);
+	const struct scene_file_material *file_materials =
+		SECTION(SCENE_SECTION_MATERIALS, struct scene_file_material, &nr_materials);
+	const struct light *lights = SECTION(SCENE_SECTION_LIGHTS, struct light, &nr_lights);
+	struct entity *entities =
+		(struct entity *)SECTION(SCENE_SECTION_ENTITIES, struct entity, &nr_entities);
+	const struct scene_file_prototype *prototypes =
+		SECTION(SCENE_SECTION_PROTOTYPES, struct scene_file_prototype,
+			&nr_prototypes);
+	struct entity *proto_entities =
+		(struct entity *)SECTION(SCENE_SECTION_PROTO_ENTITIES, struct entity,
+					 &nr_proto_entities);
+	struct instance *instances =
+		(struct instance *)SECTION(SCENE_SECTION_INSTANCES, struct instance,
+					   &nr_instances);
+	const struct scene_file_mesh *meshes =
+		SECTION(SCENE_SECTION_MESHES, struct scene_file_mesh, &nr_meshes);
+	float *mesh_floats =
+		(float *)SECTION(SCENE_SECTION_MESH_FLOATS, float, &nr_mesh_floats);
+	uint32_t *mesh_indices =
+		(uint32_t *)SECTION(SCENE_SECTION_MESH_INDICES, uint32_t,
+				    &nr_mesh_indices);
+	const struct scene_file_particles *particle_sets =
+		SECTION(SCENE_SECTION_PARTICLE_SETS, struct scene_file_particles,
+			&nr_particle_sets);
+	float *particle_floats =
+		(float *)SECTION(SCENE_SECTION_PARTICLE_FLOATS, float,
+				 &nr_particle_floats);
+	uint16_t *particle_radii =
+		(uint16_t *)SECTION(SCENE_SECTION_PARTICLE_RADII, uint16_t, &nr_radii);
+	uint8_t *particle_colors =
+		(uint8_t *)SECTION(SCENE_SECTION_PARTICLE_COLORS, uint8_t, &nr_colors);
+	const struct scene_file_heightfield *heightfields =
+		SECTION(SCENE_SECTION_HEIGHTFIELDS, struct scene_file_heightfield,
+			&nr_heightfields);
+	float *heightfield_floats =
+		(float *)SECTION(SCENE_SECTION_HEIGHTFIELD_FLOATS, float,
+				 &nr_heightfield_floats);
+	uint16_t *heightfield_samples =
+		(uint16_t *)SECTION(SCENE_SECTION_HEIGHTFIELD_SAMPLES, uint16_t,
+				    &nr_heightfield_samples);
+#undef SECTION
+
+	struct texture **textures;
+	ALLOC_ARRAY(textures, nr_textures);
+	for (size_t i = 0; i < nr_textures; i++) {
+		const struct scene_file_texture *t = &file_textures[i];
+		if (t->name >= strings_size ||
+		    !memchr(strings + t->name, '\0', strings_size - t->name))
+			die("scene file '%s': bad name for texture %zu", path, i);
+		struct texture_opts opts = {
+			.invert_X = t->invert_X,
+			.invert_Y = t->invert_Y,
+			.rotate_X = t->rotate_X,
+		};
+		textures[i] = load_texture(strings + t->name, &opts);
+	}
+
+	for (size_t i = 0; i < nr_materials; i++) {
+		const struct scene_file_material *m = &file_materials[i];
+		if (m->texture >= (int64_t)nr_textures)
+			die("scene file '%s': material %zu references unknown texture %d",
+			    path, i, m->texture);
+		scene_add_material(scene, (struct material){
+			.color = m->color,
+			.texture = m->texture < 0 ? NULL : textures[m->texture],
+			.shininess = m->shininess,
+			.reflectiveness = m->reflectiveness,
+			.diffuse_constant = m->diffuse_constant,
+			.specular_constant = m->specular_constant,
+		});
+	}
+
+	for (size_t i = 0; i < nr_lights; i++)
+		scene_add_light(scene, lights[i]);
+
+	if (header->background >= (int64_t)nr_textures)
+		die("scene file '%s': unknown background texture %d", path,
+		    header->background);
+	scene->background = header->background < 0 ? NULL :
+			    textures[header->background];
+	scene->camera = header->camera;
+	scene->content_hash = header->content_hash;
+
+	for (size_t i = 0; i < nr_prototypes; i++) {
+		const struct scene_file_prototype *p = &prototypes[i];
+		if (!p->nr || p->first > nr_proto_entities ||
+		    p->nr > nr_proto_entities - p->first)
+			die("scene file '%s': prototype %zu is out of bounds", path, i);
+		ALLOC_GROW(scene->prototypes, scene->nr_prototypes + 1,
+			   scene->alloc_prototypes);
+		scene->prototypes[scene->nr_prototypes++] = (struct prototype){
+			.first = p->first,
+			.nr = p->nr,
+		};
+	}
+
+	for (size_t i = 0; i < nr_meshes; i++) {
+		const struct scene_file_mesh *fm = &meshes[i];
+		uint64_t floats = (uint64_t)fm->nr_vertices * (fm->has_normals ? 6 : 3);
+		struct mesh m = {
+			.nr_vertices = fm->nr_vertices,
+			.nr_triangles = fm->nr_triangles,
+		};
+		if (!fm->nr_triangles || fm->vertices > nr_mesh_floats ||
+		    floats > nr_mesh_floats - fm->vertices ||
+		    fm->triangles > nr_mesh_indices / 3 ||
+		    fm->nr_triangles > nr_mesh_indices / 3 - fm->triangles)
+			die("scene file '%s': mesh %zu is out of bounds", path, i);
+		m.x = mesh_floats + fm->vertices;
+		m.y = m.x + fm->nr_vertices;
+		m.z = m.y + fm->nr_vertices;
+		if (fm->has_normals) {
+			m.nx = m.z + fm->nr_vertices;
+			m.ny = m.nx + fm->nr_vertices;
+			m.nz = m.ny + fm->nr_vertices;
+		}
+		m.tris = (void *)(mesh_indices + 3 * fm->triangles);
+		for (size_t t = 0; t < m.nr_triangles; t++)
+			for (int k = 0; k < 3; k++)
+				if (m.tris[t][k] >= m.nr_vertices)
+					die("scene file '%s': triangle %zu of mesh %zu references unknown vertex %u",
+					    path, t, i, m.tris[t][k]);
+		scene_add_mesh(scene, &m);
+	}
+
+	if (nr_radii != nr_colors)
+		die("scene file '%s': particle sections disagree", path);
+	for (size_t i = 0; i < nr_particle_sets; i++) {
+		const struct scene_file_particles *fp = &particle_sets[i];
+		uint64_t floats = 3 * ((uint64_t)fp->nr + fp->nr_colors);
+		struct particles p = {
+			.nr = fp->nr,
+			.nr_colors = fp->nr_colors,
+			.radius_scale = fp->radius_scale,
+		};
+		if (fp->centers > nr_particle_floats ||
+		    floats > nr_particle_floats - fp->centers ||
+		    fp->first > nr_radii || fp->nr > nr_radii - fp->first)
+			die("scene file '%s': particle set %zu is out of bounds",
+			    path, i);
+		p.x = particle_floats + fp->centers;
+		p.y = p.x + fp->nr;
+		p.z = p.y + fp->nr;
+		p.palette = (struct vec3 *)(p.z + fp->nr);
+		p.radius = particle_radii + fp->first;
+		p.color = particle_colors + fp->first;
+		scene_add_particles(scene, &p);
+	}
+
+	for (size_t i = 0; i < nr_heightfields; i++) {
+		const struct scene_file_heightfield *fh = &heightfields[i];
+		uint64_t nr = (uint64_t)fh->nx * fh->nz;
+		size_t avail = fh->bits16 ? nr_heightfield_samples : nr_heightfield_floats;
+		struct heightfield hf = {
+			.nx = fh->nx,
+			.nz = fh->nz,
+			.origin = fh->origin,
+			.cell_x = fh->cell_x,
+			.cell_z = fh->cell_z,
+			.height_scale = fh->height_scale,
+		};
+		if (fh->first > avail || nr > avail - fh->first)
+			die("scene file '%s': heightfield %zu is out of bounds", path, i);
+		if (fh->bits16)
+			hf.heights16 = heightfield_samples + fh->first;
+		else
+			hf.heights = heightfield_floats + fh->first;
+		scene_add_heightfield(scene, &hf);
+	}
+
+	/*
+	 * The entities, instances, meshes, particles and heightfields are
+	 * used in place.
+	 */
+	scene->entities = entities;
+	scene->nr_entities = nr_entities;
+	scene->alloc_entities = 0;
+	scene->proto_entities = proto_entities;
+	scene->nr_proto_entities = nr_proto_entities;
+	scene->alloc_proto_entities = 0;
+	scene->instances = instances;
+	scene->nr_instances = nr_instances;
+	scene->alloc_instances = 0;
+	scene->map = map;
+	scene->map_size = map_size;
+
+	/* Instances are checked against their prototype's entities. */
+	for (size_t i = 0; i < nr_proto_entities; i++) {
+		if (proto_entities[i].type == ENT_PLANE ||
+		    proto_entities[i].type == ENT_INSTANCE)
+			die("scene file '%s': prototype entity %zu is a plane or an instance",
+			    path, i);
+		check_file_entity(scene, &proto_entities[i], path,
+				  "prototype entity", i);
+	}
+	for (size_t i = 0; i < nr_instances; i++)
+		if (instances[i].prototype >= scene->nr_prototypes)
+			die("scene file '%s': instance %zu references unknown prototype %u",
+			    path, i, instances[i].prototype);
+	for (size_t i = 0; i < nr_entities; i++)
+		check_file_entity(scene, &entities[i], path, "entity", i);
+
+	free(textures);
+}
@@ -0,0 +1,186 @@
+#pragma once
+
+#include <stdint.h>
+#include "scene.h"
+
+/*
+ * Binary scene files
+ * ------------------
+ *
+ * A scene file is laid out as:
+ *
+ *   struct scene_file_header
+ *   struct scene_file_section[header.nr_sections]
+ *   section payloads, each aligned to SCENE_FILE_ALIGN bytes
+ *
+ * Every section is an array of fixed-size records. Entities are stored
+ * exactly as `struct entity`, so loading a scene amounts to mmap()ing the
+ * file and pointing `scene->entities` at the entity section: there is no
+ * per-entity parsing, only a pass checking the indices of the entities,
+ * instances, triangles and particle colors, whose cost is dominated by
+ * the page faults as they are first touched. Only the (small) string,
+ * texture, material and light sections are copied out.
+ *
+ * Files are written in the native byte order and record layout; the header
+ * stores a byte order mark and each section its record size, so that a
+ * mismatching file is rejected instead of misread. SCENE_FILE_VERSION must
+ * be bumped whenever an existing record layout changes. New section types
+ * may be added without a version bump: readers ignore unknown types.
+ *
+ * Scene files are produced by the tools/scene2bin converter, from the text
+ * format described in README.md.
+ */
+
+#define SCENE_FILE_MAGIC "RTSCENE"
+#define SCENE_FILE_VERSION 1
+#define SCENE_FILE_BYTE_ORDER 0x01020304
+#define SCENE_FILE_ALIGN 64
+
+enum scene_section_type {
+	SCENE_SECTION_STRINGS,   /* char: NUL-terminated strings */
+	SCENE_SECTION_TEXTURES,  /* struct scene_file_texture */
+	SCENE_SECTION_MATERIALS, /* struct scene_file_material */
+	SCENE_SECTION_LIGHTS,    /* struct light */
+	SCENE_SECTION_ENTITIES,  /* struct entity */
+	SCENE_SECTION_PROTOTYPES, /* struct scene_file_prototype */
+	SCENE_SECTION_PROTO_ENTITIES, /* struct entity */
+	SCENE_SECTION_INSTANCES, /* struct instance */
+	SCENE_SECTION_MESHES,    /* struct scene_file_mesh */
+	SCENE_SECTION_MESH_FLOATS, /* float: mesh vertex attributes */
+	SCENE_SECTION_MESH_INDICES, /* uint32_t: mesh triangles */
+	SCENE_SECTION_PARTICLE_SETS, /* struct scene_file_particles */
+	SCENE_SECTION_PARTICLE_FLOATS, /* float: centers and palettes */
+	SCENE_SECTION_PARTICLE_RADII, /* uint16_t */
+	SCENE_SECTION_PARTICLE_COLORS, /* uint8_t */
+	SCENE_SECTION_HEIGHTFIELDS, /* struct scene_file_heightfield */
+	SCENE_SECTION_HEIGHTFIELD_FLOATS, /* float: heights */
+	SCENE_SECTION_HEIGHTFIELD_SAMPLES, /* uint16_t: 16-bit heights */
+};
+
+struct scene_file_section {
+	uint32_t type, record_size;
+	uint64_t offset, nr;
+};
+
+struct scene_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	/* Hash of everything that follows the header (see lib/hash.h). */
+	uint64_t content_hash;
+	struct camera camera;
+	int32_t background; /* texture index, or -1 for none */
+	uint32_t nr_sections;
+};
+
+struct scene_file_texture {
+	uint32_t name; /* offset into the string section */
+	int32_t rotate_X;
+	uint8_t invert_X, invert_Y;
+	uint8_t pad[2];
+};
+
+struct scene_file_material {
+	struct vec3 color;
+	int32_t texture; /* texture index, or -1 for none */
+	float shininess, reflectiveness;
+	float diffuse_constant, specular_constant;
+};
+
+struct scene_file_prototype {
+	uint32_t first, nr; /* range of the prototype entity section */
+};
+
+/*
+ * A mesh's x, y and z arrays (and nx, ny and nz, if it has normals) are
+ * stored one after the other, starting at float `vertices` of the float
+ * section. Its triangles start at index `3 * triangles` of the index
+ * section. Meshes are used in place, like entities.
+ */
+struct scene_file_mesh {
+	uint64_t vertices, triangles;
+	uint32_t nr_vertices, nr_triangles;
+	uint32_t has_normals;
+	uint32_t pad;
+};
+
+/*
+ * A particle set's x, y and z arrays start at float `centers` of the
+ * particle float section, followed by its palette (`nr_colors` r, g, b
+ * triples). Its radii and colors start at index `first` of their
+ * sections. The particles must be sorted (see particles_sort()) and are
+ * used in place.
+ */
+struct scene_file_particles {
+	uint64_t centers, first;
+	uint32_t nr, nr_colors;
+	float radius_scale;
+	uint32_t pad;
+};
+
+/*
+ * A heightfield's nx * nz heights start at index `first` of the float
+ * section, or of the 16-bit sample section if `bits16` is set. They are
+ * used in place.
+ */
+struct scene_file_heightfield {
+	uint64_t first;
+	uint32_t nx, nz;
+	struct vec3 origin;
+	float cell_x, cell_z, height_scale;
+	uint32_t bits16;
+	uint32_t pad;
+};
+
+/* The contents of a scene file, as taken by scene_file_write(). */
+struct scene_file_data {
+	struct camera camera;
+	int32_t background;
+	const char *strings;
+	size_t strings_size;
+	const struct scene_file_texture *textures;
+	size_t nr_textures;
+	const struct scene_file_material *materials;
+	size_t nr_materials;
+	const struct light *lights;
+	size_t nr_lights;
+	const struct entity *entities;
+	size_t nr_entities;
+	const struct scene_file_prototype *prototypes;
+	size_t nr_prototypes;
+	const struct entity *proto_entities;
+	size_t nr_proto_entities;
+	const struct instance *instances;
+	size_t nr_instances;
+	const struct scene_file_mesh *meshes;
+	size_t nr_meshes;
+	const float *mesh_floats;
+	size_t nr_mesh_floats;
+	const uint32_t *mesh_indices;
+	size_t nr_mesh_indices;
+	const struct scene_file_particles *particle_sets;
+	size_t nr_particle_sets;
+	const float *particle_floats;
+	size_t nr_particle_floats;
+	const uint16_t *particle_radii;
+	const uint8_t *particle_colors;
+	size_t nr_particles;
+	const struct scene_file_heightfield *heightfields;
+	size_t nr_heightfields;
+	const float *heightfield_floats;
+	size_t nr_heightfield_floats;
+	const uint16_t *heightfield_samples;
+	size_t nr_heightfield_samples;
+};
+
+/*
+ * Atomically write a scene file at `path`. Returns 0 on success or -1 on
+ * failure (with an error message already printed).
+ */
+int scene_file_write(const struct scene_file_data *data, const char *path);
+
+/*
+ * Load the scene file at `path` into `scene`, which must be empty
+ * (SCENE_INIT). The referenced textures are loaded as well. Dies on error.
+ */
+void scene_file_load(struct scene *scene, const char *path);
@@ -0,0 +1,222 @@
+#include <sys/mman.h>
+#include "scene.h"
+#include "lib/array.h"
+
+uint32_t scene_add_material(struct scene *scene, struct material material)
+{
+	ALLOC_GROW(scene->materials, scene->nr_materials + 1, scene->alloc_materials);
+	scene->materials[scene->nr_materials] = material;
+	return scene->nr_materials++;
+}
+
+static void check_entity(struct scene *scene, struct entity *entity)
+{
+	if (entity->type == ENT_MESH && entity->u.mesh >= scene->nr_meshes)
+		die("entity references unknown mesh %u", entity->u.mesh);
+	if (entity->type == ENT_PARTICLES &&
+	    entity->u.particles >= scene->nr_particle_sets)
+		die("entity references unknown particle set %u",
+		    entity->u.particles);
+	if (entity->type == ENT_HEIGHTFIELD &&
+	    entity->u.heightfield >= scene->nr_heightfields)
+		die("entity references unknown heightfield %u",
+		    entity->u.heightfield);
+	if (entity->type == ENT_INSTANCE) {
+		if (entity->u.instance >= scene->nr_instances)
+			die("entity references unknown instance %u",
+			    entity->u.instance);
+		if (entity->material == ENTITY_NO_MATERIAL)
+			return;
+	}
+	if (entity->material >= scene->nr_materials)
+		die("entity references unknown material %u", entity->material);
+	if (scene->materials[entity->material].texture &&
+	    !scene_entity_takes_texture(scene, entity))
+		die("only spheres and heightfields can be textured");
+	if (entity->type == ENT_PLANE)
+		vec3_normalize_inplace(entity->u.p.normal);
+}
+
+void scene_add_entity(struct scene *scene, struct entity entity)
+{
+	if (scene->map)
+		BUG("cannot add entities to a memory-mapped scene");
+	check_entity(scene, &entity);
+	ALLOC_GROW(scene->entities, scene->nr_entities + 1, scene->alloc_entities);
+	scene->entities[scene->nr_entities++] = entity;
+}
+
+void scene_add_light(struct scene *scene, struct light light)
+{
+	ALLOC_GROW(scene->lights, scene->nr_lights + 1, scene->alloc_lights);
+	scene->lights[scene->nr_lights++] = light;
+}
+
+uint32_t scene_add_prototype(struct scene *scene, const struct entity *entities,
+			     size_t nr)
+{
+	if (scene->map)
+		BUG("cannot add prototypes to a memory-mapped scene");
+	if (!nr)
+		die("empty prototype");
+	if (scene->nr_proto_entities + nr > UINT32_MAX)
+		die("too many prototype entities");
+
+	struct prototype p = { .first = scene->nr_proto_entities, .nr = nr };
+	ALLOC_GROW(scene->proto_entities, scene->nr_proto_entities + nr,
+		   scene->alloc_proto_entities);
+	for (size_t i = 0; i < nr; i++) {
+		struct entity e = entities[i];
+		if (e.type == ENT_PLANE || e.type == ENT_INSTANCE)
+			die("prototypes may only contain bounded, non-instance entities");
+		check_entity(scene, &e);
+		scene->proto_entities[scene->nr_proto_entities++] = e;
+	}
+
+	ALLOC_GROW(scene->prototypes, scene->nr_prototypes + 1,
+		   scene->alloc_prototypes);
+	scene->prototypes[scene->nr_prototypes] = p;
+	return scene->nr_prototypes++;
+}
+
+void scene_add_instance(struct scene *scene, uint32_t prototype,
+			struct affine to_world, uint32_t material)
+{
+	struct instance inst = { .to_world = to_world, .prototype = prototype };
+	if (prototype >= scene->nr_prototypes)
+		die("instance references unknown prototype %u", prototype);
+	if (affine_invert(&to_world, &inst.to_object))
+		die("instance transform is singular");
+	ALLOC_GROW(scene->instances, scene->nr_instances + 1, scene->alloc_instances);
+	scene->instances[scene->nr_instances++] = inst;
+	scene_add_entity(scene, ENTITY_INSTANCE(scene->nr_instances - 1, material));
+}
+
+uint32_t scene_add_mesh(struct scene *scene, struct mesh *mesh)
+{
+	ALLOC_GROW(scene->meshes, scene->nr_meshes + 1, scene->alloc_meshes);
+	scene->meshes[scene->nr_meshes] = *mesh;
+	return scene->nr_meshes++;
+}
+
+uint32_t scene_add_particles(struct scene *scene, struct particles *p)
+{
+	if (!p->nr)
+		die("empty particle set");
+	if (p->nr_colors > PARTICLE_MAX_COLORS)
+		die("particle sets may have at most %d colors", PARTICLE_MAX_COLORS);
+	for (uint32_t i = 0; p->nr_colors && i < p->nr; i++)
+		if (p->color[i] >= p->nr_colors)
+			die("particle %u has color %u, but its set has %u colors",
+			    i, p->color[i], p->nr_colors);
+	ALLOC_GROW(scene->particle_sets, scene->nr_particle_sets + 1,
+		   scene->alloc_particle_sets);
+	scene->particle_sets[scene->nr_particle_sets] = *p;
+	return scene->nr_particle_sets++;
+}
+
+uint32_t scene_add_heightfield(struct scene *scene, struct heightfield *hf)
+{
+	if (hf->nx < 2 || hf->nz < 2)
+		die("heightfields need at least 2 by 2 samples");
+	if (!(hf->cell_x > 0) || !(hf->cell_z > 0))
+		die("heightfield cells must have a positive size");
+	ALLOC_GROW(scene->heightfields, scene->nr_heightfields + 1,
+		   scene->alloc_heightfields);
+	scene->heightfields[scene->nr_heightfields] = *hf;
+	return scene->nr_heightfields++;
+}
+
+int scene_entity_bounds(const struct scene *scene, const struct entity *e,
+			struct aabb *b)
+{
+	if (e->type == ENT_PARTICLES) {
+		*b = scene->particle_sets[e->u.particles].bounds;
+		return 1;
+	}
+	if (e->type == ENT_MESH) {
+		*b = scene->meshes[e->u.mesh].bounds;
+		return 1;
+	}
+	if (e->type == ENT_HEIGHTFIELD) {
+		*b = scene->heightfields[e->u.heightfield].bounds;
+		return 1;
+	}
+	if (e->type == ENT_INSTANCE) {
+		const struct instance *inst = &scene->instances[e->u.instance];
+		*b = affine_aabb(&inst->to_world,
+				 scene->prototypes[inst->prototype].bounds);
+		return 1;
+	}
+	return entity_bounds(e, b);
+}
+
+int scene_entity_takes_texture(const struct scene *scene, const struct entity *e)
+{
+	if (e->type == ENT_INSTANCE) {
+		const struct instance *inst = &scene->instances[e->u.instance];
+		const struct prototype *p = &scene->prototypes[inst->prototype];
+		for (uint32_t i = 0; i < p->nr; i++)
+			if (!scene_entity_takes_texture(scene,
+							&scene->proto_entities[p->first + i]))
+				return 0;
+		return 1;
+	}
+	return e->type == ENT_SPHERE || e->type == ENT_HEIGHTFIELD;
+}
+
+struct vec3 intersection_base_color(struct scene *scene,
+				    const struct intersection *it,
+				    const struct material *material)
+{
+	if (it->entity->type == ENT_PARTICLES) {
+		const struct particles *p = &scene->particle_sets[it->entity->u.particles];
+		if (p->nr_colors)
+			return p->palette[p->color[it->prim]];
+	}
+	if (material->texture && it->entity->type == ENT_HEIGHTFIELD)
+		return heightfield_lookup_texture(
+			&scene->heightfields[it->entity->u.heightfield],
+			material->texture, intersection_local_pos(scene, it));
+	if (material->texture)
+		return entity_lookup_texture(it->entity, material->texture,
+					     intersection_local_pos(scene, it));
+	return material->color;
+}
+
+void scene_destroy(struct scene *scene)
+{
+	if (scene->alloc_entities)
+		free(scene->entities);
+	if (scene->alloc_proto_entities)
+		free(scene->proto_entities);
+	if (scene->alloc_instances)
+		free(scene->instances);
+	for (size_t i = 0; i < scene->nr_prototypes; i++)
+		bvh_destroy(&scene->prototypes[i].bvh);
+	free(scene->prototypes);
+	for (size_t i = 0; i < scene->nr_meshes; i++)
+		mesh_destroy(&scene->meshes[i]);
+	free(scene->meshes);
+	for (size_t i = 0; i < scene->nr_particle_sets; i++)
+		particles_destroy(&scene->particle_sets[i]);
+	free(scene->particle_sets);
+	for (size_t i = 0; i < scene->nr_heightfields; i++)
+		heightfield_destroy(&scene->heightfields[i]);
+	free(scene->heightfields);
+	free(scene->materials);
+	free(scene->lights);
+	light_sampler_destroy(&scene->light_sampler);
+	shadow_maps_destroy(&scene->shadow_maps);
+	ao_cache_destroy(&scene->ao_cache);
+	screen_bins_destroy(&scene->screen_bins);
+	if (!scene->bvh.mapped)
+		free(scene->unbounded);
+	free(scene->entity_leaves);
+	bvh_destroy(&scene->bvh);
+	if (scene->accel_map && munmap(scene->accel_map, scene->accel_map_size))
+		error_errno("failed to unmap BVH cache");
+	if (scene->map && munmap(scene->map, scene->map_size))
+		error_errno("failed to unmap scene");
+	memset(scene, 0, sizeof(*scene));
+}
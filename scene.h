@@ -0,0 +1,231 @@
+#pragma once
+
+#include <stddef.h>
+#include "entities/entities.h"
+#include "affine.h"
+#include "texture.h"
+#include "lights.h"
+#include "shadow-maps.h"
+#include "ao-cache.h"
+#include "screen-bins.h"
+#include "config.h"
+
+/*
+ * The camera looks from `pos` towards `dir`, and `up` gives the vertical
+ * orientation of the viewport. The viewport is a 2 by (2 / ASPECT_RATIO)
+ * plane (in world coordinates) at `viewpoint_dist` units in front of the
+ * camera, so `viewpoint_dist` indirectly defines the field of view.
+ */
+struct camera {
+	struct vec3 pos, dir, up;
+	float viewpoint_dist;
+};
+
+#define CAMERA_INIT { .pos = {0, 0, 0}, .dir = {0, 0, 1}, .up = {0, 1, 0}, \
+		      .viewpoint_dist = VIEWPOINT_DIST }
+
+/* An orthonormal basis derived from a camera, ready for ray generation. */
+struct camera_frame {
+	struct vec3 pos, right, up, fwd;
+	float viewpoint_dist;
+};
+
+static inline struct camera_frame camera_frame(const struct camera *c)
+{
+	struct camera_frame f;
+	f.pos = c->pos;
+	f.fwd = vec3_normalize(c->dir);
+	f.right = vec3_normalize(vec3_cross(c->up, f.fwd));
+	f.up = vec3_cross(f.fwd, f.right);
+	f.viewpoint_dist = c->viewpoint_dist;
+	return f;
+}
+
+/* Returns the ray passing through the viewport coordinates (x, y). */
+static inline struct ray camera_ray(const struct camera_frame *f, float x, float y)
+{
+	struct vec3 offset = vec3_add(vec3_smul(f->right, x), vec3_smul(f->up, y));
+#if CAN_PROJ_ORTO == 1
+	return ray_new(vec3_add(f->pos, offset), f->fwd);
+#else
+	return ray_new(f->pos, vec3_add(offset, vec3_smul(f->fwd, f->viewpoint_dist)));
+#endif
+}
+
+/*
+ * A prototype is a group of entities that is only rendered through
+ * instances, each placing it with its own transform. Its entities are
+ * scene->proto_entities[first, first + nr), and its BVH (built by
+ * scene_prepare_accel()) refers to them relative to `first`. Prototypes
+ * may only contain bounded entities, and cannot contain instances.
+ */
+struct prototype {
+	uint32_t first, nr;
+	/* In object space. Set along with the BVH. */
+	struct aabb bounds;
+	struct bvh bvh;
+};
+
+struct instance {
+	/* Object to world space, and its inverse. */
+	struct affine to_world, to_object;
+	uint32_t prototype;
+};
+
+struct scene {
+	/*
+	 * When the scene is loaded from a file, `entities` points directly
+	 * into the file mapping and `alloc_entities` is 0.
+	 */
+	struct entity *entities;
+	size_t nr_entities, alloc_entities;
+
+	struct material *materials;
+	size_t nr_materials, alloc_materials;
+
+	struct light *lights;
+	size_t nr_lights, alloc_lights;
+	/* Set by scene_prepare_lights(). */
+	struct light_sampler light_sampler;
+	/* Set by scene_prepare_shadow_maps(). */
+	struct shadow_maps shadow_maps;
+	/* Set by scene_prepare_ao(). */
+	struct ao_cache ao_cache;
+	/* Set by scene_prepare_screen_bins(). */
+	struct screen_bins screen_bins;
+
+	/*
+	 * Instancing. Like `entities`, `proto_entities` and `instances` may
+	 * point into the scene file mapping.
+	 */
+	struct prototype *prototypes;
+	size_t nr_prototypes, alloc_prototypes;
+	struct entity *proto_entities;
+	size_t nr_proto_entities, alloc_proto_entities;
+	struct instance *instances;
+	size_t nr_instances, alloc_instances;
+
+	struct mesh *meshes;
+	size_t nr_meshes, alloc_meshes;
+	struct particles *particle_sets;
+	size_t nr_particle_sets, alloc_particle_sets;
+	struct heightfield *heightfields;
+	size_t nr_heightfields, alloc_heightfields;
+
+	/* Environment map. May be NULL, in which case the background is black. */
+	struct texture *background;
+	struct camera camera;
+
+	/*
+	 * Acceleration structure (see accel.h): a BVH whose primitive
+	 * indices refer to `entities`, plus the unbounded entities, which
+	 * are tested separately.
+	 */
+	struct bvh bvh;
+	uint32_t *unbounded;
+	uint32_t nr_unbounded;
+	/*
+	 * The BVH leaf holding each entity, or BVH_NO_LEAF for the unbounded
+	 * ones (see cast_shadow_ray()).
+	 */
+	uint32_t *entity_leaves;
+	/* The BVH cache mapping, if the structure was loaded from it. */
+	void *accel_map;
+	size_t accel_map_size;
+
+	/* From the scene file header; 0 for scenes built in memory. */
+	uint64_t content_hash;
+	void *map;
+	size_t map_size;
+};
+
+#define SCENE_INIT { .camera = CAMERA_INIT }
+
+/* Returns the index of the new material. */
+uint32_t scene_add_material(struct scene *scene, struct material material);
+void scene_add_entity(struct scene *scene, struct entity entity);
+void scene_add_light(struct scene *scene, struct light light);
+
+/* Copies `entities` into a new prototype and returns its index. */
+uint32_t scene_add_prototype(struct scene *scene, const struct entity *entities,
+			     size_t nr);
+/*
+ * Adds an entity placing `prototype` with the `to_world` transform.
+ * `material` is a material index or ENTITY_NO_MATERIAL.
+ */
+void scene_add_instance(struct scene *scene, uint32_t prototype,
+			struct affine to_world, uint32_t material);
+
+/*
+ * Adds `mesh` to the scene, which takes ownership of it, and returns its
+ * index for ENTITY_MESH().
+ */
+uint32_t scene_add_mesh(struct scene *scene, struct mesh *mesh);
+
+/*
+ * Adds the particle set `p` to the scene, which takes ownership of it,
+ * and returns its index for ENTITY_PARTICLES(). The particles should be
+ * sorted (see particles_sort()).
+ */
+uint32_t scene_add_particles(struct scene *scene, struct particles *p);
+
+/*
+ * Adds the heightfield `hf` to the scene, which takes ownership of it, and
+ * returns its index for ENTITY_HEIGHTFIELD().
+ */
+uint32_t scene_add_heightfield(struct scene *scene, struct heightfield *hf);
+
+/*
+ * Like entity_bounds(), but also handles instances, meshes, particles and
+ * heightfields, whose prototypes, meshes, particle sets and heightfields
+ * must have their bounds set.
+ */
+int scene_entity_bounds(const struct scene *scene, const struct entity *e,
+			struct aabb *b);
+
+/*
+ * Whether `e` may have a textured material: only spheres and heightfields
+ * have texture coordinates (see intersection_base_color()), and instances
+ * whose prototype holds nothing else. The instance and prototype tables
+ * must be set.
+ */
+int scene_entity_takes_texture(const struct scene *scene, const struct entity *e);
+
+/*
+ * Releases the scene's memory (and file mapping, if any). Textures are
+ * global and must be released separately with free_textures().
+ */
+void scene_destroy(struct scene *scene);
+
+static inline struct material *entity_material(struct scene *scene,
+					       struct entity *e)
+{
+	return &scene->materials[e->material];
+}
+
+static inline struct material *intersection_material(struct scene *scene,
+						     const struct intersection *it)
+{
+	if (it->instance && it->instance->material != ENTITY_NO_MATERIAL)
+		return entity_material(scene, it->instance);
+	return entity_material(scene, it->entity);
+}
+
+/*
+ * The color of the surface at the hit, before lighting: the particle's
+ * palette color, the material's texture or the material's color.
+ * Heightfields are textured from above.
+ */
+struct vec3 intersection_base_color(struct scene *scene,
+				    const struct intersection *it,
+				    const struct material *material);
+
+/* The hit position in the space of it->entity, for texture lookups. */
+static inline struct vec3 intersection_local_pos(struct scene *scene,
+						 const struct intersection *it)
+{
+	if (!it->instance)
+		return it->pos;
+	return affine_point(&scene->instances[it->instance->u.instance].to_object,
+			    it->pos);
+}
@@ -0,0 +1,331 @@
+#include "screen-bins.h"
+#include "scene.h"
+#include "util.h"
+#include "lib/array.h"
+
+void screen_bins_destroy(struct screen_bins *sb)
+{
+	free(sb->tiles);
+	free(sb->ids);
+	free(sb->near);
+	memset(sb, 0, sizeof(*sb));
+}
+
+/* The tiles a bounded entity overlaps, and the depth at which it starts. */
+struct footprint {
+	uint32_t entity;
+	uint32_t tx0, ty0, tx1, ty1;
+	float near;
+	/* For entities other than spheres. */
+	struct aabb bounds;
+};
+
+/*
+ * The screen bounds of a sphere, as viewport coordinates: along each
+ * axis, the slopes of the two lines from the camera tangent to the
+ * sphere's cross-section.
+ */
+static int sphere_bounds(const struct camera_frame *f, const struct sphere *s,
+			 float lo[2], float hi[2], float *near)
+{
+	struct vec3 d = vec3_sub(s->center, f->pos);
+	float c[2] = { vec3_dot(d, f->right), vec3_dot(d, f->up) };
+	float z = vec3_dot(d, f->fwd), r = s->radius;
+
+	*near = z - r;
+	if (z + r <= 0)
+		return 0;
+	for (int a = 0; a < 2; a++) {
+#if CAN_PROJ_ORTO == 1
+		lo[a] = c[a] - r;
+		hi[a] = c[a] + r;
+#else
+		if (z <= r) {
+			lo[a] = -INFINITY;
+			hi[a] = INFINITY;
+			continue;
+		}
+		float denom = z * z - r * r;
+		float delta = r * sqrtf(c[a] * c[a] + denom);
+		lo[a] = f->viewpoint_dist * (c[a] * z - delta) / denom;
+		hi[a] = f->viewpoint_dist * (c[a] * z + delta) / denom;
+#endif
+	}
+	return 1;
+}
+
+/* The screen bounds of the corners of a box. */
+static int box_bounds(const struct camera_frame *f, const struct aabb *b,
+		      float lo[2], float hi[2], float *near)
+{
+	float far = -INFINITY;
+
+	*near = INFINITY;
+	lo[0] = lo[1] = INFINITY;
+	hi[0] = hi[1] = -INFINITY;
+	for (int c = 0; c < 8; c++) {
+		struct vec3 corner = vec3_new(c & 1 ? b->max.x : b->min.x,
+					      c & 2 ? b->max.y : b->min.y,
+					      c & 4 ? b->max.z : b->min.z);
+		struct vec3 d = vec3_sub(corner, f->pos);
+		float z = vec3_dot(d, f->fwd);
+		float p[2] = { vec3_dot(d, f->right), vec3_dot(d, f->up) };
+		*near = fminf(*near, z);
+		far = fmaxf(far, z);
+		for (int a = 0; a < 2; a++) {
+#if CAN_PROJ_ORTO != 1
+			p[a] *= f->viewpoint_dist / z;
+#endif
+			lo[a] = fminf(lo[a], p[a]);
+			hi[a] = fmaxf(hi[a], p[a]);
+		}
+	}
+	if (far <= 0)
+		return 0;
+#if CAN_PROJ_ORTO != 1
+	if (*near <= 0) {
+		lo[0] = lo[1] = -INFINITY;
+		hi[0] = hi[1] = INFINITY;
+	}
+#endif
+	return 1;
+}
+
+/* Clamps `x` to [lo, hi] before converting it, as it may be infinite. */
+static inline int64_t clamp_to_int(float x, int64_t lo, int64_t hi)
+{
+	return x <= lo ? lo : x >= hi ? hi : (int64_t)floorf(x);
+}
+
+/*
+ * Returns 0 if the entity cannot be seen by camera rays, and its
+ * footprint otherwise. Bounds are padded by a quarter pixel against
+ * rounding errors.
+ */
+static int entity_footprint(const struct scene *scene, uint32_t i,
+			    const struct camera_frame *camera, int width,
+			    int height, uint32_t tile_size,
+			    struct footprint *fp)
+{
+	const struct entity *e = &scene->entities[i];
+	float viewport_W = 2.0, viewport_H = viewport_W / ASPECT_RATIO;
+	float pixel_sz = viewport_W / width, pad = pixel_sz / 4;
+	float lo[2], hi[2];
+
+	if (e->type == ENT_SPHERE) {
+		if (!sphere_bounds(camera, &e->u.s, lo, hi, &fp->near))
+			return 0;
+	} else {
+		if (!scene_entity_bounds(scene, e, &fp->bounds) ||
+		    !box_bounds(camera, &fp->bounds, lo, hi, &fp->near))
+			return 0;
+	}
+
+	/*
+	 * Like in render(), the samples of pixel (i, j) have x in
+	 * -viewport_W/2 + [j, j + 1] * pixel_sz and y in
+	 * viewport_H/2 - [i - 1, i] * pixel_sz.
+	 */
+	int64_t j0 = clamp_to_int((lo[0] - pad + viewport_W/2) / pixel_sz, -1, width);
+	int64_t j1 = clamp_to_int((hi[0] + pad + viewport_W/2) / pixel_sz, -1, width);
+	int64_t i0 = clamp_to_int((viewport_H/2 - hi[1] - pad) / pixel_sz + 1, -1, height);
+	int64_t i1 = clamp_to_int((viewport_H/2 - lo[1] + pad) / pixel_sz + 1, -1, height);
+	if (j1 < 0 || j0 >= width || i1 < 0 || i0 >= height)
+		return 0;
+
+	fp->entity = i;
+	fp->tx0 = (j0 < 0 ? 0 : j0) / tile_size;
+	fp->tx1 = (j1 >= width ? width - 1 : j1) / tile_size;
+	fp->ty0 = (i0 < 0 ? 0 : i0) / tile_size;
+	fp->ty1 = (i1 >= height ? height - 1 : i1) / tile_size;
+	return 1;
+}
+
+/*
+ * The side planes of the tile frusta: a point at `d` from the camera is
+ * on the inner side of plane p if dot(p.normal, d) + p.offset >= 0. The
+ * planes are padded like the footprints. Tile (tx, ty) is bounded by
+ * left[tx], right[tx], top[ty] and bottom[ty].
+ */
+struct tile_plane {
+	struct vec3 normal;
+	float offset;
+};
+
+struct tile_frusta {
+	struct tile_plane *left, *right, *top, *bottom;
+};
+
+/* The plane through the camera's screen line dot(dir, p) = `at`, facing `dir`. */
+static struct tile_plane tile_plane(const struct camera_frame *f,
+				    struct vec3 dir, float at)
+{
+#if CAN_PROJ_ORTO == 1
+	return (struct tile_plane){ dir, -at };
+#else
+	struct vec3 n = vec3_sub(vec3_smul(dir, f->viewpoint_dist),
+				 vec3_smul(f->fwd, at));
+	return (struct tile_plane){ vec3_normalize(n), 0 };
+#endif
+}
+
+static void tile_frusta_init(struct tile_frusta *tf, const struct screen_bins *sb,
+			     const struct camera_frame *f, int width, int height)
+{
+	float viewport_W = 2.0, viewport_H = viewport_W / ASPECT_RATIO;
+	float pixel_sz = viewport_W / width, pad = pixel_sz / 4;
+	uint32_t ts = sb->tile_size;
+
+	ALLOC_ARRAY(tf->left, sb->tiles_w);
+	ALLOC_ARRAY(tf->right, sb->tiles_w);
+	ALLOC_ARRAY(tf->top, sb->tiles_h);
+	ALLOC_ARRAY(tf->bottom, sb->tiles_h);
+	for (uint32_t tx = 0; tx < sb->tiles_w; tx++) {
+		uint32_t j1 = (tx + 1) * ts < (uint32_t)width ? (tx + 1) * ts : width;
+		float x0 = -viewport_W/2 + tx * ts * pixel_sz - pad;
+		float x1 = -viewport_W/2 + j1 * pixel_sz + pad;
+		tf->left[tx] = tile_plane(f, f->right, x0);
+		tf->right[tx] = tile_plane(f, vec3_neg(f->right), -x1);
+	}
+	for (uint32_t ty = 0; ty < sb->tiles_h; ty++) {
+		uint32_t i1 = (ty + 1) * ts < (uint32_t)height ? (ty + 1) * ts : height;
+		/* See entity_footprint() for the y of each row. */
+		float y0 = viewport_H/2 - (ty * ts - 1.0f) * pixel_sz + pad;
+		float y1 = viewport_H/2 - (i1 - 1.0f) * pixel_sz - pad;
+		tf->top[ty] = tile_plane(f, vec3_neg(f->up), -y0);
+		tf->bottom[ty] = tile_plane(f, f->up, y1);
+	}
+}
+
+static void tile_frusta_release(struct tile_frusta *tf)
+{
+	free(tf->left);
+	free(tf->right);
+	free(tf->top);
+	free(tf->bottom);
+}
+
+/* Whether the entity reaches the inner side of `p`. */
+static int inside_plane(const struct entity *e, const struct aabb *b,
+			const struct tile_plane *p, struct vec3 camera)
+{
+	if (e->type == ENT_SPHERE)
+		return vec3_dot(p->normal, vec3_sub(e->u.s.center, camera)) +
+		       p->offset >= -e->u.s.radius;
+	/* The corner farthest along the normal. */
+	struct vec3 c = vec3_new(p->normal.x > 0 ? b->max.x : b->min.x,
+				 p->normal.y > 0 ? b->max.y : b->min.y,
+				 p->normal.z > 0 ? b->max.z : b->min.z);
+	return vec3_dot(p->normal, vec3_sub(c, camera)) + p->offset >= 0;
+}
+
+/*
+ * Whether the entity of footprint `fp` may be seen from tile (tx, ty). The
+ * footprint's rectangle is conservative: boxes projecting to a large
+ * rectangle, such as long diagonal ones or those crossing the camera
+ * plane, often miss many of its tiles.
+ */
+static int tile_overlaps(const struct scene *scene, const struct tile_frusta *tf,
+			 const struct footprint *fp, uint32_t tx, uint32_t ty)
+{
+	const struct entity *e = &scene->entities[fp->entity];
+	const struct aabb *b = &fp->bounds;
+	struct vec3 camera = scene->camera.pos;
+
+	if (fp->tx0 == fp->tx1 && fp->ty0 == fp->ty1)
+		return 1;
+	return inside_plane(e, b, &tf->left[tx], camera) &&
+	       inside_plane(e, b, &tf->right[tx], camera) &&
+	       inside_plane(e, b, &tf->top[ty], camera) &&
+	       inside_plane(e, b, &tf->bottom[ty], camera);
+}
+
+static int footprint_cmp(const void *va, const void *vb)
+{
+	const struct footprint *a = va, *b = vb;
+	if (a->near != b->near)
+		return a->near < b->near ? -1 : 1;
+	return a->entity < b->entity ? -1 : a->entity > b->entity;
+}
+
+void scene_prepare_screen_bins(struct scene *scene, int width, int height,
+			       uint32_t tile_size)
+{
+	struct screen_bins *sb = &scene->screen_bins;
+	struct camera_frame camera = camera_frame(&scene->camera);
+	struct footprint *fps;
+	struct tile_frusta tf;
+	uint8_t *visible;
+	size_t nr_fps = 0, nr_tiles, overflowed = 0, empty = 0;
+	uint32_t *next;
+
+	screen_bins_destroy(sb);
+	if (!tile_size)
+		return;
+
+	double start = now_seconds();
+	sb->tile_size = tile_size;
+	sb->width = width;
+	sb->height = height;
+	sb->tiles_w = (width + tile_size - 1) / tile_size;
+	sb->tiles_h = (height + tile_size - 1) / tile_size;
+	nr_tiles = (size_t)sb->tiles_w * sb->tiles_h;
+
+	ALLOC_ARRAY(fps, scene->nr_entities);
+	ALLOC_ARRAY(visible, scene->nr_entities);
+	#pragma omp parallel for schedule(dynamic, 256)
+	for (size_t i = 0; i < scene->nr_entities; i++)
+		visible[i] = entity_footprint(scene, i, &camera, width, height,
+					      tile_size, &fps[i]);
+	for (size_t i = 0; i < scene->nr_entities; i++)
+		if (visible[i])
+			fps[nr_fps++] = fps[i];
+	free(visible);
+	/* Filling the tiles in this order sorts each of them. */
+	qsort(fps, nr_fps, sizeof(*fps), footprint_cmp);
+
+	tile_frusta_init(&tf, sb, &camera, width, height);
+	CALLOC_ARRAY(sb->tiles, nr_tiles);
+	for (size_t f = 0; f < nr_fps; f++)
+		for (uint32_t ty = fps[f].ty0; ty <= fps[f].ty1; ty++)
+			for (uint32_t tx = fps[f].tx0; tx <= fps[f].tx1; tx++)
+				if (tile_overlaps(scene, &tf, &fps[f], tx, ty))
+					sb->tiles[(size_t)ty * sb->tiles_w + tx].nr++;
+	for (size_t t = 0; t < nr_tiles; t++) {
+		struct screen_tile *tile = &sb->tiles[t];
+		empty += !tile->nr;
+		if (tile->nr > SCREEN_BINS_MAX_ENTITIES) {
+			tile->nr = SCREEN_TILE_OVERFLOW;
+			overflowed++;
+			continue;
+		}
+		tile->first = sb->nr;
+		sb->nr += tile->nr;
+	}
+
+	ALLOC_ARRAY(sb->ids, sb->nr);
+	ALLOC_ARRAY(sb->near, sb->nr);
+	ALLOC_ARRAY(next, nr_tiles);
+	for (size_t t = 0; t < nr_tiles; t++)
+		next[t] = sb->tiles[t].first;
+	for (size_t f = 0; f < nr_fps; f++) {
+		for (uint32_t ty = fps[f].ty0; ty <= fps[f].ty1; ty++) {
+			for (uint32_t tx = fps[f].tx0; tx <= fps[f].tx1; tx++) {
+				size_t t = (size_t)ty * sb->tiles_w + tx;
+				if (sb->tiles[t].nr == SCREEN_TILE_OVERFLOW ||
+				    !tile_overlaps(scene, &tf, &fps[f], tx, ty))
+					continue;
+				sb->ids[next[t]] = fps[f].entity;
+				sb->near[next[t]++] = fps[f].near;
+			}
+		}
+	}
+	free(next);
+	free(fps);
+	tile_frusta_release(&tf);
+
+	fprintf(stderr, "Binned %zu entities into %ux%u tiles of %u pixels "
+		"(%zu entries, %zu empty tiles, %zu left to the BVH) in %.3fs\n",
+		nr_fps, sb->tiles_w, sb->tiles_h, tile_size, sb->nr, empty,
+		overflowed, now_seconds() - start);
+}
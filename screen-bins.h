@@ -0,0 +1,80 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct scene;
+
+/*
+ * Screen bins
+ * -----------
+ *
+ * Primary rays all start at the camera, so which bounded entities they can
+ * hit is known before tracing: those whose projection on the viewport
+ * covers their pixel. Each entity's screen bounds are projected (exactly
+ * for spheres, through the corners of the bounding box otherwise) and the
+ * entity is binned into the square tiles of `tile_size` pixels they
+ * overlap. A camera ray then tests the unbounded entities and its tile's
+ * entities, nearest first, and stops at the first entity that starts
+ * beyond its closest hit so far: its cost depends on the entities covering
+ * its tile rather than on the size of the scene.
+ *
+ * The projected bounds are a rectangle of tiles, which is then culled
+ * tile by tile against the side planes of each tile's frustum: boxes
+ * crossing the camera plane or lying across the view would otherwise be
+ * binned far from where they are seen. Tiles with more than
+ * SCREEN_BINS_MAX_ENTITIES entities are traced through the BVH instead,
+ * which is faster than a long list, while tiles without any, in scenes
+ * without unbounded entities, only see the background and are not traced
+ * at all.
+ */
+#define SCREEN_BINS_MAX_ENTITIES 64
+
+struct screen_tile {
+	/*
+	 * The tile's entries, nearest first, are [first, first + nr). nr is
+	 * SCREEN_TILE_OVERFLOW for tiles left to the BVH.
+	 */
+	uint32_t first, nr;
+};
+
+#define SCREEN_TILE_OVERFLOW UINT32_MAX
+
+struct screen_bins {
+	/* 0 when camera rays go through the BVH. */
+	uint32_t tile_size;
+	/* The size of the render the bins are for. */
+	int width, height;
+	uint32_t tiles_w, tiles_h;
+	/* Row-major. */
+	struct screen_tile *tiles;
+	/*
+	 * The entries: entity indices into scene->entities, and the camera
+	 * depth at which each entity starts.
+	 */
+	uint32_t *ids;
+	float *near;
+	size_t nr;
+};
+
+/*
+ * Sets up scene->screen_bins for a `width` by `height` render with tiles
+ * of `tile_size` pixels, or turns them off if `tile_size` is 0. Must be
+ * called after scene_prepare_accel() (which sets the bounds of meshes,
+ * particle sets and prototypes), and again when the geometry or the
+ * camera moves or the image size changes: renders of another size die.
+ */
+void scene_prepare_screen_bins(struct scene *scene, int width, int height,
+			       uint32_t tile_size);
+
+void screen_bins_destroy(struct screen_bins *sb);
+
+/* The tile of pixel (i, j), or NULL if there are no screen bins. */
+static inline const struct screen_tile *screen_bins_tile(const struct screen_bins *sb,
+							 int i, int j)
+{
+	if (!sb->tile_size)
+		return NULL;
+	return &sb->tiles[(size_t)(i / sb->tile_size) * sb->tiles_w +
+			  j / sb->tile_size];
+}
@@ -0,0 +1,390 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include "server.h"
+#include "render.h"
+#include "util.h"
+#include "lib/array.h"
+#include "lib/wrappers.h"
+
+struct job {
+	struct server_request req;
+	/* Index into server.clients. */
+	int client;
+};
+
+struct client {
+	/* -1 for free slots. */
+	int fd;
+	/* The request being received, of which `in_len` bytes arrived. */
+	struct server_request in;
+	size_t in_len;
+	/* Replies waiting for the client to read them: out[out_pos, out_len). */
+	char *out;
+	size_t out_pos, out_len, out_alloc;
+};
+
+struct server {
+	struct scene *scene;
+	const struct render_opts *opts;
+	int width, height;
+	uint32_t screen_tiles;
+
+	int listen_fd;
+	struct client clients[SERVER_MAX_CLIENTS];
+
+	/* Waiting requests, oldest first. */
+	struct job queue[SERVER_QUEUE];
+	int nr_queued;
+
+	/* The request being rendered, and whether it was cancelled. */
+	struct job current;
+	int rendering, cancelled;
+
+	/* What the screen bins and the AO cache were built for. */
+	struct camera view_camera;
+	int view_width, view_height;
+	int ao_max_depth;
+};
+
+static void drop_client(struct server *s, int c)
+{
+	struct client *cl = &s->clients[c];
+	int kept = 0;
+
+	close(cl->fd);
+	free(cl->out);
+	memset(cl, 0, sizeof(*cl));
+	cl->fd = -1;
+	for (int q = 0; q < s->nr_queued; q++)
+		if (s->queue[q].client != c)
+			s->queue[kept++] = s->queue[q];
+	s->nr_queued = kept;
+	if (s->rendering && s->current.client == c)
+		s->cancelled = 1;
+}
+
+static size_t pending(const struct client *cl)
+{
+	return cl->out_len - cl->out_pos;
+}
+
+/* Writes what the client takes of its replies without blocking. */
+static int flush_client(struct server *s, int c)
+{
+	struct client *cl = &s->clients[c];
+
+	while (pending(cl)) {
+		ssize_t ret = write(cl->fd, cl->out + cl->out_pos, pending(cl));
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if (ret <= 0) {
+			drop_client(s, c);
+			return -1;
+		}
+		cl->out_pos += ret;
+	}
+	cl->out_pos = cl->out_len = 0;
+	return 0;
+}
+
+static int send_reply(struct server *s, int c, const struct server_reply *reply,
+		      const void *data, size_t size)
+{
+	struct client *cl = &s->clients[c];
+
+	if (cl->fd < 0)
+		return -1;
+	if (cl->out_pos) {
+		memmove(cl->out, cl->out + cl->out_pos, pending(cl));
+		cl->out_len -= cl->out_pos;
+		cl->out_pos = 0;
+	}
+	ALLOC_GROW(cl->out, cl->out_len + sizeof(*reply) + size, cl->out_alloc);
+	memcpy(cl->out + cl->out_len, reply, sizeof(*reply));
+	cl->out_len += sizeof(*reply);
+	if (size)
+		memcpy(cl->out + cl->out_len, data, size);
+	cl->out_len += size;
+	return flush_client(s, c);
+}
+
+static void reply(struct server *s, int c, const struct server_request *req,
+		  enum server_reply_type type)
+{
+	struct server_reply r = { .type = type, .id = req->id };
+	send_reply(s, c, &r, NULL, 0);
+}
+
+static int valid_request(const struct server_request *req)
+{
+	return req->width <= SERVER_MAX_SIZE && req->height <= SERVER_MAX_SIZE &&
+	       !req->width == !req->height && req->max_depth <= MAX_RAY_DEPTH &&
+	       req->rr_threshold <= 1 && vec3_square(req->camera.dir) > 0 &&
+	       vec3_square(vec3_cross(req->camera.dir, req->camera.up)) > 0 &&
+	       req->camera.viewpoint_dist > 0;
+}
+
+static void cancel(struct server *s, int c, uint32_t id)
+{
+	if (s->rendering && s->current.client == c && s->current.req.id == id) {
+		s->cancelled = 1;
+		return;
+	}
+	for (int q = 0; q < s->nr_queued; q++) {
+		if (s->queue[q].client != c || s->queue[q].req.id != id)
+			continue;
+		reply(s, c, &s->queue[q].req, SERVER_CANCELLED);
+		memmove(&s->queue[q], &s->queue[q + 1],
+			(s->nr_queued - q - 1) * sizeof(*s->queue));
+		s->nr_queued--;
+		return;
+	}
+}
+
+static void read_request(struct server *s, int c)
+{
+	struct client *cl = &s->clients[c];
+	ssize_t ret = read(cl->fd, (char *)&cl->in + cl->in_len,
+			   sizeof(cl->in) - cl->in_len);
+
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (ret <= 0) {
+		drop_client(s, c);
+		return;
+	}
+	cl->in_len += ret;
+	if (cl->in_len < sizeof(cl->in))
+		return;
+	cl->in_len = 0;
+
+	struct server_request req = cl->in;
+	switch (req.type) {
+	case SERVER_RENDER:
+		if (!valid_request(&req))
+			reply(s, c, &req, SERVER_INVALID);
+		else if (s->nr_queued == SERVER_QUEUE)
+			reply(s, c, &req, SERVER_BUSY);
+		else
+			s->queue[s->nr_queued++] = (struct job){ req, c };
+		break;
+	case SERVER_CANCEL:
+		cancel(s, c, req.id);
+		break;
+	default:
+		reply(s, c, &req, SERVER_INVALID);
+	}
+}
+
+/*
+ * Accepts connections, sends what clients take of their replies and reads
+ * requests, waiting at most `timeout` milliseconds (see poll()) for the
+ * first event. Requests are not read from clients with more than
+ * SERVER_MAX_PENDING bytes of replies pending, until they read them.
+ */
+static void handle_events(struct server *s, int timeout)
+{
+	struct pollfd fds[SERVER_MAX_CLIENTS + 1];
+	int nr_fds = 0, polled[SERVER_MAX_CLIENTS];
+
+	fds[nr_fds++] = (struct pollfd){ .fd = s->listen_fd, .events = POLLIN };
+	for (int c = 0; c < SERVER_MAX_CLIENTS; c++) {
+		const struct client *cl = &s->clients[c];
+		if (cl->fd < 0)
+			continue;
+		polled[nr_fds - 1] = c;
+		fds[nr_fds++] = (struct pollfd){
+			.fd = cl->fd,
+			.events = (pending(cl) <= SERVER_MAX_PENDING ? POLLIN : 0) |
+				  (pending(cl) ? POLLOUT : 0),
+		};
+	}
+	if (poll(fds, nr_fds, timeout) < 0) {
+		if (errno == EINTR)
+			return;
+		die_errno("failed to wait for clients");
+	}
+
+	for (int k = 1; k < nr_fds; k++) {
+		int c = polled[k - 1];
+		if (!fds[k].revents)
+			continue;
+		if (pending(&s->clients[c]) && flush_client(s, c))
+			continue;
+		if (fds[k].revents & (POLLIN | POLLHUP | POLLERR))
+			read_request(s, c);
+	}
+	if (fds[0].revents) {
+		int fd = accept(s->listen_fd, NULL, NULL);
+		if (fd < 0) {
+			error_errno("failed to accept a client");
+			return;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		for (int c = 0; c < SERVER_MAX_CLIENTS; c++) {
+			/*
+			 * The slot of a client that went away mid-render is
+			 * kept until the render stops.
+			 */
+			if (s->rendering && c == s->current.client)
+				continue;
+			if (s->clients[c].fd < 0) {
+				s->clients[c].fd = fd;
+				return;
+			}
+		}
+		warning("too many clients, refusing one");
+		close(fd);
+	}
+}
+
+/*
+ * Waits for the client being rendered for to read its replies down to
+ * SERVER_MAX_PENDING bytes, serving the others meanwhile. Clients that
+ * read nothing for SERVER_STALL_TIMEOUT milliseconds are dropped.
+ */
+static void wait_for_client(struct server *s)
+{
+	int c = s->current.client;
+	double stalled = now_seconds();
+
+	while (s->clients[c].fd >= 0 && pending(&s->clients[c]) > SERVER_MAX_PENDING) {
+		size_t before = pending(&s->clients[c]);
+		int left = SERVER_STALL_TIMEOUT - (now_seconds() - stalled) * 1000;
+		if (left <= 0) {
+			warning("dropping a client that stopped reading");
+			drop_client(s, c);
+			return;
+		}
+		handle_events(s, left);
+		if (s->clients[c].fd >= 0 && pending(&s->clients[c]) < before)
+			stalled = now_seconds();
+	}
+}
+
+static void render_job(struct server *s)
+{
+	const struct server_request *req = &s->current.req;
+	struct render_opts opts = *s->opts;
+	struct render_stats stats = { 0 };
+	int c = s->current.client;
+	int width = req->width ? req->width : s->width;
+	int height = req->height ? req->height : s->height;
+	double start = now_seconds();
+	uint8_t *bytes;
+
+	if (req->max_depth >= 0)
+		opts.max_depth = req->max_depth;
+	if (req->rr_threshold >= 0)
+		opts.rr_threshold = req->rr_threshold;
+
+	int moved = memcmp(&s->view_camera, &req->camera, sizeof(req->camera)) ||
+		    s->view_width != width || s->view_height != height;
+	s->scene->camera = req->camera;
+	if (moved)
+		scene_prepare_screen_bins(s->scene, width, height, s->screen_tiles);
+	/* The AO records are placed at the hits of the view, up to max_depth. */
+	if (s->scene->ao_cache.samples &&
+	    (moved || s->ao_max_depth != opts.max_depth)) {
+		scene_prepare_ao(s->scene, width, height, opts.max_depth,
+				 s->scene->ao_cache.samples,
+				 s->scene->ao_cache.distance);
+		s->ao_max_depth = opts.max_depth;
+	}
+	s->view_camera = req->camera;
+	s->view_width = width;
+	s->view_height = height;
+
+	struct ppm *ppm = ppm_new(height, width);
+	ALLOC_ARRAY(bytes, (size_t)SERVER_BAND_ROWS * width * 3);
+	for (int y0 = 0; y0 < height && !s->cancelled; y0 += SERVER_BAND_ROWS) {
+		int y1 = y0 + SERVER_BAND_ROWS < height ? y0 + SERVER_BAND_ROWS : height;
+		struct render_region band = { 0, y0, width, y1 };
+		struct server_reply r = {
+			.type = SERVER_BAND, .id = req->id,
+			.width = width, .height = height, .y0 = y0, .y1 = y1,
+		};
+		render_region(s->scene, ppm, &opts, &band, &stats);
+		ppm_get_bytes(ppm, y0, y1 - y0, bytes);
+		send_reply(s, c, &r, bytes, (size_t)(y1 - y0) * width * 3);
+		/* Picks up cancellations, and new requests for the queue. */
+		handle_events(s, 0);
+		wait_for_client(s);
+	}
+
+	double elapsed = now_seconds() - start;
+	struct server_reply r = {
+		.type = s->cancelled ? SERVER_CANCELLED : SERVER_DONE,
+		.id = req->id, .width = width, .height = height,
+		.y1 = height, .micros = elapsed * 1e6,
+	};
+	send_reply(s, c, &r, NULL, 0);
+	fprintf(stderr, "Request %u: %dx%d %s in %.3fs, %d queued\n", req->id,
+		width, height, s->cancelled ? "cancelled" : "rendered", elapsed,
+		s->nr_queued);
+	free(bytes);
+	ppm_destroy(&ppm);
+}
+
+static int listen_at(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+		die("socket path '%s' is too long", path);
+	strcpy(addr.sun_path, path);
+	/* A socket left by a previous server would make bind() fail. */
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		die_errno("failed to create socket");
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(fd, SERVER_MAX_CLIENTS))
+		die_errno("failed to listen on '%s'", path);
+	return fd;
+}
+
+noreturn void serve(struct scene *scene, const struct render_opts *opts,
+		    int width, int height, uint32_t screen_tiles,
+		    const char *path)
+{
+	struct server s = {
+		.scene = scene, .opts = opts,
+		.width = width, .height = height,
+		.screen_tiles = screen_tiles,
+		.view_camera = scene->camera,
+		.view_width = width, .view_height = height,
+		.ao_max_depth = opts->max_depth,
+	};
+
+	for (int c = 0; c < SERVER_MAX_CLIENTS; c++)
+		s.clients[c].fd = -1;
+	/* Writing to a client that went away must fail, not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+	s.listen_fd = listen_at(path);
+	fprintf(stderr, "Serving on '%s'\n", path);
+
+	for (;;) {
+		if (!s.nr_queued) {
+			handle_events(&s, -1);
+			continue;
+		}
+		s.current = s.queue[0];
+		memmove(&s.queue[0], &s.queue[1], --s.nr_queued * sizeof(*s.queue));
+		s.rendering = 1;
+		s.cancelled = 0;
+		render_job(&s);
+		s.rendering = 0;
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdnoreturn.h>
+#include "scene.h"
+
+struct render_opts;
+
+/*
+ * Render server
+ * -------------
+ *
+ * A long-lived raytracer that keeps its scene, textures, acceleration
+ * structures and thread pool loaded, and renders images on request for
+ * clients connected to a Unix domain socket. A request gives the camera
+ * and, optionally, the image size and a few render options; the rest
+ * are the server's command line options. Requests are served one at a
+ * time, in order, and up to SERVER_QUEUE of them may wait: beyond that,
+ * they are refused with SERVER_BUSY.
+ *
+ * Images are streamed back in bands of SERVER_BAND_ROWS rows, as 8-bit
+ * RGB (see ppm_get_bytes()), as soon as they are rendered. Between
+ * bands, the server reads incoming requests, so a render can be cancelled
+ * with a SERVER_CANCEL request for its id, and is cancelled when its
+ * client disconnects.
+ *
+ * Clients are never waited for: replies they do not read yet are kept
+ * for them. Once more than SERVER_MAX_PENDING bytes are, their requests
+ * are left unread, and a render for them pauses until they catch up. A
+ * client that reads nothing for SERVER_STALL_TIMEOUT milliseconds while
+ * its render is paused is dropped.
+ *
+ * Messages are in the machine's byte order. Clients send struct
+ * server_request and receive struct server_reply, each SERVER_BAND reply
+ * followed by its pixels. A render ends with SERVER_DONE or
+ * SERVER_CANCELLED.
+ */
+#define SERVER_QUEUE 8
+#define SERVER_BAND_ROWS 16
+#define SERVER_MAX_CLIENTS 64
+#define SERVER_MAX_SIZE 8192
+#define SERVER_MAX_PENDING (4 << 20)
+#define SERVER_STALL_TIMEOUT 10000
+
+enum server_request_type {
+	SERVER_RENDER = 1,
+	SERVER_CANCEL,
+};
+
+struct server_request {
+	uint32_t type; /* enum server_request_type */
+	/* Chosen by the client, to match replies and cancellations. */
+	uint32_t id;
+	/* The image size, or 0 for the server's. */
+	uint32_t width, height;
+	struct camera camera;
+	/* Reflections followed at most, or -1 for the server's. */
+	int32_t max_depth;
+	/* The Russian roulette threshold, or a negative number for the server's. */
+	float rr_threshold;
+};
+
+enum server_reply_type {
+	/* Rows y0 to y1 of the image follow, as width * 3 bytes each. */
+	SERVER_BAND = 1,
+	/* The image is complete, in `micros` microseconds. */
+	SERVER_DONE,
+	SERVER_CANCELLED,
+	/* The queue is full: the request was dropped. */
+	SERVER_BUSY,
+	SERVER_INVALID,
+};
+
+struct server_reply {
+	uint32_t type; /* enum server_reply_type */
+	uint32_t id;
+	uint32_t width, height;
+	uint32_t y0, y1;
+	uint32_t micros;
+};
+
+/*
+ * Serves renders of `scene`, which must be prepared like for render(), on
+ * a socket at `path`, with `opts` as defaults. The screen bins, of
+ * `screen_tiles` pixels (see screen-bins.h), and the AO cache, if any,
+ * are rebuilt for each camera. Renders are `width` by `height` unless
+ * requested otherwise. Never returns.
+ */
+noreturn void serve(struct scene *scene, const struct render_opts *opts,
+		    int width, int height, uint32_t screen_tiles,
+		    const char *path);
@@ -0,0 +1,106 @@
+#include "shadow-maps.h"
+#include "scene.h"
+#include "trace.h"
+#include "util.h"
+#include "lib/array.h"
+
+void shadow_maps_destroy(struct shadow_maps *sm)
+{
+	for (size_t i = 0; i < sm->nr; i++)
+		free(sm->depth[i]);
+	free(sm->depth);
+	memset(sm, 0, sizeof(*sm));
+}
+
+/*
+ * Face f looks down axis f / 2, towards + for even faces and - for odd
+ * ones. On it, u and v, in [-1, 1], run along the two next axes.
+ */
+static struct vec3 face_dir(int f, float u, float v)
+{
+	float d[3];
+	int a = f / 2;
+	d[a] = f & 1 ? -1 : 1;
+	d[(a + 1) % 3] = u;
+	d[(a + 2) % 3] = v;
+	return vec3_normalize(vec3_new(d[0], d[1], d[2]));
+}
+
+static int dir_face(struct vec3 dir, float *u, float *v)
+{
+	float d[3] = { dir.x, dir.y, dir.z };
+	int a = 0;
+	if (fabsf(d[1]) > fabsf(d[a]))
+		a = 1;
+	if (fabsf(d[2]) > fabsf(d[a]))
+		a = 2;
+	float major = fabsf(d[a]);
+	*u = d[(a + 1) % 3] / major;
+	*v = d[(a + 2) % 3] / major;
+	return 2 * a + (d[a] < 0);
+}
+
+void scene_prepare_shadow_maps(struct scene *scene, uint32_t res, float bias)
+{
+	struct shadow_maps *sm = &scene->shadow_maps;
+	const struct light_sampler *ls = &scene->light_sampler;
+
+	shadow_maps_destroy(sm);
+	if (!res)
+		return;
+
+	double start = now_seconds();
+	size_t face = (size_t)res * res, texels = st_mult(6, face);
+	sm->res = res;
+	sm->bias = bias;
+	sm->nr = scene->nr_lights;
+	CALLOC_ARRAY(sm->depth, sm->nr);
+	for (uint32_t i = 0; i < ls->nr; i++)
+		ALLOC_ARRAY(sm->depth[ls->ids[i]], texels);
+
+	#pragma omp parallel for collapse(2) schedule(dynamic, 256)
+	for (uint32_t i = 0; i < ls->nr; i++) {
+		for (size_t t = 0; t < texels; t++) {
+			struct light *l = &scene->lights[ls->ids[i]];
+			int f = t / face;
+			uint32_t y = t % face / res, x = t % res;
+			struct vec3 dir = face_dir(f, (x + 0.5f) * 2 / res - 1,
+						   (y + 0.5f) * 2 / res - 1);
+			struct ray r = ray_new(l->pos, dir);
+			struct intersection it;
+			sm->depth[ls->ids[i]][t] =
+				cast_ray(scene, &r, INFINITY, &it) ? it.dist : INFINITY;
+		}
+	}
+	fprintf(stderr, "Built %u shadow maps of 6x%ux%u in %.3fs\n", ls->nr,
+		res, res, now_seconds() - start);
+}
+
+static inline uint32_t clamp_texel(int64_t x, uint32_t res)
+{
+	return x < 0 ? 0 : x >= res ? res - 1 : x;
+}
+
+float shadow_map_visibility(const struct shadow_maps *sm, uint32_t light,
+			    struct vec3 light_pos, struct vec3 pos)
+{
+	struct vec3 d = vec3_sub(pos, light_pos);
+	float dist = vec3_norm(d), u, v;
+	int f = dir_face(d, &u, &v);
+	const float *depth = sm->depth[light] + (size_t)f * sm->res * sm->res;
+
+	/* Texel coordinates, relative to texel centers. */
+	float s = (u + 1) / 2 * sm->res - 0.5f, t = (v + 1) / 2 * sm->res - 0.5f;
+	float s0 = floorf(s), t0 = floorf(t), fs = s - s0, ft = t - t0;
+	uint32_t x[2] = { clamp_texel(s0, sm->res), clamp_texel(s0 + 1, sm->res) };
+	uint32_t y[2] = { clamp_texel(t0, sm->res), clamp_texel(t0 + 1, sm->res) };
+
+	/* A texel spans about 2 / res radians. */
+	float biased = dist - sm->bias * dist * 2 / sm->res;
+	float lit[2][2];
+	for (int i = 0; i < 2; i++)
+		for (int j = 0; j < 2; j++)
+			lit[i][j] = depth[(size_t)y[i] * sm->res + x[j]] >= biased;
+	return (lit[0][0] * (1 - fs) + lit[0][1] * fs) * (1 - ft) +
+	       (lit[1][0] * (1 - fs) + lit[1][1] * fs) * ft;
+}
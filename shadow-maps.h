@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "vec3.h"
+
+struct scene;
+
+/*
+ * Shadow maps
+ * -----------
+ *
+ * An approximate shadow test for previews. Each light gets a cube map:
+ * six faces of res by res texels around it, each holding the distance
+ * from the light to the first surface seen through the texel's center.
+ * A hit is then in shadow when it lies farther from the light than the
+ * map says, which takes a few memory reads instead of a shadow ray.
+ *
+ * Lookups are filtered: the four texels around the hit's direction are
+ * compared, and the results are blended bilinearly, so shadows get soft
+ * edges about a texel wide instead of blocky ones. To keep surfaces from
+ * shadowing themselves, hits are moved `bias` texels (measured at their
+ * distance from the light) towards it before comparing. Too low a bias
+ * gives speckles on lit surfaces ("acne"), too high a bias lets light
+ * leak under objects touching the ground.
+ *
+ * Building the maps casts 6 * res^2 rays per light, and they take
+ * 24 * res^2 bytes each: they pay off when the image has many more hits
+ * than the maps have texels.
+ */
+struct shadow_maps {
+	/* 0 when shadow maps are not used. */
+	uint32_t res;
+	float bias;
+	/*
+	 * Indexed like scene->lights, NULL for culled lights (see
+	 * lights.h). Each holds the six faces one after the other.
+	 */
+	float **depth;
+	size_t nr;
+};
+
+/*
+ * Sets up scene->shadow_maps, with maps of `res` by `res` texels per face,
+ * or none if `res` is 0. Must be called after scene_prepare_accel() and
+ * scene_prepare_lights(), and again whenever the scene changes.
+ */
+void scene_prepare_shadow_maps(struct scene *scene, uint32_t res, float bias);
+
+void shadow_maps_destroy(struct shadow_maps *sm);
+
+/*
+ * Returns how much of light `light` reaches `pos`, from 0 (in shadow) to 1
+ * (lit), according to its shadow map.
+ */
+float shadow_map_visibility(const struct shadow_maps *sm, uint32_t light,
+			    struct vec3 light_pos, struct vec3 pos);
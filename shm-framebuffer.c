@@ -0,0 +1,170 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "shm-framebuffer.h"
+#include "render.h"
+#include "ppm.h"
+#include "lib/error.h"
+
+static size_t nr_pixels(const struct shm_framebuffer *fb)
+{
+	return (size_t)fb->header->width * fb->header->height;
+}
+
+static void map_object(struct shm_framebuffer *fb, int fd, size_t size,
+		       int prot)
+{
+	void *map = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	fb->header = map == MAP_FAILED ? NULL : map;
+	fb->size = size;
+}
+
+void shm_framebuffer_create(struct shm_framebuffer *fb, const char *name,
+			    int width, int height)
+{
+	uint32_t tiles_w = (width + RENDER_TILE - 1) / RENDER_TILE;
+	uint32_t tiles_h = (height + RENDER_TILE - 1) / RENDER_TILE;
+	/* The pixels start on a cache line. */
+	size_t offset = sizeof(struct shm_framebuffer_header) +
+			(size_t)tiles_w * tiles_h * sizeof(uint32_t);
+	offset = (offset + 63) & ~(size_t)63;
+	size_t size = offset + (size_t)width * height * 3 * sizeof(float);
+
+	/*
+	 * A fresh object, rather than the previous one truncated: viewers
+	 * still mapping that one keep a consistent image.
+	 */
+	if (shm_unlink(name) && errno != ENOENT)
+		die_errno("failed to remove shared memory '%s'", name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0666);
+	if (fd < 0)
+		die_errno("failed to create shared memory '%s'", name);
+	if (ftruncate(fd, size))
+		die_errno("failed to size shared memory '%s'", name);
+	map_object(fb, fd, size, PROT_READ | PROT_WRITE);
+	close(fd);
+	if (!fb->header)
+		die_errno("failed to mmap shared memory '%s'", name);
+
+	struct shm_framebuffer_header *h = fb->header;
+	h->version = SHM_FRAMEBUFFER_VERSION;
+	h->width = width;
+	h->height = height;
+	h->tile_size = RENDER_TILE;
+	h->tiles_w = tiles_w;
+	h->tiles_h = tiles_h;
+	h->pixels_offset = offset;
+	fb->pixels = (float *)((char *)h + offset);
+	/* The magic goes last: viewers wait for it. */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(h->magic, SHM_FRAMEBUFFER_MAGIC, sizeof(SHM_FRAMEBUFFER_MAGIC));
+}
+
+int shm_framebuffer_open(struct shm_framebuffer *fb, const char *name)
+{
+	struct stat st;
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 1;
+		return error_errno("failed to open shared memory '%s'", name);
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		return error_errno("failed to stat shared memory '%s'", name);
+	}
+	/* Not sized yet. */
+	if ((size_t)st.st_size < sizeof(struct shm_framebuffer_header)) {
+		close(fd);
+		return 1;
+	}
+	map_object(fb, fd, st.st_size, PROT_READ);
+	close(fd);
+	if (!fb->header)
+		return error_errno("failed to mmap shared memory '%s'", name);
+
+	const struct shm_framebuffer_header *h = fb->header;
+	if (!h->magic[0]) {
+		shm_framebuffer_close(fb);
+		return 1;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (memcmp(h->magic, SHM_FRAMEBUFFER_MAGIC, sizeof(SHM_FRAMEBUFFER_MAGIC)) ||
+	    h->version != SHM_FRAMEBUFFER_VERSION ||
+	    h->pixels_offset + nr_pixels(fb) * 3 * sizeof(float) > fb->size ||
+	    sizeof(*h) + shm_framebuffer_nr_tiles(fb) * sizeof(uint32_t) >
+	    h->pixels_offset) {
+		shm_framebuffer_close(fb);
+		return error("'%s' is not a raytracer framebuffer", name);
+	}
+	fb->pixels = (float *)((char *)h + h->pixels_offset);
+	return 0;
+}
+
+void shm_framebuffer_close(struct shm_framebuffer *fb)
+{
+	if (fb->header)
+		munmap(fb->header, fb->size);
+	memset(fb, 0, sizeof(*fb));
+}
+
+/*
+ * Each tile is only written by one thread at a time, so the generation
+ * needs no read-modify-write: a plain load and a release store will do.
+ */
+static void bump_tile(struct shm_framebuffer_header *h, uint32_t tile)
+{
+	uint32_t gen = __atomic_load_n(&h->generations[tile], __ATOMIC_RELAXED);
+	__atomic_store_n(&h->generations[tile], gen + 1, __ATOMIC_RELEASE);
+}
+
+/* Adaptive rendering passes the whole image as one tile. */
+static void tile_done(const struct render_region *tile, void *data)
+{
+	struct shm_framebuffer_header *h = data;
+	for (uint32_t y = tile->y0 / h->tile_size; y * h->tile_size < tile->y1; y++)
+		for (uint32_t x = tile->x0 / h->tile_size; x * h->tile_size < tile->x1; x++)
+			bump_tile(h, y * h->tiles_w + x);
+}
+
+void shm_framebuffer_target(struct shm_framebuffer *fb,
+			    struct render_target *target)
+{
+	*target = (struct render_target){
+		.pixels = fb->pixels,
+		.width = fb->header->width,
+		.height = fb->header->height,
+		.format = PIXEL_RGB_FLOAT,
+		.tile_done = tile_done,
+		.data = fb->header,
+	};
+}
+
+void shm_framebuffer_publish(struct shm_framebuffer *fb, struct ppm *ppm)
+{
+	if (ppm->cols != fb->header->width || ppm->rows != fb->header->height)
+		BUG("publishing a %ux%u image to a %ux%u framebuffer",
+		    ppm->cols, ppm->rows, fb->header->width, fb->header->height);
+	memcpy(fb->pixels, ppm->img, nr_pixels(fb) * sizeof(*ppm->img));
+	for (uint32_t t = 0; t < shm_framebuffer_nr_tiles(fb); t++)
+		bump_tile(fb->header, t);
+}
+
+void shm_framebuffer_get(struct shm_framebuffer *fb, struct ppm *ppm)
+{
+	if (ppm->cols != fb->header->width || ppm->rows != fb->header->height)
+		BUG("reading a %ux%u framebuffer into a %ux%u image",
+		    fb->header->width, fb->header->height, ppm->cols, ppm->rows);
+	memcpy(ppm->img, fb->pixels, nr_pixels(fb) * sizeof(*ppm->img));
+}
+
+void shm_framebuffer_set_frame(struct shm_framebuffer *fb, uint32_t frame)
+{
+	__atomic_store_n(&fb->header->frame, frame, __ATOMIC_RELEASE);
+}
+
+void shm_framebuffer_set_done(struct shm_framebuffer *fb)
+{
+	__atomic_store_n(&fb->header->done, 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct ppm;
+struct render_target;
+
+/*
+ * Shared-memory framebuffer
+ * -------------------------
+ *
+ * With --shm=<name>, the image is rendered into a POSIX shared memory
+ * object (see shm_open(3)), which viewers can map to follow the render as
+ * it goes, reading the pixels in place. The object holds struct
+ * shm_framebuffer_header, a generation counter per tile of RENDER_TILE
+ * pixels (row-major), and, at `pixels_offset`, the pixels, as three
+ * unclamped floats each, row by row (see PIXEL_RGB_FLOAT).
+ *
+ * The renderer does not wait for viewers, nor lock anything: once the
+ * pixels of a tile are written, its generation is bumped with a release
+ * store, and that is all. A viewer that reads a new generation with an
+ * acquire load then sees the tile's pixels of at least that generation,
+ * and maybe some of the next one if the tile is being rendered again
+ * meanwhile. Progressive renders publish the mean of the passes after
+ * each pass, bumping all tiles. `frame` is the frame being rendered, and
+ * `done` is set once the last frame is complete; the object is left in
+ * place for viewers, and replaced by the next render of the same name.
+ *
+ * Fields are in the machine's byte order.
+ */
+#define SHM_FRAMEBUFFER_MAGIC "RTSHMFB"
+#define SHM_FRAMEBUFFER_VERSION 1
+
+struct shm_framebuffer_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t width, height;
+	uint32_t tile_size, tiles_w, tiles_h;
+	uint32_t pixels_offset;
+	/* Accessed atomically, like the generations. */
+	uint32_t frame, done;
+	uint32_t generations[];
+};
+
+struct shm_framebuffer {
+	struct shm_framebuffer_header *header;
+	size_t size;
+	float *pixels;
+};
+
+/*
+ * Creates (or replaces) the shared memory object `name`, which must start
+ * with a slash, for a `width` by `height` image. Dies on error.
+ */
+void shm_framebuffer_create(struct shm_framebuffer *fb, const char *name,
+			    int width, int height);
+
+/*
+ * Maps the existing object `name` read-only, for viewers. Returns 0 on
+ * success, 1 if the renderer has not created, sized or initialized the
+ * object yet (try again later), or -1 with an error printed.
+ */
+int shm_framebuffer_open(struct shm_framebuffer *fb, const char *name);
+
+/* Unmaps the object, which stays in place. */
+void shm_framebuffer_close(struct shm_framebuffer *fb);
+
+/*
+ * Points `target` at the pixels, for render_into(), bumping the
+ * generation of each tile as it is done.
+ */
+void shm_framebuffer_target(struct shm_framebuffer *fb,
+			    struct render_target *target);
+
+/* Copies `ppm`, of the framebuffer's size, in and bumps all tiles. */
+void shm_framebuffer_publish(struct shm_framebuffer *fb, struct ppm *ppm);
+
+/* Copies the pixels out into `ppm`, of the framebuffer's size. */
+void shm_framebuffer_get(struct shm_framebuffer *fb, struct ppm *ppm);
+
+void shm_framebuffer_set_frame(struct shm_framebuffer *fb, uint32_t frame);
+void shm_framebuffer_set_done(struct shm_framebuffer *fb);
+
+static inline uint32_t shm_framebuffer_nr_tiles(const struct shm_framebuffer *fb)
+{
+	return fb->header->tiles_w * fb->header->tiles_h;
+}
+
+/* Acquire load of a tile's generation, for viewers. */
+static inline uint32_t shm_framebuffer_generation(const struct shm_framebuffer *fb,
+						  uint32_t tile)
+{
+	return __atomic_load_n(&fb->header->generations[tile], __ATOMIC_ACQUIRE);
+}
@@ -36,3 +36,10 @@ static inline struct vec3 texture_color(struct texture *t, unsigned u, unsigned
 {
 	return t->data[texture_2d_to_1d(t, u, v)];
 }
+
+/*
+ * Looks up the environment map `t` in the unit directions dirs[0, nr),
+ * mapped like lookup_sphere_texture() maps a sphere, into colors[0, nr).
+ */
+void env_texture_lookup(struct texture *t, const struct vec3 *dirs,
+			struct vec3 *colors, size_t nr);
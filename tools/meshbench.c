@@ -0,0 +1,91 @@
+/*
+ * meshbench: measure how fast an OBJ file is loaded, how fast its BVH is
+ * built and how many closest-hit rays per second the mesh intersector
+ * traces against it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "../obj.h"
+#include "../util.h"
+#include "../lib/array.h"
+#include "../lib/error.h"
+
+#define DEFAULT_RAYS 1000000
+
+/* A random ray from a sphere around the mesh towards a point inside it. */
+static struct ray random_ray(const struct aabb *b, unsigned int *state)
+{
+	struct vec3 center = vec3_smul(vec3_add(b->min, b->max), 0.5);
+	float radius = vec3_norm(vec3_sub(b->max, b->min));
+	struct vec3 dir, target;
+
+	do {
+		dir = vec3_new(rand_r_in(state, -1, 1), rand_r_in(state, -1, 1),
+			       rand_r_in(state, -1, 1));
+	} while (vec3_norm(dir) > 1 || !vec3_norm(dir));
+	target = vec3_new(rand_r_in(state, b->min.x, b->max.x),
+			  rand_r_in(state, b->min.y, b->max.y),
+			  rand_r_in(state, b->min.z, b->max.z));
+	struct vec3 pos = vec3_add(center, vec3_smul(vec3_normalize(dir), radius));
+	return (struct ray){ pos, vec3_normalize(vec3_sub(target, pos)) };
+}
+
+int main(int argc, char **argv)
+{
+	struct mesh mesh;
+	struct stat st;
+	size_t nr_rays = DEFAULT_RAYS, hits = 0;
+	double start;
+
+	if (argc != 2 && argc != 3)
+		die("usage: meshbench <file.obj> [<rays>]");
+	if (argc == 3 && !(nr_rays = strtoul(argv[2], NULL, 10)))
+		die("invalid number of rays '%s'", argv[2]);
+	if (stat(argv[1], &st))
+		die_errno("failed to stat '%s'", argv[1]);
+
+	start = now_seconds();
+	if (obj_load(&mesh, argv[1]))
+		return 1;
+	double load = now_seconds() - start;
+	printf("load:  %u vertices, %u triangles in %.3fs (%.1f MB/s, %.2f Mtris/s)\n",
+	       mesh.nr_vertices, mesh.nr_triangles, load,
+	       st.st_size / load / 1e6, mesh.nr_triangles / load / 1e6);
+
+	start = now_seconds();
+	mesh_build_accel(&mesh);
+	double build = now_seconds() - start;
+	size_t vertex_bytes = (size_t)mesh.nr_vertices * 6 * sizeof(float);
+	size_t index_bytes = (size_t)mesh.nr_triangles * sizeof(*mesh.tris);
+	size_t bvh_bytes = mesh.bvh.nr_nodes * sizeof(*mesh.bvh.nodes) +
+			   mesh.bvh.nr_prims * sizeof(*mesh.bvh.prims);
+	printf("build: %u nodes in %.3fs (%.2f Mtris/s)\n", mesh.bvh.nr_nodes,
+	       build, mesh.nr_triangles / build / 1e6);
+	printf("memory per triangle: %.1f bytes (vertices %.1f, indices %.1f, BVH %.1f)\n",
+	       (double)(vertex_bytes + index_bytes + bvh_bytes) / mesh.nr_triangles,
+	       (double)vertex_bytes / mesh.nr_triangles,
+	       (double)index_bytes / mesh.nr_triangles,
+	       (double)bvh_bytes / mesh.nr_triangles);
+
+	struct ray *rays;
+	ALLOC_ARRAY(rays, nr_rays);
+	unsigned int state = 42;
+	for (size_t i = 0; i < nr_rays; i++)
+		rays[i] = random_ray(&mesh.bounds, &state);
+
+	start = now_seconds();
+	#pragma omp parallel for schedule(dynamic, 1024) reduction(+:hits)
+	for (size_t i = 0; i < nr_rays; i++) {
+		struct intersection it;
+		float limit = INFINITY;
+		hits += mesh_intersect(&mesh, &rays[i], &limit, &it);
+	}
+	double trace = now_seconds() - start;
+	printf("trace: %zu rays, %zu hits in %.3fs (%.2f Mrays/s)\n", nr_rays,
+	       hits, trace, nr_rays / trace / 1e6);
+
+	free(rays);
+	mesh_destroy(&mesh);
+	return 0;
+}
@@ -0,0 +1,114 @@
+/*
+ * rayquery: trace a file of rays against a scene, closest-hit or any-hit,
+ * write a file of hits (see ray-query.h) and report the throughput.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "../ray-query.h"
+#include "../scene-file.h"
+#include "../accel.h"
+#include "../util.h"
+#include "../lib/error.h"
+#include "../lib/string-util.h"
+#include "../lib/tempfile.h"
+
+static const char usage[] =
+	"usage: rayquery [--any] [--sort] <scene-file> <rays-file> <hits-file>";
+
+/* Maps the rays of `path` read-only, dying on error. */
+static const struct ray_query *map_rays(const char *path, size_t *nr,
+					size_t *map_size)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		die_errno("failed to open '%s'", path);
+	if (fstat(fd, &st))
+		die_errno("failed to stat '%s'", path);
+	if ((size_t)st.st_size < sizeof(struct ray_file_header))
+		die("'%s' is not a ray file", path);
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		die_errno("failed to mmap '%s'", path);
+
+	const struct ray_file_header *h = map;
+	if (memcmp(h->magic, RAY_FILE_MAGIC, sizeof(RAY_FILE_MAGIC)) ||
+	    h->version != RAY_FILE_VERSION ||
+	    h->byte_order != SCENE_FILE_BYTE_ORDER)
+		die("'%s' is not a ray file of this version and byte order", path);
+	if ((st.st_size - sizeof(*h)) / sizeof(struct ray_query) != h->nr ||
+	    (st.st_size - sizeof(*h)) % sizeof(struct ray_query))
+		die("'%s' does not hold %llu rays", path,
+		    (unsigned long long)h->nr);
+	*nr = h->nr;
+	*map_size = st.st_size;
+	return (const struct ray_query *)(h + 1);
+}
+
+int main(int argc, char **argv)
+{
+	struct scene scene = SCENE_INIT;
+	enum ray_query_type type = RAY_QUERY_CLOSEST;
+	int sort = 0;
+	size_t nr, rays_size;
+
+	for (; argc > 1 && !strncmp(argv[1], "--", 2); argc--, argv++) {
+		if (!strcmp(argv[1], "--any"))
+			type = RAY_QUERY_ANY;
+		else if (!strcmp(argv[1], "--sort"))
+			sort = 1;
+		else
+			die("%s", usage);
+	}
+	if (argc != 4)
+		die("%s", usage);
+	const char *hits_path = argv[3];
+
+	const struct ray_query *rays = map_rays(argv[2], &nr, &rays_size);
+	scene_file_load(&scene, argv[1]);
+	char *cache_path = xmkstr("%s.bvh", argv[1]);
+	scene_prepare_accel(&scene, cache_path, BVH_BUILD_SAH);
+	free(cache_path);
+
+	/* Hits are written in place, into the mapped file. */
+	size_t hits_size = sizeof(struct ray_file_header) + nr * sizeof(struct ray_hit);
+	char *template = xmkstr("%s.XXXXXX", hits_path);
+	struct tempfile *tempfile = mktempfile_m(template, 0666);
+	free(template);
+	if (!tempfile)
+		die_errno("failed to create temporary file for '%s'", hits_path);
+	if (ftruncate(get_tempfile_fd(tempfile), hits_size))
+		die_errno("failed to size '%s'", get_tempfile_path(tempfile));
+	struct ray_file_header *h = mmap(NULL, hits_size, PROT_READ | PROT_WRITE,
+					 MAP_SHARED, get_tempfile_fd(tempfile), 0);
+	if (h == MAP_FAILED)
+		die_errno("failed to mmap '%s'", get_tempfile_path(tempfile));
+	*h = (struct ray_file_header){
+		.magic = HIT_FILE_MAGIC,
+		.version = RAY_FILE_VERSION,
+		.byte_order = SCENE_FILE_BYTE_ORDER,
+		.nr = nr,
+	};
+
+	double start = now_seconds();
+	size_t nr_hits = scene_query_rays(&scene, type, sort, rays,
+					  (struct ray_hit *)(h + 1), nr);
+	double elapsed = now_seconds() - start;
+	printf("%s: %zu rays, %zu hits (%.1f%%) in %.3fs (%.2f Mrays/s)\n",
+	       type == RAY_QUERY_ANY ? "any-hit" : "closest-hit", nr, nr_hits,
+	       nr ? 100.0 * nr_hits / nr : 0, elapsed, nr / elapsed / 1e6);
+
+	if (munmap(h, hits_size))
+		die_errno("failed to unmap '%s'", get_tempfile_path(tempfile));
+	if (rename_tempfile(&tempfile, hits_path))
+		die_errno("failed to write '%s'", hits_path);
+	munmap((void *)((const struct ray_file_header *)rays - 1), rays_size);
+	scene_destroy(&scene);
+	return 0;
+}
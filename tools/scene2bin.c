@@ -0,0 +1,801 @@
+/*
+ * scene2bin: convert a text scene description into a binary scene file
+ * (see scene-file.h). The text format is documented in README.md.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include "../obj.h"
+#include "../scene-file.h"
+#include "../lib/array.h"
+#include "../lib/error.h"
+#include "../lib/strmap.h"
+#include "../lib/string-util.h"
+#include "../lib/wrappers.h"
+
+#define MAX_TOKENS 16
+
+static const char *input_path;
+static size_t line_nr;
+
+static ARRAY(char) strings;
+static ARRAY(struct scene_file_texture) textures;
+static ARRAY(struct scene_file_material) materials;
+static ARRAY(struct light) lights;
+static ARRAY(struct entity) entities;
+static ARRAY(struct scene_file_prototype) prototypes;
+static ARRAY(struct entity) proto_entities;
+static ARRAY(struct instance) instances;
+static ARRAY(struct scene_file_mesh) meshes;
+static ARRAY(float) mesh_floats;
+static ARRAY(uint32_t) mesh_indices;
+static ARRAY(struct scene_file_particles) particle_sets;
+static ARRAY(float) particle_floats;
+static ARRAY(uint16_t) particle_radii;
+static ARRAY(uint8_t) particle_colors;
+static ARRAY(struct scene_file_heightfield) heightfields;
+static ARRAY(float) heightfield_floats;
+static ARRAY(uint16_t) heightfield_samples;
+static struct strmap texture_names, material_names, prototype_names;
+/* The prototype being defined, if any. */
+static struct scene_file_prototype *cur_prototype;
+
+static struct scene_file_data data = {
+	.camera = CAMERA_INIT,
+	.background = -1,
+};
+
+noreturn static void parse_die(const char *fmt, ...)
+{
+	va_list args;
+	fprintf(stderr, "fatal: %s:%zu: ", input_path, line_nr);
+	va_start(args, fmt);
+	vfprintf(stderr, fmt, args);
+	va_end(args);
+	fputc('\n', stderr);
+	exit(128);
+}
+
+static int tokenize(char *line, char **tokens)
+{
+	int nr = 0;
+	char *saveptr;
+	for (char *tok = strtok_r(line, " \t\r\n", &saveptr); tok;
+	     tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+		if (*tok == '#')
+			break;
+		if (nr == MAX_TOKENS)
+			parse_die("too many tokens");
+		tokens[nr++] = tok;
+	}
+	return nr;
+}
+
+static float parse_float(const char *str)
+{
+	char *end;
+	float f = strtof(str, &end);
+	if (end == str || *end)
+		parse_die("invalid number '%s'", str);
+	return f;
+}
+
+/* Parses `nr` comma-separated numbers. Returns -1 on error. */
+static int parse_floats(const char *str, float *v, int nr)
+{
+	const char *p = str;
+	for (int i = 0; i < nr; i++) {
+		char *end;
+		v[i] = strtof(p, &end);
+		if (end == p || *end != (i == nr - 1 ? '\0' : ','))
+			return -1;
+		p = end + 1;
+	}
+	return 0;
+}
+
+static struct vec3 parse_vec3(const char *str)
+{
+	float v[3];
+	if (parse_floats(str, v, 3))
+		parse_die("invalid vector '%s' (expected x,y,z)", str);
+	return vec3_new(v[0], v[1], v[2]);
+}
+
+static struct vec3 parse_vec3_tokens(char **tokens)
+{
+	return vec3_new(parse_float(tokens[0]), parse_float(tokens[1]),
+			parse_float(tokens[2]));
+}
+
+static uint32_t add_name(struct strmap *map, const char *kind, const char *name,
+			 size_t index)
+{
+	char *key = xstrdup(name);
+	if (strmap_put(map, key, (void *)(uintptr_t)(index + 1)))
+		parse_die("duplicate %s '%s'", kind, name);
+	return index;
+}
+
+static uint32_t lookup_name(struct strmap *map, const char *kind, const char *name)
+{
+	void *val;
+	if (!strmap_find(map, name, &val))
+		parse_die("unknown %s '%s'", kind, name);
+	return (uintptr_t)val - 1;
+}
+
+static uint32_t add_string(const char *str)
+{
+	uint32_t offset = strings.nr;
+	for (const char *c = str; ; c++) {
+		ARRAY_APPEND(&strings, *c);
+		if (!*c)
+			break;
+	}
+	return offset;
+}
+
+static void parse_camera(char **tokens, int nr)
+{
+	for (int i = 1; i < nr; i++) {
+		const char *val;
+		if (skip_prefix(tokens[i], "pos=", &val))
+			data.camera.pos = parse_vec3(val);
+		else if (skip_prefix(tokens[i], "dir=", &val))
+			data.camera.dir = parse_vec3(val);
+		else if (skip_prefix(tokens[i], "up=", &val))
+			data.camera.up = parse_vec3(val);
+		else if (skip_prefix(tokens[i], "dist=", &val))
+			data.camera.viewpoint_dist = parse_float(val);
+		else
+			parse_die("unknown camera property '%s'", tokens[i]);
+	}
+}
+
+/* texture <name> <file> [rotate_x=<pixels>] [invert_x] [invert_y] */
+static void parse_texture(char **tokens, int nr)
+{
+	struct scene_file_texture t = { 0 };
+	const char *val;
+	if (nr < 3)
+		parse_die("usage: texture <name> <file> [<options>]");
+	add_name(&texture_names, "texture", tokens[1], textures.nr);
+	t.name = add_string(tokens[2]);
+	for (int i = 3; i < nr; i++) {
+		if (skip_prefix(tokens[i], "rotate_x=", &val))
+			t.rotate_X = parse_float(val);
+		else if (!strcmp(tokens[i], "invert_x"))
+			t.invert_X = 1;
+		else if (!strcmp(tokens[i], "invert_y"))
+			t.invert_Y = 1;
+		else
+			parse_die("unknown texture option '%s'", tokens[i]);
+	}
+	ARRAY_APPEND(&textures, t);
+}
+
+/* material <name> [matte|glossy|reflective] [<key>=<value>...] */
+static void parse_material(char **tokens, int nr)
+{
+	struct scene_file_material m = { .texture = -1, .diffuse_constant = 1 };
+	const char *val;
+	if (nr < 2)
+		parse_die("usage: material <name> [<preset>] [<key>=<value>...]");
+	add_name(&material_names, "material", tokens[1], materials.nr);
+	for (int i = 2; i < nr; i++) {
+		if (!strcmp(tokens[i], "matte")) {
+			m.specular_constant = m.shininess = 0;
+		} else if (!strcmp(tokens[i], "glossy")) {
+			m.specular_constant = 1;
+			m.shininess = 400;
+		} else if (!strcmp(tokens[i], "reflective")) {
+			m.specular_constant = 1;
+			m.shininess = 800;
+			m.reflectiveness = 0.5;
+		} else if (skip_prefix(tokens[i], "color=", &val)) {
+			m.color = parse_vec3(val);
+		} else if (skip_prefix(tokens[i], "texture=", &val)) {
+			m.texture = lookup_name(&texture_names, "texture", val);
+		} else if (skip_prefix(tokens[i], "diffuse=", &val)) {
+			m.diffuse_constant = parse_float(val);
+		} else if (skip_prefix(tokens[i], "specular=", &val)) {
+			m.specular_constant = parse_float(val);
+		} else if (skip_prefix(tokens[i], "shininess=", &val)) {
+			m.shininess = parse_float(val);
+		} else if (skip_prefix(tokens[i], "reflect=", &val)) {
+			m.reflectiveness = parse_float(val);
+		} else {
+			parse_die("unknown material property '%s'", tokens[i]);
+		}
+	}
+	ARRAY_APPEND(&materials, m);
+}
+
+static struct entity parse_sphere(char **tokens, int nr)
+{
+	if (nr != 6)
+		parse_die("usage: sphere <x> <y> <z> <radius> <material>");
+	return ENTITY_SPHERE(parse_vec3_tokens(&tokens[1]), parse_float(tokens[4]),
+			     lookup_name(&material_names, "material", tokens[5]));
+}
+
+/* See scene_entity_takes_texture(). */
+static void check_texture(const struct entity *e)
+{
+	if (e->material == ENTITY_NO_MATERIAL ||
+	    materials.arr[e->material].texture < 0 ||
+	    e->type == ENT_SPHERE || e->type == ENT_HEIGHTFIELD)
+		return;
+	if (e->type == ENT_INSTANCE) {
+		const struct scene_file_prototype *p =
+			&prototypes.arr[instances.arr[e->u.instance].prototype];
+		for (uint32_t i = 0; i < p->nr; i++) {
+			struct entity pe = proto_entities.arr[p->first + i];
+			pe.material = e->material;
+			check_texture(&pe);
+		}
+		return;
+	}
+	parse_die("only spheres and heightfields can be textured");
+}
+
+/*
+ * instance <prototype> [material=<material>] [scale=<s>|<x>,<y>,<z>]
+ *          [rotate=<x>,<y>,<z>,<degrees>] [translate=<x>,<y>,<z>]
+ *
+ * Transforms are applied in the order given.
+ */
+static void parse_instance(char **tokens, int nr)
+{
+	struct instance inst = { .to_world = AFFINE_IDENTITY };
+	uint32_t material = ENTITY_NO_MATERIAL;
+	const char *val;
+	if (nr < 2)
+		parse_die("usage: instance <prototype> [<key>=<value>...]");
+	inst.prototype = lookup_name(&prototype_names, "prototype", tokens[1]);
+	for (int i = 2; i < nr; i++) {
+		struct affine t;
+		float v[4];
+		if (skip_prefix(tokens[i], "material=", &val)) {
+			material = lookup_name(&material_names, "material", val);
+			continue;
+		} else if (skip_prefix(tokens[i], "scale=", &val)) {
+			if (!parse_floats(val, v, 1))
+				v[1] = v[2] = v[0];
+			else if (parse_floats(val, v, 3))
+				parse_die("invalid scale '%s'", val);
+			t = affine_scale(vec3_new(v[0], v[1], v[2]));
+		} else if (skip_prefix(tokens[i], "rotate=", &val)) {
+			if (parse_floats(val, v, 4) || !vec3_norm(vec3_new(v[0], v[1], v[2])))
+				parse_die("invalid rotation '%s' (expected x,y,z,degrees)", val);
+			t = affine_rotate(vec3_new(v[0], v[1], v[2]), v[3]);
+		} else if (skip_prefix(tokens[i], "translate=", &val)) {
+			t = affine_translate(parse_vec3(val));
+		} else {
+			parse_die("unknown instance property '%s'", tokens[i]);
+		}
+		inst.to_world = affine_mul(&t, &inst.to_world);
+	}
+	if (affine_invert(&inst.to_world, &inst.to_object))
+		parse_die("instance transform is singular");
+	ARRAY_APPEND(&instances, inst);
+	struct entity e = ENTITY_INSTANCE(instances.nr - 1, material);
+	check_texture(&e);
+	ARRAY_APPEND(&entities, e);
+}
+
+#define APPEND_N(array, src, n) do { \
+	ALLOC_GROW((array)->arr, (array)->nr + (n), (array)->alloc); \
+	memcpy((array)->arr + (array)->nr, (src), (n) * sizeof(*(array)->arr)); \
+	(array)->nr += (n); \
+} while (0)
+
+/* mesh <file.obj> <material> [flat] */
+static struct entity parse_mesh(char **tokens, int nr)
+{
+	struct scene_file_mesh fm = { 0 };
+	struct mesh m;
+	int flat = 0;
+	if (nr == 4 && !strcmp(tokens[3], "flat"))
+		flat = 1;
+	else if (nr != 3)
+		parse_die("usage: mesh <file.obj> <material> [flat]");
+	uint32_t material = lookup_name(&material_names, "material", tokens[2]);
+	if (obj_load(&m, tokens[1]))
+		parse_die("failed to load mesh '%s'", tokens[1]);
+
+	fm.vertices = mesh_floats.nr;
+	fm.triangles = mesh_indices.nr / 3;
+	fm.nr_vertices = m.nr_vertices;
+	fm.nr_triangles = m.nr_triangles;
+	fm.has_normals = !flat;
+	APPEND_N(&mesh_floats, m.x, m.nr_vertices);
+	APPEND_N(&mesh_floats, m.y, m.nr_vertices);
+	APPEND_N(&mesh_floats, m.z, m.nr_vertices);
+	if (!flat) {
+		APPEND_N(&mesh_floats, m.nx, m.nr_vertices);
+		APPEND_N(&mesh_floats, m.ny, m.nr_vertices);
+		APPEND_N(&mesh_floats, m.nz, m.nr_vertices);
+	}
+	APPEND_N(&mesh_indices, m.tris, st_mult(3, m.nr_triangles));
+	mesh_destroy(&m);
+
+	ARRAY_APPEND(&meshes, fm);
+	return ENTITY_MESH(meshes.nr - 1, material);
+}
+
+/*
+ * Reads a particle file, whose lines are "<x> <y> <z> [<radius> [<color>]]",
+ * into `p`. Particles without a radius get `radius`, and those without a
+ * color get color 0.
+ */
+static void read_particles(const char *path, float radius, uint32_t nr_colors,
+			   struct particles *p)
+{
+	ARRAY(float) pos = { 0 };
+	ARRAY(float) radii = { 0 };
+	ARRAY(uint8_t) colors = { 0 };
+	char *line = NULL;
+	size_t alloc = 0, nr = 0, file_line = 0;
+	float max_radius = 0;
+
+	FILE *in = fopen(path, "r");
+	if (!in)
+		die_errno("failed to open '%s'", path);
+	while (getline(&line, &alloc, in) > 0) {
+		char *tokens[MAX_TOKENS];
+		int nr_tokens = tokenize(line, tokens);
+		float v[4];
+		file_line++;
+		if (!nr_tokens)
+			continue;
+		if (nr_tokens < 3 || nr_tokens > 5)
+			die("%s:%zu: expected <x> <y> <z> [<radius> [<color>]]",
+			    path, file_line);
+		for (int i = 0; i < 3; i++)
+			v[i] = parse_float(tokens[i]);
+		v[3] = nr_tokens > 3 ? parse_float(tokens[3]) : radius;
+		if (!(v[3] > 0))
+			die("%s:%zu: particles need a positive radius", path, file_line);
+		unsigned long color = 0;
+		if (nr_tokens > 4) {
+			char *end;
+			color = strtoul(tokens[4], &end, 10);
+			if (*end || color >= (nr_colors ? nr_colors : 1))
+				die("%s:%zu: invalid color '%s'", path, file_line,
+				    tokens[4]);
+		}
+		APPEND_N(&pos, v, 3);
+		ARRAY_APPEND(&radii, v[3]);
+		uint8_t c = color;
+		ARRAY_APPEND(&colors, c);
+		if (v[3] > max_radius)
+			max_radius = v[3];
+		nr++;
+	}
+	if (ferror(in))
+		die_errno("failed to read '%s'", path);
+	fclose(in);
+	free(line);
+	if (!nr)
+		parse_die("no particles in '%s'", path);
+	if (nr > UINT32_MAX)
+		parse_die("too many particles in '%s'", path);
+
+	particles_alloc(p, nr, nr_colors);
+	p->radius_scale = particles_radius_scale(max_radius);
+	for (size_t i = 0; i < nr; i++) {
+		p->x[i] = pos.arr[3 * i];
+		p->y[i] = pos.arr[3 * i + 1];
+		p->z[i] = pos.arr[3 * i + 2];
+		p->radius[i] = particles_quantize_radius(p, radii.arr[i]);
+		p->color[i] = colors.arr[i];
+	}
+	free(pos.arr);
+	free(radii.arr);
+	free(colors.arr);
+}
+
+/*
+ * particles <file> <material> [radius=<r>] [color=<r>,<g>,<b>...]
+ *
+ * Each color option adds an entry to the palette, which the particle
+ * file's colors index.
+ */
+static struct entity parse_particles(char **tokens, int nr)
+{
+	struct scene_file_particles fp = { 0 };
+	struct vec3 palette[PARTICLE_MAX_COLORS];
+	struct particles p;
+	uint32_t nr_colors = 0;
+	float radius = 0;
+	const char *val;
+
+	if (nr < 3)
+		parse_die("usage: particles <file> <material> [<key>=<value>...]");
+	uint32_t material = lookup_name(&material_names, "material", tokens[2]);
+	for (int i = 3; i < nr; i++) {
+		if (skip_prefix(tokens[i], "radius=", &val)) {
+			radius = parse_float(val);
+		} else if (skip_prefix(tokens[i], "color=", &val)) {
+			if (nr_colors == PARTICLE_MAX_COLORS)
+				parse_die("too many colors");
+			palette[nr_colors++] = parse_vec3(val);
+		} else {
+			parse_die("unknown particles property '%s'", tokens[i]);
+		}
+	}
+	read_particles(tokens[1], radius, nr_colors, &p);
+	memcpy(p.palette, palette, nr_colors * sizeof(*palette));
+	particles_sort(&p);
+
+	fp.centers = particle_floats.nr;
+	fp.first = particle_radii.nr;
+	fp.nr = p.nr;
+	fp.nr_colors = p.nr_colors;
+	fp.radius_scale = p.radius_scale;
+	APPEND_N(&particle_floats, p.x, p.nr);
+	APPEND_N(&particle_floats, p.y, p.nr);
+	APPEND_N(&particle_floats, p.z, p.nr);
+	APPEND_N(&particle_floats, (float *)p.palette, 3 * p.nr_colors);
+	APPEND_N(&particle_radii, p.radius, p.nr);
+	APPEND_N(&particle_colors, p.color, p.nr);
+	particles_destroy(&p);
+
+	ARRAY_APPEND(&particle_sets, fp);
+	return ENTITY_PARTICLES(particle_sets.nr - 1, material);
+}
+
+/* Reads the next header field of a PGM file, skipping comments. */
+static unsigned long read_pgm_field(FILE *in, const char *path)
+{
+	unsigned long val;
+	int c;
+	while ((c = fgetc(in)) == '#' || isspace(c))
+		if (c == '#')
+			while ((c = fgetc(in)) != EOF && c != '\n')
+				;
+	if (c == EOF || ungetc(c, in) == EOF || fscanf(in, "%lu", &val) != 1)
+		parse_die("'%s' has a bad PGM header", path);
+	return val;
+}
+
+/*
+ * Reads a binary (P5) or plain (P2) PGM file into 16-bit heights. Returns
+ * the maximum sample value.
+ */
+static unsigned long read_pgm(const char *path, FILE *in, struct heightfield *hf)
+{
+	char magic[2];
+	if (fread(magic, 1, 2, in) != 2 || magic[0] != 'P' ||
+	    (magic[1] != '2' && magic[1] != '5'))
+		parse_die("'%s' is not a PGM file", path);
+	unsigned long nx = read_pgm_field(in, path);
+	unsigned long nz = read_pgm_field(in, path);
+	unsigned long maxval = read_pgm_field(in, path);
+	if (nx > UINT32_MAX || nz > UINT32_MAX || !maxval || maxval > UINT16_MAX)
+		parse_die("'%s' has a bad PGM header", path);
+	if (magic[1] == '5')
+		fgetc(in); /* the single whitespace before the samples */
+
+	heightfield_alloc(hf, nx, nz, 1);
+	for (size_t i = 0; i < (size_t)nx * nz; i++) {
+		unsigned long v;
+		if (magic[1] == '2') {
+			if (fscanf(in, "%lu", &v) != 1)
+				v = ULONG_MAX;
+		} else if (maxval < 256) {
+			int c = fgetc(in);
+			v = c == EOF ? ULONG_MAX : c;
+		} else {
+			int hi = fgetc(in), lo = fgetc(in);
+			v = hi == EOF || lo == EOF ? ULONG_MAX : (hi << 8 | lo);
+		}
+		if (v > maxval)
+			parse_die("'%s' is truncated or has bad samples", path);
+		hf->heights16[i] = v;
+	}
+	return maxval;
+}
+
+/*
+ * Reads a text grid, with one row of heights per line, into float
+ * heights.
+ */
+static void read_height_grid(const char *path, FILE *in, struct heightfield *hf)
+{
+	ARRAY(float) heights = { 0 };
+	char *line = NULL;
+	size_t alloc = 0, nx = 0, nz = 0;
+
+	while (getline(&line, &alloc, in) > 0) {
+		size_t row = 0;
+		char *saveptr;
+		for (char *tok = strtok_r(line, " \t\r\n", &saveptr); tok;
+		     tok = strtok_r(NULL, " \t\r\n", &saveptr)) {
+			if (*tok == '#')
+				break;
+			float h = parse_float(tok);
+			ARRAY_APPEND(&heights, h);
+			row++;
+		}
+		if (!row)
+			continue;
+		if (nz && row != nx)
+			parse_die("'%s': row %zu has %zu heights, expected %zu",
+				  path, nz + 1, row, nx);
+		nx = row;
+		nz++;
+	}
+	if (ferror(in))
+		die_errno("failed to read '%s'", path);
+	free(line);
+	if (nx > UINT32_MAX || nz > UINT32_MAX)
+		parse_die("'%s' is too large", path);
+
+	heightfield_alloc(hf, nx, nz, 0);
+	memcpy(hf->heights, heights.arr, st_mult(heights.nr, sizeof(float)));
+	free(heights.arr);
+}
+
+/*
+ * Quantizes float heights to 16 bits over their range, adjusting the
+ * origin and scale to keep the same world heights.
+ */
+static void quantize_heights(struct heightfield *hf)
+{
+	struct heightfield q;
+	size_t nr = (size_t)hf->nx * hf->nz;
+	float lo = INFINITY, hi = -INFINITY;
+
+	for (size_t i = 0; i < nr; i++) {
+		lo = hf->heights[i] < lo ? hf->heights[i] : lo;
+		hi = hf->heights[i] > hi ? hf->heights[i] : hi;
+	}
+	heightfield_alloc(&q, hf->nx, hf->nz, 1);
+	q.origin = hf->origin;
+	q.origin.y += lo * hf->height_scale;
+	q.cell_x = hf->cell_x;
+	q.cell_z = hf->cell_z;
+	q.height_scale = hi > lo ? (hi - lo) * hf->height_scale / UINT16_MAX : 1;
+	for (size_t i = 0; i < nr; i++)
+		q.heights16[i] = hi > lo ?
+			roundf((hf->heights[i] - lo) / (hi - lo) * UINT16_MAX) : 0;
+	heightfield_destroy(hf);
+	*hf = q;
+}
+
+/*
+ * heightfield <file> <material> [origin=<x>,<y>,<z>] [size=<x>,<y>,<z>]
+ *             [16bit]
+ *
+ * The file is either a PGM image, whose samples are kept as 16-bit
+ * heights, or a text grid of float heights. The grid spans `size` along x
+ * and z from `origin`, and heights are scaled by size.y, so that a PGM's
+ * maximum value is size.y above origin.y.
+ */
+static struct entity parse_heightfield(char **tokens, int nr)
+{
+	struct scene_file_heightfield fh = { 0 };
+	struct vec3 origin = vec3_new(0, 0, 0), size = vec3_new(1, 1, 1);
+	struct heightfield hf;
+	int bits16 = 0;
+	const char *val;
+
+	if (nr < 3)
+		parse_die("usage: heightfield <file> <material> [<key>=<value>...]");
+	uint32_t material = lookup_name(&material_names, "material", tokens[2]);
+	for (int i = 3; i < nr; i++) {
+		if (skip_prefix(tokens[i], "origin=", &val))
+			origin = parse_vec3(val);
+		else if (skip_prefix(tokens[i], "size=", &val))
+			size = parse_vec3(val);
+		else if (!strcmp(tokens[i], "16bit"))
+			bits16 = 1;
+		else
+			parse_die("unknown heightfield property '%s'", tokens[i]);
+	}
+
+	FILE *in = fopen(tokens[1], "r");
+	if (!in)
+		die_errno("failed to open '%s'", tokens[1]);
+	float scale = size.y;
+	size_t len;
+	if (strip_suffix(tokens[1], ".pgm", &len))
+		scale /= read_pgm(tokens[1], in, &hf);
+	else
+		read_height_grid(tokens[1], in, &hf);
+	fclose(in);
+	if (hf.nx < 2 || hf.nz < 2)
+		parse_die("'%s' needs at least 2 by 2 heights", tokens[1]);
+	if (!(size.x > 0) || !(size.z > 0))
+		parse_die("heightfield size must be positive along x and z");
+	hf.origin = origin;
+	hf.cell_x = size.x / (hf.nx - 1);
+	hf.cell_z = size.z / (hf.nz - 1);
+	hf.height_scale = scale;
+	if (bits16 && hf.heights)
+		quantize_heights(&hf);
+
+	fh.nx = hf.nx;
+	fh.nz = hf.nz;
+	fh.origin = hf.origin;
+	fh.cell_x = hf.cell_x;
+	fh.cell_z = hf.cell_z;
+	fh.height_scale = hf.height_scale;
+	fh.bits16 = !!hf.heights16;
+	if (hf.heights16) {
+		fh.first = heightfield_samples.nr;
+		APPEND_N(&heightfield_samples, hf.heights16, (size_t)hf.nx * hf.nz);
+	} else {
+		fh.first = heightfield_floats.nr;
+		APPEND_N(&heightfield_floats, hf.heights, (size_t)hf.nx * hf.nz);
+	}
+	heightfield_destroy(&hf);
+
+	ARRAY_APPEND(&heightfields, fh);
+	return ENTITY_HEIGHTFIELD(heightfields.nr - 1, material);
+}
+
+/* Lines between "prototype <name>" and "end". */
+static void parse_prototype_line(char **tokens, int nr)
+{
+	struct entity e;
+	if (!strcmp(tokens[0], "sphere")) {
+		e = parse_sphere(tokens, nr);
+	} else if (!strcmp(tokens[0], "mesh")) {
+		e = parse_mesh(tokens, nr);
+	} else if (!strcmp(tokens[0], "particles")) {
+		e = parse_particles(tokens, nr);
+	} else if (!strcmp(tokens[0], "heightfield")) {
+		e = parse_heightfield(tokens, nr);
+	} else if (!strcmp(tokens[0], "end")) {
+		if (!cur_prototype->nr)
+			parse_die("empty prototype");
+		cur_prototype = NULL;
+		return;
+	} else {
+		parse_die("prototypes may only contain spheres, meshes, particles and heightfields");
+	}
+	check_texture(&e);
+	ARRAY_APPEND(&proto_entities, e);
+	cur_prototype->nr++;
+}
+
+static void parse_line(char *line)
+{
+	char *tokens[MAX_TOKENS];
+	int nr = tokenize(line, tokens);
+	if (!nr)
+		return;
+
+	if (cur_prototype) {
+		parse_prototype_line(tokens, nr);
+	} else if (!strcmp(tokens[0], "sphere")) {
+		struct entity e = parse_sphere(tokens, nr);
+		ARRAY_APPEND(&entities, e);
+	} else if (!strcmp(tokens[0], "mesh")) {
+		struct entity e = parse_mesh(tokens, nr);
+		check_texture(&e);
+		ARRAY_APPEND(&entities, e);
+	} else if (!strcmp(tokens[0], "particles")) {
+		struct entity e = parse_particles(tokens, nr);
+		check_texture(&e);
+		ARRAY_APPEND(&entities, e);
+	} else if (!strcmp(tokens[0], "heightfield")) {
+		struct entity e = parse_heightfield(tokens, nr);
+		check_texture(&e);
+		ARRAY_APPEND(&entities, e);
+	} else if (!strcmp(tokens[0], "prototype")) {
+		if (nr != 2)
+			parse_die("usage: prototype <name>");
+		add_name(&prototype_names, "prototype", tokens[1], prototypes.nr);
+		struct scene_file_prototype p = { .first = proto_entities.nr };
+		ARRAY_APPEND(&prototypes, p);
+		cur_prototype = &prototypes.arr[prototypes.nr - 1];
+	} else if (!strcmp(tokens[0], "instance")) {
+		parse_instance(tokens, nr);
+	} else if (!strcmp(tokens[0], "plane")) {
+		if (nr != 8)
+			parse_die("usage: plane <x> <y> <z> <nx> <ny> <nz> <material>");
+		struct entity e = ENTITY_PLANE(parse_vec3_tokens(&tokens[1]),
+				vec3_normalize(parse_vec3_tokens(&tokens[4])),
+				lookup_name(&material_names, "material", tokens[7]));
+		check_texture(&e);
+		ARRAY_APPEND(&entities, e);
+	} else if (!strcmp(tokens[0], "light")) {
+		if (nr != 5)
+			parse_die("usage: light <x> <y> <z> <intensity>");
+		struct light l = { .pos = parse_vec3_tokens(&tokens[1]),
+				   .intensity = parse_float(tokens[4]) };
+		ARRAY_APPEND(&lights, l);
+	} else if (!strcmp(tokens[0], "material")) {
+		parse_material(tokens, nr);
+	} else if (!strcmp(tokens[0], "texture")) {
+		parse_texture(tokens, nr);
+	} else if (!strcmp(tokens[0], "background")) {
+		if (nr != 2)
+			parse_die("usage: background <texture>");
+		data.background = lookup_name(&texture_names, "texture", tokens[1]);
+	} else if (!strcmp(tokens[0], "camera")) {
+		parse_camera(tokens, nr);
+	} else {
+		parse_die("unknown directive '%s'", tokens[0]);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	if (argc != 3)
+		die("usage: scene2bin <scene.txt> <scene.rtb>");
+	input_path = argv[1];
+
+	FILE *in = fopen(input_path, "r");
+	if (!in)
+		die_errno("failed to open '%s'", input_path);
+
+	strmap_init(&texture_names, strmap_val_plain_copy);
+	strmap_init(&material_names, strmap_val_plain_copy);
+	strmap_init(&prototype_names, strmap_val_plain_copy);
+
+	char *line = NULL;
+	size_t line_alloc = 0;
+	while (getline(&line, &line_alloc, in) > 0) {
+		line_nr++;
+		parse_line(line);
+	}
+	if (ferror(in))
+		die_errno("failed to read '%s'", input_path);
+	if (cur_prototype)
+		parse_die("missing 'end' of prototype");
+	fclose(in);
+	free(line);
+
+	data.strings = strings.arr;
+	data.strings_size = strings.nr;
+	data.textures = textures.arr;
+	data.nr_textures = textures.nr;
+	data.materials = materials.arr;
+	data.nr_materials = materials.nr;
+	data.lights = lights.arr;
+	data.nr_lights = lights.nr;
+	data.entities = entities.arr;
+	data.nr_entities = entities.nr;
+	data.prototypes = prototypes.arr;
+	data.nr_prototypes = prototypes.nr;
+	data.proto_entities = proto_entities.arr;
+	data.nr_proto_entities = proto_entities.nr;
+	data.instances = instances.arr;
+	data.nr_instances = instances.nr;
+	data.meshes = meshes.arr;
+	data.nr_meshes = meshes.nr;
+	data.mesh_floats = mesh_floats.arr;
+	data.nr_mesh_floats = mesh_floats.nr;
+	data.mesh_indices = mesh_indices.arr;
+	data.nr_mesh_indices = mesh_indices.nr;
+	data.particle_sets = particle_sets.arr;
+	data.nr_particle_sets = particle_sets.nr;
+	data.particle_floats = particle_floats.arr;
+	data.nr_particle_floats = particle_floats.nr;
+	data.particle_radii = particle_radii.arr;
+	data.particle_colors = particle_colors.arr;
+	data.nr_particles = particle_radii.nr;
+	data.heightfields = heightfields.arr;
+	data.nr_heightfields = heightfields.nr;
+	data.heightfield_floats = heightfield_floats.arr;
+	data.nr_heightfield_floats = heightfield_floats.nr;
+	data.heightfield_samples = heightfield_samples.arr;
+	data.nr_heightfield_samples = heightfield_samples.nr;
+	if (scene_file_write(&data, argv[2]))
+		return 1;
+
+	fprintf(stderr, "%zu entities, %zu materials, %zu lights, %zu textures, "
+		"%zu prototypes, %zu instances, %zu meshes, %zu particles, "
+		"%zu heightfields\n",
+		entities.nr, materials.nr, lights.nr, textures.nr, prototypes.nr,
+		instances.nr, meshes.nr, particle_radii.nr, heightfields.nr);
+	return 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * shmview: follow a render into a shared-memory framebuffer (see
+ * raytracer --shm), writing a snapshot of the image, as a PPM file, each
+ * time tiles have changed, and a last one once the render is done.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../shm-framebuffer.h"
+#include "../ppm.h"
+#include "../util.h"
+#include "../lib/array.h"
+#include "../lib/error.h"
+#include "../lib/string-util.h"
+
+#define DEFAULT_INTERVAL_MS 100
+
+static void sleep_ms(unsigned long ms)
+{
+	struct timespec ts = { ms / 1000, ms % 1000 * 1000000 };
+	nanosleep(&ts, NULL);
+}
+
+static void write_snapshot(struct shm_framebuffer *fb, struct ppm *ppm,
+			   const char *pattern, unsigned nr)
+{
+	char *path = xmkstr(pattern, nr);
+	FILE *f = fopen(path, "w");
+	if (!f)
+		die_errno("failed to open '%s'", path);
+	shm_framebuffer_get(fb, ppm);
+	ppm_write(ppm, f);
+	if (fclose(f))
+		die_errno("failed to write '%s'", path);
+	free(path);
+}
+
+int main(int argc, char **argv)
+{
+	struct shm_framebuffer fb;
+	unsigned long interval = DEFAULT_INTERVAL_MS;
+	unsigned nr_snapshots = 0;
+	int ret;
+
+	if (argc != 3 && argc != 4)
+		die("usage: shmview <name> <snapshot-pattern> [<interval-ms>]");
+	if (argc == 4 && !(interval = strtoul(argv[3], NULL, 10)))
+		die("invalid interval '%s'", argv[3]);
+	if (check_output_pattern(argv[2]) != 1)
+		die("snapshot pattern '%s' needs exactly one %%d", argv[2]);
+
+	/* The render may not have started yet. */
+	while ((ret = shm_framebuffer_open(&fb, argv[1])) > 0)
+		sleep_ms(interval);
+	if (ret < 0)
+		return 1;
+
+	uint32_t nr_tiles = shm_framebuffer_nr_tiles(&fb);
+	uint32_t *seen;
+	CALLOC_ARRAY(seen, nr_tiles);
+	struct ppm *ppm = ppm_new(fb.header->height, fb.header->width);
+	double start = now_seconds();
+	fprintf(stderr, "%s: %ux%u, %u tiles\n", argv[1], fb.header->width,
+		fb.header->height, nr_tiles);
+
+	for (;;) {
+		/*
+		 * Once `done` is read, the last tiles are too: the pixels read
+		 * after it are final.
+		 */
+		int done = __atomic_load_n(&fb.header->done, __ATOMIC_ACQUIRE);
+		uint32_t frame = __atomic_load_n(&fb.header->frame, __ATOMIC_ACQUIRE);
+		uint32_t updated = 0;
+		for (uint32_t t = 0; t < nr_tiles; t++) {
+			uint32_t gen = shm_framebuffer_generation(&fb, t);
+			updated += gen != seen[t];
+			seen[t] = gen;
+		}
+		if (updated || done) {
+			write_snapshot(&fb, ppm, argv[2], nr_snapshots++);
+			fprintf(stderr, "%.3fs: frame %u, %u tiles updated%s\n",
+				now_seconds() - start, frame, updated,
+				done ? ", done" : "");
+		}
+		if (done)
+			break;
+		sleep_ms(interval);
+	}
+
+	ppm_destroy(&ppm);
+	free(seen);
+	shm_framebuffer_close(&fb);
+	return 0;
+}
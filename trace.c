@@ -0,0 +1,232 @@
+#include "trace.h"
+
+static int traverse(struct scene *scene, const struct bvh *bvh,
+		    struct entity *entities, struct ray *r, float *limit,
+		    struct intersection *nearest_it, int *ret, uint32_t *stop);
+
+/*
+ * Traces the ray through the instance's prototype, in object space. The
+ * object space ray direction is renormalized, so distances are scaled by
+ * its length on the way in and out.
+ */
+static inline int test_instance(struct scene *scene, struct entity *e,
+				struct ray *r, float *limit,
+				struct intersection *nearest_it, int *ret)
+{
+	const struct instance *inst = &scene->instances[e->u.instance];
+	const struct prototype *p = &scene->prototypes[inst->prototype];
+	struct vec3 dir = affine_vector(&inst->to_object, r->dir);
+	float scale = vec3_norm(dir);
+	struct ray obj_r = {
+		.pos = affine_point(&inst->to_object, r->pos),
+		.dir = vec3_sdiv(dir, scale),
+	};
+	float obj_limit = *limit * scale;
+	struct intersection obj_it = { .dist = INFINITY };
+	int hit = 0;
+
+	if (traverse(scene, &p->bvh, scene->proto_entities + p->first, &obj_r,
+		     &obj_limit, nearest_it ? &obj_it : NULL, &hit, NULL)) {
+		*ret = 1;
+		return 1;
+	}
+	if (!hit || obj_it.dist / scale >= nearest_it->dist)
+		return 0;
+
+	nearest_it->dist = *limit = obj_it.dist / scale;
+	nearest_it->pos = vec3_add(r->pos, vec3_smul(r->dir, nearest_it->dist));
+	nearest_it->normal = vec3_normalize(
+		affine_transpose_vector(&inst->to_object, obj_it.normal));
+	nearest_it->entity = obj_it.entity;
+	nearest_it->instance = e;
+	nearest_it->prim = obj_it.prim;
+	*ret = 1;
+	return 0;
+}
+
+static inline int test_mesh(struct scene *scene, struct entity *e,
+			    struct ray *r, float *limit,
+			    struct intersection *nearest_it, int *ret)
+{
+	struct intersection this_it;
+	if (!mesh_intersect(&scene->meshes[e->u.mesh], r, limit,
+			    nearest_it ? &this_it : NULL))
+		return 0;
+	*ret = 1;
+	if (!nearest_it)
+		return 1;
+	/* mesh_intersect() only returns hits closer than *limit. */
+	*nearest_it = this_it;
+	nearest_it->entity = e;
+	nearest_it->instance = NULL;
+	return 0;
+}
+
+static inline int test_particles(struct scene *scene, struct entity *e,
+				 struct ray *r, float *limit,
+				 struct intersection *nearest_it, int *ret)
+{
+	struct intersection this_it;
+	if (!particles_intersect(&scene->particle_sets[e->u.particles], r, limit,
+				 nearest_it ? &this_it : NULL))
+		return 0;
+	*ret = 1;
+	if (!nearest_it)
+		return 1;
+	*nearest_it = this_it;
+	nearest_it->entity = e;
+	nearest_it->instance = NULL;
+	return 0;
+}
+
+static inline int test_heightfield(struct scene *scene, struct entity *e,
+				   struct ray *r, float *limit,
+				   struct intersection *nearest_it, int *ret)
+{
+	struct intersection this_it;
+	if (!heightfield_intersect(&scene->heightfields[e->u.heightfield], r,
+				   limit, nearest_it ? &this_it : NULL))
+		return 0;
+	*ret = 1;
+	if (!nearest_it)
+		return 1;
+	*nearest_it = this_it;
+	nearest_it->entity = e;
+	nearest_it->instance = NULL;
+	return 0;
+}
+
+/*
+ * Tests entity `e` against the ray. Returns 1 if the search can stop
+ * (any-hit query with a hit).
+ */
+static inline int test_entity(struct scene *scene, struct entity *e,
+			      struct ray *r, float *limit,
+			      struct intersection *nearest_it, int *ret)
+{
+	struct intersection this_it;
+	if (e->type == ENT_INSTANCE)
+		return test_instance(scene, e, r, limit, nearest_it, ret);
+	if (e->type == ENT_MESH)
+		return test_mesh(scene, e, r, limit, nearest_it, ret);
+	if (e->type == ENT_PARTICLES)
+		return test_particles(scene, e, r, limit, nearest_it, ret);
+	if (e->type == ENT_HEIGHTFIELD)
+		return test_heightfield(scene, e, r, limit, nearest_it, ret);
+	if (!entity_ray_intersects(r, e, &this_it) || this_it.dist > *limit)
+		return 0;
+	if (!nearest_it) {
+		*ret = 1;
+		return 1;
+	}
+	if (this_it.dist < nearest_it->dist) {
+		*nearest_it = this_it;
+		nearest_it->instance = NULL;
+		*limit = this_it.dist;
+		*ret = 1;
+	}
+	return 0;
+}
+
+/*
+ * Tests the ray against the primitives of `bvh`, which are indices into
+ * `entities`. Returns 1 if the search can stop, in which case the index
+ * of the entity that stopped it is saved on `stop`, if not NULL.
+ */
+static int traverse(struct scene *scene, const struct bvh *bvh,
+		    struct entity *entities, struct ray *r, float *limit,
+		    struct intersection *nearest_it, int *ret, uint32_t *stop)
+{
+	const uint32_t *prims = bvh->prims;
+	struct bvh_ray br = bvh_ray_new(r);
+	struct bvh_traversal t;
+	const struct bvh_node *leaf;
+
+	bvh_traversal_init(&t, bvh, &br, *limit);
+	while ((leaf = nearest_it ? bvh_next_leaf(&t, &br, *limit) :
+				    bvh_next_leaf_any(&t, &br, *limit))) {
+		for (uint32_t i = leaf->first; i < leaf->first + leaf->count; i++) {
+			if (test_entity(scene, &entities[prims[i]], r, limit,
+					nearest_it, ret)) {
+				if (stop)
+					*stop = prims[i];
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+int cast_ray(struct scene *scene, struct ray *r, float limit,
+	     struct intersection *nearest_it)
+{
+	int ret = 0;
+	if (nearest_it)
+		nearest_it->dist = INFINITY;
+
+	for (uint32_t i = 0; i < scene->nr_unbounded; i++) {
+		struct entity *e = &scene->entities[scene->unbounded[i]];
+		if (test_entity(scene, e, r, &limit, nearest_it, &ret))
+			return 1;
+	}
+
+	traverse(scene, &scene->bvh, scene->entities, r, &limit, nearest_it, &ret,
+		 NULL);
+	return ret;
+}
+
+int cast_shadow_ray(struct scene *scene, struct ray *r, float limit,
+		    uint32_t *occluder)
+{
+	int ret = 0;
+
+	/*
+	 * The occluder is only tested if traversal would test it too: if the
+	 * ray enters the box of its leaf, and so those of all the leaf's
+	 * ancestors, which contain it. Otherwise, whether a grazing ray is
+	 * blocked would depend on the rays the thread cast before.
+	 */
+	if (*occluder != NO_OCCLUDER) {
+		uint32_t leaf = scene->entity_leaves[*occluder];
+		struct bvh_ray br = bvh_ray_new(r);
+		if (leaf != BVH_NO_LEAF &&
+		    bvh_node_hit(&scene->bvh.nodes[leaf], &br, limit) != INFINITY &&
+		    test_entity(scene, &scene->entities[*occluder], r, &limit,
+				NULL, &ret))
+			return 1;
+	}
+
+	for (uint32_t i = 0; i < scene->nr_unbounded; i++) {
+		struct entity *e = &scene->entities[scene->unbounded[i]];
+		if (test_entity(scene, e, r, &limit, NULL, &ret)) {
+			*occluder = scene->unbounded[i];
+			return 1;
+		}
+	}
+	return traverse(scene, &scene->bvh, scene->entities, r, &limit, NULL,
+			&ret, occluder);
+}
+
+int cast_camera_ray(struct scene *scene, struct ray *r, int i, int j,
+		    struct intersection *nearest_it)
+{
+	const struct screen_bins *sb = &scene->screen_bins;
+	const struct screen_tile *tile = screen_bins_tile(sb, i, j);
+	if (!tile || tile->nr == SCREEN_TILE_OVERFLOW)
+		return cast_ray(scene, r, INFINITY, nearest_it);
+
+	float limit = INFINITY;
+	int ret = 0;
+	nearest_it->dist = INFINITY;
+	for (uint32_t k = 0; k < scene->nr_unbounded; k++)
+		test_entity(scene, &scene->entities[scene->unbounded[k]], r,
+			    &limit, nearest_it, &ret);
+	/* Hits are at least as far as their depth. */
+	for (uint32_t k = tile->first; k < tile->first + tile->nr; k++) {
+		if (sb->near[k] >= limit)
+			break;
+		test_entity(scene, &scene->entities[sb->ids[k]], r, &limit,
+			    nearest_it, &ret);
+	}
+	return ret;
+}
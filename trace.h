@@ -0,0 +1,33 @@
+#pragma once
+
+#include "scene.h"
+
+/*
+ * Returns 1 if the ray intersect any scene object or 0 otherwise.  If
+ * `nearest_it` is not NULL, the data for the nearest intersection is saved
+ * on it. Otherwise, the function returns early at the first intersection.
+ * The scene's acceleration structure must have been prepared (see accel.h).
+ */
+int cast_ray(struct scene *scene, struct ray *r, float limit,
+	     struct intersection *nearest_it);
+
+#define NO_OCCLUDER UINT32_MAX
+
+/*
+ * An any-hit query, like cast_ray() without `nearest_it`, for shadow
+ * rays. `*occluder` is the index of an entity likely to block the ray,
+ * such as the one that blocked the previous shadow ray towards the same
+ * light, or NO_OCCLUDER. It is tested first, if the ray reaches the box
+ * of its BVH leaf, and replaced with the entity that blocked the ray, if
+ * another one did. The result does not depend on `*occluder`.
+ */
+int cast_shadow_ray(struct scene *scene, struct ray *r, float limit,
+		    uint32_t *occluder);
+
+/*
+ * Like cast_ray() with a nearest hit, for a camera ray through pixel
+ * (i, j): if the scene has screen bins (see screen-bins.h), only the
+ * entities binned to the pixel's tile are tested.
+ */
+int cast_camera_ray(struct scene *scene, struct ray *r, int i, int j,
+		    struct intersection *nearest_it);
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdlib.h>
+#include <time.h>
+
 #define max(a, b) ({ \
 		typeof(a) _a = (a); \
 		typeof(b) _b = (b); \
@@ -25,3 +28,10 @@ static inline float rand_r_in(unsigned int *state, float a, float b)
 {
 	return a + (((float)rand_r(state) / RAND_MAX) * (b - a));
 }
+
+static inline double now_seconds(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
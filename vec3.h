@@ -32,6 +32,13 @@ static inline float vec3_norm(struct vec3 v)
 	return sqrt(v.x * v.x + v.y * v.y + v.z * v.z);
 }
 
+static inline struct vec3 vec3_cross(struct vec3 v, struct vec3 u)
+{
+	return vec3_new(v.y * u.z - v.z * u.y,
+			v.z * u.x - v.x * u.z,
+			v.x * u.y - v.y * u.x);
+}
+
 static inline struct vec3 vec3_smul(struct vec3 v, float s)
 {
 	return vec3_new(v.x * s, v.y * s, v.z * s);
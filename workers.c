@@ -0,0 +1,224 @@
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include "workers.h"
+#include "render.h"
+#include "util.h"
+#include "lib/array.h"
+#include "lib/wrappers.h"
+
+void worker_pool_start(struct worker_pool *pool, size_t nr, char **argv)
+{
+	size_t argc = 0;
+	char **args;
+
+	while (argv[argc])
+		argc++;
+	ALLOC_ARRAY(args, argc + 2);
+	args[0] = argv[0];
+	args[1] = "--worker";
+	memcpy(args + 2, argv + 1, argc * sizeof(*args));
+
+	/* Writing to a worker that exited must fail, not kill us. */
+	signal(SIGPIPE, SIG_IGN);
+	pool->nr = nr;
+	CALLOC_ARRAY(pool->workers, nr);
+	for (size_t w = 0; w < nr; w++) {
+		int sv[2];
+		/*
+		 * Close-on-exec, so that workers do not hold each other's
+		 * sockets open.
+		 */
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv))
+			die_errno("failed to create a socket for worker %zu", w);
+		pid_t pid = fork();
+		if (pid < 0)
+			die_errno("failed to start worker %zu", w);
+		if (!pid) {
+			if (dup2(sv[1], 0) < 0 || dup2(sv[1], 1) < 0) {
+				error_errno("failed to set up worker %zu", w);
+				_exit(127);
+			}
+			execv("/proc/self/exe", args);
+			execvp(argv[0], args);
+			error_errno("failed to run worker '%s'", argv[0]);
+			_exit(127);
+		}
+		close(sv[1]);
+		pool->workers[w] = (struct worker){ .pid = pid, .fd = sv[0], .band = -1 };
+	}
+	free(args);
+	fprintf(stderr, "Started %zu workers\n", nr);
+}
+
+typedef ARRAY(int) band_array;
+
+static void drop_worker(struct worker_pool *pool, size_t w, band_array *todo)
+{
+	struct worker *wk = &pool->workers[w];
+
+	warning("dropping worker %zu", w);
+	close(wk->fd);
+	wk->fd = -1;
+	kill(wk->pid, SIGTERM);
+	if (wk->band >= 0)
+		ARRAY_APPEND(todo, wk->band);
+	wk->band = -1;
+}
+
+static void band_rows(const struct ppm *ppm, int band, uint32_t *y0, uint32_t *y1)
+{
+	*y0 = band * WORKER_BAND;
+	*y1 = *y0 + WORKER_BAND < ppm->rows ? *y0 + WORKER_BAND : ppm->rows;
+}
+
+static int send_request(struct worker *wk, const struct ppm *ppm,
+			enum worker_request_type type, uint32_t frame)
+{
+	struct worker_request req = { .type = type, .frame = frame };
+
+	if (type == WORKER_RENDER)
+		band_rows(ppm, wk->band, &req.y0, &req.y1);
+	return write_in_full(wk->fd, &req, sizeof(req)) < 0 ? -1 : 0;
+}
+
+/* Reads the reply to the band `wk` is rendering into `ppm`. */
+static int receive_band(struct worker *wk, struct ppm *ppm, uint32_t frame)
+{
+	struct worker_request req;
+	uint32_t y0, y1;
+
+	band_rows(ppm, wk->band, &y0, &y1);
+	if (read_in_full(wk->fd, &req, sizeof(req)) != sizeof(req) ||
+	    req.type != WORKER_RENDER || req.frame != frame ||
+	    req.y0 != y0 || req.y1 != y1)
+		return -1;
+	size_t size = (size_t)(y1 - y0) * ppm->cols * sizeof(*ppm->img);
+	if (read_in_full(wk->fd, ppm_color(ppm, y0, 0), size) != size)
+		return -1;
+	return 0;
+}
+
+void worker_pool_render(struct worker_pool *pool, struct ppm *ppm,
+			uint32_t frame)
+{
+	int nr_bands = (ppm->rows + WORKER_BAND - 1) / WORKER_BAND, done = 0;
+	band_array todo = ARRAY_STATIC_INIT;
+	struct pollfd *fds;
+	size_t *polled, nr_live = 0;
+	double start = now_seconds();
+
+	/* Popped from the end: bands go out from the top of the image. */
+	for (int b = nr_bands - 1; b >= 0; b--)
+		ARRAY_APPEND(&todo, b);
+	ALLOC_ARRAY(fds, pool->nr);
+	ALLOC_ARRAY(polled, pool->nr);
+
+	while (done < nr_bands) {
+		size_t nr_fds = 0;
+		for (size_t w = 0; w < pool->nr; w++) {
+			struct worker *wk = &pool->workers[w];
+			if (wk->fd < 0)
+				continue;
+			if (wk->band < 0 && todo.nr) {
+				wk->band = todo.arr[--todo.nr];
+				if (send_request(wk, ppm, WORKER_RENDER, frame)) {
+					drop_worker(pool, w, &todo);
+					continue;
+				}
+			}
+			if (wk->band >= 0) {
+				fds[nr_fds] = (struct pollfd){ .fd = wk->fd, .events = POLLIN };
+				polled[nr_fds++] = w;
+			}
+		}
+		/* Idle workers got a band: none left means none alive. */
+		if (!nr_fds)
+			die("all workers failed");
+
+		if (poll(fds, nr_fds, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			die_errno("failed to wait for workers");
+		}
+		for (size_t k = 0; k < nr_fds; k++) {
+			struct worker *wk = &pool->workers[polled[k]];
+			if (!fds[k].revents)
+				continue;
+			if (receive_band(wk, ppm, frame)) {
+				drop_worker(pool, polled[k], &todo);
+			} else {
+				wk->band = -1;
+				done++;
+			}
+		}
+	}
+
+	for (size_t w = 0; w < pool->nr; w++) {
+		struct worker *wk = &pool->workers[w];
+		if (wk->fd < 0)
+			continue;
+		if (send_request(wk, ppm, WORKER_END_FRAME, frame))
+			drop_worker(pool, w, &todo);
+		else
+			nr_live++;
+	}
+	fprintf(stderr, "Rendered %d bands with %zu workers in %.3fs\n",
+		nr_bands, nr_live, now_seconds() - start);
+	FREE_ARRAY(&todo);
+	free(fds);
+	free(polled);
+}
+
+void worker_pool_stop(struct worker_pool *pool)
+{
+	/* Workers exit when their input ends. */
+	for (size_t w = 0; w < pool->nr; w++)
+		if (pool->workers[w].fd >= 0)
+			close(pool->workers[w].fd);
+	for (size_t w = 0; w < pool->nr; w++)
+		while (waitpid(pool->workers[w].pid, NULL, 0) < 0 && errno == EINTR)
+			;
+	FREE_AND_NULL(pool->workers);
+	pool->nr = 0;
+}
+
+void worker_serve_frame(struct scene *scene, const struct render_opts *opts,
+			int width, int height, uint32_t frame)
+{
+	struct ppm *ppm = ppm_new(height, width);
+	struct render_stats stats = { 0 };
+	struct worker_request req;
+	size_t nr_pixels = 0;
+
+	for (;;) {
+		ssize_t ret = read_in_full(0, &req, sizeof(req));
+		if (!ret)
+			exit(0);
+		if (ret < 0)
+			die_errno("failed to read request");
+		if (ret != sizeof(req))
+			die("truncated request");
+		if (req.frame != frame)
+			die("request for frame %u while rendering frame %u",
+			    req.frame, frame);
+		if (req.type == WORKER_END_FRAME)
+			break;
+		if (req.type != WORKER_RENDER || req.y0 >= req.y1 ||
+		    req.y1 > (uint32_t)height)
+			die("invalid request");
+
+		struct render_region band = { 0, req.y0, width, req.y1 };
+		size_t nr = (size_t)(req.y1 - req.y0) * width;
+		render_region(scene, ppm, opts, &band, &stats);
+		nr_pixels += nr;
+		if (write_in_full(1, &req, sizeof(req)) < 0 ||
+		    write_in_full(1, ppm_color(ppm, req.y0, 0),
+				  nr * sizeof(*ppm->img)) < 0)
+			die_errno("failed to send band");
+	}
+	render_stats_print(&stats, opts, nr_pixels);
+	ppm_destroy(&ppm);
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct scene;
+struct ppm;
+struct render_opts;
+
+/*
+ * Worker processes
+ * ----------------
+ *
+ * Instead of rendering itself, the raytracer can coordinate worker
+ * processes: each one is the raytracer run with the same arguments plus
+ * --worker, so it loads the same scene, prepares the same structures and
+ * goes through the same frames. The image is split into bands of
+ * WORKER_BAND rows, which are handed out to the workers as they become
+ * free, and the pixels they send back are merged into the image. Pixels
+ * do not depend on how the image is split (see render_region()), so the
+ * result is the same as that of a single process. A worker that exits or
+ * sends a malformed reply is dropped, and its band is handed to another.
+ *
+ * Workers talk over their standard input and output, so that they can run
+ * wherever a pipe reaches. Messages are in the machine's byte order: the
+ * coordinator sends struct worker_request, and a worker answers
+ * WORKER_RENDER with the same struct, followed by the band's pixels, row
+ * by row, as struct vec3. WORKER_END_FRAME has no answer.
+ */
+#define WORKER_BAND 16
+
+enum worker_request_type {
+	WORKER_RENDER = 1,
+	WORKER_END_FRAME,
+};
+
+struct worker_request {
+	uint32_t type; /* enum worker_request_type */
+	uint32_t frame;
+	/* The rows of the band, for WORKER_RENDER. */
+	uint32_t y0, y1;
+};
+
+struct worker {
+	pid_t pid;
+	/* The socket to the worker, -1 once it was dropped. */
+	int fd;
+	/* The band it is rendering, or -1. */
+	int band;
+};
+
+struct worker_pool {
+	struct worker *workers;
+	size_t nr;
+};
+
+/*
+ * Starts `nr` workers, running this program with `argv` (NULL-terminated,
+ * as given to main()) and --worker. Dies on errors.
+ */
+void worker_pool_start(struct worker_pool *pool, size_t nr, char **argv);
+
+/*
+ * Has the workers render frame `frame` into `ppm`. Dies if all of them
+ * were dropped.
+ */
+void worker_pool_render(struct worker_pool *pool, struct ppm *ppm,
+			uint32_t frame);
+
+/* Ends the workers and waits for them. */
+void worker_pool_stop(struct worker_pool *pool);
+
+/*
+ * The worker side: serves the requests for frame `frame`, from standard
+ * input, until its WORKER_END_FRAME. Exits if the coordinator went away.
+ */
+void worker_serve_frame(struct scene *scene, const struct render_opts *opts,
+			int width, int height, uint32_t frame);